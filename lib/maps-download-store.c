@@ -17,28 +17,195 @@
  * Author: James Westman <james@jwestman.net>
  */
 
+#include <stdio.h>
+#include <string.h>
 #include <sqlite3.h>
 #include <json-glib/json-glib.h>
 
 #include "maps-download-store.h"
+#include "maps-lru-cache.h"
+#include "maps-tile-batch.h"
+#include "maps-tile-codec.h"
+#include "maps-tile-id.h"
+#include "maps-tile-range.h"
+
+/* Number of read-only connections. Reads in WAL mode don't block each other or the writer, so this is how many
+   reads can run in parallel. */
+#define N_READ_CONNECTIONS 4
+
+/* How long a connection waits for a lock (e.g. during a WAL checkpoint) before giving up */
+#define BUSY_TIMEOUT_MS 5000
 
 struct _MapsDownloadStore {
   GObject parent_instance;
 
   char *path;
-  sqlite3 *db;
 
-  /* Note: Tasks are run in threads so they don't block the UI thread, not so that multiple tasks can run in parallel.
-     All tasks are serialized using this mutex. */
+  /* The writer connection. SQLite only allows one writer at a time, so all tasks that use this connection
+     are serialized using this mutex. */
+  sqlite3 *db;
   GMutex mutex;
+
+  /* Pool of read-only connections (ReadConnection *). A task that only reads takes a connection from the
+     queue, blocking if all of them are in use, and puts it back when it is done. */
+  GAsyncQueue *readers;
+
+  /* Tasks run on the store's own workers rather than GLib's shared pool. Reads go to read_pool, which has a thread
+     per read connection and runs interactive reads (tiles that are on screen) before bulk ones. Writes go to
+     write_pool, which has a single thread since they hold the writer lock anyway; they run in order, because a
+     later write often depends on an earlier one. Reads never wait behind writes. */
+  GThreadPool *read_pool;
+  GThreadPool *write_pool;
+  guint job_sequence;
+
+  /* Compressing and hashing tiles is CPU heavy, so it is done on a pool of worker threads, one per core,
+     before the insert task takes the writer lock. */
+  GThreadPool *compress_pool;
+
+  MapsTileCodec *codec;
+
+  /* Cache of recently read tiles, decompressed, so panning back over an area doesn't go through SQLite and the
+     codec again. Everything below is protected by cache_mutex, except cache_dirty, which belongs to the writer. */
+  GMutex cache_mutex;
+  MapsLruCache *cache;  /* TileKey * -> GBytes * */
+  /* Incremented whenever entries are invalidated. A reader only adds a tile to the cache if the epoch hasn't
+     changed since it started reading, otherwise it might add data that was overwritten in the meantime. */
+  guint64 cache_epoch;
+  /* Whether tiles were written in the writer's current transaction. Readers don't see them until it is committed,
+     so the cache is cleared again when the transaction ends. */
+  gboolean cache_dirty;
+
+  /* Maximum total size of cache-only tiles in bytes, or 0 for no limit. See maps_download_store_set_quota().
+     Protected by cache_mutex, like the access log. */
+  guint64 quota;
+  /* Total size of the cache-only tiles in bytes, as of the writer's last change. Triggers keep the total up to date
+     in the cache_used table, so it never has to be added up. Protected by cache_mutex. */
+  guint64 cache_used;
+  /* Age in milliseconds after which cache-only tiles are reported as stale, or 0 if they never are */
+  guint64 cache_max_age;
+  /* Cache-only tiles that were read since the access times were last written (TileKey *). Updating the
+     database on every read would turn reads into writes, so they are written in bulk before enforcing the
+     quota. */
+  GHashTable *accessed;
+
+  /* Which parts of the map each tileset has tiles in (char *tileset -> bitmap), so reads for tiles that aren't
+     stored, which is most of them when browsing outside the downloaded areas, don't have to touch the database.
+     Also protected by cache_mutex. */
+  GHashTable *presence;
+
+  /* Whether the database was created before incremental vacuum was enabled, and needs a full VACUUM to
+     switch. Belongs to the writer. */
+  gboolean needs_vacuum;
 };
 
+typedef struct {
+  MapsDownloadStore *store;
+  sqlite3 *db;
+} ReadConnection;
+
+typedef struct {
+  char *tileset;
+  guint64 id;
+} TileKey;
+
 G_DEFINE_TYPE (MapsDownloadStore, maps_download_store, G_TYPE_OBJECT)
 
 typedef char sqlite_str;
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (sqlite_str, sqlite3_free);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (sqlite3_stmt, sqlite3_finalize);
 
+static ReadConnection *
+read_connection_acquire (MapsDownloadStore *self)
+{
+  return g_async_queue_pop (self->readers);
+}
+
+static void
+read_connection_release (ReadConnection *conn)
+{
+  g_async_queue_push (conn->store->readers, conn);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ReadConnection, read_connection_release);
+
+typedef enum {
+  JOB_PRIORITY_INTERACTIVE,
+  JOB_PRIORITY_BULK,
+} JobPriority;
+
+typedef struct {
+  GTask *task;
+  GTaskThreadFunc func;
+  JobPriority priority;
+  guint sequence;
+} StoreJob;
+
+static gint
+store_job_compare (gconstpointer a,
+                   gconstpointer b,
+                   gpointer      user_data)
+{
+  const StoreJob *job_a = a, *job_b = b;
+
+  if (job_a->priority != job_b->priority)
+    return job_a->priority < job_b->priority ? -1 : 1;
+
+  /* First in, first out within a priority. The difference is signed so this still works when the sequence wraps
+     around. */
+  return (gint)(job_a->sequence - job_b->sequence);
+}
+
+static void
+store_job_worker (gpointer data,
+                  gpointer user_data)
+{
+  StoreJob *job = data;
+  GTask *task = job->task;
+
+  /* Requests that were cancelled while they were queued, such as tiles that were scrolled out of view, are
+     dropped without touching the database */
+  if (!g_task_return_error_if_cancelled (task))
+    job->func (task, g_task_get_source_object (task), g_task_get_task_data (task), g_task_get_cancellable (task));
+
+  g_object_unref (task);
+  g_free (job);
+}
+
+static void
+queue_job (MapsDownloadStore *self,
+           GThreadPool       *pool,
+           GTask             *task,
+           GTaskThreadFunc    func,
+           JobPriority       priority)
+{
+  StoreJob *job = g_new (StoreJob, 1);
+
+  job->task = g_object_ref (task);
+  job->func = func;
+  job->priority = priority;
+  job->sequence = g_atomic_int_add (&self->job_sequence, 1);
+  g_thread_pool_push (pool, job, NULL);
+}
+
+/* Runs a task that uses a read connection */
+static void
+queue_read (MapsDownloadStore *self,
+            GTask             *task,
+            GTaskThreadFunc    func,
+            JobPriority       priority)
+{
+  queue_job (self, self->read_pool, task, func, priority);
+}
+
+/* Runs a task that uses the writer connection */
+static void
+queue_write (MapsDownloadStore *self,
+             GTask             *task,
+             GTaskThreadFunc    func)
+{
+  queue_job (self, self->write_pool, task, func, JOB_PRIORITY_BULK);
+}
+
 #define RETURN_IF_SQLITE_ERROR(status, task, format, ...) \
   do { \
     if ((status) != SQLITE_OK) { \
@@ -61,20 +228,173 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (sqlite3_stmt, sqlite3_finalize);
     } \
   } while (0)
 
+static guint
+tile_key_hash (gconstpointer key)
+{
+  const TileKey *tile_key = key;
+  return g_str_hash (tile_key->tileset) ^ g_int64_hash (&tile_key->id);
+}
+
+static gboolean
+tile_key_equal (gconstpointer a,
+                gconstpointer b)
+{
+  const TileKey *key_a = a, *key_b = b;
+  return key_a->id == key_b->id && g_str_equal (key_a->tileset, key_b->tileset);
+}
+
+static void
+tile_key_free (TileKey *key)
+{
+  g_free (key->tileset);
+  g_free (key);
+}
+
+/* Don't let the access log grow without bound if the quota is never enforced. Tiles that don't make it into the
+   log just look older than they are. */
+#define MAX_ACCESS_LOG 65536
+
+static void
+record_access_locked (MapsDownloadStore *self,
+                      const char        *tileset,
+                      guint64            id)
+{
+  TileKey *key;
+
+  if (self->quota == 0 || g_hash_table_size (self->accessed) >= MAX_ACCESS_LOG)
+    return;
+
+  key = g_new (TileKey, 1);
+  key->tileset = g_strdup (tileset);
+  key->id = id;
+  g_hash_table_add (self->accessed, key);
+}
+
+/* Notes that a tile was read, for the least-recently-used order in which tiles are evicted when the store is over
+   its quota */
+static void
+record_access (MapsDownloadStore *self,
+               const char        *tileset,
+               guint64            id)
+{
+  G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+  record_access_locked (self, tileset, id);
+}
+
+/* Returns a new reference to the cached tile, or NULL */
+static GBytes *
+cache_lookup (MapsDownloadStore *self,
+              const char        *tileset,
+              guint64            id)
+{
+  TileKey key = { (char *)tileset, id };
+  GBytes *bytes;
+
+  G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+
+  if (maps_lru_cache_get_max_cost (self->cache) == 0)
+    return NULL;
+
+  bytes = maps_lru_cache_lookup (self->cache, &key);
+  if (bytes == NULL)
+    return NULL;
+
+  record_access_locked (self, tileset, id);
+  return g_bytes_ref (bytes);
+}
+
+static guint64
+cache_get_epoch (MapsDownloadStore *self)
+{
+  G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+  return self->cache_epoch;
+}
+
+/* Adds a tile that was read from the database. @epoch is the value of cache_get_epoch() from before the read
+   started. */
+static void
+cache_store (MapsDownloadStore *self,
+             const char        *tileset,
+             guint64            id,
+             GBytes            *bytes,
+             guint64            epoch)
+{
+  TileKey key = { (char *)tileset, id };
+  TileKey *new_key;
+
+  G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+
+  if (epoch != self->cache_epoch || maps_lru_cache_contains (self->cache, &key))
+    return;
+
+  new_key = g_new (TileKey, 1);
+  new_key->tileset = g_strdup (tileset);
+  new_key->id = id;
+
+  maps_lru_cache_insert (self->cache, new_key, g_bytes_ref (bytes),
+                         sizeof (TileKey) + strlen (tileset) + g_bytes_get_size (bytes));
+}
+
+static void
+cache_invalidate (MapsDownloadStore *self,
+                  const char        *tileset,
+                  const guint64     *ids,
+                  gsize              n_ids)
+{
+  G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+
+  self->cache_epoch++;
+
+  for (gsize i = 0; i < n_ids; i++)
+    {
+      TileKey key = { (char *)tileset, ids[i] };
+      maps_lru_cache_remove (self->cache, &key);
+    }
+}
+
+static void
+cache_clear (MapsDownloadStore *self)
+{
+  G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+
+  self->cache_epoch++;
+  maps_lru_cache_remove_all (self->cache);
+}
+
 static void
 maps_download_store_finalize (GObject *object)
 {
   MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (object);
+  ReadConnection *conn;
   int status;
 
   g_clear_pointer (&self->path, g_free);
 
+  while ((conn = g_async_queue_try_pop (self->readers)) != NULL)
+    {
+      sqlite3_close (conn->db);
+      g_free (conn);
+    }
+  g_async_queue_unref (self->readers);
+
+  g_thread_pool_free (self->compress_pool, FALSE, TRUE);
+  /* Every queued job holds a reference, so the pools are idle by now. Don't wait for the threads, since this may
+     run on one of them when a worker drops the last reference to a task. */
+  g_thread_pool_free (self->read_pool, FALSE, FALSE);
+  g_thread_pool_free (self->write_pool, FALSE, FALSE);
+  g_clear_object (&self->codec);
+
   status = sqlite3_close (self->db);
   if (status != SQLITE_OK)
     g_critical ("Failed to close downloads database: %s", sqlite3_errstr (status));
 
   g_mutex_clear (&self->mutex);
 
+  g_clear_object (&self->cache);
+  g_clear_pointer (&self->accessed, g_hash_table_unref);
+  g_clear_pointer (&self->presence, g_hash_table_unref);
+  g_mutex_clear (&self->cache_mutex);
+
   G_OBJECT_CLASS (maps_download_store_parent_class)->finalize (object);
 }
 
@@ -86,254 +406,3138 @@ maps_download_store_class_init (MapsDownloadStoreClass *klass)
   object_class->finalize = maps_download_store_finalize;
 }
 
+static void compress_worker (gpointer data,
+                             gpointer user_data);
+
 static void
 maps_download_store_init (MapsDownloadStore *self)
 {
   g_mutex_init (&self->mutex);
+  g_mutex_init (&self->cache_mutex);
+  self->cache = maps_lru_cache_new (tile_key_hash, tile_key_equal, (GDestroyNotify)tile_key_free, (GDestroyNotify)g_bytes_unref, 0);
+  self->accessed = g_hash_table_new_full (tile_key_hash, tile_key_equal, (GDestroyNotify)tile_key_free, NULL);
+  self->presence = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  self->readers = g_async_queue_new ();
+  self->compress_pool = g_thread_pool_new (compress_worker, self, g_get_num_processors (), FALSE, NULL);
+  self->read_pool = g_thread_pool_new (store_job_worker, self, N_READ_CONNECTIONS, FALSE, NULL);
+  g_thread_pool_set_sort_function (self->read_pool, store_job_compare, NULL);
+  self->write_pool = g_thread_pool_new (store_job_worker, self, 1, FALSE, NULL);
+  self->codec = maps_tile_codec_new ();
 }
 
-MapsDownloadStore *
-maps_download_store_new (void)
+#define HASH_LENGTH 32
+
+static void
+compute_hash (const guint8 *data,
+              gsize         length,
+              guint8        hash[HASH_LENGTH])
 {
-  return g_object_new (MAPS_TYPE_DOWNLOAD_STORE, NULL);
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  gsize hash_length = HASH_LENGTH;
+
+  g_checksum_update (checksum, data, length);
+  g_checksum_get_digest (checksum, hash, &hash_length);
 }
 
-gboolean
-maps_download_store_open (MapsDownloadStore  *self,
-                          const char         *path,
-                          GError            **error)
+/* SQL function used by migrations to compute the hash of existing tile data */
+static void
+tile_hash_func (sqlite3_context  *context,
+                int               argc,
+                sqlite3_value   **argv)
 {
-  int status;
-  g_autoptr(sqlite_str) error_msg = NULL;
+  guint8 hash[HASH_LENGTH];
 
-  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), FALSE);
-  g_return_val_if_fail (path != NULL, FALSE);
-  g_return_val_if_fail (self->db == NULL, FALSE);
-
-  status = sqlite3_open_v2 (path, &self->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL);
+  compute_hash (sqlite3_value_blob (argv[0]), sqlite3_value_bytes (argv[0]), hash);
+  sqlite3_result_blob (context, hash, HASH_LENGTH, SQLITE_TRANSIENT);
+}
 
-  if (status != SQLITE_OK)
+/* SQL function used by migrations to convert "z/x/y" tile names to tile IDs. Returns NULL for invalid names. */
+static void
+tile_id_from_name_func (sqlite3_context  *context,
+                        int               argc,
+                        sqlite3_value   **argv)
+{
+  const char *name = (const char *)sqlite3_value_text (argv[0]);
+  guint z, x, y;
+  char end;
+
+  if (name == NULL
+      || sscanf (name, "%u/%u/%u%c", &z, &x, &y, &end) != 3
+      || z > MAPS_TILE_ID_MAX_ZOOM
+      || (guint64)x >= ((guint64)1 << z)
+      || (guint64)y >= ((guint64)1 << z))
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to open database: %s", sqlite3_errstr (status));
-      g_clear_pointer (&self->db, sqlite3_close);
-      return FALSE;
+      sqlite3_result_null (context);
+      return;
     }
 
-  sqlite3_exec (
-    self->db,
-    "CREATE TABLE IF NOT EXISTS tiles ("
-    "  tileset TEXT,"
-    "  id TEXT,"
-    "  bytes BLOB,"
-    "  mtime INTEGER,"
-    "  PRIMARY KEY (tileset, id)"
-    ");"
-    "CREATE TABLE IF NOT EXISTS metadata ("
-    "  key TEXT PRIMARY KEY,"
-    "  value TEXT"
-    ");"
-    "INSERT INTO metadata (key, value) VALUES ('version', '1')"
-    "  ON CONFLICT (key) DO UPDATE SET value = excluded.value;",
-    NULL, NULL, &error_msg
-  );
-  if (error_msg != NULL)
+  sqlite3_result_int64 (context, maps_tile_id_from_zxy (z, x, y));
+}
+
+/* SQL functions that decode tile IDs, so that tiles can be matched against the rectangles of download areas */
+static void
+tile_coordinate_func (sqlite3_context  *context,
+                      int               argc,
+                      sqlite3_value   **argv)
+{
+  guint zxy[3];
+
+  if (!maps_tile_id_to_zxy (sqlite3_value_int64 (argv[0]), &zxy[0], &zxy[1], &zxy[2]))
     {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to initialize database schema: %s", error_msg);
-      g_clear_pointer (&self->db, sqlite3_close);
-      return FALSE;
+      sqlite3_result_null (context);
+      return;
     }
 
-  self->path = g_strdup (path);
-
-  return TRUE;
+  sqlite3_result_int64 (context, zxy[GPOINTER_TO_INT (sqlite3_user_data (context))]);
 }
 
-typedef struct {
-  char *tileset;
-  char **ids;
-  GBytes *bytes;
-  gboolean precompressed;
-  guint64 mtime;
-} InsertData;
+/* Keep the blob reference counts up to date and delete unused blobs */
+#define TILES_TRIGGERS \
+  "CREATE TRIGGER tiles_insert AFTER INSERT ON tiles BEGIN" \
+  "  UPDATE blobs SET refcount = refcount + 1 WHERE hash = new.hash;" \
+  "END;" \
+  "CREATE TRIGGER tiles_update AFTER UPDATE OF hash ON tiles WHEN old.hash IS NOT new.hash BEGIN" \
+  "  UPDATE blobs SET refcount = refcount + 1 WHERE hash = new.hash;" \
+  "  UPDATE blobs SET refcount = refcount - 1 WHERE hash = old.hash;" \
+  "  DELETE FROM blobs WHERE hash = old.hash AND refcount <= 0;" \
+  "END;" \
+  "CREATE TRIGGER tiles_delete AFTER DELETE ON tiles BEGIN" \
+  "  UPDATE blobs SET refcount = refcount - 1 WHERE hash = old.hash;" \
+  "  DELETE FROM blobs WHERE hash = old.hash AND refcount <= 0;" \
+  "END;"
+
+/* Keep the total size of the cache-only tiles up to date */
+#define CACHE_USED_TRIGGERS \
+  "CREATE TRIGGER tiles_cache_insert AFTER INSERT ON tiles WHEN new.cache_only BEGIN" \
+  "  UPDATE cache_used SET bytes = bytes + new.size;" \
+  "END;" \
+  "CREATE TRIGGER tiles_cache_update AFTER UPDATE OF size, cache_only ON tiles" \
+  "  WHEN old.cache_only OR new.cache_only BEGIN" \
+  "  UPDATE cache_used SET bytes = bytes" \
+  "    - CASE WHEN old.cache_only THEN old.size ELSE 0 END" \
+  "    + CASE WHEN new.cache_only THEN new.size ELSE 0 END;" \
+  "END;" \
+  "CREATE TRIGGER tiles_cache_delete AFTER DELETE ON tiles WHEN old.cache_only BEGIN" \
+  "  UPDATE cache_used SET bytes = bytes - old.size;" \
+  "END;"
+
+/* Each entry upgrades the database schema from version i to version i + 1. The current version is stored in the
+   metadata table. */
+static const char * const migrations[] = {
+  /* 0 -> 1 */
+  "CREATE TABLE IF NOT EXISTS tiles ("
+  "  tileset TEXT,"
+  "  id TEXT,"
+  "  bytes BLOB,"
+  "  mtime INTEGER,"
+  "  PRIMARY KEY (tileset, id)"
+  ");"
+  "CREATE TABLE IF NOT EXISTS metadata ("
+  "  key TEXT PRIMARY KEY,"
+  "  value TEXT"
+  ");",
+
+  /* 1 -> 2: Many tiles (especially ocean and empty land) have identical data, so it's stored only once in the
+     blobs table, keyed by its hash. Triggers keep the reference counts up to date and delete unused blobs. */
+  "CREATE TABLE blobs ("
+  "  hash BLOB PRIMARY KEY,"
+  "  bytes BLOB,"
+  "  refcount INTEGER NOT NULL DEFAULT 0"
+  ");"
+  "INSERT INTO blobs (hash, bytes, refcount)"
+  "  SELECT tile_hash (bytes), bytes, 1 FROM tiles WHERE true"
+  "  ON CONFLICT (hash) DO UPDATE SET refcount = refcount + 1;"
+  "CREATE TABLE tiles_v2 ("
+  "  tileset TEXT,"
+  "  id TEXT,"
+  "  hash BLOB,"
+  "  mtime INTEGER,"
+  "  PRIMARY KEY (tileset, id)"
+  ");"
+  "INSERT INTO tiles_v2 (tileset, id, hash, mtime)"
+  "  SELECT tileset, id, tile_hash (bytes), mtime FROM tiles;"
+  "DROP TABLE tiles;"
+  "ALTER TABLE tiles_v2 RENAME TO tiles;"
+  TILES_TRIGGERS,
+
+  /* 2 -> 3: Blobs may be compressed with zstd, using a dictionary per tileset that is stored in the metadata table
+     as 'zstd-dict:<tileset>'. Existing blobs are gzip (MAPS_TILE_CODEC_FORMAT_GZIP). */
+  "ALTER TABLE blobs ADD COLUMN codec INTEGER NOT NULL DEFAULT 0;",
+
+  /* 3 -> 4: Tiles are keyed by their PMTiles tile ID rather than a "z/x/y" name. The table is clustered by ID, so
+     tiles that are close together on the map are mostly close together on disk. Tiles with invalid names are
+     dropped, so the reference counts are recomputed afterwards. */
+  "DROP TRIGGER tiles_insert;"
+  "DROP TRIGGER tiles_update;"
+  "DROP TRIGGER tiles_delete;"
+  "CREATE TABLE tiles_v4 ("
+  "  tileset TEXT,"
+  "  id INTEGER,"
+  "  hash BLOB,"
+  "  mtime INTEGER,"
+  "  PRIMARY KEY (tileset, id)"
+  ") WITHOUT ROWID;"
+  "INSERT OR IGNORE INTO tiles_v4 (tileset, id, hash, mtime)"
+  "  SELECT tileset, tile_id_from_name (id), hash, mtime FROM tiles WHERE tile_id_from_name (id) IS NOT NULL;"
+  "DROP TABLE tiles;"
+  "ALTER TABLE tiles_v4 RENAME TO tiles;"
+  "UPDATE blobs SET refcount = 0;"
+  "UPDATE blobs SET refcount = counts.n"
+  "  FROM (SELECT hash, count(*) AS n FROM tiles GROUP BY hash) AS counts"
+  "  WHERE blobs.hash = counts.hash;"
+  "DELETE FROM blobs WHERE refcount <= 0;"
+  TILES_TRIGGERS,
+
+  /* 4 -> 5: Download plans are saved so that interrupted downloads can be resumed. `completed` is a bitmap of the
+     plan's ranges that have been downloaded. */
+  "CREATE TABLE download_plans ("
+  "  tileset TEXT PRIMARY KEY,"
+  "  job TEXT NOT NULL,"
+  "  version TEXT,"
+  "  plan BLOB NOT NULL,"
+  "  n_ranges INTEGER NOT NULL,"
+  "  completed BLOB NOT NULL"
+  ");",
+
+  /* 5 -> 6: The tiles each download area needs, as rectangles of tiles per zoom level (inclusive). Tiles that
+     aren't in any area's rectangles can be deleted. */
+  "CREATE TABLE area_rects ("
+  "  area TEXT NOT NULL,"
+  "  tileset TEXT NOT NULL,"
+  "  z INTEGER NOT NULL,"
+  "  x_min INTEGER NOT NULL,"
+  "  y_min INTEGER NOT NULL,"
+  "  x_max INTEGER NOT NULL,"
+  "  y_max INTEGER NOT NULL"
+  ");"
+  "CREATE INDEX area_rects_area ON area_rects (area, tileset);"
+  "CREATE INDEX area_rects_tiles ON area_rects (tileset, z);",
+
+  /* 6 -> 7: Tiles that were stored as a cache rather than for a download area. They are kept until the database
+     is over its quota, and then evicted least recently used first. `atime` is when the tile was last read, or NULL
+     if it hasn't been read since it was written. */
+  "ALTER TABLE tiles ADD COLUMN cache_only INTEGER NOT NULL DEFAULT 0;"
+  "ALTER TABLE tiles ADD COLUMN atime INTEGER;"
+  "CREATE INDEX tiles_lru ON tiles (coalesce (atime, mtime)) WHERE cache_only;",
+
+  /* 7 -> 8: Bitmaps of where each tileset has tiles, see presence_bit(). They are built when the database is
+     opened if they are missing. */
+  "CREATE TABLE tile_presence ("
+  "  tileset TEXT PRIMARY KEY,"
+  "  bitmap BLOB NOT NULL"
+  ");",
+
+  /* 8 -> 9: Each tile's size, and the total size of the cache-only tiles, so the quota can be checked without
+     adding up the sizes of every tile. Cache-only tiles that a download area needs become part of the area, as they
+     do when they are written from now on, so that any cache-only tile can be evicted. */
+  "ALTER TABLE tiles ADD COLUMN size INTEGER NOT NULL DEFAULT 0;"
+  "UPDATE tiles SET size = (SELECT length (bytes) FROM blobs WHERE blobs.hash = tiles.hash);"
+  "UPDATE tiles SET cache_only = 0 WHERE cache_only AND EXISTS ("
+  "  SELECT 1 FROM area_rects"
+  "  WHERE area_rects.tileset = tiles.tileset"
+  "    AND area_rects.z = tile_zoom (tiles.id)"
+  "    AND tile_x (tiles.id) BETWEEN area_rects.x_min AND area_rects.x_max"
+  "    AND tile_y (tiles.id) BETWEEN area_rects.y_min AND area_rects.y_max"
+  ");"
+  "CREATE TABLE cache_used (bytes INTEGER NOT NULL);"
+  "INSERT INTO cache_used (bytes) SELECT coalesce (sum (size), 0) FROM tiles WHERE cache_only;"
+  CACHE_USED_TRIGGERS,
+};
 
-static void
-insert_data_free (InsertData *data)
+static int
+get_schema_version (sqlite3 *db)
 {
-  g_clear_pointer (&data->tileset, g_free);
-  g_clear_pointer (&data->ids, g_strfreev);
-  g_clear_pointer (&data->bytes, g_bytes_unref);
-  g_free (data);
-}
+  g_autoptr(sqlite3_stmt) stmt = NULL;
 
-static GBytes *
-compress (GBytes  *bytes,
-          GError **error)
-{
-  g_autoptr(GZlibCompressor) compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, 9);
-  g_autoptr(GInputStream) input = g_memory_input_stream_new_from_bytes (bytes);
-  g_autoptr(GInputStream) converter = g_converter_input_stream_new (input, G_CONVERTER (compressor));
-  g_autoptr(GOutputStream) output = g_memory_output_stream_new_resizable ();
-  gssize result;
+  /* This fails if the metadata table doesn't exist, i.e. the database is new */
+  if (sqlite3_prepare_v2 (db, "SELECT value FROM metadata WHERE key = 'version'", -1, &stmt, NULL) != SQLITE_OK)
+    return 0;
 
-  result = g_output_stream_splice (output, converter, G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE | G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET, NULL, error);
-  if (result < 0)
-    return NULL;
+  if (sqlite3_step (stmt) != SQLITE_ROW)
+    return 0;
 
-  return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (output));
+  return sqlite3_column_int (stmt, 0);
 }
 
-static GBytes *
-decompress (GBytes  *bytes,
-            GError **error)
+/* Returns the value of an integer pragma, or -1 on error */
+static gint64
+get_pragma_int (sqlite3    *db,
+                const char *pragma)
 {
-  g_autoptr(GZlibDecompressor) compressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP);
-  g_autoptr(GInputStream) input = g_memory_input_stream_new_from_bytes (bytes);
-  g_autoptr(GInputStream) converter = g_converter_input_stream_new (input, G_CONVERTER (compressor));
-  g_autoptr(GOutputStream) output = g_memory_output_stream_new_resizable ();
-  gssize result;
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  g_autofree char *sql = g_strdup_printf ("PRAGMA %s", pragma);
 
-  result = g_output_stream_splice (output, converter, G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE | G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET, NULL, error);
-  if (result < 0)
-    return NULL;
+  if (sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    return -1;
+
+  if (sqlite3_step (stmt) != SQLITE_ROW)
+    return -1;
 
-  return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (output));
+  return sqlite3_column_int64 (stmt, 0);
 }
 
-static void
-do_insert (GTask        *task,
-           gpointer      source_object,
-           gpointer      task_data,
-           GCancellable *cancellable)
+static gboolean
+migrate (MapsDownloadStore  *self,
+         GError            **error)
 {
-  MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
-  InsertData *data = task_data;
-  g_autoptr(sqlite3_stmt) stmt = NULL;
-  g_autoptr(GBytes) bytes = NULL;
-  g_autoptr(GError) error = NULL;
-  int status;
+  int version = get_schema_version (self->db);
 
-  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  if (version > (int)G_N_ELEMENTS (migrations))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Database schema version %d is newer than the supported version %d",
+                   version, (int)G_N_ELEMENTS (migrations));
+      return FALSE;
+    }
 
-  if (data->precompressed)
-    bytes = g_bytes_ref (data->bytes);
-  else
+  for (; version < (int)G_N_ELEMENTS (migrations); version++)
     {
-      bytes = compress (data->bytes, &error);
-      if (bytes == NULL)
+      g_autoptr(sqlite_str) error_msg = NULL;
+      g_autofree char *sql = g_strdup_printf (
+        "BEGIN;"
+        "%s"
+        "INSERT INTO metadata (key, value) VALUES ('version', '%d')"
+        "  ON CONFLICT (key) DO UPDATE SET value = excluded.value;"
+        "COMMIT;",
+        migrations[version],
+        version + 1
+      );
+
+      sqlite3_exec (self->db, sql, NULL, NULL, &error_msg);
+      if (error_msg != NULL)
         {
-          g_task_return_error (task, g_steal_pointer (&error));
-          return;
+          sqlite3_exec (self->db, "ROLLBACK", NULL, NULL, NULL);
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Failed to upgrade database schema to version %d: %s", version + 1, error_msg);
+          return FALSE;
         }
     }
 
+  return TRUE;
+}
+
+#define DICTIONARY_KEY_PREFIX "zstd-dict:"
+
+static gboolean
+load_dictionaries (MapsDownloadStore  *self,
+                   GError            **error)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  int status;
+
   status = sqlite3_prepare_v2 (
     self->db,
-    "INSERT INTO tiles (tileset, id, bytes, mtime) VALUES (?, ?, ?, ?)"
-    "  ON CONFLICT (tileset, id) DO UPDATE SET bytes = excluded.bytes, mtime = excluded.mtime",
+    "SELECT substr(key, length('" DICTIONARY_KEY_PREFIX "') + 1), value FROM metadata"
+    "  WHERE key LIKE '" DICTIONARY_KEY_PREFIX "%'",
     -1,
     &stmt,
     NULL
   );
-  RETURN_IF_PREPARE_ERROR (status, task);
-
-  status = sqlite3_bind_text (stmt, 1, data->tileset, -1, SQLITE_STATIC);
-  RETURN_IF_BIND_ERROR (status, task, "tileset");
-
-  status = sqlite3_bind_blob (stmt, 3, g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes), SQLITE_STATIC);
-  RETURN_IF_BIND_ERROR (status, task, "data");
+  if (status != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to prepare statement: %s", sqlite3_errstr (status));
+      return FALSE;
+    }
 
-  status = sqlite3_bind_int64 (stmt, 4, data->mtime);
-  RETURN_IF_BIND_ERROR (status, task, "mtime");
+  while ((status = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      g_autoptr(GBytes) dictionary = g_bytes_new (sqlite3_column_blob (stmt, 1), sqlite3_column_bytes (stmt, 1));
+      maps_tile_codec_add_dictionary (self->codec, (const char *)sqlite3_column_text (stmt, 0), dictionary);
+    }
 
-  for (int i = 0; data->ids[i] != NULL; i++)
+  if (status != SQLITE_DONE)
     {
-      status = sqlite3_bind_text (stmt, 2, data->ids[i], -1, SQLITE_STATIC);
-      RETURN_IF_BIND_ERROR (status, task, "id");
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to load dictionaries: %s", sqlite3_errstr (status));
+      return FALSE;
+    }
 
-      status = sqlite3_step (stmt);
-      RETURN_IF_NOT_DONE (status, task, "Failed to insert data: %s", sqlite3_errstr (status));
+  return TRUE;
+}
 
-      sqlite3_reset (stmt);
-    }
+/* Tiles at this zoom level or below each have a bit in a tileset's presence bitmap. Deeper tiles share the bit of
+   their ancestor at this level, so a bitmap is about 11 KiB no matter how many tiles are stored. */
+#define PRESENCE_ZOOM 8
 
-  g_task_return_boolean (task, TRUE);
+static gsize
+presence_n_bits (void)
+{
+  /* Tile IDs are numbered from zoom level 0 up, so this is the number of tiles at PRESENCE_ZOOM or below */
+  return maps_tile_id_from_zxy (PRESENCE_ZOOM + 1, 0, 0);
 }
 
-/**
- * maps_download_store_insert_async:
- * @ids: (array zero-terminated=1):
- */
-void
-maps_download_store_insert_async (MapsDownloadStore    *self,
-                                  const char           *tileset,
-                                  const char          **ids,
-                                  GBytes               *data,
-                                  gboolean              precompressed,
-                                  guint64               mtime,
-                                  GAsyncReadyCallback   callback,
-                                  gpointer              user_data)
+static gsize
+presence_bitmap_size (void)
 {
-  g_autoptr(GTask) task = NULL;
-  InsertData *insert_data;
+  return (presence_n_bits () + 7) / 8;
+}
 
-  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
-  g_return_if_fail (ids != NULL);
-  g_return_if_fail (data != NULL);
+/* Returns the bit for a tile, or G_MAXSIZE if the ID is invalid */
+static gsize
+presence_bit (guint64 id)
+{
+  guint z, x, y;
 
-  task = g_task_new (self, NULL, callback, user_data);
-  g_task_set_source_tag (task, maps_download_store_insert_async);
+  if (!maps_tile_id_to_zxy (id, &z, &x, &y))
+    return G_MAXSIZE;
 
-  insert_data = g_new (InsertData, 1);
-  insert_data->tileset = g_strdup (tileset);
-  insert_data->ids = g_strdupv ((char **)ids);
-  insert_data->bytes = g_bytes_ref (data);
-  insert_data->precompressed = precompressed;
-  insert_data->mtime = mtime;
-  g_task_set_task_data (task, insert_data, (GDestroyNotify)insert_data_free);
+  if (z <= PRESENCE_ZOOM)
+    return id;
 
-  g_task_run_in_thread (task, do_insert);
+  return maps_tile_id_from_zxy (PRESENCE_ZOOM, x >> (z - PRESENCE_ZOOM), y >> (z - PRESENCE_ZOOM));
 }
 
-gboolean
-maps_download_store_insert_finish (MapsDownloadStore  *self,
-                                   GAsyncResult       *result,
-                                   GError            **error)
+/* The IDs of the descendants at zoom level @z of the tile @parent_z/@x/@y. Along the Hilbert curve, a tile's
+   descendants at any zoom level are numbered consecutively. */
+static void
+descendant_id_range (guint    parent_z,
+                     guint    x,
+                     guint    y,
+                     guint    z,
+                     guint64 *first,
+                     guint64 *last)
 {
-  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), FALSE);
-  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  guint shift = 2 * (z - parent_z);
+  guint64 base = maps_tile_id_from_zxy (z, 0, 0);
+  guint64 d = maps_tile_id_from_zxy (z, x << (z - parent_z), y << (z - parent_z)) - base;
 
-  return g_task_propagate_boolean (G_TASK (result), error);
+  *first = base + ((d >> shift) << shift);
+  *last = *first + ((guint64)1 << shift) - 1;
 }
 
-typedef struct {
-  char *tileset;
-  char **ids;
-} RemoveData;
-
-static void
-remove_data_free (RemoveData *data)
+/* Sets the bit for a tile. Returns TRUE if it wasn't set already. */
+static gboolean
+presence_bitmap_add (guint8  *bitmap,
+                     guint64  id)
 {
-  g_clear_pointer (&data->tileset, g_free);
-  g_clear_pointer (&data->ids, g_strfreev);
-  g_free (data);
+  gsize bit = presence_bit (id);
+  guint8 mask;
+
+  if (bit == G_MAXSIZE)
+    return FALSE;
+
+  mask = 1 << (bit % 8);
+  if (bitmap[bit / 8] & mask)
+    return FALSE;
+
+  bitmap[bit / 8] |= mask;
+  return TRUE;
+}
+
+/* Whether a tile might be in the store. If this returns FALSE, it certainly isn't, and a read can skip the
+   database. */
+static gboolean
+presence_check (MapsDownloadStore *self,
+                const char        *tileset,
+                guint64            id)
+{
+  const guint8 *bitmap;
+  gsize bit = presence_bit (id);
+
+  if (bit == G_MAXSIZE)
+    return TRUE;
+
+  G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+
+  bitmap = g_hash_table_lookup (self->presence, tileset);
+  return bitmap != NULL && (bitmap[bit / 8] & (1 << (bit % 8)));
+}
+
+static gboolean
+save_presence (MapsDownloadStore  *self,
+               const char         *tileset,
+               const guint8       *bitmap,
+               GError            **error)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  int status;
+
+  status = sqlite3_prepare_v2 (
+    self->db,
+    "INSERT INTO tile_presence (tileset, bitmap) VALUES (?, ?)"
+    "  ON CONFLICT (tileset) DO UPDATE SET bitmap = excluded.bitmap",
+    -1,
+    &stmt,
+    NULL
+  );
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_text (stmt, 1, tileset, -1, SQLITE_STATIC);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_blob (stmt, 2, bitmap, presence_bitmap_size (), SQLITE_STATIC);
+  if (status == SQLITE_OK)
+    status = sqlite3_step (stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode (self->db);
+
+  if (status != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to save presence bitmap: %s", sqlite3_errstr (status));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Recomputes the presence bitmaps from the tiles table, which clears the bits of tiles that were deleted. Must be
+   called with the writer lock held. */
+static gboolean
+rebuild_presence (MapsDownloadStore  *self,
+                  GError            **error)
+{
+  g_autoptr(GHashTable) presence = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  g_autoptr(sqlite_str) error_msg = NULL;
+  GHashTableIter iter;
+  const char *tileset;
+  const guint8 *bitmap;
+  int status;
+
+  status = sqlite3_prepare_v2 (self->db, "SELECT tileset, id FROM tiles", -1, &stmt, NULL);
+  if (status != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to prepare statement: %s", sqlite3_errstr (status));
+      return FALSE;
+    }
+
+  while ((status = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      const char *row_tileset = (const char *)sqlite3_column_text (stmt, 0);
+      guint8 *row_bitmap = g_hash_table_lookup (presence, row_tileset);
+
+      if (row_bitmap == NULL)
+        {
+          row_bitmap = g_malloc0 (presence_bitmap_size ());
+          g_hash_table_insert (presence, g_strdup (row_tileset), row_bitmap);
+        }
+
+      presence_bitmap_add (row_bitmap, sqlite3_column_int64 (stmt, 1));
+    }
+
+  if (status != SQLITE_DONE)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to read tiles: %s", sqlite3_errstr (status));
+      return FALSE;
+    }
+  g_clear_pointer (&stmt, sqlite3_finalize);
+
+  sqlite3_exec (self->db, "SAVEPOINT rebuild_presence; DELETE FROM tile_presence", NULL, NULL, &error_msg);
+  if (error_msg != NULL)
+    {
+      sqlite3_exec (self->db, "ROLLBACK TO rebuild_presence; RELEASE rebuild_presence", NULL, NULL, NULL);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to save presence bitmaps: %s", error_msg);
+      return FALSE;
+    }
+
+  g_hash_table_iter_init (&iter, presence);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&tileset, (gpointer *)&bitmap))
+    {
+      if (!save_presence (self, tileset, bitmap, error))
+        {
+          sqlite3_exec (self->db, "ROLLBACK TO rebuild_presence; RELEASE rebuild_presence", NULL, NULL, NULL);
+          return FALSE;
+        }
+    }
+
+  sqlite3_exec (self->db, "RELEASE rebuild_presence", NULL, NULL, NULL);
+
+  {
+    G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+    g_hash_table_unref (self->presence);
+    self->presence = g_steal_pointer (&presence);
+  }
+
+  return TRUE;
+}
+
+/* Clears the bits of deleted tiles that no remaining tile shares. Must be called with the writer lock held, and
+   only once the deletion is committed: if it were rolled back, the bitmap would be missing the restored tiles.
+   Failing is harmless, since a bitmap with extra bits is still correct, just less useful. */
+static void
+clear_presence (MapsDownloadStore *self,
+                const char        *tileset,
+                GArray            *ids)
+{
+  g_autoptr(sqlite3_stmt) max_id = NULL;
+  g_autoptr(sqlite3_stmt) exists = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree guint8 *bitmap = NULL;
+  g_autofree guint8 *checked = NULL;
+  guint max_zoom, x, y;
+  gboolean cleared = FALSE;
+  int status;
+
+  {
+    G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+    const guint8 *current = g_hash_table_lookup (self->presence, tileset);
+
+    if (current == NULL)
+      return;
+    bitmap = g_memdup2 (current, presence_bitmap_size ());
+  }
+
+  /* IDs grow with the zoom level, so the highest one says how deep the remaining tiles go */
+  status = sqlite3_prepare_v2 (self->db, "SELECT max (id) FROM tiles WHERE tileset = ?", -1, &max_id, NULL);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_text (max_id, 1, tileset, -1, SQLITE_STATIC);
+  if (status == SQLITE_OK)
+    status = sqlite3_step (max_id) == SQLITE_ROW ? SQLITE_OK : sqlite3_errcode (self->db);
+
+  if (status == SQLITE_OK && sqlite3_column_type (max_id, 0) == SQLITE_NULL)
+    {
+      /* There are no tiles left */
+      memset (bitmap, 0, presence_bitmap_size ());
+      cleared = TRUE;
+    }
+  else if (status == SQLITE_OK)
+    {
+      maps_tile_id_to_zxy (sqlite3_column_int64 (max_id, 0), &max_zoom, &x, &y);
+      max_zoom = MAX (max_zoom, PRESENCE_ZOOM);
+
+      status = sqlite3_prepare_v2 (self->db,
+                                   "SELECT EXISTS (SELECT 1 FROM tiles WHERE tileset = ? AND id BETWEEN ? AND ?)",
+                                   -1,
+                                   &exists,
+                                   NULL);
+      if (status == SQLITE_OK)
+        status = sqlite3_bind_text (exists, 1, tileset, -1, SQLITE_STATIC);
+
+      checked = g_malloc0 (presence_bitmap_size ());
+
+      for (guint i = 0; i < ids->len && status == SQLITE_OK; i++)
+        {
+          gsize bit = presence_bit (g_array_index (ids, guint64, i));
+          guint8 mask = 1 << (bit % 8);
+          gboolean in_use = FALSE;
+          guint z, last_z;
+
+          if (bit == G_MAXSIZE || (checked[bit / 8] & mask) || !(bitmap[bit / 8] & mask))
+            continue;
+          checked[bit / 8] |= mask;
+
+          /* A bit below PRESENCE_ZOOM is its tile's alone. One at PRESENCE_ZOOM is shared by the tile's whole
+             subtree, which is one range of IDs per zoom level. */
+          maps_tile_id_to_zxy (bit, &z, &x, &y);
+          last_z = z < PRESENCE_ZOOM ? z : max_zoom;
+
+          for (guint subtree_z = z; subtree_z <= last_z && !in_use && status == SQLITE_OK; subtree_z++)
+            {
+              guint64 first, last;
+
+              descendant_id_range (z, x, y, subtree_z, &first, &last);
+              status = sqlite3_bind_int64 (exists, 2, first);
+              if (status == SQLITE_OK)
+                status = sqlite3_bind_int64 (exists, 3, last);
+              if (status == SQLITE_OK)
+                status = sqlite3_step (exists) == SQLITE_ROW ? SQLITE_OK : sqlite3_errcode (self->db);
+              if (status == SQLITE_OK)
+                in_use = sqlite3_column_int (exists, 0);
+              sqlite3_reset (exists);
+            }
+
+          if (status == SQLITE_OK && !in_use)
+            {
+              bitmap[bit / 8] &= ~mask;
+              cleared = TRUE;
+            }
+        }
+    }
+
+  if (status != SQLITE_OK)
+    {
+      g_warning ("Failed to update tile presence bitmap: %s", sqlite3_errstr (status));
+      return;
+    }
+
+  if (!cleared)
+    return;
+
+  if (!save_presence (self, tileset, bitmap, &error))
+    {
+      g_warning ("%s", error->message);
+      return;
+    }
+
+  {
+    G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+    g_hash_table_replace (self->presence, g_strdup (tileset), g_steal_pointer (&bitmap));
+  }
+}
+
+/* Loads the saved presence bitmaps, or builds them if there are tiles that aren't covered, i.e. the database was
+   created before they existed */
+static gboolean
+load_presence (MapsDownloadStore  *self,
+               GError            **error)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  int status;
+
+  status = sqlite3_prepare_v2 (
+    self->db,
+    "SELECT EXISTS (SELECT 1 FROM tiles WHERE tileset NOT IN (SELECT tileset FROM tile_presence))",
+    -1,
+    &stmt,
+    NULL
+  );
+  if (status == SQLITE_OK)
+    status = sqlite3_step (stmt) == SQLITE_ROW ? SQLITE_OK : sqlite3_errcode (self->db);
+  if (status != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to load presence bitmaps: %s", sqlite3_errstr (status));
+      return FALSE;
+    }
+
+  if (sqlite3_column_int (stmt, 0))
+    return rebuild_presence (self, error);
+
+  g_clear_pointer (&stmt, sqlite3_finalize);
+  status = sqlite3_prepare_v2 (self->db, "SELECT tileset, bitmap FROM tile_presence", -1, &stmt, NULL);
+  if (status != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to prepare statement: %s", sqlite3_errstr (status));
+      return FALSE;
+    }
+
+  while ((status = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      guint8 *bitmap = g_malloc0 (presence_bitmap_size ());
+
+      /* A bitmap of the wrong size would be from a different PRESENCE_ZOOM, so start over */
+      if ((gsize)sqlite3_column_bytes (stmt, 1) != presence_bitmap_size ())
+        {
+          g_free (bitmap);
+          g_clear_pointer (&stmt, sqlite3_finalize);
+          return rebuild_presence (self, error);
+        }
+
+      memcpy (bitmap, sqlite3_column_blob (stmt, 1), presence_bitmap_size ());
+      g_hash_table_insert (self->presence, g_strdup ((const char *)sqlite3_column_text (stmt, 0)), bitmap);
+    }
+
+  if (status != SQLITE_DONE)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to load presence bitmaps: %s", sqlite3_errstr (status));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Reads the total size of the cache-only tiles after a write. Must be called with the writer lock held. On failure,
+   the last total is kept, which only delays enforcing the quota. */
+static void
+load_cache_used (MapsDownloadStore *self)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  int status;
+
+  status = sqlite3_prepare_v2 (self->db, "SELECT bytes FROM cache_used", -1, &stmt, NULL);
+  if (status == SQLITE_OK)
+    status = sqlite3_step (stmt) == SQLITE_ROW ? SQLITE_OK : sqlite3_errcode (self->db);
+  if (status != SQLITE_OK)
+    {
+      g_warning ("Failed to read the size of the tile cache: %s", sqlite3_errstr (status));
+      return;
+    }
+
+  {
+    G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+    self->cache_used = MAX (sqlite3_column_int64 (stmt, 0), 0);
+  }
+}
+
+MapsDownloadStore *
+maps_download_store_new (void)
+{
+  return g_object_new (MAPS_TYPE_DOWNLOAD_STORE, NULL);
+}
+
+gboolean
+maps_download_store_open (MapsDownloadStore  *self,
+                          const char         *path,
+                          GError            **error)
+{
+  int status;
+  g_autoptr(sqlite_str) error_msg = NULL;
+
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), FALSE);
+  g_return_val_if_fail (path != NULL, FALSE);
+  g_return_val_if_fail (self->db == NULL, FALSE);
+
+  status = sqlite3_open_v2 (path, &self->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL);
+
+  if (status != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to open database: %s", sqlite3_errstr (status));
+      g_clear_pointer (&self->db, sqlite3_close);
+      return FALSE;
+    }
+
+  sqlite3_busy_timeout (self->db, BUSY_TIMEOUT_MS);
+
+  /* Free pages are given back to the filesystem a few at a time with maps_download_store_reclaim_async(), rather
+     than with a VACUUM that rewrites the whole file. This only takes effect by itself in a new database; older
+     ones are converted by the first reclaim. */
+  sqlite3_exec (self->db, "PRAGMA auto_vacuum = INCREMENTAL", NULL, NULL, NULL);
+
+  /* WAL mode lets the read connections keep reading while a download is writing tiles. The journal mode is
+     persistent, so this only does anything the first time. */
+  sqlite3_exec (
+    self->db,
+    "PRAGMA journal_mode = WAL;"
+    "PRAGMA synchronous = NORMAL;",
+    NULL, NULL, &error_msg
+  );
+  if (error_msg != NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to set journal mode: %s", error_msg);
+      g_clear_pointer (&self->db, sqlite3_close);
+      return FALSE;
+    }
+
+  sqlite3_create_function (self->db, "tile_hash", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, tile_hash_func, NULL, NULL);
+  sqlite3_create_function (self->db, "tile_id_from_name", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, tile_id_from_name_func, NULL, NULL);
+  sqlite3_create_function (self->db, "tile_zoom", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, GINT_TO_POINTER (0), tile_coordinate_func, NULL, NULL);
+  sqlite3_create_function (self->db, "tile_x", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, GINT_TO_POINTER (1), tile_coordinate_func, NULL, NULL);
+  sqlite3_create_function (self->db, "tile_y", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, GINT_TO_POINTER (2), tile_coordinate_func, NULL, NULL);
+
+  if (!migrate (self, error) || !load_dictionaries (self, error) || !load_presence (self, error))
+    {
+      g_clear_pointer (&self->db, sqlite3_close);
+      return FALSE;
+    }
+
+  self->needs_vacuum = get_pragma_int (self->db, "auto_vacuum") != 2; /* 2 = INCREMENTAL */
+  load_cache_used (self);
+
+  for (int i = 0; i < N_READ_CONNECTIONS; i++)
+    {
+      ReadConnection *conn = g_new0 (ReadConnection, 1);
+      conn->store = self;
+
+      status = sqlite3_open_v2 (path, &conn->db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+      if (status != SQLITE_OK)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to open read connection: %s", sqlite3_errstr (status));
+          sqlite3_close (conn->db);
+          g_free (conn);
+
+          while ((conn = g_async_queue_try_pop (self->readers)) != NULL)
+            {
+              sqlite3_close (conn->db);
+              g_free (conn);
+            }
+          g_clear_pointer (&self->db, sqlite3_close);
+          return FALSE;
+        }
+
+      sqlite3_busy_timeout (conn->db, BUSY_TIMEOUT_MS);
+      g_async_queue_push (self->readers, conn);
+    }
+
+  self->path = g_strdup (path);
+
+  return TRUE;
+}
+
+/* Maximum number of rows in one multi-row INSERT. Each row has at most 6 parameters, which keeps statements under
+   SQLite's default limit of 999 parameters. */
+#define ROWS_PER_INSERT 128
+
+/* Sets the given ranges' bits in the tileset's download plan. Must be called with the writer lock held. */
+static gboolean
+mark_plan_ranges_complete (MapsDownloadStore  *self,
+                           const char         *tileset,
+                           const guint        *ranges,
+                           gsize               n_ranges,
+                           GError            **error)
+{
+  g_autoptr(sqlite3_stmt) select = NULL;
+  g_autoptr(sqlite3_stmt) update = NULL;
+  g_autofree guint8 *completed = NULL;
+  gsize size;
+  int status;
+
+  if (n_ranges == 0)
+    return TRUE;
+
+  status = sqlite3_prepare_v2 (
+    self->db,
+    "SELECT completed FROM download_plans WHERE tileset = ?",
+    -1,
+    &select,
+    NULL
+  );
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_text (select, 1, tileset, -1, SQLITE_STATIC);
+  if (status != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to load download plan: %s", sqlite3_errstr (status));
+      return FALSE;
+    }
+
+  status = sqlite3_step (select);
+  if (status != SQLITE_ROW)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No download plan for %s", tileset);
+      return FALSE;
+    }
+
+  size = sqlite3_column_bytes (select, 0);
+  completed = g_memdup2 (sqlite3_column_blob (select, 0), size);
+
+  for (gsize i = 0; i < n_ranges; i++)
+    {
+      if (ranges[i] / 8 >= size)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Range %u is not in the plan", ranges[i]);
+          return FALSE;
+        }
+
+      completed[ranges[i] / 8] |= 1 << (ranges[i] % 8);
+    }
+
+  status = sqlite3_prepare_v2 (
+    self->db,
+    "UPDATE download_plans SET completed = ? WHERE tileset = ?",
+    -1,
+    &update,
+    NULL
+  );
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_blob64 (update, 1, completed, size, SQLITE_STATIC);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_text (update, 2, tileset, -1, SQLITE_STATIC);
+  if (status == SQLITE_OK)
+    status = sqlite3_step (update) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode (self->db);
+  if (status != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to update download plan: %s", sqlite3_errstr (status));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+typedef struct {
+  guint64 *ids;
+  gsize n_ids;
+  GBytes *bytes;
+  gboolean precompressed;
+  guint8 hash[HASH_LENGTH];
+  MapsTileCodecFormat codec;
+} InsertEntry;
+
+typedef struct {
+  char *tileset;
+  guint64 mtime;
+  gboolean cache_only;
+  InsertEntry *entries;
+  guint n_entries;
+  gsize n_tiles;
+  guint *completed_ranges;
+  gsize n_completed_ranges;
+
+  /* Entries are compressed in parallel on the compress pool. The last worker to finish moves the task on to
+     do_insert(), or returns the first error. */
+  gint n_pending;
+  GError *error;
+  /* The dictionary used to compress the data, if any, so it can be saved along with the tiles */
+  GBytes *dictionary;
+} InsertData;
+
+typedef struct {
+  GTask *task;
+  guint index;
+} CompressJob;
+
+static void
+insert_data_free (InsertData *data)
+{
+  for (guint i = 0; i < data->n_entries; i++)
+    {
+      g_clear_pointer (&data->entries[i].ids, g_free);
+      g_clear_pointer (&data->entries[i].bytes, g_bytes_unref);
+    }
+
+  g_clear_pointer (&data->tileset, g_free);
+  g_clear_pointer (&data->entries, g_free);
+  g_clear_pointer (&data->completed_ranges, g_free);
+  g_clear_error (&data->error);
+  g_clear_pointer (&data->dictionary, g_bytes_unref);
+  g_free (data);
+}
+
+/* Prepares "<prefix> <row>, <row>, ... <suffix>" with n_rows rows */
+static sqlite3_stmt *
+prepare_multi_row (MapsDownloadStore  *self,
+                   const char         *prefix,
+                   const char         *row,
+                   guint               n_rows,
+                   const char         *suffix,
+                   GError            **error)
+{
+  g_autoptr(GString) sql = g_string_new (prefix);
+  sqlite3_stmt *stmt = NULL;
+  int status;
+
+  for (guint i = 0; i < n_rows; i++)
+    {
+      g_string_append (sql, i == 0 ? " " : ", ");
+      g_string_append (sql, row);
+    }
+  g_string_append (sql, suffix);
+
+  status = sqlite3_prepare_v2 (self->db, sql->str, sql->len, &stmt, NULL);
+  if (status != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to prepare statement: %s", sqlite3_errstr (status));
+      return NULL;
+    }
+
+  return stmt;
+}
+
+static gboolean
+step_multi_row (MapsDownloadStore  *self,
+                sqlite3_stmt       *stmt,
+                int                 bind_status,
+                GCancellable       *cancellable,
+                GError            **error)
+{
+  int status = bind_status;
+
+  /* Checked once per statement, so a cancelled batch stops within ROWS_PER_INSERT rows */
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    {
+      sqlite3_reset (stmt);
+      return FALSE;
+    }
+
+  if (status == SQLITE_OK && sqlite3_step (stmt) != SQLITE_DONE)
+    status = sqlite3_errcode (self->db);
+
+  sqlite3_reset (stmt);
+
+  if (status != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to insert data: %s", sqlite3_errstr (status));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+#define INSERT_BLOBS_PREFIX "INSERT INTO blobs (hash, bytes, codec) VALUES"
+#define INSERT_BLOBS_ROW "(?, ?, ?)"
+#define INSERT_BLOBS_SUFFIX " ON CONFLICT (hash) DO NOTHING"
+
+static gboolean
+insert_blobs (MapsDownloadStore  *self,
+              InsertData         *data,
+              GCancellable       *cancellable,
+              GError            **error)
+{
+  g_autoptr(sqlite3_stmt) full = NULL;
+
+  for (guint start = 0; start < data->n_entries; start += ROWS_PER_INSERT)
+    {
+      g_autoptr(sqlite3_stmt) partial = NULL;
+      guint n_rows = MIN (ROWS_PER_INSERT, data->n_entries - start);
+      sqlite3_stmt *stmt;
+      int status = SQLITE_OK;
+
+      /* Full-size chunks all use the same statement, only the last chunk needs one of its own */
+      if (n_rows == ROWS_PER_INSERT)
+        {
+          if (full == NULL)
+            full = prepare_multi_row (self, INSERT_BLOBS_PREFIX, INSERT_BLOBS_ROW, n_rows, INSERT_BLOBS_SUFFIX, error);
+          stmt = full;
+        }
+      else
+        stmt = partial = prepare_multi_row (self, INSERT_BLOBS_PREFIX, INSERT_BLOBS_ROW, n_rows, INSERT_BLOBS_SUFFIX, error);
+
+      if (stmt == NULL)
+        return FALSE;
+
+      for (guint i = 0; i < n_rows && status == SQLITE_OK; i++)
+        {
+          InsertEntry *entry = &data->entries[start + i];
+
+          status = sqlite3_bind_blob (stmt, 3 * i + 1, entry->hash, HASH_LENGTH, SQLITE_STATIC);
+          if (status == SQLITE_OK)
+            status = sqlite3_bind_blob (stmt, 3 * i + 2, g_bytes_get_data (entry->bytes, NULL), g_bytes_get_size (entry->bytes), SQLITE_STATIC);
+          if (status == SQLITE_OK)
+            status = sqlite3_bind_int (stmt, 3 * i + 3, entry->codec);
+        }
+
+      if (!step_multi_row (self, stmt, status, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* A tile stays out of reach of the quota once anything stores it for a download area */
+#define INSERT_TILES_PREFIX "INSERT INTO tiles (tileset, id, hash, mtime, cache_only, size) VALUES"
+#define INSERT_TILES_ROW "(?, ?, ?, ?, ?, ?)"
+#define INSERT_TILES_SUFFIX \
+  " ON CONFLICT (tileset, id) DO UPDATE SET" \
+  "   hash = excluded.hash, mtime = excluded.mtime, cache_only = tiles.cache_only AND excluded.cache_only," \
+  "   size = excluded.size"
+
+/* Checks whether a download area needs a tile, so a tile the map view happens to write for it is stored as part of
+   the area. Keeping cache-only tiles out of the areas means eviction never has to look at the areas. */
+static gboolean
+tile_in_area (MapsDownloadStore  *self,
+              sqlite3_stmt      **stmt,
+              const char         *tileset,
+              guint64             id,
+              gboolean           *in_area,
+              GError            **error)
+{
+  guint z, x, y;
+  int status = SQLITE_OK;
+
+  if (!maps_tile_id_to_zxy (id, &z, &x, &y))
+    {
+      *in_area = FALSE;
+      return TRUE;
+    }
+
+  if (*stmt == NULL)
+    status = sqlite3_prepare_v2 (
+      self->db,
+      "SELECT EXISTS (SELECT 1 FROM area_rects"
+      "  WHERE tileset = ?1 AND z = ?2 AND ?3 BETWEEN x_min AND x_max AND ?4 BETWEEN y_min AND y_max)",
+      -1,
+      stmt,
+      NULL
+    );
+  else
+    status = sqlite3_reset (*stmt);
+
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_text (*stmt, 1, tileset, -1, SQLITE_STATIC);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_int (*stmt, 2, z);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_int (*stmt, 3, x);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_int (*stmt, 4, y);
+  if (status == SQLITE_OK)
+    status = sqlite3_step (*stmt) == SQLITE_ROW ? SQLITE_OK : sqlite3_errcode (self->db);
+  if (status != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to look up download areas: %s", sqlite3_errstr (status));
+      return FALSE;
+    }
+
+  *in_area = sqlite3_column_int (*stmt, 0);
+  return TRUE;
+}
+
+static gboolean
+insert_tiles (MapsDownloadStore  *self,
+              InsertData         *data,
+              GCancellable       *cancellable,
+              GError            **error)
+{
+  g_autoptr(sqlite3_stmt) full = NULL;
+  g_autoptr(sqlite3_stmt) partial = NULL;
+  g_autoptr(sqlite3_stmt) area_stmt = NULL;
+  sqlite3_stmt *stmt = NULL;
+  gsize n_done = 0;
+  guint n_rows = 0;
+  guint row = 0;
+  int status = SQLITE_OK;
+
+  for (guint e = 0; e < data->n_entries; e++)
+    {
+      InsertEntry *entry = &data->entries[e];
+
+      for (gsize i = 0; i < entry->n_ids; i++)
+        {
+          gboolean in_area = FALSE;
+
+          if (data->cache_only && !tile_in_area (self, &area_stmt, data->tileset, entry->ids[i], &in_area, error))
+            return FALSE;
+
+          if (row == 0)
+            {
+              n_rows = MIN (ROWS_PER_INSERT, data->n_tiles - n_done);
+
+              if (n_rows == ROWS_PER_INSERT)
+                {
+                  if (full == NULL)
+                    full = prepare_multi_row (self, INSERT_TILES_PREFIX, INSERT_TILES_ROW, n_rows, INSERT_TILES_SUFFIX, error);
+                  stmt = full;
+                }
+              else
+                stmt = partial = prepare_multi_row (self, INSERT_TILES_PREFIX, INSERT_TILES_ROW, n_rows, INSERT_TILES_SUFFIX, error);
+
+              if (stmt == NULL)
+                return FALSE;
+            }
+
+          if (status == SQLITE_OK)
+            status = sqlite3_bind_text (stmt, 6 * row + 1, data->tileset, -1, SQLITE_STATIC);
+          if (status == SQLITE_OK)
+            status = sqlite3_bind_int64 (stmt, 6 * row + 2, entry->ids[i]);
+          if (status == SQLITE_OK)
+            status = sqlite3_bind_blob (stmt, 6 * row + 3, entry->hash, HASH_LENGTH, SQLITE_STATIC);
+          if (status == SQLITE_OK)
+            status = sqlite3_bind_int64 (stmt, 6 * row + 4, data->mtime);
+          if (status == SQLITE_OK)
+            status = sqlite3_bind_int (stmt, 6 * row + 5, data->cache_only && !in_area);
+          if (status == SQLITE_OK)
+            status = sqlite3_bind_int64 (stmt, 6 * row + 6, g_bytes_get_size (entry->bytes));
+
+          n_done++;
+          if (++row == n_rows)
+            {
+              if (!step_multi_row (self, stmt, status, cancellable, error))
+                return FALSE;
+              row = 0;
+            }
+        }
+    }
+
+  return TRUE;
+}
+
+/* Sets the bits for newly inserted tiles, and saves the bitmap if it changed. Bits are set before the tiles are
+   committed, so readers never skip a tile that is there; if the insert is rolled back, the extra bits only cost a
+   lookup. Must be called with the writer lock held. */
+static gboolean
+update_presence (MapsDownloadStore  *self,
+                 InsertData         *data,
+                 GError            **error)
+{
+  g_autofree guint8 *copy = NULL;
+
+  {
+    G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+    guint8 *bitmap = g_hash_table_lookup (self->presence, data->tileset);
+    gboolean changed = FALSE;
+
+    if (bitmap == NULL)
+      {
+        bitmap = g_malloc0 (presence_bitmap_size ());
+        g_hash_table_insert (self->presence, g_strdup (data->tileset), bitmap);
+      }
+
+    for (guint e = 0; e < data->n_entries; e++)
+      for (gsize i = 0; i < data->entries[e].n_ids; i++)
+        changed |= presence_bitmap_add (bitmap, data->entries[e].ids[i]);
+
+    if (!changed)
+      return TRUE;
+
+    copy = g_memdup2 (bitmap, presence_bitmap_size ());
+  }
+
+  return save_presence (self, data->tileset, copy, error);
+}
+
+static gboolean
+insert_batch (MapsDownloadStore  *self,
+              InsertData         *data,
+              GCancellable       *cancellable,
+              GError            **error)
+{
+  int status;
+
+  if (data->dictionary != NULL)
+    {
+      g_autoptr(sqlite3_stmt) stmt = NULL;
+
+      /* Save the dictionary in the same transaction as the first tile that needs it */
+      status = sqlite3_prepare_v2 (
+        self->db,
+        "INSERT INTO metadata (key, value) VALUES ('" DICTIONARY_KEY_PREFIX "' || ?, ?)"
+        "  ON CONFLICT (key) DO NOTHING",
+        -1,
+        &stmt,
+        NULL
+      );
+      if (status == SQLITE_OK)
+        status = sqlite3_bind_text (stmt, 1, data->tileset, -1, SQLITE_STATIC);
+      if (status == SQLITE_OK)
+        status = sqlite3_bind_blob (stmt, 2, g_bytes_get_data (data->dictionary, NULL), g_bytes_get_size (data->dictionary), SQLITE_STATIC);
+      if (status == SQLITE_OK)
+        status = sqlite3_step (stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode (self->db);
+      if (status != SQLITE_OK)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to save dictionary: %s", sqlite3_errstr (status));
+          return FALSE;
+        }
+    }
+
+  /* Blobs first: the tiles' triggers count references to existing blobs by hash, and would miss new ones */
+  return insert_blobs (self, data, cancellable, error)
+    && insert_tiles (self, data, cancellable, error)
+    && update_presence (self, data, error)
+    && mark_plan_ranges_complete (self, data->tileset, data->completed_ranges, data->n_completed_ranges, error);
+}
+
+static void
+do_insert (GTask        *task,
+           gpointer      source_object,
+           gpointer      task_data,
+           GCancellable *cancellable)
+{
+  MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  InsertData *data = task_data;
+  GError *error = NULL;
+  gboolean in_transaction;
+  int status;
+
+  /* Data is compressed and hashed by compress_worker() before the task gets here */
+
+  /* A savepoint makes the batch atomic. If the caller hasn't started a transaction, it also commits the whole
+     batch at once, instead of once per row. */
+  in_transaction = !sqlite3_get_autocommit (self->db);
+  status = sqlite3_exec (self->db, "SAVEPOINT insert_batch", NULL, NULL, NULL);
+  RETURN_IF_SQLITE_ERROR (status, task, "Failed to start transaction: %s", sqlite3_errstr (status));
+
+  if (!insert_batch (self, data, cancellable, &error))
+    {
+      sqlite3_exec (self->db, "ROLLBACK TO insert_batch; RELEASE insert_batch", NULL, NULL, NULL);
+      g_task_return_error (task, error);
+      return;
+    }
+
+  status = sqlite3_exec (self->db, "RELEASE insert_batch", NULL, NULL, NULL);
+  if (status != SQLITE_OK)
+    {
+      sqlite3_exec (self->db, "ROLLBACK TO insert_batch; RELEASE insert_batch", NULL, NULL, NULL);
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to commit: %s", sqlite3_errstr (status));
+      return;
+    }
+
+  for (guint i = 0; i < data->n_entries; i++)
+    cache_invalidate (self, data->tileset, data->entries[i].ids, data->entries[i].n_ids);
+  if (in_transaction)
+    self->cache_dirty = TRUE;
+  load_cache_used (self);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+compress_worker (gpointer data,
+                 gpointer user_data)
+{
+  MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (user_data);
+  g_autofree CompressJob *job = data;
+  g_autoptr(GTask) task = job->task;
+  InsertData *insert_data = g_task_get_task_data (task);
+  InsertEntry *entry = &insert_data->entries[job->index];
+  GBytes *compressed;
+  GError *error = NULL;
+
+  /* Don't bother if another entry already failed, or the insert was cancelled. The insert task drops itself in
+     that case. */
+  if (g_atomic_pointer_get (&insert_data->error) == NULL && !g_cancellable_is_cancelled (g_task_get_cancellable (task)))
+    {
+      compressed = maps_tile_codec_encode (self->codec,
+                                           insert_data->tileset,
+                                           entry->bytes,
+                                           entry->precompressed,
+                                           &entry->codec,
+                                           &error);
+      if (compressed == NULL)
+        {
+          if (!g_atomic_pointer_compare_and_exchange (&insert_data->error, NULL, error))
+            g_error_free (error);
+        }
+      else
+        {
+          g_bytes_unref (entry->bytes);
+          entry->bytes = compressed;
+          entry->precompressed = TRUE;
+
+          if (entry->codec == MAPS_TILE_CODEC_FORMAT_ZSTD && g_atomic_pointer_get (&insert_data->dictionary) == NULL)
+            {
+              GBytes *dictionary = maps_tile_codec_get_dictionary (self->codec, insert_data->tileset);
+              if (!g_atomic_pointer_compare_and_exchange (&insert_data->dictionary, NULL, dictionary))
+                g_bytes_unref (dictionary);
+            }
+
+          /* Hashing is done here too, so it doesn't happen under the writer lock */
+          compute_hash (g_bytes_get_data (entry->bytes, NULL), g_bytes_get_size (entry->bytes), entry->hash);
+        }
+    }
+
+  if (!g_atomic_int_dec_and_test (&insert_data->n_pending))
+    return;
+
+  if (insert_data->error != NULL)
+    g_task_return_error (task, g_steal_pointer (&insert_data->error));
+  else
+    queue_write (self, task, do_insert);
+}
+
+static void
+insert_start (MapsDownloadStore *self,
+              GTask             *task,
+              InsertData        *data)
+{
+  g_task_set_task_data (task, data, (GDestroyNotify)insert_data_free);
+
+  if (data->n_entries == 0)
+    {
+      queue_write (self, task, do_insert);
+      return;
+    }
+
+  data->n_pending = data->n_entries;
+  for (guint i = 0; i < data->n_entries; i++)
+    {
+      CompressJob *job = g_new (CompressJob, 1);
+      job->task = g_object_ref (task);
+      job->index = i;
+      g_thread_pool_push (self->compress_pool, job, NULL);
+    }
+}
+
+/**
+ * maps_download_store_insert_async:
+ * @ids: (array length=n_ids): tile IDs
+ * @n_ids: the length of @ids
+ */
+void
+maps_download_store_insert_async (MapsDownloadStore    *self,
+                                  const char           *tileset,
+                                  const guint64        *ids,
+                                  gsize                 n_ids,
+                                  GBytes               *data,
+                                  gboolean              precompressed,
+                                  guint64               mtime,
+                                  GCancellable         *cancellable,
+                                  GAsyncReadyCallback   callback,
+                                  gpointer              user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  InsertData *insert_data;
+
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
+  g_return_if_fail (ids != NULL || n_ids == 0);
+  g_return_if_fail (data != NULL);
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, maps_download_store_insert_async);
+
+  insert_data = g_new0 (InsertData, 1);
+  insert_data->tileset = g_strdup (tileset);
+  insert_data->mtime = mtime;
+  insert_data->n_entries = 1;
+  insert_data->n_tiles = n_ids;
+  insert_data->entries = g_new0 (InsertEntry, 1);
+  insert_data->entries[0].ids = g_memdup2 (ids, n_ids * sizeof (guint64));
+  insert_data->entries[0].n_ids = n_ids;
+  insert_data->entries[0].bytes = g_bytes_ref (data);
+  insert_data->entries[0].precompressed = precompressed;
+
+  insert_start (self, task, insert_data);
+}
+
+gboolean
+maps_download_store_insert_finish (MapsDownloadStore  *self,
+                                   GAsyncResult       *result,
+                                   GError            **error)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), FALSE);
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * maps_download_store_insert_batch_async:
+ * @self: a [class@DownloadStore]
+ * @batch: the tiles to insert
+ * @cancellable: (nullable): a [class@Gio.Cancellable]
+ * @callback: a [callback@Gio.AsyncReadyCallback]
+ * @user_data: user data passed to @callback
+ *
+ * Inserts a batch of tiles, and marks the batch's plan ranges as complete.
+ *
+ * The tiles are compressed in parallel, then written with multi-row inserts
+ * in a single transaction, which is much faster than inserting them one at a
+ * time. If a transaction is already open, the batch is written as part of it.
+ * Either the whole batch is written or none of it is.
+ *
+ * The batch must not be modified while the operation is running. If
+ * @cancellable is cancelled, the batch is rolled back.
+ */
+void
+maps_download_store_insert_batch_async (MapsDownloadStore    *self,
+                                        MapsTileBatch        *batch,
+                                        GCancellable         *cancellable,
+                                        GAsyncReadyCallback   callback,
+                                        gpointer              user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  InsertData *insert_data;
+  const guint *completed_ranges;
+
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
+  g_return_if_fail (MAPS_IS_TILE_BATCH (batch));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, maps_download_store_insert_batch_async);
+
+  insert_data = g_new0 (InsertData, 1);
+  insert_data->tileset = g_strdup (maps_tile_batch_get_tileset (batch));
+  insert_data->mtime = maps_tile_batch_get_mtime (batch);
+  insert_data->cache_only = maps_tile_batch_get_cache_only (batch);
+  insert_data->n_entries = maps_tile_batch_get_n_entries (batch);
+  insert_data->n_tiles = maps_tile_batch_get_n_tiles (batch);
+  insert_data->entries = g_new0 (InsertEntry, insert_data->n_entries);
+
+  for (guint i = 0; i < insert_data->n_entries; i++)
+    {
+      InsertEntry *entry = &insert_data->entries[i];
+      const guint64 *ids;
+      GBytes *bytes;
+
+      bytes = maps_tile_batch_get_entry (batch, i, &ids, &entry->n_ids, &entry->precompressed);
+      entry->ids = g_memdup2 (ids, entry->n_ids * sizeof (guint64));
+      entry->bytes = g_bytes_ref (bytes);
+    }
+
+  completed_ranges = maps_tile_batch_get_completed_ranges (batch, &insert_data->n_completed_ranges);
+  insert_data->completed_ranges = g_memdup2 (completed_ranges, insert_data->n_completed_ranges * sizeof (guint));
+
+  insert_start (self, task, insert_data);
+}
+
+gboolean
+maps_download_store_insert_batch_finish (MapsDownloadStore  *self,
+                                         GAsyncResult       *result,
+                                         GError            **error)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), FALSE);
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static GHashTable *
+tile_ids_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_array_unref);
+}
+
+static void
+add_tile_id (GHashTable *ids,
+             const char *tileset,
+             guint64     id)
+{
+  GArray *tileset_ids = g_hash_table_lookup (ids, tileset);
+
+  if (tileset_ids == NULL)
+    {
+      tileset_ids = g_array_new (FALSE, FALSE, sizeof (guint64));
+      g_hash_table_insert (ids, g_strdup (tileset), tileset_ids);
+    }
+
+  g_array_append_val (tileset_ids, id);
+}
+
+/* Removes deleted tiles from the memory cache and the presence bitmaps. Inside a transaction, this waits until
+   the deletion is visible to readers: the cache is cleared when the transaction ends, and the bitmaps keep the
+   deleted tiles' bits. */
+static void
+forget_deleted (MapsDownloadStore *self,
+                GHashTable        *deleted)
+{
+  GHashTableIter iter;
+  const char *tileset;
+  GArray *ids;
+
+  if (!sqlite3_get_autocommit (self->db))
+    {
+      self->cache_dirty = TRUE;
+      return;
+    }
+
+  g_hash_table_iter_init (&iter, deleted);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&tileset, (gpointer *)&ids))
+    {
+      cache_invalidate (self, tileset, (const guint64 *)ids->data, ids->len);
+      clear_presence (self, tileset, ids);
+    }
+}
+
+typedef struct {
+  char *tileset;
+  guint64 *ids;
+  gsize n_ids;
+} RemoveData;
+
+static void
+remove_data_free (RemoveData *data)
+{
+  g_clear_pointer (&data->tileset, g_free);
+  g_clear_pointer (&data->ids, g_free);
+  g_free (data);
+}
+
+static void
+do_remove (GTask        *task,
+           gpointer      source_object,
+           gpointer      task_data,
+           GCancellable *cancellable)
+{
+  MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  RemoveData *data = task_data;
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  g_autoptr(GHashTable) deleted = tile_ids_new ();
+  int status;
+
+  status = sqlite3_prepare_v2 (
+    self->db,
+    "DELETE FROM tiles WHERE tileset = ? and id = ?",
+    -1,
+    &stmt,
+    NULL
+  );
+  RETURN_IF_PREPARE_ERROR (status, task);
+
+  status = sqlite3_bind_text (stmt, 1, data->tileset, -1, SQLITE_STATIC);
+  RETURN_IF_BIND_ERROR (status, task, "tileset");
+
+  /* All or nothing, so cancelling doesn't leave some of the tiles removed */
+  status = sqlite3_exec (self->db, "SAVEPOINT remove", NULL, NULL, NULL);
+  RETURN_IF_SQLITE_ERROR (status, task, "Failed to start transaction: %s", sqlite3_errstr (status));
+
+  for (gsize i = 0; i < data->n_ids; i++)
+    {
+      if (g_cancellable_is_cancelled (cancellable))
+        status = SQLITE_INTERRUPT;
+      else if ((status = sqlite3_bind_int64 (stmt, 2, data->ids[i])) == SQLITE_OK)
+        status = sqlite3_step (stmt);
+
+      if (status == SQLITE_DONE && sqlite3_changes (self->db) > 0)
+        add_tile_id (deleted, data->tileset, data->ids[i]);
+      sqlite3_reset (stmt);
+
+      if (status != SQLITE_DONE)
+        {
+          sqlite3_exec (self->db, "ROLLBACK TO remove; RELEASE remove", NULL, NULL, NULL);
+          if (!g_task_return_error_if_cancelled (task))
+            g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to remove data: %s", sqlite3_errstr (status));
+          return;
+        }
+    }
+
+  status = sqlite3_exec (self->db, "RELEASE remove", NULL, NULL, NULL);
+  if (status != SQLITE_OK)
+    {
+      sqlite3_exec (self->db, "ROLLBACK TO remove; RELEASE remove", NULL, NULL, NULL);
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to commit: %s", sqlite3_errstr (status));
+      return;
+    }
+
+  forget_deleted (self, deleted);
+  load_cache_used (self);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * maps_download_store_remove_async:
+ * @ids: (array length=n_ids): tile IDs
+ * @n_ids: the length of @ids
+ *
+ * Removes tiles. Their bits in the presence bitmap are cleared once no
+ * remaining tile shares them, unless the removal is part of a transaction,
+ * in which case they stay set and the removed tiles only cost a lookup.
+ */
+void
+maps_download_store_remove_async (MapsDownloadStore    *self,
+                                  const char           *tileset,
+                                  const guint64        *ids,
+                                  gsize                 n_ids,
+                                  GCancellable         *cancellable,
+                                  GAsyncReadyCallback   callback,
+                                  gpointer              user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  RemoveData *data;
+
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
+  g_return_if_fail (ids != NULL || n_ids == 0);
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, maps_download_store_remove_async);
+
+  data = g_new (RemoveData, 1);
+  data->tileset = g_strdup (tileset);
+  data->ids = g_memdup2 (ids, n_ids * sizeof (guint64));
+  data->n_ids = n_ids;
+  g_task_set_task_data (task, data, (GDestroyNotify)remove_data_free);
+  queue_write (self, task, do_remove);
+}
+
+gboolean
+maps_download_store_remove_finish (MapsDownloadStore  *self,
+                                   GAsyncResult       *result,
+                                   GError            **error)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), FALSE);
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+typedef struct {
+  char *tileset;
+  guint64 id;
+} GetData;
+
+static void
+get_data_free (GetData *data)
+{
+  g_clear_pointer (&data->tileset, g_free);
+  g_free (data);
+}
+
+/* Cache-only tiles written before this time (in milliseconds) are stale. Stale tiles are still returned, but kept
+   out of the memory cache, so that tiles from the memory cache are always fresh. */
+static gint64
+get_stale_before (MapsDownloadStore *self)
+{
+  guint64 max_age;
+
+  {
+    G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+    max_age = self->cache_max_age;
+  }
+
+  return max_age > 0 ? g_get_real_time () / 1000 - max_age : 0;
+}
+
+static void
+do_get (GTask        *task,
+        gpointer      source_object,
+        gpointer      task_data,
+        GCancellable *cancellable)
+{
+  MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
+  g_autoptr(ReadConnection) conn = read_connection_acquire (self);
+  GetData *data = task_data;
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  GError *error = NULL;
+  guint64 epoch = cache_get_epoch (self);
+  int status;
+
+  status = sqlite3_prepare_v2 (
+    conn->db,
+    "SELECT blobs.bytes, blobs.codec, tiles.cache_only AND tiles.mtime < ?"
+    "  FROM tiles JOIN blobs ON blobs.hash = tiles.hash WHERE tileset = ? and id = ?",
+    -1,
+    &stmt,
+    NULL
+  );
+  RETURN_IF_PREPARE_ERROR (status, task);
+
+  status = sqlite3_bind_int64 (stmt, 1, get_stale_before (self));
+  RETURN_IF_BIND_ERROR (status, task, "mtime");
+
+  status = sqlite3_bind_text (stmt, 2, data->tileset, -1, SQLITE_STATIC);
+  RETURN_IF_BIND_ERROR (status, task, "tileset");
+
+  status = sqlite3_bind_int64 (stmt, 3, data->id);
+  RETURN_IF_BIND_ERROR (status, task, "id");
+
+  status = sqlite3_step (stmt);
+  if (status == SQLITE_DONE)
+    g_task_return_pointer (task, NULL, NULL);
+  else if (status == SQLITE_ROW)
+    {
+      GBytes *decompressed = maps_tile_codec_decode (self->codec,
+                                                     sqlite3_column_blob (stmt, 0),
+                                                     sqlite3_column_bytes (stmt, 0),
+                                                     sqlite3_column_int (stmt, 1),
+                                                     &error);
+
+      if (decompressed == NULL)
+        {
+          g_task_return_error (task, error);
+          return;
+        }
+
+      if (!sqlite3_column_int (stmt, 2))
+        cache_store (self, data->tileset, data->id, decompressed, epoch);
+      record_access (self, data->tileset, data->id);
+      g_task_return_pointer (task, decompressed, (GDestroyNotify)g_bytes_unref);
+    }
+  else
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to get data: %s", sqlite3_errstr (status));
+}
+
+/**
+ * maps_download_store_get_async:
+ * @self: a [class@DownloadStore]
+ * @tileset: the tileset to read from
+ * @z: the tile's zoom level
+ * @x: the tile's X coordinate
+ * @y: the tile's Y coordinate
+ * @cancellable: (nullable): a [class@Gio.Cancellable]
+ * @callback: a [callback@Gio.AsyncReadyCallback]
+ * @user_data: user data passed to @callback
+ *
+ * Reads a tile. Reads are done before queued bulk work such as downloads,
+ * and if @cancellable is cancelled before the read starts, the database
+ * isn't touched at all.
+ */
+void
+maps_download_store_get_async (MapsDownloadStore   *self,
+                               const char          *tileset,
+                               guint                z,
+                               guint                x,
+                               guint                y,
+                               GCancellable        *cancellable,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  GetData *data;
+  GBytes *cached;
+
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
+  g_return_if_fail (tileset != NULL);
+  g_return_if_fail (z <= MAPS_TILE_ID_MAX_ZOOM);
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, maps_download_store_get_async);
+
+  if (!presence_check (self, tileset, maps_tile_id_from_zxy (z, x, y)))
+    {
+      g_task_return_pointer (task, NULL, NULL);
+      return;
+    }
+
+  cached = cache_lookup (self, tileset, maps_tile_id_from_zxy (z, x, y));
+  if (cached != NULL)
+    {
+      g_task_return_pointer (task, cached, (GDestroyNotify)g_bytes_unref);
+      return;
+    }
+
+  data = g_new (GetData, 1);
+  data->tileset = g_strdup (tileset);
+  data->id = maps_tile_id_from_zxy (z, x, y);
+  g_task_set_task_data (task, data, (GDestroyNotify)get_data_free);
+  queue_read (self, task, do_get, JOB_PRIORITY_INTERACTIVE);
+}
+
+/**
+ * maps_download_store_get_finish:
+ * @self: a [class@DownloadStore]
+ * @result: a [class@Gio.AsyncResult]
+ * @error: return location for a [class@GError]
+ *
+ * Finishes a get_async() operation.
+ *
+ * Returns: (transfer full) (nullable): the data, or %NULL if the data was not found
+ * or an error occurred
+ */
+GBytes *
+maps_download_store_get_finish (MapsDownloadStore  *self,
+                                GAsyncResult       *result,
+                                GError            **error)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), NULL);
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+typedef struct {
+  char *tileset;
+  guint64 *ids;
+  gsize n_ids;
+  MapsDownloadStoreTileFunc tile_func;
+  gpointer tile_func_data;
+  GDestroyNotify tile_func_data_destroy;
+  /* The caller's context, where tile_func_data is destroyed */
+  GMainContext *context;
+  /* For prefetch_async(), which only warms the memory cache: the tiles that aren't stored or are stale, collected
+     on the worker instead of being passed to tile_func */
+  GArray *missing;
+} GetManyData;
+
+static gboolean
+release_tile_func_data (gpointer user_data)
+{
+  /* Nothing to do, the destroy notify passed along with this does the work */
+  return G_SOURCE_REMOVE;
+}
+
+static void
+get_many_data_free (GetManyData *data)
+{
+  g_clear_pointer (&data->tileset, g_free);
+  g_clear_pointer (&data->ids, g_free);
+
+  /* The last reference to the task may be dropped by a worker thread, but tile_func_data belongs to the caller's
+     thread, so it's destroyed there. If that is the current thread, this happens right away. */
+  if (data->tile_func_data_destroy != NULL)
+    g_main_context_invoke_full (data->context,
+                                G_PRIORITY_DEFAULT,
+                                release_tile_func_data,
+                                data->tile_func_data,
+                                data->tile_func_data_destroy);
+  g_clear_pointer (&data->context, g_main_context_unref);
+
+  g_clear_pointer (&data->missing, g_array_unref);
+  g_free (data);
+}
+
+typedef struct {
+  GTask *task;
+  guint64 id;
+  GBytes *bytes;
+  gboolean stale;
+} TileResult;
+
+static void
+tile_result_free (TileResult *result)
+{
+  g_clear_object (&result->task);
+  g_clear_pointer (&result->bytes, g_bytes_unref);
+  g_free (result);
+}
+
+static gboolean
+emit_tile_result (gpointer user_data)
+{
+  TileResult *result = user_data;
+  GetManyData *data = g_task_get_task_data (result->task);
+
+  data->tile_func (result->id, result->bytes, result->stale, data->tile_func_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Passes a tile to the caller's tile_func. Takes ownership of @bytes. */
+static void
+queue_tile_result (GTask    *task,
+                   guint64   id,
+                   GBytes   *bytes,
+                   gboolean  stale)
+{
+  GetManyData *data = g_task_get_task_data (task);
+  TileResult *result;
+
+  if (data->missing != NULL)
+    {
+      if (bytes == NULL || stale)
+        g_array_append_val (data->missing, id);
+      g_clear_pointer (&bytes, g_bytes_unref);
+      return;
+    }
+
+  result = g_new0 (TileResult, 1);
+
+  result->task = g_object_ref (task);
+  result->id = id;
+  result->bytes = bytes;
+  result->stale = stale;
+
+  /* Hand each tile to the caller as soon as it's ready rather than waiting for the whole batch */
+  g_main_context_invoke_full (g_task_get_context (task),
+                              g_task_get_priority (task),
+                              emit_tile_result,
+                              result,
+                              (GDestroyNotify)tile_result_free);
+}
+
+static void
+return_get_many (GTask *task)
+{
+  GetManyData *data = g_task_get_task_data (task);
+
+  if (data->missing != NULL)
+    g_task_return_pointer (task, g_steal_pointer (&data->missing), (GDestroyNotify)g_array_unref);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/* Reports every tile as missing, on the task's context, then completes the task */
+static gboolean
+return_all_missing (gpointer user_data)
+{
+  GTask *task = user_data;
+  GetManyData *data = g_task_get_task_data (task);
+
+  for (gsize i = 0; i < data->n_ids; i++)
+    data->tile_func (data->ids[i], NULL, FALSE, data->tile_func_data);
+
+  g_task_return_boolean (task, TRUE);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+get_many_in_transaction (GTask          *task,
+                         ReadConnection *conn,
+                         GetManyData    *data,
+                         const guint64  *ids,
+                         gsize           n_ids,
+                         guint64         epoch)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  gint64 stale_before = get_stale_before (conn->store);
+  int status;
+
+  status = sqlite3_prepare_v2 (
+    conn->db,
+    "SELECT blobs.bytes, blobs.codec, tiles.cache_only AND tiles.mtime < ?"
+    "  FROM tiles JOIN blobs ON blobs.hash = tiles.hash WHERE tileset = ? and id = ?",
+    -1,
+    &stmt,
+    NULL
+  );
+  RETURN_IF_PREPARE_ERROR (status, task);
+
+  status = sqlite3_bind_int64 (stmt, 1, stale_before);
+  RETURN_IF_BIND_ERROR (status, task, "mtime");
+
+  status = sqlite3_bind_text (stmt, 2, data->tileset, -1, SQLITE_STATIC);
+  RETURN_IF_BIND_ERROR (status, task, "tileset");
+
+  for (gsize i = 0; i < n_ids; i++)
+    {
+      GBytes *bytes = NULL;
+      gboolean stale = FALSE;
+      GError *error = NULL;
+
+      /* Tiles that were already read have been passed to tile_func, the rest are dropped */
+      if (g_task_return_error_if_cancelled (task))
+        return;
+
+      status = sqlite3_bind_int64 (stmt, 3, ids[i]);
+      RETURN_IF_BIND_ERROR (status, task, "id");
+
+      status = sqlite3_step (stmt);
+      if (status == SQLITE_ROW)
+        {
+          bytes = maps_tile_codec_decode (conn->store->codec,
+                                          sqlite3_column_blob (stmt, 0),
+                                          sqlite3_column_bytes (stmt, 0),
+                                          sqlite3_column_int (stmt, 1),
+                                          &error);
+          if (bytes == NULL)
+            {
+              g_task_return_error (task, error);
+              return;
+            }
+
+          stale = sqlite3_column_int (stmt, 2);
+          if (!stale)
+            cache_store (conn->store, data->tileset, ids[i], bytes, epoch);
+          record_access (conn->store, data->tileset, ids[i]);
+        }
+      else if (status != SQLITE_DONE)
+        {
+          g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to get data: %s", sqlite3_errstr (status));
+          return;
+        }
+
+      sqlite3_reset (stmt);
+
+      queue_tile_result (task, ids[i], bytes, stale);
+    }
+
+  return_get_many (task);
+}
+
+static void
+do_get_many (GTask        *task,
+             gpointer      source_object,
+             gpointer      task_data,
+             GCancellable *cancellable)
+{
+  MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
+  g_autoptr(ReadConnection) conn = NULL;
+  GetManyData *data = task_data;
+  g_autoptr(GArray) missing = g_array_new (FALSE, FALSE, sizeof (guint64));
+  guint64 epoch = cache_get_epoch (self);
+
+  for (gsize i = 0; i < data->n_ids; i++)
+    {
+      GBytes *cached;
+
+      if (!presence_check (self, data->tileset, data->ids[i]))
+        {
+          queue_tile_result (task, data->ids[i], NULL, FALSE);
+          continue;
+        }
+
+      cached = cache_lookup (self, data->tileset, data->ids[i]);
+      if (cached != NULL)
+        queue_tile_result (task, data->ids[i], cached, FALSE);
+      else
+        g_array_append_val (missing, data->ids[i]);
+    }
+
+  if (missing->len == 0)
+    {
+      return_get_many (task);
+      return;
+    }
+
+  conn = read_connection_acquire (self);
+
+  /* Read all the tiles from the same snapshot, rather than starting a new read transaction for each one */
+  sqlite3_exec (conn->db, "BEGIN", NULL, NULL, NULL);
+  get_many_in_transaction (task, conn, data, (const guint64 *)missing->data, missing->len, epoch);
+  sqlite3_exec (conn->db, "COMMIT", NULL, NULL, NULL);
+}
+
+/**
+ * maps_download_store_get_many_async:
+ * @self: a [class@DownloadStore]
+ * @tileset: the tileset to read from
+ * @ids: (array length=n_ids): the tile IDs to read
+ * @n_ids: the length of @ids
+ * @tile_func: (scope notified) (closure tile_func_data) (destroy tile_func_data_destroy):
+ *   called on the calling thread's main context for each tile in @ids
+ * @tile_func_data: user data passed to @tile_func
+ * @tile_func_data_destroy: destroy notify for @tile_func_data, also called on
+ *   the calling thread's main context
+ * @cancellable: (nullable): a [class@Gio.Cancellable]
+ * @callback: a [callback@Gio.AsyncReadyCallback]
+ * @user_data: user data passed to @callback
+ *
+ * Reads several tiles at once. This is much cheaper than calling get_async()
+ * for each tile, since all of them are read in a single task using the
+ * same prepared statement.
+ *
+ * Tiles are passed to @tile_func as soon as they are read, so callers don't
+ * have to wait for the whole batch. @callback is called after @tile_func has
+ * been called for every tile.
+ *
+ * Like get_async(), the read is done before queued bulk work, and is
+ * dropped if @cancellable is cancelled before it starts.
+ */
+void
+maps_download_store_get_many_async (MapsDownloadStore          *self,
+                                    const char                 *tileset,
+                                    const guint64              *ids,
+                                    gsize                       n_ids,
+                                    MapsDownloadStoreTileFunc   tile_func,
+                                    gpointer                    tile_func_data,
+                                    GDestroyNotify              tile_func_data_destroy,
+                                    GCancellable               *cancellable,
+                                    GAsyncReadyCallback         callback,
+                                    gpointer                    user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  g_autoptr(GSource) source = NULL;
+  GetManyData *data;
+
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
+  g_return_if_fail (tileset != NULL);
+  g_return_if_fail (ids != NULL || n_ids == 0);
+  g_return_if_fail (tile_func != NULL);
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, maps_download_store_get_many_async);
+
+  data = g_new0 (GetManyData, 1);
+  data->tileset = g_strdup (tileset);
+  data->ids = g_memdup2 (ids, n_ids * sizeof (guint64));
+  data->n_ids = n_ids;
+  data->tile_func = tile_func;
+  data->tile_func_data = tile_func_data;
+  data->tile_func_data_destroy = tile_func_data_destroy;
+  data->context = g_main_context_ref_thread_default ();
+  g_task_set_task_data (task, data, (GDestroyNotify)get_many_data_free);
+
+  for (gsize i = 0; i < n_ids; i++)
+    {
+      if (presence_check (self, tileset, ids[i]))
+        {
+          queue_read (self, task, do_get_many, JOB_PRIORITY_INTERACTIVE);
+          return;
+        }
+    }
+
+  /* None of the tiles are stored, so there's no need to go to a worker thread. The results are still delivered
+     from the main loop, since callers don't expect tile_func to be called before this function returns. */
+  source = g_idle_source_new ();
+  g_source_set_priority (source, g_task_get_priority (task));
+  g_source_set_callback (source, return_all_missing, g_object_ref (task), g_object_unref);
+  g_source_set_name (source, "[gnome-maps] return_all_missing");
+  g_source_attach (source, g_task_get_context (task));
+}
+
+/**
+ * maps_download_store_get_many_finish:
+ * @self: a [class@DownloadStore]
+ * @result: a [class@Gio.AsyncResult]
+ * @error: return location for a [class@GError]
+ *
+ * Finishes a get_many_async() operation.
+ *
+ * Returns: %TRUE if the operation succeeded, %FALSE otherwise
+ */
+gboolean
+maps_download_store_get_many_finish (MapsDownloadStore  *self,
+                                     GAsyncResult       *result,
+                                     GError            **error)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), FALSE);
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/* Finishes a task that returns a GArray of tile IDs */
+static guint64 *
+propagate_ids (GTask   *task,
+               gsize   *n_ids,
+               GError **error)
+{
+  g_autoptr(GArray) ids = g_task_propagate_pointer (task, error);
+
+  if (ids == NULL)
+    {
+      *n_ids = 0;
+      return NULL;
+    }
+
+  return g_array_steal (ids, n_ids);
+}
+
+/**
+ * maps_download_store_might_contain:
+ * @self: a [class@DownloadStore]
+ * @tileset: the tileset
+ * @id: a tile ID
+ *
+ * Checks whether a tile may be stored, using the in-memory bitmap that
+ * reads use to skip the database for tiles that aren't there. A tile that
+ * was deleted may still be reported as possibly stored.
+ *
+ * Returns: %FALSE if the tile is certainly not stored, %TRUE if it may be
+ */
+gboolean
+maps_download_store_might_contain (MapsDownloadStore *self,
+                                   const char        *tileset,
+                                   guint64            id)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), TRUE);
+  g_return_val_if_fail (tileset != NULL, TRUE);
+
+  return presence_check (self, tileset, id);
+}
+
+/**
+ * maps_download_store_prefetch_async:
+ * @self: a [class@DownloadStore]
+ * @tileset: the tileset to read from
+ * @ids: (array length=n_ids): the tile IDs to read
+ * @n_ids: the length of @ids
+ * @cancellable: (nullable): a [class@Gio.Cancellable]
+ * @callback: a [callback@Gio.AsyncReadyCallback]
+ * @user_data: user data passed to @callback
+ *
+ * Reads tiles that are likely to be needed soon into the memory cache (see
+ * maps_download_store_set_cache_size()), so that get_many_async() finds them
+ * there. Unlike get_many_async(), the read waits behind other reads, and the
+ * tiles aren't passed back to the caller.
+ */
+void
+maps_download_store_prefetch_async (MapsDownloadStore    *self,
+                                    const char           *tileset,
+                                    const guint64        *ids,
+                                    gsize                 n_ids,
+                                    GCancellable         *cancellable,
+                                    GAsyncReadyCallback   callback,
+                                    gpointer              user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  GetManyData *data;
+
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
+  g_return_if_fail (tileset != NULL);
+  g_return_if_fail (ids != NULL || n_ids == 0);
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, maps_download_store_prefetch_async);
+
+  data = g_new0 (GetManyData, 1);
+  data->tileset = g_strdup (tileset);
+  data->ids = g_memdup2 (ids, n_ids * sizeof (guint64));
+  data->n_ids = n_ids;
+  data->missing = g_array_new (FALSE, FALSE, sizeof (guint64));
+  g_task_set_task_data (task, data, (GDestroyNotify)get_many_data_free);
+
+  queue_read (self, task, do_get_many, JOB_PRIORITY_BULK);
+}
+
+/**
+ * maps_download_store_prefetch_finish:
+ * @self: a [class@DownloadStore]
+ * @result: a [class@Gio.AsyncResult]
+ * @n_ids: (out): return location for the number of tiles
+ * @error: return location for a [class@GError]
+ *
+ * Finishes a prefetch_async() operation.
+ *
+ * Returns: (transfer full) (array length=n_ids): the tiles that aren't in
+ *   the store, or are stale cache-only tiles, and so should be fetched
+ */
+guint64 *
+maps_download_store_prefetch_finish (MapsDownloadStore  *self,
+                                     GAsyncResult       *result,
+                                     gsize              *n_ids,
+                                     GError            **error)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), NULL);
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+  g_return_val_if_fail (n_ids != NULL, NULL);
+
+  return propagate_ids (G_TASK (result), n_ids, error);
+}
+
+static void
+do_exec (GTask        *task,
+           gpointer      source_object,
+           gpointer      task_data,
+           GCancellable *cancellable)
+{
+  MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
+  const char *sql = task_data;
+  int status;
+
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+
+  status = sqlite3_exec (self->db, sql, NULL, NULL, NULL);
+
+  /* If a transaction that wrote tiles just ended, readers may have cached the old data in the meantime */
+  if (self->cache_dirty && sqlite3_get_autocommit (self->db))
+    {
+      self->cache_dirty = FALSE;
+      cache_clear (self);
+    }
+  load_cache_used (self);
+
+  if (status != SQLITE_OK)
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to execute `%s`: %s", sql, sqlite3_errstr (status));
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * maps_download_store_exec_async:
+ * @self: a [class@DownloadStore]
+ * @sql: SQL statement to execute
+ * @callback: a [callback@Gio.AsyncReadyCallback]
+ * @user_data: user data passed to @callback
+ *
+ * Asynchronously executes a SQL statement.
+ *
+ * Tiles must not be inserted this way, since reads rely on the presence
+ * bitmaps that maps_download_store_insert_batch_async() keeps up to date.
+ */
+void
+maps_download_store_exec_async (MapsDownloadStore   *self,
+                                const char          *sql,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, maps_download_store_exec_async);
+  g_task_set_task_data (task, g_strdup (sql), g_free);
+
+  queue_write (self, task, do_exec);
+}
+
+/**
+ * maps_download_store_exec_finish:
+ * @self: a [class@DownloadStore]
+ *
+ * Finishes an exec_async() operation.
+ *
+ * Returns: %TRUE if the operation succeeded, %FALSE otherwise
+ */
+gboolean
+maps_download_store_exec_finish (MapsDownloadStore  *self,
+                                   GAsyncResult     *result,
+                                   GError          **error)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), FALSE);
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+do_list_tilesets (GTask        *task,
+                  gpointer      source_object,
+                  gpointer      task_data,
+                  GCancellable *cancellable)
+{
+  MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
+  g_autoptr(ReadConnection) conn = read_connection_acquire (self);
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  g_autoptr(GStrvBuilder) builder = g_strv_builder_new ();
+  int status;
+
+  status = sqlite3_prepare_v2 (
+    conn->db,
+    "SELECT DISTINCT tileset FROM tiles",
+    -1,
+    &stmt,
+    NULL
+  );
+  RETURN_IF_PREPARE_ERROR (status, task);
+
+  while ((status = sqlite3_step (stmt)) == SQLITE_ROW)
+    g_strv_builder_add (builder, (const char *)sqlite3_column_text (stmt, 0));
+
+  g_task_return_pointer (task, g_strv_builder_end (builder), (GDestroyNotify)g_strfreev);
+}
+
+void
+maps_download_store_list_tilesets_async (MapsDownloadStore    *self,
+                                         GCancellable         *cancellable,
+                                         GAsyncReadyCallback   callback,
+                                         gpointer              user_data)
+{
+  g_autoptr(GTask) task = NULL;
+
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, maps_download_store_list_tilesets_async);
+
+  queue_read (self, task, do_list_tilesets, JOB_PRIORITY_BULK);
+}
+
+/**
+ * maps_download_store_list_tilesets_finish:
+ * Returns: (transfer full):
+ */
+char **
+maps_download_store_list_tilesets_finish (MapsDownloadStore  *self,
+                                          GAsyncResult       *result,
+                                          GError            **error)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), NULL);
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+do_list_tiles (GTask        *task,
+               gpointer      source_object,
+               gpointer      task_data,
+               GCancellable *cancellable)
+{
+  MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
+  g_autoptr(ReadConnection) conn = read_connection_acquire (self);
+  const char *tileset = task_data;
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  g_autoptr(GArray) ids = g_array_new (FALSE, FALSE, sizeof (guint64));
+  int status;
+
+  status = sqlite3_prepare_v2 (
+    conn->db,
+    "SELECT id FROM tiles WHERE tileset = ?",
+    -1,
+    &stmt,
+    NULL
+  );
+  RETURN_IF_PREPARE_ERROR (status, task);
+
+  status = sqlite3_bind_text (stmt, 1, tileset, -1, SQLITE_STATIC);
+  RETURN_IF_BIND_ERROR (status, task, "tileset");
+
+  while ((status = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      guint64 id = sqlite3_column_int64 (stmt, 0);
+
+      if (g_task_return_error_if_cancelled (task))
+        return;
+
+      g_array_append_val (ids, id);
+    }
+
+  g_task_return_pointer (task, g_steal_pointer (&ids), (GDestroyNotify)g_array_unref);
+}
+
+void
+maps_download_store_list_tiles_async (MapsDownloadStore    *self,
+                                      const char           *tileset,
+                                      GCancellable         *cancellable,
+                                      GAsyncReadyCallback   callback,
+                                      gpointer              user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  g_autofree char *tileset_dup = g_strdup (tileset);
+
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
+  g_return_if_fail (tileset != NULL);
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, maps_download_store_list_tiles_async);
+  g_task_set_task_data (task, g_steal_pointer (&tileset_dup), g_free);
+
+  queue_read (self, task, do_list_tiles, JOB_PRIORITY_BULK);
+}
+
+/**
+ * maps_download_store_list_tiles_finish:
+ * @n_ids: (out): return location for the number of tiles
+ * Returns: (transfer full) (array length=n_ids):
+ */
+guint64 *
+maps_download_store_list_tiles_finish (MapsDownloadStore  *self,
+                                       GAsyncResult       *result,
+                                       gsize              *n_ids,
+                                       GError            **error)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), NULL);
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+  g_return_val_if_fail (n_ids != NULL, NULL);
+
+  return propagate_ids (G_TASK (result), n_ids, error);
+}
+
+typedef struct {
+  char *tileset;
+  guint64 *ids;
+  gsize n_ids;
+  guint64 mtime;
+} TileQueryData;
+
+static void
+tile_query_data_free (TileQueryData *data)
+{
+  g_clear_pointer (&data->tileset, g_free);
+  g_clear_pointer (&data->ids, g_free);
+  g_free (data);
+}
+
+/* Loads @ids into the temp.query_ids table of @conn, so that queries over a large set of tiles can be answered
+   with a single join rather than one query per tile. Must be called inside a transaction, and the table must be
+   cleared with clear_query_ids() afterwards. */
+static gboolean
+load_query_ids (ReadConnection  *conn,
+                const guint64   *ids,
+                gsize            n_ids,
+                GCancellable    *cancellable,
+                GError         **error)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  g_autoptr(sqlite_str) error_msg = NULL;
+  int status;
+
+  /* Temporary tables are private to the connection and live in memory, so this works on read-only connections */
+  sqlite3_exec (conn->db, "CREATE TEMP TABLE IF NOT EXISTS query_ids (id INTEGER PRIMARY KEY)", NULL, NULL, &error_msg);
+  if (error_msg != NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to create temporary table: %s", error_msg);
+      return FALSE;
+    }
+
+  status = sqlite3_prepare_v2 (conn->db, "INSERT OR IGNORE INTO temp.query_ids (id) VALUES (?)", -1, &stmt, NULL);
+  if (status != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to prepare statement: %s", sqlite3_errstr (status));
+      return FALSE;
+    }
+
+  for (gsize i = 0; i < n_ids; i++)
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      sqlite3_bind_int64 (stmt, 1, ids[i]);
+
+      status = sqlite3_step (stmt);
+      if (status != SQLITE_DONE)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to load tile IDs: %s", sqlite3_errstr (status));
+          return FALSE;
+        }
+
+      sqlite3_reset (stmt);
+    }
+
+  return TRUE;
+}
+
+static void
+clear_query_ids (ReadConnection *conn)
+{
+  sqlite3_exec (conn->db, "DELETE FROM temp.query_ids", NULL, NULL, NULL);
+}
+
+static void
+compute_size_in_transaction (GTask          *task,
+                             ReadConnection *conn,
+                             TileQueryData  *data)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  GError *error = NULL;
+  int status;
+
+  if (!load_query_ids (conn, data->ids, data->n_ids, g_task_get_cancellable (task), &error))
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  status = sqlite3_prepare_v2 (
+    conn->db,
+    "SELECT total(length(blobs.bytes)) FROM temp.query_ids"
+    "  JOIN tiles ON tiles.tileset = ? AND tiles.id = query_ids.id"
+    "  JOIN blobs ON blobs.hash = tiles.hash",
+    -1,
+    &stmt,
+    NULL
+  );
+  RETURN_IF_PREPARE_ERROR (status, task);
+
+  status = sqlite3_bind_text (stmt, 1, data->tileset, -1, SQLITE_STATIC);
+  RETURN_IF_BIND_ERROR (status, task, "tileset");
+
+  status = sqlite3_step (stmt);
+  if (status != SQLITE_ROW)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to compute size: %s", sqlite3_errstr (status));
+      return;
+    }
+
+  g_task_return_int (task, sqlite3_column_int64 (stmt, 0));
+}
+
+static void
+do_compute_size (GTask        *task,
+                 gpointer      source_object,
+                 gpointer      task_data,
+                 GCancellable *cancellable)
+{
+  MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
+  g_autoptr(ReadConnection) conn = read_connection_acquire (self);
+  TileQueryData *data = task_data;
+
+  sqlite3_exec (conn->db, "BEGIN", NULL, NULL, NULL);
+  compute_size_in_transaction (task, conn, data);
+  clear_query_ids (conn);
+  sqlite3_exec (conn->db, "COMMIT", NULL, NULL, NULL);
+}
+
+/**
+ * maps_download_store_compute_size_async:
+ * @tile_ids: (array length=n_tile_ids): tile IDs
+ * @n_tile_ids: the length of @tile_ids
+ */
+void
+maps_download_store_compute_size_async (MapsDownloadStore    *self,
+                                        const char           *tileset,
+                                        const guint64        *tile_ids,
+                                        gsize                 n_tile_ids,
+                                        GCancellable         *cancellable,
+                                        GAsyncReadyCallback   callback,
+                                        gpointer              user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  TileQueryData *data = NULL;
+
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
+  g_return_if_fail (tileset != NULL);
+  g_return_if_fail (tile_ids != NULL || n_tile_ids == 0);
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, maps_download_store_compute_size_async);
+
+  data = g_new0 (TileQueryData, 1);
+  data->tileset = g_strdup (tileset);
+  data->ids = g_memdup2 (tile_ids, n_tile_ids * sizeof (guint64));
+  data->n_ids = n_tile_ids;
+  g_task_set_task_data (task, data, (GDestroyNotify)tile_query_data_free);
+
+  queue_read (self, task, do_compute_size, JOB_PRIORITY_BULK);
+}
+
+gsize
+maps_download_store_compute_size_finish (MapsDownloadStore  *self,
+                                         GAsyncResult       *result,
+                                         GError            **error)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), 0);
+  g_return_val_if_fail (g_task_is_valid (result, self), 0);
+
+  return g_task_propagate_int (G_TASK (result), error);
+}
+
+static void
+filter_by_mtime_in_transaction (GTask          *task,
+                                ReadConnection *conn,
+                                TileQueryData  *data)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  g_autoptr(GArray) ids = g_array_new (FALSE, FALSE, sizeof (guint64));
+  GError *error = NULL;
+  int status;
+
+  if (!load_query_ids (conn, data->ids, data->n_ids, g_task_get_cancellable (task), &error))
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  status = sqlite3_prepare_v2 (
+    conn->db,
+    "SELECT tiles.id FROM temp.query_ids"
+    "  JOIN tiles ON tiles.tileset = ? AND tiles.id = query_ids.id"
+    "  WHERE tiles.mtime > ?"
+    "  ORDER BY query_ids.id",
+    -1,
+    &stmt,
+    NULL
+  );
+  RETURN_IF_PREPARE_ERROR (status, task);
+
+  status = sqlite3_bind_text (stmt, 1, data->tileset, -1, SQLITE_STATIC);
+  RETURN_IF_BIND_ERROR (status, task, "tileset");
+
+  status = sqlite3_bind_int64 (stmt, 2, data->mtime);
+  RETURN_IF_BIND_ERROR (status, task, "mtime");
+
+  while ((status = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      guint64 id = sqlite3_column_int64 (stmt, 0);
+
+      if (g_task_return_error_if_cancelled (task))
+        return;
+
+      g_array_append_val (ids, id);
+    }
+
+  if (status != SQLITE_DONE)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to filter by mtime: %s", sqlite3_errstr (status));
+      return;
+    }
+
+  g_task_return_pointer (task, g_steal_pointer (&ids), (GDestroyNotify)g_array_unref);
+}
+
+static void
+do_filter_by_mtime (GTask        *task,
+                    gpointer      source_object,
+                    gpointer      task_data,
+                    GCancellable *cancellable)
+{
+  MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
+  g_autoptr(ReadConnection) conn = read_connection_acquire (self);
+  TileQueryData *data = task_data;
+
+  sqlite3_exec (conn->db, "BEGIN", NULL, NULL, NULL);
+  filter_by_mtime_in_transaction (task, conn, data);
+  clear_query_ids (conn);
+  sqlite3_exec (conn->db, "COMMIT", NULL, NULL, NULL);
+}
+
+/**
+ * maps_download_store_filter_by_mtime_async:
+ * @tile_ids: (array length=n_tile_ids): tile IDs
+ * @n_tile_ids: the length of @tile_ids
+ *
+ * Finds the tiles in @tile_ids that are in the store and were modified after
+ * @mtime. They are returned in ascending order.
+ */
+void
+maps_download_store_filter_by_mtime_async (MapsDownloadStore    *self,
+                                           const char           *tileset,
+                                           const guint64        *tile_ids,
+                                           gsize                 n_tile_ids,
+                                           guint64               mtime,
+                                           GCancellable         *cancellable,
+                                           GAsyncReadyCallback   callback,
+                                           gpointer              user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  TileQueryData *data = NULL;
+
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
+  g_return_if_fail (tileset != NULL);
+  g_return_if_fail (tile_ids != NULL || n_tile_ids == 0);
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, maps_download_store_filter_by_mtime_async);
+
+  data = g_new0 (TileQueryData, 1);
+  data->tileset = g_strdup (tileset);
+  data->ids = g_memdup2 (tile_ids, n_tile_ids * sizeof (guint64));
+  data->n_ids = n_tile_ids;
+  data->mtime = mtime;
+  g_task_set_task_data (task, data, (GDestroyNotify)tile_query_data_free);
+
+  queue_read (self, task, do_filter_by_mtime, JOB_PRIORITY_BULK);
+}
+
+/**
+ * maps_download_store_filter_by_mtime_finish:
+ * @n_ids: (out): return location for the number of tiles
+ * Returns: (transfer full) (array length=n_ids):
+ */
+guint64 *
+maps_download_store_filter_by_mtime_finish (MapsDownloadStore  *self,
+                                            GAsyncResult       *result,
+                                            gsize              *n_ids,
+                                            GError            **error)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), NULL);
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+  g_return_val_if_fail (n_ids != NULL, NULL);
+
+  return propagate_ids (G_TASK (result), n_ids, error);
+}
+
+typedef struct {
+  char *tileset;
+  char *job;
+  char *version;
+  GBytes *plan;
+  guint n_ranges;
+  guint range;
+  GBytes *completed;
+} PlanData;
+
+static void
+plan_data_free (PlanData *data)
+{
+  g_clear_pointer (&data->tileset, g_free);
+  g_clear_pointer (&data->job, g_free);
+  g_clear_pointer (&data->version, g_free);
+  g_clear_pointer (&data->plan, g_bytes_unref);
+  g_clear_pointer (&data->completed, g_bytes_unref);
+  g_free (data);
+}
+
+static void
+do_save_plan (GTask        *task,
+              gpointer      source_object,
+              gpointer      task_data,
+              GCancellable *cancellable)
+{
+  MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  PlanData *data = task_data;
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  gsize plan_size;
+  gconstpointer plan = g_bytes_get_data (data->plan, &plan_size);
+  int status;
+
+  status = sqlite3_prepare_v2 (
+    self->db,
+    "INSERT INTO download_plans (tileset, job, version, plan, n_ranges, completed)"
+    "  VALUES (?, ?, ?, ?, ?, zeroblob (?))"
+    "  ON CONFLICT (tileset) DO UPDATE SET"
+    "    job = excluded.job, version = excluded.version, plan = excluded.plan,"
+    "    n_ranges = excluded.n_ranges, completed = excluded.completed",
+    -1,
+    &stmt,
+    NULL
+  );
+  RETURN_IF_PREPARE_ERROR (status, task);
+
+  status = sqlite3_bind_text (stmt, 1, data->tileset, -1, SQLITE_STATIC);
+  RETURN_IF_BIND_ERROR (status, task, "tileset");
+  status = sqlite3_bind_text (stmt, 2, data->job, -1, SQLITE_STATIC);
+  RETURN_IF_BIND_ERROR (status, task, "job");
+  status = sqlite3_bind_text (stmt, 3, data->version, -1, SQLITE_STATIC);
+  RETURN_IF_BIND_ERROR (status, task, "version");
+  status = sqlite3_bind_blob64 (stmt, 4, plan, plan_size, SQLITE_STATIC);
+  RETURN_IF_BIND_ERROR (status, task, "plan");
+  status = sqlite3_bind_int64 (stmt, 5, data->n_ranges);
+  RETURN_IF_BIND_ERROR (status, task, "n_ranges");
+  status = sqlite3_bind_int64 (stmt, 6, (data->n_ranges + 7) / 8);
+  RETURN_IF_BIND_ERROR (status, task, "completed");
+
+  status = sqlite3_step (stmt);
+  RETURN_IF_NOT_DONE (status, task, "Failed to save download plan: %s", sqlite3_errstr (status));
+
+  g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * maps_download_store_save_plan_async:
+ * @self: a [class@DownloadStore]
+ * @tileset: the tileset being downloaded
+ * @job: identifies what is being downloaded, so that a plan isn't resumed
+ *   for a different set of areas
+ * @version: (nullable): the version of the source the plan was made for,
+ *   such as its ETag
+ * @plan: the serialized plan
+ * @n_ranges: the number of ranges in the plan
+ * @callback: a [callback@Gio.AsyncReadyCallback]
+ * @user_data: user data passed to @callback
+ *
+ * Saves the plan for downloading a tileset, so that an interrupted download
+ * can be resumed without planning it again. Replaces any previous plan for
+ * the tileset, and marks all its ranges as incomplete.
+ */
+void
+maps_download_store_save_plan_async (MapsDownloadStore    *self,
+                                     const char           *tileset,
+                                     const char           *job,
+                                     const char           *version,
+                                     GBytes               *plan,
+                                     guint                 n_ranges,
+                                     GAsyncReadyCallback   callback,
+                                     gpointer              user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  PlanData *data;
+
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
+  g_return_if_fail (tileset != NULL);
+  g_return_if_fail (job != NULL);
+  g_return_if_fail (plan != NULL);
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, maps_download_store_save_plan_async);
+
+  data = g_new0 (PlanData, 1);
+  data->tileset = g_strdup (tileset);
+  data->job = g_strdup (job);
+  data->version = g_strdup (version);
+  data->plan = g_bytes_ref (plan);
+  data->n_ranges = n_ranges;
+  g_task_set_task_data (task, data, (GDestroyNotify)plan_data_free);
+
+  queue_write (self, task, do_save_plan);
+}
+
+gboolean
+maps_download_store_save_plan_finish (MapsDownloadStore  *self,
+                                      GAsyncResult       *result,
+                                      GError            **error)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), FALSE);
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+do_load_plan (GTask        *task,
+              gpointer      source_object,
+              gpointer      task_data,
+              GCancellable *cancellable)
+{
+  MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  PlanData *data = task_data;
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  int status;
+
+  /* This uses the writer connection, so it sees progress from the current transaction */
+  status = sqlite3_prepare_v2 (
+    self->db,
+    "SELECT job, version, plan, completed FROM download_plans WHERE tileset = ?",
+    -1,
+    &stmt,
+    NULL
+  );
+  RETURN_IF_PREPARE_ERROR (status, task);
+
+  status = sqlite3_bind_text (stmt, 1, data->tileset, -1, SQLITE_STATIC);
+  RETURN_IF_BIND_ERROR (status, task, "tileset");
+
+  status = sqlite3_step (stmt);
+  if (status == SQLITE_DONE)
+    {
+      g_task_return_boolean (task, TRUE);
+      return;
+    }
+  else if (status != SQLITE_ROW)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to load download plan: %s", sqlite3_errstr (status));
+      return;
+    }
+
+  data->job = g_strdup ((const char *)sqlite3_column_text (stmt, 0));
+  data->version = g_strdup ((const char *)sqlite3_column_text (stmt, 1));
+  data->plan = g_bytes_new (sqlite3_column_blob (stmt, 2), sqlite3_column_bytes (stmt, 2));
+  data->completed = g_bytes_new (sqlite3_column_blob (stmt, 3), sqlite3_column_bytes (stmt, 3));
+
+  g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * maps_download_store_load_plan_async:
+ * @self: a [class@DownloadStore]
+ * @tileset: the tileset
+ * @callback: a [callback@Gio.AsyncReadyCallback]
+ * @user_data: user data passed to @callback
+ *
+ * Loads the saved download plan for a tileset, see
+ * maps_download_store_save_plan_async().
+ */
+void
+maps_download_store_load_plan_async (MapsDownloadStore    *self,
+                                     const char           *tileset,
+                                     GAsyncReadyCallback   callback,
+                                     gpointer              user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  PlanData *data;
+
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
+  g_return_if_fail (tileset != NULL);
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, maps_download_store_load_plan_async);
+
+  data = g_new0 (PlanData, 1);
+  data->tileset = g_strdup (tileset);
+  g_task_set_task_data (task, data, (GDestroyNotify)plan_data_free);
+
+  queue_write (self, task, do_load_plan);
+}
+
+/**
+ * maps_download_store_load_plan_finish:
+ * @self: a [class@DownloadStore]
+ * @result: a [iface@Gio.AsyncResult]
+ * @job: (out) (optional) (nullable) (transfer full): return location for the
+ *   job the plan was saved for
+ * @version: (out) (optional) (nullable) (transfer full): return location for
+ *   the version of the source the plan was made for
+ * @completed: (out) (optional) (nullable) (transfer full): return location for
+ *   a bitmap of the ranges that have been completed. Bit `i % 8` of byte
+ *   `i / 8` is set if range `i` is complete.
+ * @error: return location for a [class@GError]
+ *
+ * Finishes loading a download plan.
+ *
+ * Returns: (nullable) (transfer full): the serialized plan, or %NULL if there
+ * is no saved plan for the tileset
+ */
+GBytes *
+maps_download_store_load_plan_finish (MapsDownloadStore  *self,
+                                      GAsyncResult       *result,
+                                      char              **job,
+                                      char              **version,
+                                      GBytes            **completed,
+                                      GError            **error)
+{
+  PlanData *data;
+
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), NULL);
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  if (!g_task_propagate_boolean (G_TASK (result), error))
+    return NULL;
+
+  data = g_task_get_task_data (G_TASK (result));
+
+  if (job != NULL)
+    *job = g_steal_pointer (&data->job);
+  if (version != NULL)
+    *version = g_steal_pointer (&data->version);
+  if (completed != NULL)
+    *completed = g_steal_pointer (&data->completed);
+
+  return g_steal_pointer (&data->plan);
+}
+
+static void
+do_complete_plan_range (GTask        *task,
+                        gpointer      source_object,
+                        gpointer      task_data,
+                        GCancellable *cancellable)
+{
+  MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  PlanData *data = task_data;
+  GError *error = NULL;
+
+  if (!mark_plan_ranges_complete (self, data->tileset, &data->range, 1, &error))
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * maps_download_store_complete_plan_range_async:
+ * @self: a [class@DownloadStore]
+ * @tileset: the tileset
+ * @range: the index of the range in the plan
+ * @callback: a [callback@Gio.AsyncReadyCallback]
+ * @user_data: user data passed to @callback
+ *
+ * Marks a range of the tileset's download plan as complete. Call this in the
+ * same transaction as the tiles from the range are inserted, so that the two
+ * are always consistent.
+ */
+void
+maps_download_store_complete_plan_range_async (MapsDownloadStore    *self,
+                                               const char           *tileset,
+                                               guint                 range,
+                                               GAsyncReadyCallback   callback,
+                                               gpointer              user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  PlanData *data;
+
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
+  g_return_if_fail (tileset != NULL);
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, maps_download_store_complete_plan_range_async);
+
+  data = g_new0 (PlanData, 1);
+  data->tileset = g_strdup (tileset);
+  data->range = range;
+  g_task_set_task_data (task, data, (GDestroyNotify)plan_data_free);
+
+  queue_write (self, task, do_complete_plan_range);
+}
+
+gboolean
+maps_download_store_complete_plan_range_finish (MapsDownloadStore  *self,
+                                                GAsyncResult       *result,
+                                                GError            **error)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), FALSE);
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
 }
 
 static void
-do_remove (GTask        *task,
-           gpointer      source_object,
-           gpointer      task_data,
-           GCancellable *cancellable)
+do_delete_plan (GTask        *task,
+                gpointer      source_object,
+                gpointer      task_data,
+                GCancellable *cancellable)
 {
   MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
-  RemoveData *data = task_data;
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  PlanData *data = task_data;
   g_autoptr(sqlite3_stmt) stmt = NULL;
   int status;
 
-  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
-
   status = sqlite3_prepare_v2 (
     self->db,
-    "DELETE FROM tiles WHERE tileset = ? and id = ?",
+    "DELETE FROM download_plans WHERE tileset = ?",
     -1,
     &stmt,
     NULL
@@ -343,252 +3547,801 @@ do_remove (GTask        *task,
   status = sqlite3_bind_text (stmt, 1, data->tileset, -1, SQLITE_STATIC);
   RETURN_IF_BIND_ERROR (status, task, "tileset");
 
-  for (int i = 0; data->ids[i] != NULL; i++)
-    {
-      status = sqlite3_bind_text (stmt, 2, data->ids[i], -1, SQLITE_STATIC);
-      RETURN_IF_BIND_ERROR (status, task, "id");
-
-      status = sqlite3_step (stmt);
-      RETURN_IF_NOT_DONE (status, task, "Failed to remove data: %s", sqlite3_errstr (status));
-
-      sqlite3_reset (stmt);
-    }
+  status = sqlite3_step (stmt);
+  RETURN_IF_NOT_DONE (status, task, "Failed to delete download plan: %s", sqlite3_errstr (status));
 
   g_task_return_boolean (task, TRUE);
 }
 
 /**
- * maps_download_store_remove_async:
- * @ids: (array zero-terminated=1):
+ * maps_download_store_delete_plan_async:
+ * @self: a [class@DownloadStore]
+ * @tileset: the tileset
+ * @callback: a [callback@Gio.AsyncReadyCallback]
+ * @user_data: user data passed to @callback
+ *
+ * Deletes the tileset's download plan once the download is complete.
  */
 void
-maps_download_store_remove_async (MapsDownloadStore    *self,
-                                  const char           *tileset,
-                                  const char          **ids,
-                                  GAsyncReadyCallback   callback,
-                                  gpointer              user_data)
+maps_download_store_delete_plan_async (MapsDownloadStore    *self,
+                                       const char           *tileset,
+                                       GAsyncReadyCallback   callback,
+                                       gpointer              user_data)
 {
   g_autoptr(GTask) task = NULL;
-  RemoveData *data;
+  PlanData *data;
 
   g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
-  g_return_if_fail (ids != NULL);
+  g_return_if_fail (tileset != NULL);
 
   task = g_task_new (self, NULL, callback, user_data);
-  g_task_set_source_tag (task, maps_download_store_remove_async);
+  g_task_set_source_tag (task, maps_download_store_delete_plan_async);
 
-  data = g_new (RemoveData, 1);
+  data = g_new0 (PlanData, 1);
   data->tileset = g_strdup (tileset);
-  data->ids = g_strdupv ((char **)ids);
-  g_task_set_task_data (task, data, (GDestroyNotify)remove_data_free);
-  g_task_run_in_thread (task, do_remove);
+  g_task_set_task_data (task, data, (GDestroyNotify)plan_data_free);
+
+  queue_write (self, task, do_delete_plan);
 }
 
 gboolean
-maps_download_store_remove_finish (MapsDownloadStore  *self,
-                                   GAsyncResult       *result,
-                                   GError            **error)
+maps_download_store_delete_plan_finish (MapsDownloadStore  *self,
+                                        GAsyncResult       *result,
+                                        GError            **error)
 {
   g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), FALSE);
   g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
 
-  return g_task_propagate_boolean (G_TASK (result), error);
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+typedef struct {
+  char *area;
+  char *tileset;
+  MapsTileRange *tiles;
+} AreaData;
+
+static void
+area_data_free (AreaData *data)
+{
+  g_clear_pointer (&data->area, g_free);
+  g_clear_pointer (&data->tileset, g_free);
+  g_clear_object (&data->tiles);
+  g_free (data);
+}
+
+typedef struct {
+  char *tileset;
+  guint z, x_min, y_min, x_max, y_max;
+} AreaRect;
+
+static void
+area_rect_clear (AreaRect *rect)
+{
+  g_clear_pointer (&rect->tileset, g_free);
+}
+
+/* Loads the rectangles of an area, or only those for @tileset if it isn't %NULL */
+static gboolean
+load_area_rects (MapsDownloadStore  *self,
+                 const char         *area,
+                 const char         *tileset,
+                 GArray             *rects,
+                 GError            **error)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  int status;
+
+  status = sqlite3_prepare_v2 (
+    self->db,
+    "SELECT tileset, z, x_min, y_min, x_max, y_max FROM area_rects WHERE area = ?1 AND (?2 IS NULL OR tileset = ?2)",
+    -1,
+    &stmt,
+    NULL
+  );
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_text (stmt, 1, area, -1, SQLITE_STATIC);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_text (stmt, 2, tileset, -1, SQLITE_STATIC);
+
+  while (status == SQLITE_OK && (status = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      AreaRect rect = {
+        g_strdup ((const char *)sqlite3_column_text (stmt, 0)),
+        sqlite3_column_int (stmt, 1),
+        sqlite3_column_int (stmt, 2),
+        sqlite3_column_int (stmt, 3),
+        sqlite3_column_int (stmt, 4),
+        sqlite3_column_int (stmt, 5),
+      };
+
+      g_array_append_val (rects, rect);
+      status = SQLITE_OK;
+    }
+
+  if (status != SQLITE_DONE)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to read area: %s", sqlite3_errstr (status));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+typedef struct {
+  guint64 first, last;
+} IdRange;
+
+static int
+compare_id_ranges (gconstpointer a,
+                   gconstpointer b)
+{
+  const IdRange *ra = a, *rb = b;
+  return (ra->first > rb->first) - (ra->first < rb->first);
+}
+
+/* Squares of tiles this small are not split up any further when covering a rectangle with ID ranges */
+#define MIN_SPLIT_ZOOM 3
+
+/* Adds ID ranges that cover the tiles of @rect. The tile @level/@x/@y is added as one range if it's inside the
+   rectangle or small enough, otherwise the parts of it that overlap the rectangle are. The ranges may include
+   tiles outside the rectangle. */
+static void
+add_rect_id_ranges (GArray         *ranges,
+                    const AreaRect *rect,
+                    guint           level,
+                    guint           x,
+                    guint           y)
+{
+  guint shift = rect->z - level;
+  guint x_min = x << shift, y_min = y << shift;
+  guint x_max = x_min + ((1u << shift) - 1), y_max = y_min + ((1u << shift) - 1);
+
+  if (x_max < rect->x_min || x_min > rect->x_max || y_max < rect->y_min || y_min > rect->y_max)
+    return;
+
+  if (shift <= MIN_SPLIT_ZOOM
+      || (x_min >= rect->x_min && x_max <= rect->x_max && y_min >= rect->y_min && y_max <= rect->y_max))
+    {
+      IdRange range;
+
+      descendant_id_range (level, x, y, rect->z, &range.first, &range.last);
+      g_array_append_val (ranges, range);
+      return;
+    }
+
+  for (guint i = 0; i < 4; i++)
+    add_rect_id_ranges (ranges, rect, level + 1, 2 * x + (i & 1), 2 * y + (i >> 1));
+}
+
+static int
+compare_ids (gconstpointer a,
+             gconstpointer b)
+{
+  guint64 ia = *(const guint64 *)a, ib = *(const guint64 *)b;
+  return (ia > ib) - (ia < ib);
+}
+
+/* Tiles are stored by ID, so rectangles are looked up as ID ranges. Returns sorted ranges that cover @rect, with the
+   ones that touch merged. */
+static GArray *
+rect_id_ranges (const AreaRect *rect)
+{
+  GArray *ranges = g_array_new (FALSE, FALSE, sizeof (IdRange));
+  guint n_merged = 0;
+
+  add_rect_id_ranges (ranges, rect, 0, 0, 0);
+  g_array_sort (ranges, compare_id_ranges);
+  for (guint i = 0; i < ranges->len; i++)
+    {
+      IdRange *range = &g_array_index (ranges, IdRange, i);
+
+      if (n_merged > 0 && g_array_index (ranges, IdRange, n_merged - 1).last + 1 == range->first)
+        g_array_index (ranges, IdRange, n_merged - 1).last = range->last;
+      else
+        g_array_index (ranges, IdRange, n_merged++) = *range;
+    }
+  g_array_set_size (ranges, n_merged);
+
+  return ranges;
+}
+
+/* Finds the orphans among the tiles in @rect */
+static int
+find_orphans_in_rect (MapsDownloadStore *self,
+                      const AreaRect    *rect,
+                      GHashTable        *orphans)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  g_autoptr(GArray) ranges = rect_id_ranges (rect);
+  int status;
+
+  status = sqlite3_prepare_v2 (
+    self->db,
+    "SELECT id FROM tiles"
+    "  WHERE tileset = ?1 AND id BETWEEN ?2 AND ?3 AND NOT cache_only"
+    "    AND tile_x (id) BETWEEN ?4 AND ?5 AND tile_y (id) BETWEEN ?6 AND ?7"
+    "    AND NOT EXISTS ("
+    "      SELECT 1 FROM area_rects"
+    "      WHERE area_rects.tileset = ?1"
+    "        AND area_rects.z = ?8"
+    "        AND tile_x (tiles.id) BETWEEN area_rects.x_min AND area_rects.x_max"
+    "        AND tile_y (tiles.id) BETWEEN area_rects.y_min AND area_rects.y_max"
+    "    )",
+    -1,
+    &stmt,
+    NULL
+  );
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_text (stmt, 1, rect->tileset, -1, SQLITE_STATIC);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_int (stmt, 4, rect->x_min);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_int (stmt, 5, rect->x_max);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_int (stmt, 6, rect->y_min);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_int (stmt, 7, rect->y_max);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_int (stmt, 8, rect->z);
+
+  for (guint i = 0; i < ranges->len && status == SQLITE_OK; i++)
+    {
+      status = sqlite3_bind_int64 (stmt, 2, g_array_index (ranges, IdRange, i).first);
+      if (status == SQLITE_OK)
+        status = sqlite3_bind_int64 (stmt, 3, g_array_index (ranges, IdRange, i).last);
+
+      while (status == SQLITE_OK && (status = sqlite3_step (stmt)) == SQLITE_ROW)
+        {
+          add_tile_id (orphans, rect->tileset, sqlite3_column_int64 (stmt, 0));
+          status = SQLITE_OK;
+        }
+
+      if (status == SQLITE_DONE)
+        status = SQLITE_OK;
+      sqlite3_reset (stmt);
+    }
+
+  return status;
+}
+
+/* Finds the orphans among all tiles. This reads the whole tiles table. */
+static int
+find_all_orphans (MapsDownloadStore *self,
+                  GHashTable        *orphans)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  int status;
+
+  status = sqlite3_prepare_v2 (
+    self->db,
+    "SELECT tileset, id FROM tiles WHERE NOT cache_only AND NOT EXISTS ("
+    "  SELECT 1 FROM area_rects"
+    "  WHERE area_rects.tileset = tiles.tileset"
+    "    AND area_rects.z = tile_zoom (tiles.id)"
+    "    AND tile_x (tiles.id) BETWEEN area_rects.x_min AND area_rects.x_max"
+    "    AND tile_y (tiles.id) BETWEEN area_rects.y_min AND area_rects.y_max"
+    ")",
+    -1,
+    &stmt,
+    NULL
+  );
+
+  while (status == SQLITE_OK && (status = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      add_tile_id (orphans, (const char *)sqlite3_column_text (stmt, 0), sqlite3_column_int64 (stmt, 1));
+      status = SQLITE_OK;
+    }
+
+  return status == SQLITE_DONE ? SQLITE_OK : status;
+}
+
+/* Deletes orphans, i.e. tiles that aren't covered by any area's rectangles, except cache-only tiles, which are left
+   to the quota. Only the tiles in @rects are checked, or every tile if @rects is %NULL. The IDs of the deleted
+   tiles are added to @deleted, by tileset, in ascending order. Must be called with the writer lock held. */
+static gboolean
+delete_orphans (MapsDownloadStore  *self,
+                GArray             *rects,
+                GHashTable         *deleted,
+                gsize              *n_deleted,
+                GError            **error)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  GHashTableIter iter;
+  const char *tileset;
+  GArray *ids;
+  int status = SQLITE_OK;
+
+  *n_deleted = 0;
+
+  if (rects == NULL)
+    status = find_all_orphans (self, deleted);
+  for (guint i = 0; rects != NULL && i < rects->len && status == SQLITE_OK; i++)
+    status = find_orphans_in_rect (self, &g_array_index (rects, AreaRect, i), deleted);
+
+  if (status == SQLITE_OK)
+    status = sqlite3_prepare_v2 (self->db, "DELETE FROM tiles WHERE tileset = ? AND id = ?", -1, &stmt, NULL);
+
+  g_hash_table_iter_init (&iter, deleted);
+  while (status == SQLITE_OK && g_hash_table_iter_next (&iter, (gpointer *)&tileset, (gpointer *)&ids))
+    {
+      guint n_unique = 0;
+
+      /* Rectangles can overlap */
+      g_array_sort (ids, compare_ids);
+      for (guint i = 0; i < ids->len; i++)
+        {
+          if (n_unique == 0 || g_array_index (ids, guint64, n_unique - 1) != g_array_index (ids, guint64, i))
+            g_array_index (ids, guint64, n_unique++) = g_array_index (ids, guint64, i);
+        }
+      g_array_set_size (ids, n_unique);
+
+      status = sqlite3_bind_text (stmt, 1, tileset, -1, SQLITE_STATIC);
+      for (guint i = 0; i < ids->len && status == SQLITE_OK; i++)
+        {
+          status = sqlite3_bind_int64 (stmt, 2, g_array_index (ids, guint64, i));
+          if (status == SQLITE_OK)
+            status = sqlite3_step (stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode (self->db);
+          if (status == SQLITE_OK)
+            *n_deleted += sqlite3_changes (self->db);
+          sqlite3_reset (stmt);
+        }
+    }
+
+  if (status != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to delete tiles: %s", sqlite3_errstr (status));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Makes the cache-only tiles in @rect part of the download areas, so the quota doesn't evict tiles an area needs.
+   Must be called with the writer lock held. */
+static int
+claim_cached_tiles (MapsDownloadStore *self,
+                    const AreaRect    *rect)
+{
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  g_autoptr(GArray) ranges = rect_id_ranges (rect);
+  int status;
+
+  status = sqlite3_prepare_v2 (
+    self->db,
+    "UPDATE tiles SET cache_only = 0"
+    "  WHERE tileset = ?1 AND id BETWEEN ?2 AND ?3 AND cache_only"
+    "    AND tile_x (id) BETWEEN ?4 AND ?5 AND tile_y (id) BETWEEN ?6 AND ?7",
+    -1,
+    &stmt,
+    NULL
+  );
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_text (stmt, 1, rect->tileset, -1, SQLITE_STATIC);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_int (stmt, 4, rect->x_min);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_int (stmt, 5, rect->x_max);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_int (stmt, 6, rect->y_min);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_int (stmt, 7, rect->y_max);
+
+  for (guint i = 0; i < ranges->len && status == SQLITE_OK; i++)
+    {
+      status = sqlite3_bind_int64 (stmt, 2, g_array_index (ranges, IdRange, i).first);
+      if (status == SQLITE_OK)
+        status = sqlite3_bind_int64 (stmt, 3, g_array_index (ranges, IdRange, i).last);
+      if (status == SQLITE_OK)
+        status = sqlite3_step (stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode (self->db);
+      sqlite3_reset (stmt);
+    }
+
+  return status;
+}
+
+static gboolean
+area_rect_contains (const AreaRect *outer,
+                    const AreaRect *inner)
+{
+  return outer->z == inner->z
+    && outer->x_min <= inner->x_min && outer->y_min <= inner->y_min
+    && outer->x_max >= inner->x_max && outer->y_max >= inner->y_max;
+}
+
+static gboolean
+area_rect_in_range (const AreaRect *rect,
+                    MapsTileRange  *tiles)
+{
+  guint n_rects = maps_tile_range_get_n_rects (tiles);
+
+  for (guint i = 0; i < n_rects; i++)
+    {
+      guint z, x_min, y_min, x_max, y_max;
+
+      maps_tile_range_get_rect (tiles, i, &z, &x_min, &y_min, &x_max, &y_max);
+      if (z == rect->z && x_min <= rect->x_min && y_min <= rect->y_min && x_max >= rect->x_max && y_max >= rect->y_max)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+do_set_area (GTask        *task,
+             gpointer      source_object,
+             gpointer      task_data,
+             GCancellable *cancellable)
+{
+  MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  AreaData *data = task_data;
+  g_autoptr(sqlite3_stmt) delete = NULL;
+  g_autoptr(sqlite3_stmt) insert = NULL;
+  g_autoptr(GArray) old_rects = g_array_new (FALSE, FALSE, sizeof (AreaRect));
+  g_autoptr(GHashTable) deleted = tile_ids_new ();
+  guint n_rects = maps_tile_range_get_n_rects (data->tiles);
+  GError *error = NULL;
+  gsize n_deleted = 0;
+  int status;
+
+  g_array_set_clear_func (old_rects, (GDestroyNotify)area_rect_clear);
+
+  status = sqlite3_exec (self->db, "SAVEPOINT set_area", NULL, NULL, NULL);
+  RETURN_IF_SQLITE_ERROR (status, task, "Failed to start transaction: %s", sqlite3_errstr (status));
+
+  if (!load_area_rects (self, data->area, data->tileset, old_rects, &error))
+    {
+      sqlite3_exec (self->db, "ROLLBACK TO set_area; RELEASE set_area", NULL, NULL, NULL);
+      g_task_return_error (task, error);
+      return;
+    }
+
+  status = sqlite3_prepare_v2 (self->db, "DELETE FROM area_rects WHERE area = ? AND tileset = ?", -1, &delete, NULL);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_text (delete, 1, data->area, -1, SQLITE_STATIC);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_text (delete, 2, data->tileset, -1, SQLITE_STATIC);
+  if (status == SQLITE_OK)
+    status = sqlite3_step (delete) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode (self->db);
+
+  if (status == SQLITE_OK)
+    status = sqlite3_prepare_v2 (
+      self->db,
+      "INSERT INTO area_rects (area, tileset, z, x_min, y_min, x_max, y_max) VALUES (?, ?, ?, ?, ?, ?, ?)",
+      -1,
+      &insert,
+      NULL
+    );
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_text (insert, 1, data->area, -1, SQLITE_STATIC);
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_text (insert, 2, data->tileset, -1, SQLITE_STATIC);
+
+  for (guint i = 0; i < n_rects && status == SQLITE_OK; i++)
+    {
+      AreaRect rect = { .tileset = data->tileset };
+      gboolean is_new = TRUE;
+
+      maps_tile_range_get_rect (data->tiles, i, &rect.z, &rect.x_min, &rect.y_min, &rect.x_max, &rect.y_max);
+      status = sqlite3_bind_int (insert, 3, rect.z);
+      if (status == SQLITE_OK)
+        status = sqlite3_bind_int (insert, 4, rect.x_min);
+      if (status == SQLITE_OK)
+        status = sqlite3_bind_int (insert, 5, rect.y_min);
+      if (status == SQLITE_OK)
+        status = sqlite3_bind_int (insert, 6, rect.x_max);
+      if (status == SQLITE_OK)
+        status = sqlite3_bind_int (insert, 7, rect.y_max);
+
+      if (status == SQLITE_OK)
+        status = sqlite3_step (insert) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode (self->db);
+      sqlite3_reset (insert);
+
+      /* The area already owns the tiles of rectangles it had before */
+      for (guint j = 0; j < old_rects->len && is_new; j++)
+        is_new = !area_rect_contains (&g_array_index (old_rects, AreaRect, j), &rect);
+      if (status == SQLITE_OK && is_new)
+        status = claim_cached_tiles (self, &rect);
+    }
+
+  if (status != SQLITE_OK)
+    g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to save area: %s", sqlite3_errstr (status));
+
+  /* Only tiles the area used to cover can have become orphans. Usually the area hasn't changed, so there are none
+     to look for. */
+  for (guint i = old_rects->len; i > 0 && error == NULL; i--)
+    {
+      if (area_rect_in_range (&g_array_index (old_rects, AreaRect, i - 1), data->tiles))
+        g_array_remove_index_fast (old_rects, i - 1);
+    }
+
+  if (error == NULL && old_rects->len > 0)
+    delete_orphans (self, old_rects, deleted, &n_deleted, &error);
+
+  if (error == NULL)
+    {
+      status = sqlite3_exec (self->db, "RELEASE set_area", NULL, NULL, NULL);
+      if (status != SQLITE_OK)
+        g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to commit: %s", sqlite3_errstr (status));
+    }
+
+  if (error != NULL)
+    {
+      sqlite3_exec (self->db, "ROLLBACK TO set_area; RELEASE set_area", NULL, NULL, NULL);
+      g_task_return_error (task, error);
+      return;
+    }
+
+  if (n_deleted > 0)
+    forget_deleted (self, deleted);
+  load_cache_used (self);
+
+  g_task_return_int (task, n_deleted);
+}
+
+/**
+ * maps_download_store_set_area_async:
+ * @self: a [class@DownloadStore]
+ * @area: the ID of the download area
+ * @tileset: the tileset
+ * @tiles: the tiles the area needs from @tileset
+ * @callback: a [callback@Gio.AsyncReadyCallback]
+ * @user_data: user data passed to @callback
+ *
+ * Records which tiles of @tileset a download area needs, replacing what was
+ * recorded for it before. Tiles the area no longer needs are deleted if no
+ * other area needs them either, in the same transaction. Cached tiles the
+ * area needs become part of it, and no longer count towards the quota.
+ */
+void
+maps_download_store_set_area_async (MapsDownloadStore    *self,
+                                    const char           *area,
+                                    const char           *tileset,
+                                    MapsTileRange        *tiles,
+                                    GAsyncReadyCallback   callback,
+                                    gpointer              user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AreaData *data;
+
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
+  g_return_if_fail (area != NULL);
+  g_return_if_fail (tileset != NULL);
+  g_return_if_fail (MAPS_IS_TILE_RANGE (tiles));
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, maps_download_store_set_area_async);
+
+  data = g_new0 (AreaData, 1);
+  data->area = g_strdup (area);
+  data->tileset = g_strdup (tileset);
+  /* Copied so the caller can keep modifying its range */
+  data->tiles = maps_tile_range_copy (tiles);
+  g_task_set_task_data (task, data, (GDestroyNotify)area_data_free);
+
+  queue_write (self, task, do_set_area);
 }
 
-typedef struct {
-  char *tileset;
-  char *id;
-} GetData;
-
-static void
-get_data_free (GetData *data)
+/**
+ * maps_download_store_set_area_finish:
+ *
+ * Returns: the number of tiles that were deleted
+ */
+gsize
+maps_download_store_set_area_finish (MapsDownloadStore  *self,
+                                     GAsyncResult       *result,
+                                     GError            **error)
 {
-  g_clear_pointer (&data->tileset, g_free);
-  g_clear_pointer (&data->id, g_free);
-  g_free (data);
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), 0);
+  g_return_val_if_fail (g_task_is_valid (result, self), 0);
+
+  return g_task_propagate_int (G_TASK (result), error);
 }
 
 static void
-do_get (GTask        *task,
-        gpointer      source_object,
-        gpointer      task_data,
-        GCancellable *cancellable)
+do_remove_area (GTask        *task,
+                gpointer      source_object,
+                gpointer      task_data,
+                GCancellable *cancellable)
 {
   MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
-  GetData *data = task_data;
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  AreaData *data = task_data;
   g_autoptr(sqlite3_stmt) stmt = NULL;
+  g_autoptr(GArray) rects = g_array_new (FALSE, FALSE, sizeof (AreaRect));
+  g_autoptr(GHashTable) deleted = tile_ids_new ();
   GError *error = NULL;
+  gsize n_deleted = 0;
   int status;
 
-  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
-
-  status = sqlite3_prepare_v2 (
-    self->db,
-    "SELECT bytes FROM tiles WHERE tileset = ? and id = ?",
-    -1,
-    &stmt,
-    NULL
-  );
-  RETURN_IF_PREPARE_ERROR (status, task);
+  g_array_set_clear_func (rects, (GDestroyNotify)area_rect_clear);
 
-  sqlite3_bind_text (stmt, 1, data->tileset, -1, SQLITE_STATIC);
-  RETURN_IF_BIND_ERROR (status, task, "tileset");
+  status = sqlite3_exec (self->db, "SAVEPOINT remove_area", NULL, NULL, NULL);
+  RETURN_IF_SQLITE_ERROR (status, task, "Failed to start transaction: %s", sqlite3_errstr (status));
 
-  sqlite3_bind_text (stmt, 2, data->id, -1, SQLITE_STATIC);
-  RETURN_IF_BIND_ERROR (status, task, "id");
+  /* Only the tiles in the area's rectangles can become orphans */
+  load_area_rects (self, data->area, NULL, rects, &error);
 
-  status = sqlite3_step (stmt);
-  if (status == SQLITE_DONE)
-    g_task_return_pointer (task, NULL, NULL);
-  else if (status == SQLITE_ROW)
+  if (error == NULL)
     {
-      g_autoptr(GBytes) bytes = g_bytes_new (
-        sqlite3_column_blob (stmt, 0),
-        sqlite3_column_bytes (stmt, 0)
-      );
-      GBytes *decompressed = decompress (bytes, &error);
+      status = sqlite3_prepare_v2 (self->db, "DELETE FROM area_rects WHERE area = ?", -1, &stmt, NULL);
+      if (status == SQLITE_OK)
+        status = sqlite3_bind_text (stmt, 1, data->area, -1, SQLITE_STATIC);
+      if (status == SQLITE_OK)
+        status = sqlite3_step (stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode (self->db);
+      if (status != SQLITE_OK)
+        g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to remove area: %s", sqlite3_errstr (status));
+    }
 
-      if (decompressed == NULL)
-        {
-          g_task_return_error (task, error);
-          return;
-        }
+  if (error == NULL)
+    delete_orphans (self, rects, deleted, &n_deleted, &error);
 
-      g_task_return_pointer (task, decompressed, (GDestroyNotify)g_bytes_unref);
+  if (error == NULL)
+    {
+      status = sqlite3_exec (self->db, "RELEASE remove_area", NULL, NULL, NULL);
+      if (status != SQLITE_OK)
+        g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to commit: %s", sqlite3_errstr (status));
     }
-  else
-    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to get data: %s", sqlite3_errstr (status));
+
+  if (error != NULL)
+    {
+      sqlite3_exec (self->db, "ROLLBACK TO remove_area; RELEASE remove_area", NULL, NULL, NULL);
+      g_task_return_error (task, error);
+      return;
+    }
+
+  if (n_deleted > 0)
+    forget_deleted (self, deleted);
+
+  g_task_return_int (task, n_deleted);
 }
 
+/**
+ * maps_download_store_remove_area_async:
+ * @self: a [class@DownloadStore]
+ * @area: the ID of the download area
+ * @callback: a [callback@Gio.AsyncReadyCallback]
+ * @user_data: user data passed to @callback
+ *
+ * Forgets a download area and deletes the tiles that no other area needs,
+ * in one transaction. Any download for the area must have stopped writing
+ * tiles first, or the tiles it writes afterwards are left behind.
+ */
 void
-maps_download_store_get_async (MapsDownloadStore   *self,
-                               const char          *tileset,
-                               const char          *id,
-                               GAsyncReadyCallback  callback,
-                               gpointer             user_data)
+maps_download_store_remove_area_async (MapsDownloadStore    *self,
+                                       const char           *area,
+                                       GAsyncReadyCallback   callback,
+                                       gpointer              user_data)
 {
   g_autoptr(GTask) task = NULL;
-  GetData *data;
+  AreaData *data;
 
   g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
-  g_return_if_fail (id != NULL);
+  g_return_if_fail (area != NULL);
 
   task = g_task_new (self, NULL, callback, user_data);
-  g_task_set_source_tag (task, maps_download_store_get_async);
+  g_task_set_source_tag (task, maps_download_store_remove_area_async);
 
-  data = g_new (GetData, 1);
-  data->tileset = g_strdup (tileset);
-  data->id = g_strdup (id);
-  g_task_set_task_data (task, data, (GDestroyNotify)get_data_free);
-  g_task_run_in_thread (task, do_get);
+  data = g_new0 (AreaData, 1);
+  data->area = g_strdup (area);
+  g_task_set_task_data (task, data, (GDestroyNotify)area_data_free);
+
+  queue_write (self, task, do_remove_area);
 }
 
 /**
- * maps_download_store_get_finish:
- * @self: a [class@DownloadStore]
- * @result: a [class@Gio.AsyncResult]
- * @error: return location for a [class@GError]
- *
- * Finishes a get_async() operation.
+ * maps_download_store_remove_area_finish:
  *
- * Returns: (transfer full) (nullable): the data, or %NULL if the data was not found
- * or an error occurred
+ * Returns: the number of tiles that were deleted
  */
-GBytes *
-maps_download_store_get_finish (MapsDownloadStore  *self,
-                                GAsyncResult       *result,
-                                GError            **error)
+gsize
+maps_download_store_remove_area_finish (MapsDownloadStore  *self,
+                                        GAsyncResult       *result,
+                                        GError            **error)
 {
-  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), NULL);
-  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), 0);
+  g_return_val_if_fail (g_task_is_valid (result, self), 0);
 
-  return g_task_propagate_pointer (G_TASK (result), error);
+  return g_task_propagate_int (G_TASK (result), error);
 }
 
 static void
-do_exec (GTask        *task,
-           gpointer      source_object,
-           gpointer      task_data,
-           GCancellable *cancellable)
+do_delete_orphans (GTask        *task,
+                   gpointer      source_object,
+                   gpointer      task_data,
+                   GCancellable *cancellable)
 {
   MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
-  const char *sql = task_data;
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  g_autoptr(GHashTable) deleted = tile_ids_new ();
+  GError *error = NULL;
+  gsize n_deleted = 0;
   int status;
 
-  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  /* Deleting one by one, so it's done in a transaction */
+  status = sqlite3_exec (self->db, "SAVEPOINT delete_orphans", NULL, NULL, NULL);
+  RETURN_IF_SQLITE_ERROR (status, task, "Failed to start transaction: %s", sqlite3_errstr (status));
 
-  status = sqlite3_exec (self->db, sql, NULL, NULL, NULL);
-  if (status != SQLITE_OK)
-    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to execute `%s`: %s", sql, sqlite3_errstr (status));
-  else
-    g_task_return_boolean (task, TRUE);
+  if (delete_orphans (self, NULL, deleted, &n_deleted, &error))
+    {
+      status = sqlite3_exec (self->db, "RELEASE delete_orphans", NULL, NULL, NULL);
+      if (status != SQLITE_OK)
+        g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to commit: %s", sqlite3_errstr (status));
+    }
+
+  if (error != NULL)
+    {
+      sqlite3_exec (self->db, "ROLLBACK TO delete_orphans; RELEASE delete_orphans", NULL, NULL, NULL);
+      g_task_return_error (task, error);
+      return;
+    }
+
+  if (n_deleted > 0)
+    forget_deleted (self, deleted);
+
+  g_task_return_int (task, n_deleted);
 }
 
 /**
- * maps_download_store_exec_async:
+ * maps_download_store_delete_orphans_async:
  * @self: a [class@DownloadStore]
- * @sql: SQL statement to execute
  * @callback: a [callback@Gio.AsyncReadyCallback]
  * @user_data: user data passed to @callback
  *
- * Asynchronously executes a SQL statement.
+ * Deletes all tiles that aren't needed by any download area, see
+ * maps_download_store_set_area_async().
+ *
+ * Setting and removing areas already deletes the tiles they no longer need,
+ * so this is only needed to repair a store whose tiles were written for an
+ * area after it was removed, which can't happen as long as areas are only
+ * changed while no download is writing tiles for them. It reads every
+ * stored tile.
  */
 void
-maps_download_store_exec_async (MapsDownloadStore   *self,
-                                const char          *sql,
-                                GAsyncReadyCallback  callback,
-                                gpointer             user_data)
+maps_download_store_delete_orphans_async (MapsDownloadStore    *self,
+                                          GAsyncReadyCallback   callback,
+                                          gpointer              user_data)
 {
   g_autoptr(GTask) task = NULL;
 
-  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
 
   task = g_task_new (self, NULL, callback, user_data);
-  g_task_set_source_tag (task, maps_download_store_exec_async);
-  g_task_set_task_data (task, g_strdup (sql), g_free);
+  g_task_set_source_tag (task, maps_download_store_delete_orphans_async);
 
-  g_task_run_in_thread (task, do_exec);
+  queue_write (self, task, do_delete_orphans);
 }
 
 /**
- * maps_download_store_exec_finish:
- * @self: a [class@DownloadStore]
- *
- * Finishes an exec_async() operation.
+ * maps_download_store_delete_orphans_finish:
  *
- * Returns: %TRUE if the operation succeeded, %FALSE otherwise
+ * Returns: the number of tiles that were deleted
  */
-gboolean
-maps_download_store_exec_finish (MapsDownloadStore  *self,
-                                   GAsyncResult     *result,
-                                   GError          **error)
+gsize
+maps_download_store_delete_orphans_finish (MapsDownloadStore  *self,
+                                           GAsyncResult       *result,
+                                           GError            **error)
 {
-  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), FALSE);
-  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), 0);
+  g_return_val_if_fail (g_task_is_valid (result, self), 0);
 
-  return g_task_propagate_boolean (G_TASK (result), error);
+  return g_task_propagate_int (G_TASK (result), error);
 }
 
 static void
-do_list_tilesets (GTask        *task,
-                  gpointer      source_object,
-                  gpointer      task_data,
-                  GCancellable *cancellable)
+do_list_areas (GTask        *task,
+               gpointer      source_object,
+               gpointer      task_data,
+               GCancellable *cancellable)
 {
   MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
+  g_autoptr(ReadConnection) conn = read_connection_acquire (self);
   g_autoptr(sqlite3_stmt) stmt = NULL;
   g_autoptr(GStrvBuilder) builder = g_strv_builder_new ();
   int status;
 
-  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
-
-  status = sqlite3_prepare_v2 (
-    self->db,
-    "SELECT DISTINCT tileset FROM tiles",
-    -1,
-    &stmt,
-    NULL
-  );
+  status = sqlite3_prepare_v2 (conn->db, "SELECT DISTINCT area FROM area_rects", -1, &stmt, NULL);
   RETURN_IF_PREPARE_ERROR (status, task);
 
   while ((status = sqlite3_step (stmt)) == SQLITE_ROW)
@@ -597,29 +4350,38 @@ do_list_tilesets (GTask        *task,
   g_task_return_pointer (task, g_strv_builder_end (builder), (GDestroyNotify)g_strfreev);
 }
 
+/**
+ * maps_download_store_list_areas_async:
+ * @self: a [class@DownloadStore]
+ * @callback: a [callback@Gio.AsyncReadyCallback]
+ * @user_data: user data passed to @callback
+ *
+ * Lists the download areas recorded with
+ * maps_download_store_set_area_async().
+ */
 void
-maps_download_store_list_tilesets_async (MapsDownloadStore    *self,
-                                         GAsyncReadyCallback   callback,
-                                         gpointer              user_data)
+maps_download_store_list_areas_async (MapsDownloadStore    *self,
+                                      GAsyncReadyCallback   callback,
+                                      gpointer              user_data)
 {
   g_autoptr(GTask) task = NULL;
 
   g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
 
   task = g_task_new (self, NULL, callback, user_data);
-  g_task_set_source_tag (task, maps_download_store_list_tilesets_async);
+  g_task_set_source_tag (task, maps_download_store_list_areas_async);
 
-  g_task_run_in_thread (task, do_list_tilesets);
+  queue_read (self, task, do_list_areas, JOB_PRIORITY_BULK);
 }
 
 /**
- * maps_download_store_list_tilesets_finish:
- * Returns: (transfer full):
+ * maps_download_store_list_areas_finish:
+ * Returns: (transfer full): the area IDs
  */
 char **
-maps_download_store_list_tilesets_finish (MapsDownloadStore  *self,
-                                          GAsyncResult       *result,
-                                          GError            **error)
+maps_download_store_list_areas_finish (MapsDownloadStore  *self,
+                                       GAsyncResult       *result,
+                                       GError            **error)
 {
   g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), NULL);
   g_return_val_if_fail (g_task_is_valid (result, self), NULL);
@@ -628,164 +4390,357 @@ maps_download_store_list_tilesets_finish (MapsDownloadStore  *self,
 }
 
 static void
-do_list_tiles (GTask        *task,
-               gpointer      source_object,
-               gpointer      task_data,
-               GCancellable *cancellable)
+do_reclaim (GTask        *task,
+            gpointer      source_object,
+            gpointer      task_data,
+            GCancellable *cancellable)
 {
   MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
-  const char *tileset = task_data;
-  g_autoptr(sqlite3_stmt) stmt = NULL;
-  g_autoptr(GStrvBuilder) builder = g_strv_builder_new ();
-  int status;
-
   G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  guint max_pages = GPOINTER_TO_UINT (task_data);
+  g_autoptr(sqlite_str) error_msg = NULL;
+  g_autofree char *sql = NULL;
+  gint64 remaining;
 
-  status = sqlite3_prepare_v2 (
-    self->db,
-    "SELECT id FROM tiles WHERE tileset = ?",
-    -1,
-    &stmt,
-    NULL
-  );
-  RETURN_IF_PREPARE_ERROR (status, task);
+  /* VACUUM can't run inside a transaction, so the conversion waits until the next reclaim that isn't in one */
+  if (self->needs_vacuum && sqlite3_get_autocommit (self->db))
+    {
+      sqlite3_exec (self->db, "VACUUM", NULL, NULL, &error_msg);
+      if (error_msg != NULL)
+        {
+          g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to vacuum database: %s", error_msg);
+          return;
+        }
 
-  status = sqlite3_bind_text (stmt, 1, tileset, -1, SQLITE_STATIC);
-  RETURN_IF_BIND_ERROR (status, task, "tileset");
+      self->needs_vacuum = FALSE;
+      g_task_return_int (task, 0);
+      return;
+    }
 
-  while ((status = sqlite3_step (stmt)) == SQLITE_ROW)
-    g_strv_builder_add (builder, (const char *)sqlite3_column_text (stmt, 0));
+  sql = g_strdup_printf ("PRAGMA incremental_vacuum (%u)", max_pages);
+  sqlite3_exec (self->db, sql, NULL, NULL, &error_msg);
+  if (error_msg != NULL)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to reclaim free pages: %s", error_msg);
+      return;
+    }
 
-  g_task_return_pointer (task, g_strv_builder_end (builder), (GDestroyNotify)g_strfreev);
+  remaining = get_pragma_int (self->db, "freelist_count");
+  if (remaining < 0)
+    {
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to count free pages: %s", sqlite3_errmsg (self->db));
+      return;
+    }
+
+  /* In WAL mode the file is only truncated when the WAL is checkpointed */
+  if (remaining == 0 && sqlite3_get_autocommit (self->db))
+    sqlite3_wal_checkpoint_v2 (self->db, NULL, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+
+  g_task_return_int (task, remaining);
 }
 
+/**
+ * maps_download_store_reclaim_async:
+ * @self: a [class@DownloadStore]
+ * @max_pages: the maximum number of pages to free
+ * @callback: a [callback@Gio.AsyncReadyCallback]
+ * @user_data: user data passed to @callback
+ *
+ * Gives space that was freed by deleting tiles back to the filesystem, at
+ * most @max_pages pages at a time, so that it can be done in small steps
+ * that don't hold up other writes for long.
+ *
+ * A database created before incremental vacuuming was enabled is instead
+ * vacuumed in full once, which converts it.
+ */
 void
-maps_download_store_list_tiles_async (MapsDownloadStore    *self,
-                                      const char           *tileset,
-                                      GAsyncReadyCallback   callback,
-                                      gpointer              user_data)
+maps_download_store_reclaim_async (MapsDownloadStore    *self,
+                                   guint                 max_pages,
+                                   GAsyncReadyCallback   callback,
+                                   gpointer              user_data)
 {
   g_autoptr(GTask) task = NULL;
-  g_autofree char *tileset_dup = g_strdup (tileset);
 
-  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
-  g_return_if_fail (tileset != NULL);
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
+  g_return_if_fail (max_pages > 0);
+
+  task = g_task_new (self, NULL, callback, user_data);
+  g_task_set_source_tag (task, maps_download_store_reclaim_async);
+  g_task_set_task_data (task, GUINT_TO_POINTER (max_pages), NULL);
+
+  queue_write (self, task, do_reclaim);
+}
+
+/**
+ * maps_download_store_reclaim_finish:
+ * @self: a [class@DownloadStore]
+ * @result: a [class@Gio.AsyncResult]
+ * @error: return location for a [class@GError]
+ *
+ * Finishes a reclaim_async() operation.
+ *
+ * Returns: the number of free pages that are left to reclaim
+ */
+gsize
+maps_download_store_reclaim_finish (MapsDownloadStore  *self,
+                                    GAsyncResult       *result,
+                                    GError            **error)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), 0);
+  g_return_val_if_fail (g_task_is_valid (result, self), 0);
+
+  return g_task_propagate_int (G_TASK (result), error);
+}
+
+/* Writes the access times of the tiles that were read since the last time. Must be called with the writer lock
+   held. */
+static gboolean
+flush_access_times (MapsDownloadStore  *self,
+                    GError            **error)
+{
+  g_autoptr(GHashTable) accessed = NULL;
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  g_autoptr(sqlite_str) error_msg = NULL;
+  GHashTableIter iter;
+  TileKey *key;
+  gint64 now = g_get_real_time () / 1000;
+  int status;
+
+  {
+    G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+    accessed = g_steal_pointer (&self->accessed);
+    self->accessed = g_hash_table_new_full (tile_key_hash, tile_key_equal, (GDestroyNotify)tile_key_free, NULL);
+  }
+
+  if (g_hash_table_size (accessed) == 0)
+    return TRUE;
+
+  status = sqlite3_prepare_v2 (
+    self->db,
+    "UPDATE tiles SET atime = ? WHERE tileset = ? AND id = ? AND cache_only",
+    -1,
+    &stmt,
+    NULL
+  );
+  if (status != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to prepare statement: %s", sqlite3_errstr (status));
+      return FALSE;
+    }
+
+  sqlite3_exec (self->db, "SAVEPOINT flush_access_times", NULL, NULL, NULL);
 
-  task = g_task_new (self, NULL, callback, user_data);
-  g_task_set_source_tag (task, maps_download_store_list_tiles_async);
-  g_task_set_task_data (task, g_steal_pointer (&tileset_dup), g_free);
+  g_hash_table_iter_init (&iter, accessed);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&key, NULL))
+    {
+      status = sqlite3_bind_int64 (stmt, 1, now);
+      if (status == SQLITE_OK)
+        status = sqlite3_bind_text (stmt, 2, key->tileset, -1, SQLITE_STATIC);
+      if (status == SQLITE_OK)
+        status = sqlite3_bind_int64 (stmt, 3, key->id);
+      if (status == SQLITE_OK)
+        status = sqlite3_step (stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode (self->db);
+      sqlite3_reset (stmt);
+
+      if (status != SQLITE_OK)
+        {
+          sqlite3_exec (self->db, "ROLLBACK TO flush_access_times; RELEASE flush_access_times", NULL, NULL, NULL);
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to update access times: %s", sqlite3_errstr (status));
+          return FALSE;
+        }
+    }
+
+  sqlite3_exec (self->db, "RELEASE flush_access_times", NULL, NULL, &error_msg);
+  if (error_msg != NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to update access times: %s", error_msg);
+      return FALSE;
+    }
 
-  g_task_run_in_thread (task, do_list_tiles);
+  return TRUE;
 }
 
-/**
- * maps_download_store_list_tiles_finish:
- * Returns: (transfer full):
- */
-char **
-maps_download_store_list_tiles_finish (MapsDownloadStore  *self,
-                                       GAsyncResult       *result,
-                                       GError            **error)
+/* Gets the total size of the cache-only tiles. Tiles that share a blob are each counted, so this overestimates a
+   cache with many identical tiles, such as ocean, but it is what the tiles would take up without sharing. */
+/* Maximum number of tiles evicted by one enforce_quota_async() call, so a large excess is freed in slices that keep
+   the writer lock for a short time each */
+#define MAX_EVICTIONS 512
+
+/* Finds the least recently used cache-only tiles that have to go to free @excess bytes. Cache-only tiles are never
+   inside a download area, and the tiles_lru index lists them in order, so this only reads the tiles it returns. */
+static GPtrArray *
+find_tiles_to_evict (MapsDownloadStore  *self,
+                     guint64             excess,
+                     GError            **error)
 {
-  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), NULL);
-  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+  g_autoptr(GPtrArray) keys = g_ptr_array_new_with_free_func ((GDestroyNotify)tile_key_free);
+  g_autoptr(sqlite3_stmt) stmt = NULL;
+  guint64 freed = 0;
+  int status;
 
-  return g_task_propagate_pointer (G_TASK (result), error);
-}
+  status = sqlite3_prepare_v2 (
+    self->db,
+    "SELECT tileset, id, size FROM tiles WHERE cache_only ORDER BY coalesce (atime, mtime) LIMIT ?",
+    -1,
+    &stmt,
+    NULL
+  );
+  if (status == SQLITE_OK)
+    status = sqlite3_bind_int (stmt, 1, MAX_EVICTIONS);
+  if (status != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to prepare statement: %s", sqlite3_errstr (status));
+      return NULL;
+    }
 
-typedef struct {
-  char *tileset;
-  char **ids;
-  guint64 mtime;
-} TileQueryData;
+  while (freed < excess && (status = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      TileKey *key = g_new (TileKey, 1);
+      key->tileset = g_strdup ((const char *)sqlite3_column_text (stmt, 0));
+      key->id = sqlite3_column_int64 (stmt, 1);
+      g_ptr_array_add (keys, key);
 
-static void
-tile_query_data_free (TileQueryData *data)
-{
-  g_clear_pointer (&data->tileset, g_free);
-  g_clear_pointer (&data->ids, g_strfreev);
-  g_free (data);
+      freed += sqlite3_column_int64 (stmt, 2);
+    }
+
+  if (freed < excess && status != SQLITE_DONE)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to find tiles to evict: %s", sqlite3_errstr (status));
+      return NULL;
+    }
+
+  return g_steal_pointer (&keys);
 }
 
 static void
-do_compute_size (GTask        *task,
-                 gpointer      source_object,
-                 gpointer      task_data,
-                 GCancellable *cancellable)
+do_enforce_quota (GTask        *task,
+                  gpointer      source_object,
+                  gpointer      task_data,
+                  GCancellable *cancellable)
 {
   MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
-  TileQueryData *data = task_data;
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  g_autoptr(GPtrArray) keys = NULL;
   g_autoptr(sqlite3_stmt) stmt = NULL;
+  g_autoptr(GHashTable) deleted = tile_ids_new ();
+  GError *error = NULL;
+  guint64 quota;
+  guint64 used;
   int status;
-  gssize total_size = 0;
 
-  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  {
+    G_MUTEX_AUTO_LOCK (&self->cache_mutex, cache_locker);
+    quota = self->quota;
+    used = self->cache_used;
+  }
 
-  status = sqlite3_prepare_v2 (
-    self->db,
-    "SELECT length(bytes) FROM tiles WHERE tileset = ? and id = ?",
-    -1,
-    &stmt,
-    NULL
-  );
+  if (quota == 0 || used <= quota)
+    {
+      g_task_return_int (task, 0);
+      return;
+    }
+
+  if (!flush_access_times (self, &error))
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  keys = find_tiles_to_evict (self, used - quota, &error);
+  if (keys == NULL)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  status = sqlite3_prepare_v2 (self->db, "DELETE FROM tiles WHERE tileset = ? AND id = ?", -1, &stmt, NULL);
   RETURN_IF_PREPARE_ERROR (status, task);
 
-  status = sqlite3_bind_text (stmt, 1, data->tileset, -1, SQLITE_STATIC);
-  RETURN_IF_BIND_ERROR (status, task, "tileset");
+  status = sqlite3_exec (self->db, "SAVEPOINT evict", NULL, NULL, NULL);
+  RETURN_IF_SQLITE_ERROR (status, task, "Failed to start transaction: %s", sqlite3_errstr (status));
 
-  for (int i = 0; data->ids[i] != NULL; i++)
+  for (guint i = 0; i < keys->len; i++)
     {
-      status = sqlite3_bind_text (stmt, 2, data->ids[i], -1, SQLITE_STATIC);
-      RETURN_IF_BIND_ERROR (status, task, "id");
+      TileKey *key = g_ptr_array_index (keys, i);
 
-      status = sqlite3_step (stmt);
-      if (status == SQLITE_ROW)
-        total_size += sqlite3_column_int64 (stmt, 0);
-      else if (status != SQLITE_DONE)
+      status = sqlite3_bind_text (stmt, 1, key->tileset, -1, SQLITE_STATIC);
+      if (status == SQLITE_OK)
+        status = sqlite3_bind_int64 (stmt, 2, key->id);
+      if (status == SQLITE_OK)
+        status = sqlite3_step (stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode (self->db);
+      sqlite3_reset (stmt);
+
+      if (status != SQLITE_OK)
         {
-          g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to compute size: %s", sqlite3_errstr (status));
+          sqlite3_exec (self->db, "ROLLBACK TO evict; RELEASE evict", NULL, NULL, NULL);
+          g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to evict tiles: %s", sqlite3_errstr (status));
           return;
         }
+    }
 
-      sqlite3_reset (stmt);
+  status = sqlite3_exec (self->db, "RELEASE evict", NULL, NULL, NULL);
+  if (status != SQLITE_OK)
+    {
+      sqlite3_exec (self->db, "ROLLBACK TO evict; RELEASE evict", NULL, NULL, NULL);
+      g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to commit: %s", sqlite3_errstr (status));
+      return;
+    }
+
+  for (guint i = 0; i < keys->len; i++)
+    {
+      TileKey *key = g_ptr_array_index (keys, i);
+      add_tile_id (deleted, key->tileset, key->id);
     }
+  forget_deleted (self, deleted);
+  load_cache_used (self);
 
-  g_task_return_int (task, total_size);
+  g_task_return_int (task, keys->len);
 }
 
 /**
- * maps_download_store_compute_size_async:
- * @tile_ids: (array zero-terminated=1):
+ * maps_download_store_enforce_quota_async:
+ * @self: a [class@DownloadStore]
+ * @callback: a [callback@Gio.AsyncReadyCallback]
+ * @user_data: user data passed to @callback
+ *
+ * Evicts cache-only tiles, least recently used first, until they are within
+ * the quota set with maps_download_store_set_quota(). Tiles that belong to
+ * a download area are never evicted. At most 512 tiles are evicted per call,
+ * so call it again while maps_download_store_is_over_quota() returns %TRUE.
+ * It returns right away if the tiles are within the quota.
+ *
+ * This only frees pages inside the database file; use
+ * maps_download_store_reclaim_async() to shrink the file.
  */
 void
-maps_download_store_compute_size_async (MapsDownloadStore    *self,
-                                        const char           *tileset,
-                                        const char          **tile_ids,
-                                        GAsyncReadyCallback   callback,
-                                        gpointer              user_data)
+maps_download_store_enforce_quota_async (MapsDownloadStore    *self,
+                                         GAsyncReadyCallback   callback,
+                                         gpointer              user_data)
 {
   g_autoptr(GTask) task = NULL;
-  TileQueryData *data = NULL;
 
   g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
-  g_return_if_fail (tileset != NULL);
-  g_return_if_fail (tile_ids != NULL);
 
   task = g_task_new (self, NULL, callback, user_data);
-  g_task_set_source_tag (task, maps_download_store_compute_size_async);
-
-  data = g_new0 (TileQueryData, 1);
-  data->tileset = g_strdup (tileset);
-  data->ids = g_strdupv ((char **)tile_ids);
-  g_task_set_task_data (task, data, (GDestroyNotify)tile_query_data_free);
+  g_task_set_source_tag (task, maps_download_store_enforce_quota_async);
 
-  g_task_run_in_thread (task, do_compute_size);
+  queue_write (self, task, do_enforce_quota);
 }
 
+/**
+ * maps_download_store_enforce_quota_finish:
+ * @self: a [class@DownloadStore]
+ * @result: a [class@Gio.AsyncResult]
+ * @error: return location for a [class@GError]
+ *
+ * Finishes an enforce_quota_async() operation.
+ *
+ * Returns: the number of tiles that were evicted
+ */
 gsize
-maps_download_store_compute_size_finish (MapsDownloadStore  *self,
-                                         GAsyncResult       *result,
-                                         GError            **error)
+maps_download_store_enforce_quota_finish (MapsDownloadStore  *self,
+                                          GAsyncResult       *result,
+                                          GError            **error)
 {
   g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), 0);
   g_return_val_if_fail (g_task_is_valid (result, self), 0);
@@ -793,97 +4748,179 @@ maps_download_store_compute_size_finish (MapsDownloadStore  *self,
   return g_task_propagate_int (G_TASK (result), error);
 }
 
-static void
-do_filter_by_mtime (GTask        *task,
-                    gpointer      source_object,
-                    gpointer      task_data,
-                    GCancellable *cancellable)
+/**
+ * maps_download_store_set_quota:
+ * @self: a [class@DownloadStore]
+ * @quota: the maximum total size of cache-only tiles in bytes, or 0 for no
+ *   limit
+ *
+ * Sets the size above which maps_download_store_enforce_quota_async() evicts
+ * cache-only tiles. Tiles that belong to download areas don't count towards
+ * it.
+ */
+void
+maps_download_store_set_quota (MapsDownloadStore *self,
+                               guint64            quota)
 {
-  MapsDownloadStore *self = MAPS_DOWNLOAD_STORE (source_object);
-  TileQueryData *data = task_data;
-  g_autoptr(sqlite3_stmt) stmt = NULL;
-  g_autoptr(GStrvBuilder) builder = g_strv_builder_new ();
-  int status;
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
 
-  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
 
-  status = sqlite3_prepare_v2 (
-    self->db,
-    "SELECT id FROM tiles WHERE tileset = ? AND id = ? AND mtime > ?",
-    -1,
-    &stmt,
-    NULL
-  );
-  RETURN_IF_PREPARE_ERROR (status, task);
+  self->quota = quota;
+  if (quota == 0)
+    g_hash_table_remove_all (self->accessed);
+}
 
-  status = sqlite3_bind_text (stmt, 1, data->tileset, -1, SQLITE_STATIC);
-  RETURN_IF_BIND_ERROR (status, task, "tileset");
+/**
+ * maps_download_store_get_quota:
+ * @self: a [class@DownloadStore]
+ *
+ * Gets the quota set with maps_download_store_set_quota().
+ *
+ * Returns: the maximum size of the cache-only tiles in bytes, or 0 for no
+ *   limit
+ */
+guint64
+maps_download_store_get_quota (MapsDownloadStore *self)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), 0);
 
-  status = sqlite3_bind_int64 (stmt, 3, data->mtime);
-  RETURN_IF_BIND_ERROR (status, task, "mtime");
+  G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
 
-  for (int i = 0; data->ids[i] != NULL; i++)
-    {
-      status = sqlite3_bind_text (stmt, 2, data->ids[i], -1, SQLITE_STATIC);
-      RETURN_IF_BIND_ERROR (status, task, "id");
+  return self->quota;
+}
 
-      status = sqlite3_step (stmt);
-      if (status == SQLITE_ROW)
-        g_strv_builder_add (builder, (const char *)sqlite3_column_text (stmt, 0));
-      else if (status != SQLITE_DONE)
-        {
-          g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to filter by mtime: %s", sqlite3_errstr (status));
-          return;
-        }
+/**
+ * maps_download_store_get_cache_used:
+ * @self: a [class@DownloadStore]
+ *
+ * Gets the total size of the cache-only tiles, as of the last write that
+ * finished.
+ *
+ * Returns: the size in bytes
+ */
+guint64
+maps_download_store_get_cache_used (MapsDownloadStore *self)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), 0);
 
-      sqlite3_reset (stmt);
-    }
+  G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+  return self->cache_used;
+}
 
-  g_task_return_pointer (task, g_strv_builder_end (builder), (GDestroyNotify)g_strfreev);
+/**
+ * maps_download_store_is_over_quota:
+ * @self: a [class@DownloadStore]
+ *
+ * Checks whether the cache-only tiles exceed the quota, without touching the
+ * database, so callers can skip maps_download_store_enforce_quota_async()
+ * when there is nothing to evict.
+ *
+ * Returns: %TRUE if a quota is set and the tiles exceed it
+ */
+gboolean
+maps_download_store_is_over_quota (MapsDownloadStore *self)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), FALSE);
+
+  G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+  return self->quota > 0 && self->cache_used > self->quota;
 }
 
 /**
- * maps_download_store_filter_by_mtime_async:
- * @tile_ids: (array zero-terminated=1):
+ * maps_download_store_set_cache_max_age:
+ * @self: a [class@DownloadStore]
+ * @max_age: the age in milliseconds, or 0 if cached tiles never go stale
+ *
+ * Sets the age after which cache-only tiles are reported as stale by
+ * maps_download_store_get_many_async(), so the caller knows to fetch them
+ * again. Stale tiles are still returned, so they can be shown until then.
  */
 void
-maps_download_store_filter_by_mtime_async (MapsDownloadStore    *self,
-                                           const char           *tileset,
-                                           const char          **tile_ids,
-                                           guint64               mtime,
-                                           GAsyncReadyCallback   callback,
-                                           gpointer              user_data)
+maps_download_store_set_cache_max_age (MapsDownloadStore *self,
+                                       guint64            max_age)
 {
-  g_autoptr(GTask) task = NULL;
-  TileQueryData *data = NULL;
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
+
+  G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+
+  self->cache_max_age = max_age;
+}
+
+/**
+ * maps_download_store_get_cache_max_age:
+ * @self: a [class@DownloadStore]
+ *
+ * Gets the age set with maps_download_store_set_cache_max_age().
+ *
+ * Returns: the age in milliseconds, or 0 if cached tiles never go stale
+ */
+guint64
+maps_download_store_get_cache_max_age (MapsDownloadStore *self)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), 0);
+
+  G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
 
+  return self->cache_max_age;
+}
+
+/**
+ * maps_download_store_set_cache_size:
+ * @self: a [class@DownloadStore]
+ * @max_size: the maximum size of the cache in bytes, or 0 to disable it
+ *
+ * Sets the size of the in-memory cache of recently read tiles.
+ */
+void
+maps_download_store_set_cache_size (MapsDownloadStore *self,
+                                    gsize              max_size)
+{
   g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
-  g_return_if_fail (tileset != NULL);
-  g_return_if_fail (tile_ids != NULL);
 
-  task = g_task_new (self, NULL, callback, user_data);
-  g_task_set_source_tag (task, maps_download_store_filter_by_mtime_async);
+  G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
 
-  data = g_new0 (TileQueryData, 1);
-  data->tileset = g_strdup (tileset);
-  data->ids = g_strdupv ((char **)tile_ids);
-  data->mtime = mtime;
-  g_task_set_task_data (task, data, (GDestroyNotify)tile_query_data_free);
+  maps_lru_cache_set_max_cost (self->cache, max_size);
+}
+
+/**
+ * maps_download_store_get_cache_size:
+ * @self: a [class@DownloadStore]
+ *
+ * Gets the maximum size of the in-memory tile cache.
+ *
+ * Returns: the maximum size in bytes, or 0 if the cache is disabled
+ */
+gsize
+maps_download_store_get_cache_size (MapsDownloadStore *self)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), 0);
+
+  G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
 
-  g_task_run_in_thread (task, do_filter_by_mtime);
+  return maps_lru_cache_get_max_cost (self->cache);
 }
 
 /**
- * maps_download_store_filter_by_mtime_finish:
- * Returns: (transfer full):
+ * maps_download_store_get_cache_stats:
+ * @self: a [class@DownloadStore]
+ * @hits: (out) (optional): return location for the number of cache hits
+ * @misses: (out) (optional): return location for the number of cache misses
+ * @evictions: (out) (optional): return location for the number of tiles that
+ *   were evicted from the cache to make room for others
+ *
+ * Gets the number of tile reads that were answered from the in-memory cache,
+ * and the number that had to go to the database.
  */
-char **
-maps_download_store_filter_by_mtime_finish (MapsDownloadStore  *self,
-                                            GAsyncResult       *result,
-                                            GError            **error)
+void
+maps_download_store_get_cache_stats (MapsDownloadStore *self,
+                                     guint64           *hits,
+                                     guint64           *misses,
+                                     guint64           *evictions)
 {
-  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (self), NULL);
-  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+  g_return_if_fail (MAPS_IS_DOWNLOAD_STORE (self));
 
-  return g_task_propagate_pointer (G_TASK (result), error);
+  G_MUTEX_AUTO_LOCK (&self->cache_mutex, locker);
+
+  maps_lru_cache_get_stats (self->cache, hits, misses, evictions);
 }
@@ -21,11 +21,30 @@
 
 #include <gio/gio.h>
 
+#include "maps-tile-batch.h"
+#include "maps-tile-range.h"
+
 G_BEGIN_DECLS
 
 #define MAPS_TYPE_DOWNLOAD_STORE (maps_download_store_get_type())
 G_DECLARE_FINAL_TYPE (MapsDownloadStore, maps_download_store, MAPS, DOWNLOAD_STORE, GObject)
 
+/**
+ * MapsDownloadStoreTileFunc:
+ * @id: the tile ID, see maps_tile_id_from_zxy()
+ * @data: (nullable): the tile data, or %NULL if the tile is not in the store
+ * @stale: whether the tile is a cache-only tile that is older than the
+ *   maximum age set with maps_download_store_set_cache_max_age(), and should
+ *   be fetched again
+ * @user_data: user data
+ *
+ * Called by maps_download_store_get_many_async() for each tile.
+ */
+typedef void (*MapsDownloadStoreTileFunc) (guint64   id,
+                                           GBytes   *data,
+                                           gboolean  stale,
+                                           gpointer  user_data);
+
 MapsDownloadStore *maps_download_store_new (void);
 
 gboolean maps_download_store_open (MapsDownloadStore *self,
@@ -34,19 +53,32 @@ gboolean maps_download_store_open (MapsDownloadStore *self,
 
 void maps_download_store_insert_async (MapsDownloadStore    *self,
                                        const char           *tileset,
-                                       const char          **ids,
+                                       const guint64        *ids,
+                                       gsize                 n_ids,
                                        GBytes               *data,
                                        gboolean              precompressed,
                                        guint64               mtime,
+                                       GCancellable         *cancellable,
                                        GAsyncReadyCallback   callback,
                                        gpointer              user_data);
 gboolean maps_download_store_insert_finish (MapsDownloadStore  *self,
                                             GAsyncResult       *result,
                                             GError            **error);
 
+void maps_download_store_insert_batch_async (MapsDownloadStore    *self,
+                                             MapsTileBatch        *batch,
+                                             GCancellable         *cancellable,
+                                             GAsyncReadyCallback   callback,
+                                             gpointer              user_data);
+gboolean maps_download_store_insert_batch_finish (MapsDownloadStore  *self,
+                                                  GAsyncResult       *result,
+                                                  GError            **error);
+
 void maps_download_store_remove_async (MapsDownloadStore    *self,
                                        const char           *tileset,
-                                       const char          **ids,
+                                       const guint64        *ids,
+                                       gsize                 n_ids,
+                                       GCancellable         *cancellable,
                                        GAsyncReadyCallback   callback,
                                        gpointer              user_data);
 gboolean maps_download_store_remove_finish (MapsDownloadStore *self,
@@ -55,13 +87,46 @@ gboolean maps_download_store_remove_finish (MapsDownloadStore *self,
 
 void maps_download_store_get_async (MapsDownloadStore *self,
                                     const char        *tileset,
-                                    const char        *id,
+                                    guint              z,
+                                    guint              x,
+                                    guint              y,
+                                    GCancellable      *cancellable,
                                     GAsyncReadyCallback callback,
                                     gpointer           user_data);
 GBytes *maps_download_store_get_finish (MapsDownloadStore *self,
                                         GAsyncResult      *result,
                                         GError           **error);
 
+void maps_download_store_get_many_async (MapsDownloadStore          *self,
+                                         const char                 *tileset,
+                                         const guint64              *ids,
+                                         gsize                       n_ids,
+                                         MapsDownloadStoreTileFunc   tile_func,
+                                         gpointer                    tile_func_data,
+                                         GDestroyNotify              tile_func_data_destroy,
+                                         GCancellable               *cancellable,
+                                         GAsyncReadyCallback         callback,
+                                         gpointer                    user_data);
+gboolean maps_download_store_get_many_finish (MapsDownloadStore  *self,
+                                              GAsyncResult       *result,
+                                              GError            **error);
+
+gboolean maps_download_store_might_contain (MapsDownloadStore *self,
+                                            const char        *tileset,
+                                            guint64            id);
+
+void maps_download_store_prefetch_async (MapsDownloadStore    *self,
+                                         const char           *tileset,
+                                         const guint64        *ids,
+                                         gsize                 n_ids,
+                                         GCancellable         *cancellable,
+                                         GAsyncReadyCallback   callback,
+                                         gpointer              user_data);
+guint64 *maps_download_store_prefetch_finish (MapsDownloadStore  *self,
+                                              GAsyncResult       *result,
+                                              gsize              *n_ids,
+                                              GError            **error);
+
 void maps_download_store_exec_async (MapsDownloadStore *self,
                                      const char        *sql,
                                      GAsyncReadyCallback callback,
@@ -71,6 +136,7 @@ gboolean maps_download_store_exec_finish (MapsDownloadStore *self,
                                           GError **error);
 
 void maps_download_store_list_tilesets_async (MapsDownloadStore    *self,
+                                              GCancellable         *cancellable,
                                               GAsyncReadyCallback   callback,
                                               gpointer              user_data);
 
@@ -80,15 +146,19 @@ char **maps_download_store_list_tilesets_finish (MapsDownloadStore  *self,
 
 void maps_download_store_list_tiles_async (MapsDownloadStore     *self,
                                            const char            *tileset,
+                                           GCancellable          *cancellable,
                                            GAsyncReadyCallback    callback,
                                            gpointer               user_data);
-char **maps_download_store_list_tiles_finish (MapsDownloadStore  *self,
-                                              GAsyncResult       *result,
-                                              GError            **error);
+guint64 *maps_download_store_list_tiles_finish (MapsDownloadStore  *self,
+                                                GAsyncResult       *result,
+                                                gsize              *n_ids,
+                                                GError            **error);
 
 void maps_download_store_compute_size_async (MapsDownloadStore    *self,
                                              const char           *tileset,
-                                             const char          **tile_ids,
+                                             const guint64        *tile_ids,
+                                             gsize                 n_tile_ids,
+                                             GCancellable         *cancellable,
                                              GAsyncReadyCallback   callback,
                                              gpointer              user_data);
 gsize maps_download_store_compute_size_finish (MapsDownloadStore  *self,
@@ -97,12 +167,121 @@ gsize maps_download_store_compute_size_finish (MapsDownloadStore  *self,
 
 void maps_download_store_filter_by_mtime_async (MapsDownloadStore    *self,
                                                 const char           *tileset,
-                                                const char          **tile_ids,
+                                                const guint64        *tile_ids,
+                                                gsize                 n_tile_ids,
                                                 guint64               mtime,
+                                                GCancellable         *cancellable,
                                                 GAsyncReadyCallback   callback,
                                                 gpointer              user_data);
-char **maps_download_store_filter_by_mtime_finish (MapsDownloadStore  *self,
-                                                   GAsyncResult       *result,
-                                                   GError            **error);
+guint64 *maps_download_store_filter_by_mtime_finish (MapsDownloadStore  *self,
+                                                     GAsyncResult       *result,
+                                                     gsize              *n_ids,
+                                                     GError            **error);
+
+void maps_download_store_save_plan_async (MapsDownloadStore    *self,
+                                          const char           *tileset,
+                                          const char           *job,
+                                          const char           *version,
+                                          GBytes               *plan,
+                                          guint                 n_ranges,
+                                          GAsyncReadyCallback   callback,
+                                          gpointer              user_data);
+gboolean maps_download_store_save_plan_finish (MapsDownloadStore  *self,
+                                               GAsyncResult       *result,
+                                               GError            **error);
+
+void maps_download_store_load_plan_async (MapsDownloadStore    *self,
+                                          const char           *tileset,
+                                          GAsyncReadyCallback   callback,
+                                          gpointer              user_data);
+GBytes *maps_download_store_load_plan_finish (MapsDownloadStore  *self,
+                                              GAsyncResult       *result,
+                                              char              **job,
+                                              char              **version,
+                                              GBytes            **completed,
+                                              GError            **error);
+
+void maps_download_store_complete_plan_range_async (MapsDownloadStore    *self,
+                                                    const char           *tileset,
+                                                    guint                 range,
+                                                    GAsyncReadyCallback   callback,
+                                                    gpointer              user_data);
+gboolean maps_download_store_complete_plan_range_finish (MapsDownloadStore  *self,
+                                                         GAsyncResult       *result,
+                                                         GError            **error);
+
+void maps_download_store_delete_plan_async (MapsDownloadStore    *self,
+                                            const char           *tileset,
+                                            GAsyncReadyCallback   callback,
+                                            gpointer              user_data);
+gboolean maps_download_store_delete_plan_finish (MapsDownloadStore  *self,
+                                                 GAsyncResult       *result,
+                                                 GError            **error);
+
+void maps_download_store_set_area_async (MapsDownloadStore    *self,
+                                         const char           *area,
+                                         const char           *tileset,
+                                         MapsTileRange        *tiles,
+                                         GAsyncReadyCallback   callback,
+                                         gpointer              user_data);
+gsize maps_download_store_set_area_finish (MapsDownloadStore  *self,
+                                           GAsyncResult       *result,
+                                           GError            **error);
+
+void maps_download_store_remove_area_async (MapsDownloadStore    *self,
+                                            const char           *area,
+                                            GAsyncReadyCallback   callback,
+                                            gpointer              user_data);
+gsize maps_download_store_remove_area_finish (MapsDownloadStore  *self,
+                                              GAsyncResult       *result,
+                                              GError            **error);
+
+void maps_download_store_delete_orphans_async (MapsDownloadStore    *self,
+                                               GAsyncReadyCallback   callback,
+                                               gpointer              user_data);
+gsize maps_download_store_delete_orphans_finish (MapsDownloadStore  *self,
+                                                 GAsyncResult       *result,
+                                                 GError            **error);
+
+void maps_download_store_list_areas_async (MapsDownloadStore    *self,
+                                           GAsyncReadyCallback   callback,
+                                           gpointer              user_data);
+char **maps_download_store_list_areas_finish (MapsDownloadStore  *self,
+                                              GAsyncResult       *result,
+                                              GError            **error);
+
+void maps_download_store_reclaim_async (MapsDownloadStore    *self,
+                                        guint                 max_pages,
+                                        GAsyncReadyCallback   callback,
+                                        gpointer              user_data);
+gsize maps_download_store_reclaim_finish (MapsDownloadStore  *self,
+                                          GAsyncResult       *result,
+                                          GError            **error);
+
+void maps_download_store_enforce_quota_async (MapsDownloadStore    *self,
+                                              GAsyncReadyCallback   callback,
+                                              gpointer              user_data);
+gsize maps_download_store_enforce_quota_finish (MapsDownloadStore  *self,
+                                                GAsyncResult       *result,
+                                                GError            **error);
+
+void maps_download_store_set_quota (MapsDownloadStore *self,
+                                    guint64            quota);
+guint64 maps_download_store_get_quota (MapsDownloadStore *self);
+guint64 maps_download_store_get_cache_used (MapsDownloadStore *self);
+gboolean maps_download_store_is_over_quota (MapsDownloadStore *self);
+
+void maps_download_store_set_cache_max_age (MapsDownloadStore *self,
+                                            guint64            max_age);
+guint64 maps_download_store_get_cache_max_age (MapsDownloadStore *self);
+
+void maps_download_store_set_cache_size (MapsDownloadStore *self,
+                                         gsize              max_size);
+gsize maps_download_store_get_cache_size (MapsDownloadStore *self);
+
+void maps_download_store_get_cache_stats (MapsDownloadStore *self,
+                                          guint64           *hits,
+                                          guint64           *misses,
+                                          guint64           *evictions);
 
 G_END_DECLS
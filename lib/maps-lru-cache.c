@@ -0,0 +1,380 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "maps-lru-cache.h"
+
+/* A hash table whose entries are also linked in least recently used order, so that lookups, insertions and evictions
+   are all O(1). Each entry has a cost, usually its size in bytes, and the least recently used entries are evicted
+   when the total goes over the maximum.
+
+   The cache is not thread safe. Callers that share one between threads have to lock around it. */
+
+typedef struct {
+  gpointer key;
+  gpointer value;
+  gsize cost;
+  GList link;
+} Entry;
+
+struct _MapsLruCache {
+  GObject parent_instance;
+
+  GDestroyNotify key_destroy_func;
+  GDestroyNotify value_destroy_func;
+
+  GHashTable *entries;  /* key -> Entry * */
+  GQueue lru;           /* Entry *, most recently used first */
+  gsize cost;
+  gsize max_cost;
+
+  guint64 hits;
+  guint64 misses;
+  guint64 evictions;
+};
+
+G_DEFINE_TYPE (MapsLruCache, maps_lru_cache, G_TYPE_OBJECT)
+
+static void
+entry_free (MapsLruCache *self,
+            Entry        *entry)
+{
+  if (self->key_destroy_func != NULL)
+    self->key_destroy_func (entry->key);
+  if (self->value_destroy_func != NULL)
+    self->value_destroy_func (entry->value);
+  g_free (entry);
+}
+
+static void
+remove_entry (MapsLruCache *self,
+              Entry        *entry)
+{
+  g_hash_table_remove (self->entries, entry->key);
+  g_queue_unlink (&self->lru, &entry->link);
+  self->cost -= entry->cost;
+  entry_free (self, entry);
+}
+
+static void
+trim (MapsLruCache *self)
+{
+  while (self->cost > self->max_cost)
+    {
+      remove_entry (self, g_queue_peek_tail (&self->lru));
+      self->evictions++;
+    }
+}
+
+static void
+maps_lru_cache_finalize (GObject *object)
+{
+  MapsLruCache *self = MAPS_LRU_CACHE (object);
+
+  maps_lru_cache_remove_all (self);
+  g_clear_pointer (&self->entries, g_hash_table_unref);
+
+  G_OBJECT_CLASS (maps_lru_cache_parent_class)->finalize (object);
+}
+
+static void
+maps_lru_cache_class_init (MapsLruCacheClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = maps_lru_cache_finalize;
+}
+
+static void
+maps_lru_cache_init (MapsLruCache *self)
+{
+}
+
+/**
+ * maps_lru_cache_new: (skip)
+ * @hash_func: a function to hash keys
+ * @key_equal_func: a function to compare keys
+ * @key_destroy_func: (nullable): a function to free keys
+ * @value_destroy_func: (nullable): a function to free values
+ * @max_cost: the maximum total cost of the entries
+ *
+ * Creates a new least recently used cache.
+ *
+ * Returns: (transfer full): a new [class@LruCache]
+ */
+MapsLruCache *
+maps_lru_cache_new (GHashFunc       hash_func,
+                    GEqualFunc      key_equal_func,
+                    GDestroyNotify  key_destroy_func,
+                    GDestroyNotify  value_destroy_func,
+                    gsize           max_cost)
+{
+  MapsLruCache *self;
+
+  g_return_val_if_fail (hash_func != NULL, NULL);
+  g_return_val_if_fail (key_equal_func != NULL, NULL);
+
+  self = g_object_new (MAPS_TYPE_LRU_CACHE, NULL);
+  self->key_destroy_func = key_destroy_func;
+  self->value_destroy_func = value_destroy_func;
+  self->max_cost = max_cost;
+
+  /* The entries own the keys and values, so they're freed by remove_entry() */
+  self->entries = g_hash_table_new (hash_func, key_equal_func);
+
+  return self;
+}
+
+/**
+ * maps_lru_cache_lookup: (skip)
+ * @self: a [class@LruCache]
+ * @key: the key to look up
+ *
+ * Looks up an entry and marks it as the most recently used one. Counts
+ * as a hit or a miss in the statistics.
+ *
+ * Returns: (nullable) (transfer none): the value, or %NULL if the key is not
+ * in the cache
+ */
+gpointer
+maps_lru_cache_lookup (MapsLruCache  *self,
+                       gconstpointer  key)
+{
+  Entry *entry;
+
+  g_return_val_if_fail (MAPS_IS_LRU_CACHE (self), NULL);
+
+  entry = g_hash_table_lookup (self->entries, key);
+  if (entry == NULL)
+    {
+      self->misses++;
+      return NULL;
+    }
+
+  self->hits++;
+  g_queue_unlink (&self->lru, &entry->link);
+  g_queue_push_head_link (&self->lru, &entry->link);
+
+  return entry->value;
+}
+
+/**
+ * maps_lru_cache_contains: (skip)
+ * @self: a [class@LruCache]
+ * @key: the key to look up
+ *
+ * Checks whether the cache has an entry for @key, without marking it as
+ * used or counting it in the statistics.
+ *
+ * Returns: whether the key is in the cache
+ */
+gboolean
+maps_lru_cache_contains (MapsLruCache  *self,
+                         gconstpointer  key)
+{
+  g_return_val_if_fail (MAPS_IS_LRU_CACHE (self), FALSE);
+
+  return g_hash_table_contains (self->entries, key);
+}
+
+/**
+ * maps_lru_cache_insert: (skip)
+ * @self: a [class@LruCache]
+ * @key: (transfer full): the key. It must not be the same pointer as the
+ *   key of an existing entry.
+ * @value: (transfer full): the value
+ * @cost: the cost of the entry
+ *
+ * Adds an entry as the most recently used one, replacing any existing entry
+ * with the same key, and evicts the least recently used entries until the
+ * cache is within its maximum cost again. If the entry alone costs more than
+ * the maximum, it isn't added and @key and @value are freed right away.
+ *
+ * Returns: whether the entry was added
+ */
+gboolean
+maps_lru_cache_insert (MapsLruCache *self,
+                       gpointer      key,
+                       gpointer      value,
+                       gsize         cost)
+{
+  Entry *entry;
+
+  g_return_val_if_fail (MAPS_IS_LRU_CACHE (self), FALSE);
+
+  entry = g_hash_table_lookup (self->entries, key);
+  if (entry != NULL)
+    remove_entry (self, entry);
+
+  entry = g_new0 (Entry, 1);
+  entry->key = key;
+  entry->value = value;
+  entry->cost = cost;
+  entry->link.data = entry;
+
+  if (cost > self->max_cost)
+    {
+      entry_free (self, entry);
+      return FALSE;
+    }
+
+  g_hash_table_insert (self->entries, key, entry);
+  g_queue_push_head_link (&self->lru, &entry->link);
+  self->cost += cost;
+  trim (self);
+
+  return TRUE;
+}
+
+/**
+ * maps_lru_cache_remove: (skip)
+ * @self: a [class@LruCache]
+ * @key: the key to remove
+ *
+ * Removes an entry. This doesn't count as an eviction.
+ *
+ * Returns: whether the key was in the cache
+ */
+gboolean
+maps_lru_cache_remove (MapsLruCache  *self,
+                       gconstpointer  key)
+{
+  Entry *entry;
+
+  g_return_val_if_fail (MAPS_IS_LRU_CACHE (self), FALSE);
+
+  entry = g_hash_table_lookup (self->entries, key);
+  if (entry == NULL)
+    return FALSE;
+
+  remove_entry (self, entry);
+  return TRUE;
+}
+
+/**
+ * maps_lru_cache_remove_all:
+ * @self: a [class@LruCache]
+ *
+ * Removes all entries. This doesn't count as eviction.
+ */
+void
+maps_lru_cache_remove_all (MapsLruCache *self)
+{
+  Entry *entry;
+
+  g_return_if_fail (MAPS_IS_LRU_CACHE (self));
+
+  g_hash_table_remove_all (self->entries);
+
+  while ((entry = g_queue_peek_head (&self->lru)) != NULL)
+    {
+      g_queue_unlink (&self->lru, &entry->link);
+      entry_free (self, entry);
+    }
+
+  self->cost = 0;
+}
+
+/**
+ * maps_lru_cache_set_max_cost:
+ * @self: a [class@LruCache]
+ * @max_cost: the maximum total cost of the entries
+ *
+ * Sets the maximum total cost, evicting entries if needed.
+ */
+void
+maps_lru_cache_set_max_cost (MapsLruCache *self,
+                             gsize         max_cost)
+{
+  g_return_if_fail (MAPS_IS_LRU_CACHE (self));
+
+  self->max_cost = max_cost;
+  trim (self);
+}
+
+/**
+ * maps_lru_cache_get_max_cost:
+ * @self: a [class@LruCache]
+ *
+ * Gets the maximum total cost of the entries.
+ *
+ * Returns: the maximum cost
+ */
+gsize
+maps_lru_cache_get_max_cost (MapsLruCache *self)
+{
+  g_return_val_if_fail (MAPS_IS_LRU_CACHE (self), 0);
+
+  return self->max_cost;
+}
+
+/**
+ * maps_lru_cache_get_cost:
+ * @self: a [class@LruCache]
+ *
+ * Gets the total cost of the entries currently in the cache.
+ *
+ * Returns: the total cost
+ */
+gsize
+maps_lru_cache_get_cost (MapsLruCache *self)
+{
+  g_return_val_if_fail (MAPS_IS_LRU_CACHE (self), 0);
+
+  return self->cost;
+}
+
+/**
+ * maps_lru_cache_get_n_items:
+ * @self: a [class@LruCache]
+ *
+ * Gets the number of entries in the cache.
+ *
+ * Returns: the number of entries
+ */
+guint
+maps_lru_cache_get_n_items (MapsLruCache *self)
+{
+  g_return_val_if_fail (MAPS_IS_LRU_CACHE (self), 0);
+
+  return g_queue_get_length (&self->lru);
+}
+
+/**
+ * maps_lru_cache_get_stats:
+ * @self: a [class@LruCache]
+ * @hits: (out) (optional): return location for the number of lookups that
+ *   found an entry
+ * @misses: (out) (optional): return location for the number of lookups that
+ *   didn't
+ * @evictions: (out) (optional): return location for the number of entries
+ *   that were evicted to make room for others
+ *
+ * Gets statistics about how well the cache is working.
+ */
+void
+maps_lru_cache_get_stats (MapsLruCache *self,
+                          guint64      *hits,
+                          guint64      *misses,
+                          guint64      *evictions)
+{
+  g_return_if_fail (MAPS_IS_LRU_CACHE (self));
+
+  if (hits != NULL)
+    *hits = self->hits;
+  if (misses != NULL)
+    *misses = self->misses;
+  if (evictions != NULL)
+    *evictions = self->evictions;
+}
@@ -0,0 +1,59 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define MAPS_TYPE_LRU_CACHE (maps_lru_cache_get_type())
+G_DECLARE_FINAL_TYPE (MapsLruCache, maps_lru_cache, MAPS, LRU_CACHE, GObject)
+
+MapsLruCache *maps_lru_cache_new (GHashFunc       hash_func,
+                                  GEqualFunc      key_equal_func,
+                                  GDestroyNotify  key_destroy_func,
+                                  GDestroyNotify  value_destroy_func,
+                                  gsize           max_cost);
+
+gpointer maps_lru_cache_lookup (MapsLruCache  *self,
+                                gconstpointer  key);
+
+gboolean maps_lru_cache_contains (MapsLruCache  *self,
+                                  gconstpointer  key);
+
+gboolean maps_lru_cache_insert (MapsLruCache *self,
+                                gpointer      key,
+                                gpointer      value,
+                                gsize         cost);
+
+gboolean maps_lru_cache_remove (MapsLruCache  *self,
+                                gconstpointer  key);
+
+void maps_lru_cache_remove_all (MapsLruCache *self);
+
+void maps_lru_cache_set_max_cost (MapsLruCache *self,
+                                  gsize         max_cost);
+gsize maps_lru_cache_get_max_cost (MapsLruCache *self);
+
+gsize maps_lru_cache_get_cost (MapsLruCache *self);
+guint maps_lru_cache_get_n_items (MapsLruCache *self);
+
+void maps_lru_cache_get_stats (MapsLruCache *self,
+                               guint64      *hits,
+                               guint64      *misses,
+                               guint64      *evictions);
+
+G_END_DECLS
@@ -0,0 +1,1127 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "maps-offline-data-source.h"
+#include "maps-tile-id.h"
+
+/* Serves tiles from the download store, and passes requests for tiles that aren't there (or are stale cache entries)
+   on to the next data source. Tiles that come back from the next source are added to the store's tile cache.
+
+   Shumate asks for all the tiles it needs at once, so requests are collected until the main loop is idle and then
+   looked up in a single get_many_async() call. Everything here runs on the main thread, without going through
+   JavaScript, since it happens for every tile on the screen.
+
+   Several layers, or zooming out and back in, often ask for a tile that is already being looked up or fetched. Each
+   tile has at most one request in flight (see InFlight), and later requests for it join that one instead of starting
+   their own. The shared request is only cancelled once everyone who asked for the tile has cancelled.
+
+   Tiles that are likely to be needed soon can be prefetched (see maps_offline_data_source_prefetch()). They are
+   read into the store's memory cache at low priority, and the ones that aren't stored are fetched from the next
+   source and added to the tile cache, a few at a time and only while no visible tiles are waiting. A prefetched
+   tile is in flight like any other, so if it becomes visible, the request for it joins the prefetch. */
+
+/* Tiles for the cache are written in batches, once this many are waiting or after a short delay */
+#define CACHE_BATCH_SIZE 100
+#define CACHE_FLUSH_DELAY 2 /* seconds */
+/* Number of prefetched tiles fetched from the next source at once */
+#define MAX_PREFETCH_FETCHES 2
+#define DEFAULT_PREFETCH_BUDGET 32
+
+struct _MapsOfflineDataSource {
+  ShumateDataSource parent_instance;
+
+  MapsDownloadStore *store;
+  char *tileset;
+  ShumateDataSource *next_source;
+
+  /* Tile ID -> InFlight, for every tile that is being looked up or fetched */
+  GHashTable *in_flight;
+  /* InFlights waiting to be looked up in the store */
+  GPtrArray *pending;
+  guint flush_pending_id;
+
+  gboolean cache_tiles;
+  MapsTileBatch *cache_batch;
+  guint flush_cache_id;
+  /* Tiles that have been fetched but aren't in the store yet */
+  GHashTable *caching;
+
+  guint prefetch_budget;
+  GCancellable *prefetch_cancellable;
+  /* Tiles waiting to be prefetched from the next source */
+  GArray *prefetch_queue;
+  guint n_prefetch_fetches;
+};
+
+enum {
+  PROP_0,
+  PROP_STORE,
+  PROP_TILESET,
+  PROP_NEXT_SOURCE,
+  PROP_CACHE_TILES,
+  PROP_PREFETCH_BUDGET,
+  N_PROPERTIES
+};
+
+static GParamSpec *properties[N_PROPERTIES];
+
+enum {
+  CACHE_WRITTEN,
+  N_SIGNALS
+};
+
+static guint signals[N_SIGNALS];
+
+G_DEFINE_TYPE (MapsOfflineDataSource, maps_offline_data_source, SHUMATE_TYPE_DATA_SOURCE)
+
+static void
+queue_cache_tile (MapsOfflineDataSource *self,
+                  guint64                id,
+                  GBytes                *data);
+static void
+start_prefetch_fetches (MapsOfflineDataSource *self);
+
+/* The single lookup (and, on a miss, fetch) of a tile, shared by every request for it. Reference counted, since
+   it's held by the in-flight table, the store lookup it's part of, and the signal handlers on the next source's
+   request. */
+typedef struct {
+  /* Not owned. Whatever holds an InFlight also keeps the data source alive. */
+  MapsOfflineDataSource *self;
+  guint64 id;
+  int x, y, zoom_level;
+
+  /* The requests for this tile, and their cancellables' handlers */
+  GPtrArray *requests;
+  GPtrArray *request_cancellables;
+  GArray *handler_ids;
+  /* Number of requests that haven't been cancelled. A request without a cancellable always counts. */
+  gint live;
+  /* Cancelled once @live drops to 0 */
+  GCancellable *cancellable;
+
+  ShumateDataSourceRequest *next_req;
+  /* The data the requests have been given so far, for requests that join later */
+  GBytes *data;
+  gboolean finished;
+  /* Started by a prefetch, and taking up one of the MAX_PREFETCH_FETCHES slots until it's finished */
+  gboolean prefetch;
+} InFlight;
+
+static void
+in_flight_clear (InFlight *in_flight)
+{
+  /* A prefetch that was dropped from the table without finishing */
+  if (in_flight->prefetch && !in_flight->finished)
+    in_flight->self->n_prefetch_fetches--;
+
+  /* Not g_cancellable_disconnect(), which deadlocks if this happens because the cancellable is being cancelled */
+  for (guint i = 0; i < in_flight->request_cancellables->len; i++)
+    g_signal_handler_disconnect (g_ptr_array_index (in_flight->request_cancellables, i),
+                                 g_array_index (in_flight->handler_ids, gulong, i));
+
+  if (in_flight->next_req != NULL)
+    g_signal_handlers_disconnect_by_data (in_flight->next_req, in_flight);
+
+  g_clear_pointer (&in_flight->requests, g_ptr_array_unref);
+  g_clear_pointer (&in_flight->request_cancellables, g_ptr_array_unref);
+  g_clear_pointer (&in_flight->handler_ids, g_array_unref);
+  g_clear_object (&in_flight->cancellable);
+  g_clear_object (&in_flight->next_req);
+  g_clear_pointer (&in_flight->data, g_bytes_unref);
+}
+
+static InFlight *
+in_flight_ref (InFlight *in_flight)
+{
+  return g_rc_box_acquire (in_flight);
+}
+
+static void
+in_flight_unref (InFlight *in_flight)
+{
+  g_rc_box_release_full (in_flight, (GDestroyNotify)in_flight_clear);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (InFlight, in_flight_unref)
+
+static InFlight *
+in_flight_new (MapsOfflineDataSource *self,
+               guint64                id,
+               int                    x,
+               int                    y,
+               int                    zoom_level)
+{
+  InFlight *in_flight = g_rc_box_new0 (InFlight);
+
+  in_flight->self = self;
+  in_flight->id = id;
+  in_flight->x = x;
+  in_flight->y = y;
+  in_flight->zoom_level = zoom_level;
+  in_flight->requests = g_ptr_array_new_with_free_func (g_object_unref);
+  in_flight->request_cancellables = g_ptr_array_new_with_free_func (g_object_unref);
+  in_flight->handler_ids = g_array_new (FALSE, FALSE, sizeof (gulong));
+  in_flight->cancellable = g_cancellable_new ();
+
+  return in_flight;
+}
+
+static void
+on_request_cancelled (GCancellable *cancellable,
+                      InFlight     *in_flight)
+{
+  if (g_atomic_int_dec_and_test (&in_flight->live))
+    g_cancellable_cancel (in_flight->cancellable);
+}
+
+/* Whether nobody wants the tile anymore. Such an InFlight is never joined; a new request starts over. */
+static gboolean
+in_flight_is_cancelled (InFlight *in_flight)
+{
+  return g_cancellable_is_cancelled (in_flight->cancellable);
+}
+
+typedef struct {
+  ShumateDataSourceRequest *req;
+  InFlight *in_flight;
+} CatchUp;
+
+static void
+catch_up_free (CatchUp *catch_up)
+{
+  g_clear_object (&catch_up->req);
+  g_clear_pointer (&catch_up->in_flight, in_flight_unref);
+  g_free (catch_up);
+}
+
+static gboolean
+emit_catch_up (gpointer user_data)
+{
+  CatchUp *catch_up = user_data;
+
+  /* By now the request may have been given newer data, or completed (which catches it up as well) */
+  if (!shumate_data_source_request_is_completed (catch_up->req)
+      && shumate_data_source_request_get_data (catch_up->req) == NULL)
+    shumate_data_source_request_emit_data (catch_up->req, catch_up->in_flight->data, FALSE);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Keeps the tile in flight until @cancellable is cancelled, or for good if it's %NULL */
+static void
+in_flight_hold (InFlight     *in_flight,
+                GCancellable *cancellable)
+{
+  g_atomic_int_inc (&in_flight->live);
+
+  if (cancellable != NULL)
+    {
+      /* The callback runs right away if the request is already cancelled */
+      gulong handler_id = g_cancellable_connect (cancellable, G_CALLBACK (on_request_cancelled), in_flight, NULL);
+
+      if (handler_id != 0)
+        {
+          g_ptr_array_add (in_flight->request_cancellables, g_object_ref (cancellable));
+          g_array_append_val (in_flight->handler_ids, handler_id);
+        }
+    }
+}
+
+static void
+in_flight_add_request (InFlight                 *in_flight,
+                       ShumateDataSourceRequest *req,
+                       GCancellable             *cancellable)
+{
+  g_ptr_array_add (in_flight->requests, g_object_ref (req));
+  in_flight_hold (in_flight, cancellable);
+
+  /* Catch up with what the others already have. This waits for an idle, since the caller of start_request() can't
+     have connected to the request yet. */
+  if (in_flight->data != NULL)
+    {
+      CatchUp *catch_up = g_new0 (CatchUp, 1);
+
+      catch_up->req = g_object_ref (req);
+      catch_up->in_flight = in_flight_ref (in_flight);
+      g_idle_add_full (G_PRIORITY_HIGH_IDLE, emit_catch_up, catch_up, (GDestroyNotify)catch_up_free);
+    }
+}
+
+static void
+in_flight_emit_data (InFlight *in_flight,
+                     GBytes   *data,
+                     gboolean  complete)
+{
+  if (!complete)
+    {
+      g_clear_pointer (&in_flight->data, g_bytes_unref);
+      in_flight->data = g_bytes_ref (data);
+    }
+
+  for (guint i = 0; i < in_flight->requests->len; i++)
+    shumate_data_source_request_emit_data (g_ptr_array_index (in_flight->requests, i), data, complete);
+}
+
+static void
+in_flight_emit_error (InFlight     *in_flight,
+                      const GError *error)
+{
+  for (guint i = 0; i < in_flight->requests->len; i++)
+    shumate_data_source_request_emit_error (g_ptr_array_index (in_flight->requests, i), error);
+}
+
+static void
+in_flight_complete (InFlight *in_flight)
+{
+  for (guint i = 0; i < in_flight->requests->len; i++)
+    {
+      ShumateDataSourceRequest *req = g_ptr_array_index (in_flight->requests, i);
+
+      if (shumate_data_source_request_is_completed (req))
+        continue;
+
+      /* A request that joined after the first data may still be waiting for its catch-up, which would come too
+         late once it's completed */
+      if (in_flight->data != NULL && shumate_data_source_request_get_data (req) == NULL)
+        shumate_data_source_request_emit_data (req, in_flight->data, FALSE);
+
+      shumate_data_source_request_complete (req);
+    }
+}
+
+/* Takes the tile out of the in-flight table, so the next request for it starts a new lookup. The caller must hold
+   a reference. */
+static void
+in_flight_finish (InFlight *in_flight)
+{
+  MapsOfflineDataSource *self = in_flight->self;
+
+  if (in_flight->finished)
+    return;
+
+  in_flight->finished = TRUE;
+
+  if (g_hash_table_lookup (self->in_flight, &in_flight->id) == in_flight)
+    g_hash_table_remove (self->in_flight, &in_flight->id);
+
+  if (in_flight->prefetch)
+    self->n_prefetch_fetches--;
+
+  /* Either a prefetch slot or the next source is free now */
+  start_prefetch_fetches (self);
+}
+
+static void
+on_next_data (ShumateDataSourceRequest *next_req,
+              GParamSpec               *pspec,
+              InFlight                 *in_flight)
+{
+  GBytes *data = shumate_data_source_request_get_data (next_req);
+
+  if (data == NULL || in_flight->finished)
+    return;
+
+  in_flight_emit_data (in_flight, data, FALSE);
+  queue_cache_tile (in_flight->self, in_flight->id, data);
+}
+
+static void
+on_next_error (ShumateDataSourceRequest *next_req,
+               GParamSpec               *pspec,
+               InFlight                 *in_flight)
+{
+  g_autoptr(InFlight) ref = NULL;
+  const GError *error = shumate_data_source_request_get_error (next_req);
+
+  if (error == NULL || in_flight->finished)
+    return;
+
+  ref = in_flight_ref (in_flight);
+
+  /* If the requests already have a stale copy of the tile, keep showing that */
+  if (in_flight->data != NULL)
+    in_flight_complete (in_flight);
+  else
+    in_flight_emit_error (in_flight, error);
+
+  in_flight_finish (in_flight);
+}
+
+static void
+on_next_completed (ShumateDataSourceRequest *next_req,
+                   GParamSpec               *pspec,
+                   InFlight                 *in_flight)
+{
+  g_autoptr(InFlight) ref = NULL;
+
+  if (in_flight->finished)
+    return;
+
+  ref = in_flight_ref (in_flight);
+  in_flight_complete (in_flight);
+  in_flight_finish (in_flight);
+}
+
+/* Passes the request for a tile that isn't downloaded (or whose cached copy is stale) on to the next data source */
+static void
+forward_request (InFlight *in_flight)
+{
+  ShumateDataSourceRequest *next_req;
+
+  next_req = shumate_data_source_start_request (in_flight->self->next_source,
+                                                in_flight->x,
+                                                in_flight->y,
+                                                in_flight->zoom_level,
+                                                in_flight->cancellable);
+  in_flight->next_req = next_req;
+
+  g_signal_connect (next_req, "notify::data", G_CALLBACK (on_next_data), in_flight);
+  g_signal_connect (next_req, "notify::error", G_CALLBACK (on_next_error), in_flight);
+  g_signal_connect (next_req, "notify::completed", G_CALLBACK (on_next_completed), in_flight);
+
+  /* The next source may have finished before the handlers were connected */
+  if (shumate_data_source_request_is_completed (next_req))
+    {
+      on_next_data (next_req, NULL, in_flight);
+      on_next_error (next_req, NULL, in_flight);
+      on_next_completed (next_req, NULL, in_flight);
+    }
+}
+
+/* The InFlights looked up together. Shared by the tile callback and the completion callback of get_many_async(),
+   so it's reference counted. */
+typedef struct {
+  MapsOfflineDataSource *self;
+  /* Tile ID -> InFlight, for the tiles that haven't been handled yet */
+  GHashTable *in_flight;
+  /* Cancelled once every InFlight in the batch is, so the store can drop the read */
+  GCancellable *cancellable;
+  GPtrArray *in_flight_cancellables;
+  GArray *handler_ids;
+  gint remaining;
+} Batch;
+
+static void
+batch_clear (Batch *batch)
+{
+  for (guint i = 0; i < batch->in_flight_cancellables->len; i++)
+    g_cancellable_disconnect (g_ptr_array_index (batch->in_flight_cancellables, i),
+                              g_array_index (batch->handler_ids, gulong, i));
+
+  g_clear_pointer (&batch->in_flight, g_hash_table_unref);
+  g_clear_object (&batch->self);
+  g_clear_object (&batch->cancellable);
+  g_clear_pointer (&batch->in_flight_cancellables, g_ptr_array_unref);
+  g_clear_pointer (&batch->handler_ids, g_array_unref);
+}
+
+static void
+batch_unref (Batch *batch)
+{
+  g_rc_box_release_full (batch, (GDestroyNotify)batch_clear);
+}
+
+static void
+on_in_flight_cancelled (GCancellable *cancellable,
+                        Batch        *batch)
+{
+  if (g_atomic_int_dec_and_test (&batch->remaining))
+    g_cancellable_cancel (batch->cancellable);
+}
+
+static Batch *
+batch_new (MapsOfflineDataSource *self)
+{
+  Batch *batch = g_rc_box_new0 (Batch);
+
+  batch->self = g_object_ref (self);
+  batch->in_flight = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL, (GDestroyNotify)in_flight_unref);
+  batch->cancellable = g_cancellable_new ();
+  batch->in_flight_cancellables = g_ptr_array_new_with_free_func (g_object_unref);
+  batch->handler_ids = g_array_new (FALSE, FALSE, sizeof (gulong));
+
+  return batch;
+}
+
+static void
+batch_add (Batch    *batch,
+           InFlight *in_flight)
+{
+  gulong handler_id;
+
+  g_hash_table_insert (batch->in_flight, &in_flight->id, in_flight_ref (in_flight));
+  g_atomic_int_inc (&batch->remaining);
+
+  handler_id = g_cancellable_connect (in_flight->cancellable, G_CALLBACK (on_in_flight_cancelled), batch, NULL);
+  if (handler_id != 0)
+    {
+      g_ptr_array_add (batch->in_flight_cancellables, g_object_ref (in_flight->cancellable));
+      g_array_append_val (batch->handler_ids, handler_id);
+    }
+}
+
+static void
+on_tile (guint64   id,
+         GBytes   *data,
+         gboolean  stale,
+         gpointer  user_data)
+{
+  Batch *batch = user_data;
+  g_autoptr(InFlight) in_flight = NULL;
+
+  if (!g_hash_table_steal_extended (batch->in_flight, &id, NULL, (gpointer *)&in_flight))
+    return;
+
+  if (in_flight_is_cancelled (in_flight))
+    {
+      in_flight_finish (in_flight);
+      return;
+    }
+
+  if (data != NULL && !stale)
+    {
+      in_flight_emit_data (in_flight, data, TRUE);
+      in_flight_finish (in_flight);
+    }
+  else if (data != NULL)
+    {
+      /* Show the old tile from the cache while a new one is fetched */
+      in_flight_emit_data (in_flight, data, FALSE);
+      forward_request (in_flight);
+    }
+  else
+    forward_request (in_flight);
+}
+
+static void
+on_get_many (GObject      *object,
+             GAsyncResult *result,
+             gpointer      user_data)
+{
+  Batch *batch = user_data;
+  g_autoptr(GError) error = NULL;
+
+  if (!maps_download_store_get_many_finish (MAPS_DOWNLOAD_STORE (object), result, &error))
+    {
+      GHashTableIter iter;
+      InFlight *in_flight;
+
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_warning ("Failed to read tiles: %s", error->message);
+
+      /* Anything that wasn't handled before the error gets it */
+      g_hash_table_iter_init (&iter, batch->in_flight);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&in_flight))
+        {
+          if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            in_flight_emit_error (in_flight, error);
+          in_flight_finish (in_flight);
+        }
+    }
+
+  batch_unref (batch);
+}
+
+static gboolean
+flush_pending (gpointer user_data)
+{
+  MapsOfflineDataSource *self = MAPS_OFFLINE_DATA_SOURCE (user_data);
+  g_autoptr(GPtrArray) pending = g_steal_pointer (&self->pending);
+  g_autoptr(GArray) ids = g_array_new (FALSE, FALSE, sizeof (guint64));
+  Batch *batch;
+
+  self->pending = g_ptr_array_new_with_free_func ((GDestroyNotify)in_flight_unref);
+  self->flush_pending_id = 0;
+
+  batch = batch_new (self);
+
+  for (guint i = 0; i < pending->len; i++)
+    {
+      InFlight *in_flight = g_ptr_array_index (pending, i);
+
+      /* Tiles that nobody wants anymore aren't looked up at all */
+      if (in_flight_is_cancelled (in_flight))
+        {
+          in_flight_finish (in_flight);
+          continue;
+        }
+
+      g_array_append_val (ids, in_flight->id);
+      batch_add (batch, in_flight);
+    }
+
+  if (ids->len == 0)
+    {
+      batch_unref (batch);
+      return G_SOURCE_REMOVE;
+    }
+
+  maps_download_store_get_many_async (self->store,
+                                      self->tileset,
+                                      (guint64 *)ids->data,
+                                      ids->len,
+                                      on_tile,
+                                      g_rc_box_acquire (batch),
+                                      (GDestroyNotify)batch_unref,
+                                      batch->cancellable,
+                                      on_get_many,
+                                      batch);
+
+  return G_SOURCE_REMOVE;
+}
+
+static ShumateDataSourceRequest *
+maps_offline_data_source_start_request (ShumateDataSource *source,
+                                        int                x,
+                                        int                y,
+                                        int                zoom_level,
+                                        GCancellable      *cancellable)
+{
+  MapsOfflineDataSource *self = MAPS_OFFLINE_DATA_SOURCE (source);
+  ShumateDataSourceRequest *req = shumate_data_source_request_new (x, y, zoom_level);
+  guint64 id = maps_tile_id_from_zxy (zoom_level, x, y);
+  InFlight *in_flight;
+
+  in_flight = g_hash_table_lookup (self->in_flight, &id);
+  if (in_flight == NULL || in_flight_is_cancelled (in_flight))
+    {
+      /* A cancelled InFlight is replaced, but still cleans up after itself once it's done */
+      in_flight = in_flight_new (self, id, x, y, zoom_level);
+      g_hash_table_replace (self->in_flight, &in_flight->id, in_flight);
+      g_ptr_array_add (self->pending, in_flight_ref (in_flight));
+
+      if (self->flush_pending_id == 0)
+        {
+          self->flush_pending_id = g_idle_add_full (G_PRIORITY_HIGH_IDLE, flush_pending, g_object_ref (self), g_object_unref);
+          g_source_set_name_by_id (self->flush_pending_id, "[gnome-maps] flush_pending");
+        }
+    }
+
+  in_flight_add_request (in_flight, req, cancellable);
+
+  return req;
+}
+
+/* Whether any tiles on the screen are waiting, in which case prefetching holds off */
+static gboolean
+has_visible_requests (MapsOfflineDataSource *self)
+{
+  GHashTableIter iter;
+  InFlight *in_flight;
+
+  if (self->pending->len > 0)
+    return TRUE;
+
+  g_hash_table_iter_init (&iter, self->in_flight);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&in_flight))
+    if (in_flight->requests->len > 0 && !in_flight_is_cancelled (in_flight))
+      return TRUE;
+
+  return FALSE;
+}
+
+static void
+start_prefetch_fetches (MapsOfflineDataSource *self)
+{
+  while (self->prefetch_queue->len > 0
+         && self->n_prefetch_fetches < MAX_PREFETCH_FETCHES
+         && !has_visible_requests (self))
+    {
+      guint64 id = g_array_index (self->prefetch_queue, guint64, 0);
+      g_autoptr(InFlight) ref = NULL;
+      InFlight *in_flight;
+      guint z, x, y;
+
+      g_array_remove_index (self->prefetch_queue, 0);
+
+      in_flight = g_hash_table_lookup (self->in_flight, &id);
+      if ((in_flight != NULL && !in_flight_is_cancelled (in_flight))
+          || g_hash_table_contains (self->caching, &id)
+          || !maps_tile_id_to_zxy (id, &z, &x, &y))
+        continue;
+
+      in_flight = in_flight_new (self, id, x, y, z);
+      in_flight->prefetch = TRUE;
+      in_flight_hold (in_flight, self->prefetch_cancellable);
+      g_hash_table_replace (self->in_flight, &in_flight->id, in_flight);
+      self->n_prefetch_fetches++;
+
+      ref = in_flight_ref (in_flight);
+      forward_request (in_flight);
+    }
+}
+
+static void
+on_prefetched (GObject      *object,
+               GAsyncResult *result,
+               gpointer      user_data)
+{
+  g_autoptr(MapsOfflineDataSource) self = MAPS_OFFLINE_DATA_SOURCE (user_data);
+  g_autoptr(GError) error = NULL;
+  g_autofree guint64 *ids = NULL;
+  gsize n_ids;
+
+  ids = maps_download_store_prefetch_finish (MAPS_DOWNLOAD_STORE (object), result, &n_ids, &error);
+  if (error != NULL)
+    {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_warning ("Failed to prefetch tiles: %s", error->message);
+      return;
+    }
+
+  /* A newer prefetch has replaced this one */
+  if (g_task_get_cancellable (G_TASK (result)) != self->prefetch_cancellable)
+    return;
+
+  /* Without the tile cache, there's nowhere to keep tiles from the next source */
+  if (!self->cache_tiles)
+    return;
+
+  g_array_append_vals (self->prefetch_queue, ids, n_ids);
+  start_prefetch_fetches (self);
+}
+
+/**
+ * maps_offline_data_source_prefetch:
+ * @self: a [class@OfflineDataSource]
+ * @ids: (array length=n_ids): the tiles, most important first
+ * @n_ids: the length of @ids
+ *
+ * Gets tiles ready that are likely to be requested soon, such as the ones
+ * the map is panning towards. Stored tiles are read into the download
+ * store's memory cache, and if the tile cache is enabled, the rest are
+ * fetched from the next data source into it.
+ *
+ * Prefetching works in the background and gives way to visible tiles.
+ * Only the first [property@OfflineDataSource:prefetch-budget] tiles are
+ * considered. Each call replaces the previous one: tiles from the previous
+ * call that aren't in @ids are dropped.
+ */
+void
+maps_offline_data_source_prefetch (MapsOfflineDataSource *self,
+                                   const guint64         *ids,
+                                   gsize                  n_ids)
+{
+  g_autoptr(GCancellable) previous = NULL;
+  g_autoptr(GArray) lookup = NULL;
+
+  g_return_if_fail (MAPS_IS_OFFLINE_DATA_SOURCE (self));
+  g_return_if_fail (ids != NULL || n_ids == 0);
+
+  previous = g_steal_pointer (&self->prefetch_cancellable);
+  self->prefetch_cancellable = g_cancellable_new ();
+  g_array_set_size (self->prefetch_queue, 0);
+
+  lookup = g_array_new (FALSE, FALSE, sizeof (guint64));
+
+  for (gsize i = 0; i < n_ids && i < self->prefetch_budget; i++)
+    {
+      InFlight *in_flight = g_hash_table_lookup (self->in_flight, &ids[i]);
+
+      if (in_flight != NULL && !in_flight_is_cancelled (in_flight))
+        {
+          /* Keep prefetches that are still wanted going after the previous prefetch is cancelled */
+          if (in_flight->prefetch)
+            in_flight_hold (in_flight, self->prefetch_cancellable);
+          continue;
+        }
+
+      if (!g_hash_table_contains (self->caching, &ids[i]))
+        g_array_append_val (lookup, ids[i]);
+    }
+
+  if (previous != NULL)
+    g_cancellable_cancel (previous);
+
+  if (lookup->len == 0)
+    return;
+
+  maps_download_store_prefetch_async (self->store,
+                                      self->tileset,
+                                      (guint64 *)lookup->data,
+                                      lookup->len,
+                                      self->prefetch_cancellable,
+                                      on_prefetched,
+                                      g_object_ref (self));
+}
+
+typedef struct {
+  MapsOfflineDataSource *self;
+  MapsTileBatch *batch;
+} CacheWrite;
+
+static void
+cache_write_free (CacheWrite *write)
+{
+  g_clear_object (&write->self);
+  g_clear_object (&write->batch);
+  g_free (write);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (CacheWrite, cache_write_free)
+
+static void
+on_cache_written (GObject      *object,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  g_autoptr(CacheWrite) write = user_data;
+  MapsOfflineDataSource *self = write->self;
+  g_autoptr(GError) error = NULL;
+
+  /* The tiles can be prefetched again, whether or not they made it into the store */
+  for (guint i = 0; i < maps_tile_batch_get_n_entries (write->batch); i++)
+    {
+      const guint64 *ids;
+      gsize n_ids;
+      gboolean precompressed;
+
+      maps_tile_batch_get_entry (write->batch, i, &ids, &n_ids, &precompressed);
+      for (gsize j = 0; j < n_ids; j++)
+        g_hash_table_remove (self->caching, &ids[j]);
+    }
+
+  if (!maps_download_store_insert_batch_finish (MAPS_DOWNLOAD_STORE (object), result, &error))
+    {
+      g_warning ("Failed to write tiles to the cache: %s", error->message);
+      return;
+    }
+
+  g_signal_emit (self, signals[CACHE_WRITTEN], 0);
+}
+
+static gboolean
+flush_cache_timeout (gpointer user_data)
+{
+  MapsOfflineDataSource *self = MAPS_OFFLINE_DATA_SOURCE (user_data);
+
+  self->flush_cache_id = 0;
+  maps_offline_data_source_flush_cache (self);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+queue_cache_tile (MapsOfflineDataSource *self,
+                  guint64                id,
+                  GBytes                *data)
+{
+  if (!self->cache_tiles)
+    return;
+
+  if (self->cache_batch == NULL)
+    {
+      self->cache_batch = maps_tile_batch_new (self->tileset, g_get_real_time () / 1000);
+      maps_tile_batch_set_cache_only (self->cache_batch, TRUE);
+    }
+
+  maps_tile_batch_add (self->cache_batch, &id, 1, data, FALSE);
+  g_hash_table_add (self->caching, g_memdup2 (&id, sizeof id));
+
+  if (maps_tile_batch_get_n_entries (self->cache_batch) >= CACHE_BATCH_SIZE)
+    maps_offline_data_source_flush_cache (self);
+  else if (self->flush_cache_id == 0)
+    {
+      self->flush_cache_id = g_timeout_add_seconds_full (G_PRIORITY_LOW,
+                                                         CACHE_FLUSH_DELAY,
+                                                         flush_cache_timeout,
+                                                         g_object_ref (self),
+                                                         g_object_unref);
+      g_source_set_name_by_id (self->flush_cache_id, "[gnome-maps] flush_cache_timeout");
+    }
+}
+
+static void
+maps_offline_data_source_get_property (GObject    *object,
+                                       guint       prop_id,
+                                       GValue     *value,
+                                       GParamSpec *pspec)
+{
+  MapsOfflineDataSource *self = MAPS_OFFLINE_DATA_SOURCE (object);
+
+  switch (prop_id)
+    {
+    case PROP_STORE:
+      g_value_set_object (value, self->store);
+      break;
+    case PROP_TILESET:
+      g_value_set_string (value, self->tileset);
+      break;
+    case PROP_NEXT_SOURCE:
+      g_value_set_object (value, self->next_source);
+      break;
+    case PROP_CACHE_TILES:
+      g_value_set_boolean (value, self->cache_tiles);
+      break;
+    case PROP_PREFETCH_BUDGET:
+      g_value_set_uint (value, self->prefetch_budget);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
+static void
+maps_offline_data_source_set_property (GObject      *object,
+                                       guint         prop_id,
+                                       const GValue *value,
+                                       GParamSpec   *pspec)
+{
+  MapsOfflineDataSource *self = MAPS_OFFLINE_DATA_SOURCE (object);
+
+  switch (prop_id)
+    {
+    case PROP_STORE:
+      self->store = g_value_dup_object (value);
+      break;
+    case PROP_TILESET:
+      self->tileset = g_value_dup_string (value);
+      break;
+    case PROP_NEXT_SOURCE:
+      self->next_source = g_value_dup_object (value);
+      break;
+    case PROP_CACHE_TILES:
+      maps_offline_data_source_set_cache_tiles (self, g_value_get_boolean (value));
+      break;
+    case PROP_PREFETCH_BUDGET:
+      maps_offline_data_source_set_prefetch_budget (self, g_value_get_uint (value));
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
+static void
+maps_offline_data_source_constructed (GObject *object)
+{
+  MapsOfflineDataSource *self = MAPS_OFFLINE_DATA_SOURCE (object);
+
+  G_OBJECT_CLASS (maps_offline_data_source_parent_class)->constructed (object);
+
+  g_object_bind_property (self->next_source, "min-zoom-level", self, "min-zoom-level", G_BINDING_SYNC_CREATE);
+  g_object_bind_property (self->next_source, "max-zoom-level", self, "max-zoom-level", G_BINDING_SYNC_CREATE);
+}
+
+static void
+maps_offline_data_source_finalize (GObject *object)
+{
+  MapsOfflineDataSource *self = MAPS_OFFLINE_DATA_SOURCE (object);
+
+  /* The idle and timeout sources hold a reference, so neither can be pending here */
+  g_clear_object (&self->store);
+  g_clear_pointer (&self->tileset, g_free);
+  g_clear_object (&self->next_source);
+  g_clear_pointer (&self->in_flight, g_hash_table_unref);
+  g_clear_pointer (&self->pending, g_ptr_array_unref);
+  g_clear_object (&self->cache_batch);
+  g_clear_pointer (&self->caching, g_hash_table_unref);
+  g_clear_object (&self->prefetch_cancellable);
+  g_clear_pointer (&self->prefetch_queue, g_array_unref);
+
+  G_OBJECT_CLASS (maps_offline_data_source_parent_class)->finalize (object);
+}
+
+static void
+maps_offline_data_source_class_init (MapsOfflineDataSourceClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  ShumateDataSourceClass *data_source_class = SHUMATE_DATA_SOURCE_CLASS (klass);
+
+  object_class->get_property = maps_offline_data_source_get_property;
+  object_class->set_property = maps_offline_data_source_set_property;
+  object_class->constructed = maps_offline_data_source_constructed;
+  object_class->finalize = maps_offline_data_source_finalize;
+  data_source_class->start_request = maps_offline_data_source_start_request;
+
+  properties[PROP_STORE] =
+    g_param_spec_object ("store",
+                         "store",
+                         "store",
+                         MAPS_TYPE_DOWNLOAD_STORE,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  properties[PROP_TILESET] =
+    g_param_spec_string ("tileset",
+                         "tileset",
+                         "tileset",
+                         NULL,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  properties[PROP_NEXT_SOURCE] =
+    g_param_spec_object ("next-source",
+                         "next-source",
+                         "next-source",
+                         SHUMATE_TYPE_DATA_SOURCE,
+                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  properties[PROP_CACHE_TILES] =
+    g_param_spec_boolean ("cache-tiles",
+                          "cache-tiles",
+                          "cache-tiles",
+                          FALSE,
+                          G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS);
+
+  properties[PROP_PREFETCH_BUDGET] =
+    g_param_spec_uint ("prefetch-budget",
+                       "prefetch-budget",
+                       "prefetch-budget",
+                       0,
+                       G_MAXUINT,
+                       DEFAULT_PREFETCH_BUDGET,
+                       G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, properties);
+
+  /**
+   * MapsOfflineDataSource::cache-written:
+   *
+   * Emitted after a batch of tiles from the next data source has been
+   * written to the tile cache, so the cache can be trimmed to its quota.
+   */
+  signals[CACHE_WRITTEN] =
+    g_signal_new ("cache-written",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0,
+                  NULL, NULL,
+                  NULL,
+                  G_TYPE_NONE, 0);
+}
+
+static void
+maps_offline_data_source_init (MapsOfflineDataSource *self)
+{
+  self->in_flight = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL, (GDestroyNotify)in_flight_unref);
+  self->pending = g_ptr_array_new_with_free_func ((GDestroyNotify)in_flight_unref);
+  self->caching = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+  self->prefetch_budget = DEFAULT_PREFETCH_BUDGET;
+  self->prefetch_queue = g_array_new (FALSE, FALSE, sizeof (guint64));
+}
+
+/**
+ * maps_offline_data_source_new:
+ * @store: the download store to read tiles from
+ * @tileset: the tileset in @store
+ * @next_source: the data source for tiles that aren't in @store
+ *
+ * Creates a data source that serves tiles from @store when it can, and
+ * from @next_source otherwise.
+ *
+ * Returns: (transfer full): a new [class@OfflineDataSource]
+ */
+MapsOfflineDataSource *
+maps_offline_data_source_new (MapsDownloadStore *store,
+                              const char        *tileset,
+                              ShumateDataSource *next_source)
+{
+  g_return_val_if_fail (MAPS_IS_DOWNLOAD_STORE (store), NULL);
+  g_return_val_if_fail (tileset != NULL, NULL);
+  g_return_val_if_fail (SHUMATE_IS_DATA_SOURCE (next_source), NULL);
+
+  return g_object_new (MAPS_TYPE_OFFLINE_DATA_SOURCE,
+                       "store", store,
+                       "tileset", tileset,
+                       "next-source", next_source,
+                       NULL);
+}
+
+const char *
+maps_offline_data_source_get_tileset (MapsOfflineDataSource *self)
+{
+  g_return_val_if_fail (MAPS_IS_OFFLINE_DATA_SOURCE (self), NULL);
+  return self->tileset;
+}
+
+/**
+ * maps_offline_data_source_set_cache_tiles:
+ * @self: a [class@OfflineDataSource]
+ * @cache_tiles: whether to cache tiles
+ *
+ * Sets whether tiles that come from the next data source are written to the
+ * download store as cache-only tiles.
+ */
+void
+maps_offline_data_source_set_cache_tiles (MapsOfflineDataSource *self,
+                                          gboolean               cache_tiles)
+{
+  g_return_if_fail (MAPS_IS_OFFLINE_DATA_SOURCE (self));
+
+  cache_tiles = !!cache_tiles;
+  if (self->cache_tiles == cache_tiles)
+    return;
+
+  self->cache_tiles = cache_tiles;
+  g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_CACHE_TILES]);
+}
+
+gboolean
+maps_offline_data_source_get_cache_tiles (MapsOfflineDataSource *self)
+{
+  g_return_val_if_fail (MAPS_IS_OFFLINE_DATA_SOURCE (self), FALSE);
+  return self->cache_tiles;
+}
+
+/**
+ * maps_offline_data_source_flush_cache:
+ * @self: a [class@OfflineDataSource]
+ *
+ * Writes the tiles that are waiting to be added to the tile cache now,
+ * rather than after a delay.
+ */
+void
+maps_offline_data_source_flush_cache (MapsOfflineDataSource *self)
+{
+  CacheWrite *write;
+
+  g_return_if_fail (MAPS_IS_OFFLINE_DATA_SOURCE (self));
+
+  g_clear_handle_id (&self->flush_cache_id, g_source_remove);
+
+  if (self->cache_batch == NULL)
+    return;
+
+  write = g_new0 (CacheWrite, 1);
+  write->self = g_object_ref (self);
+  write->batch = g_steal_pointer (&self->cache_batch);
+
+  maps_download_store_insert_batch_async (self->store, write->batch, NULL, on_cache_written, write);
+}
+
+/**
+ * maps_offline_data_source_set_prefetch_budget:
+ * @self: a [class@OfflineDataSource]
+ * @budget: the maximum number of tiles, or 0 to turn prefetching off
+ *
+ * Sets the number of tiles considered by each call to
+ * maps_offline_data_source_prefetch().
+ */
+void
+maps_offline_data_source_set_prefetch_budget (MapsOfflineDataSource *self,
+                                              guint                  budget)
+{
+  g_return_if_fail (MAPS_IS_OFFLINE_DATA_SOURCE (self));
+
+  if (self->prefetch_budget == budget)
+    return;
+
+  self->prefetch_budget = budget;
+  g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_PREFETCH_BUDGET]);
+}
+
+guint
+maps_offline_data_source_get_prefetch_budget (MapsOfflineDataSource *self)
+{
+  g_return_val_if_fail (MAPS_IS_OFFLINE_DATA_SOURCE (self), 0);
+  return self->prefetch_budget;
+}
@@ -0,0 +1,47 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <shumate/shumate.h>
+
+#include "maps-download-store.h"
+
+G_BEGIN_DECLS
+
+#define MAPS_TYPE_OFFLINE_DATA_SOURCE (maps_offline_data_source_get_type())
+G_DECLARE_FINAL_TYPE (MapsOfflineDataSource, maps_offline_data_source, MAPS, OFFLINE_DATA_SOURCE, ShumateDataSource)
+
+MapsOfflineDataSource *maps_offline_data_source_new (MapsDownloadStore *store,
+                                                     const char        *tileset,
+                                                     ShumateDataSource *next_source);
+
+const char *maps_offline_data_source_get_tileset (MapsOfflineDataSource *self);
+
+void maps_offline_data_source_set_cache_tiles (MapsOfflineDataSource *self,
+                                               gboolean               cache_tiles);
+gboolean maps_offline_data_source_get_cache_tiles (MapsOfflineDataSource *self);
+
+void maps_offline_data_source_flush_cache (MapsOfflineDataSource *self);
+
+void maps_offline_data_source_set_prefetch_budget (MapsOfflineDataSource *self,
+                                                   guint                  budget);
+guint maps_offline_data_source_get_prefetch_budget (MapsOfflineDataSource *self);
+
+void maps_offline_data_source_prefetch (MapsOfflineDataSource *self,
+                                        const guint64         *ids,
+                                        gsize                  n_ids);
+
+G_END_DECLS
@@ -0,0 +1,491 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "maps-pmtiles-data-source.h"
+#include "maps-pmtiles-index.h"
+#include "maps-tile-id.h"
+
+/* Serves vector tiles straight from a local PMTiles archive (https://github.com/protomaps/PMTiles/blob/main/spec/v3/spec.md).
+   The file is memory-mapped, so uncompressed tiles are handed to Shumate without being copied, and there is no
+   import step. Tiles that aren't in the archive are requested from the next data source, if there is one. */
+
+#define HEADER_LENGTH 127
+
+typedef enum {
+  COMPRESSION_UNKNOWN = 0,
+  COMPRESSION_NONE = 1,
+  COMPRESSION_GZIP = 2,
+  COMPRESSION_BROTLI = 3,
+  COMPRESSION_ZSTD = 4,
+} Compression;
+
+#define TILE_TYPE_MVT 1
+
+typedef struct {
+  guint64 root_dir_offset;
+  guint64 root_dir_length;
+  guint64 leaf_dirs_offset;
+  guint64 leaf_dirs_length;
+  guint64 tile_data_offset;
+  guint64 tile_data_length;
+  Compression internal_compression;
+  Compression tile_compression;
+  guint8 tile_type;
+  guint8 min_zoom;
+  guint8 max_zoom;
+} Header;
+
+struct _MapsPMTilesDataSource {
+  ShumateDataSource parent_instance;
+
+  char *path;
+  ShumateDataSource *next_source;
+
+  GMappedFile *file;
+  GBytes *bytes;
+  Header header;
+
+  MapsPMTilesIndex *index;
+};
+
+G_DEFINE_TYPE (MapsPMTilesDataSource, maps_pmtiles_data_source, SHUMATE_TYPE_DATA_SOURCE)
+
+static guint64
+read_u64 (const guint8 *data)
+{
+  guint64 value;
+  memcpy (&value, data, sizeof value);
+  return GUINT64_FROM_LE (value);
+}
+
+static GBytes *
+decompress (GBytes       *bytes,
+            Compression   compression,
+            GError      **error)
+{
+  switch (compression)
+    {
+    case COMPRESSION_NONE:
+      return g_bytes_ref (bytes);
+
+    case COMPRESSION_GZIP:
+      {
+        g_autoptr(GZlibDecompressor) decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+        g_autoptr(GInputStream) input = g_memory_input_stream_new_from_bytes (bytes);
+        g_autoptr(GInputStream) converter = g_converter_input_stream_new (input, G_CONVERTER (decompressor));
+        g_autoptr(GOutputStream) output = g_memory_output_stream_new_resizable ();
+
+        if (g_output_stream_splice (output, converter, G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE | G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET, NULL, error) < 0)
+          return NULL;
+
+        return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (output));
+      }
+
+    default:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Unsupported compression %d", compression);
+      return NULL;
+    }
+}
+
+/* Reads a range of the archive, making sure it is within the file */
+static GBytes *
+read_range (MapsPMTilesDataSource  *self,
+            guint64                 offset,
+            guint64                 length,
+            GError                **error)
+{
+  gsize size = g_bytes_get_size (self->bytes);
+
+  if (offset > size || length > size - offset)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Range %" G_GUINT64_FORMAT "+%" G_GUINT64_FORMAT " is outside of the file", offset, length);
+      return NULL;
+    }
+
+  /* This points straight into the mapped file */
+  return g_bytes_new_from_bytes (self->bytes, offset, length);
+}
+
+/* Finds the tile's data in the archive. Returns FALSE with no error if the tile isn't in the archive. */
+static gboolean
+find_tile (MapsPMTilesDataSource  *self,
+           guint64                 tile_id,
+           guint64                *offset,
+           guint64                *length,
+           GError                **error)
+{
+  for (;;)
+    {
+      g_autoptr(GBytes) compressed = NULL;
+      g_autoptr(GBytes) leaf = NULL;
+
+      switch (maps_pmtiles_index_lookup (self->index, tile_id, offset, length, error))
+        {
+        case MAPS_PMTILES_LOOKUP_FOUND:
+          *offset += self->header.tile_data_offset;
+          return TRUE;
+
+        case MAPS_PMTILES_LOOKUP_NOT_FOUND:
+          return FALSE;
+
+        case MAPS_PMTILES_LOOKUP_NEED_LEAF:
+          /* Leaf directories are decoded the first time they're needed and kept by the index, since the same few are
+             used over and over while looking at an area */
+          if (*offset > self->header.leaf_dirs_length)
+            {
+              g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Invalid leaf directory offset");
+              return FALSE;
+            }
+
+          compressed = read_range (self, self->header.leaf_dirs_offset + *offset, *length, error);
+          if (compressed == NULL)
+            return FALSE;
+
+          leaf = decompress (compressed, self->header.internal_compression, error);
+          if (leaf == NULL || !maps_pmtiles_index_add_leaf (self->index, *offset, leaf, error))
+            return FALSE;
+          break;
+        }
+    }
+}
+
+static void
+read_tile_thread (GTask        *task,
+                  gpointer      source_object,
+                  gpointer      task_data,
+                  GCancellable *cancellable)
+{
+  MapsPMTilesDataSource *self = MAPS_PMTILES_DATA_SOURCE (source_object);
+  ShumateDataSourceRequest *req = task_data;
+  g_autoptr(GBytes) compressed = NULL;
+  GError *error = NULL;
+  guint64 tile_id, offset, length;
+  GBytes *bytes;
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  tile_id = maps_tile_id_from_zxy (shumate_data_source_request_get_zoom_level (req),
+                                   shumate_data_source_request_get_x (req),
+                                   shumate_data_source_request_get_y (req));
+
+  if (!find_tile (self, tile_id, &offset, &length, &error))
+    {
+      if (error != NULL)
+        g_task_return_error (task, error);
+      else
+        g_task_return_pointer (task, NULL, NULL);
+      return;
+    }
+
+  compressed = read_range (self, offset, length, &error);
+  if (compressed == NULL)
+    {
+      g_task_return_error (task, error);
+      return;
+    }
+
+  bytes = decompress (compressed, self->header.tile_compression, &error);
+  if (bytes == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, bytes, (GDestroyNotify)g_bytes_unref);
+}
+
+static void
+on_next_data (ShumateDataSourceRequest *next_req,
+              GParamSpec               *pspec,
+              ShumateDataSourceRequest *req)
+{
+  GBytes *data = shumate_data_source_request_get_data (next_req);
+
+  if (data != NULL)
+    shumate_data_source_request_emit_data (req, data, FALSE);
+}
+
+static void
+on_next_error (ShumateDataSourceRequest *next_req,
+               GParamSpec               *pspec,
+               ShumateDataSourceRequest *req)
+{
+  const GError *error = shumate_data_source_request_get_error (next_req);
+
+  if (error != NULL)
+    shumate_data_source_request_emit_error (req, error);
+}
+
+static void
+on_next_completed (ShumateDataSourceRequest *next_req,
+                   GParamSpec               *pspec,
+                   ShumateDataSourceRequest *req)
+{
+  if (!shumate_data_source_request_is_completed (req))
+    shumate_data_source_request_complete (req);
+}
+
+/* Passes a request for a tile that isn't in the archive on to the next data source */
+static void
+forward_request (MapsPMTilesDataSource    *self,
+                 ShumateDataSourceRequest *req,
+                 GCancellable             *cancellable)
+{
+  ShumateDataSourceRequest *next_req;
+
+  next_req = shumate_data_source_start_request (self->next_source,
+                                                shumate_data_source_request_get_x (req),
+                                                shumate_data_source_request_get_y (req),
+                                                shumate_data_source_request_get_zoom_level (req),
+                                                cancellable);
+
+  g_signal_connect_object (next_req, "notify::data", G_CALLBACK (on_next_data), req, 0);
+  g_signal_connect_object (next_req, "notify::error", G_CALLBACK (on_next_error), req, 0);
+  g_signal_connect_object (next_req, "notify::completed", G_CALLBACK (on_next_completed), req, 0);
+
+  /* Keep the next request alive for as long as ours */
+  g_object_set_data_full (G_OBJECT (req), "maps-next-request", next_req, g_object_unref);
+}
+
+static void
+on_tile_read (GObject      *object,
+              GAsyncResult *result,
+              gpointer      user_data)
+{
+  MapsPMTilesDataSource *self = MAPS_PMTILES_DATA_SOURCE (object);
+  GTask *task = G_TASK (result);
+  ShumateDataSourceRequest *req = g_task_get_task_data (task);
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+
+  bytes = g_task_propagate_pointer (task, &error);
+
+  if (error != NULL)
+    shumate_data_source_request_emit_error (req, error);
+  else if (bytes != NULL)
+    shumate_data_source_request_emit_data (req, bytes, TRUE);
+  else if (self->next_source != NULL)
+    forward_request (self, req, g_task_get_cancellable (task));
+  else
+    {
+      /* A tile missing from the archive is empty */
+      g_autoptr(GBytes) empty = g_bytes_new (NULL, 0);
+      shumate_data_source_request_emit_data (req, empty, TRUE);
+    }
+}
+
+static ShumateDataSourceRequest *
+maps_pmtiles_data_source_start_request (ShumateDataSource *source,
+                                        int                x,
+                                        int                y,
+                                        int                zoom_level,
+                                        GCancellable      *cancellable)
+{
+  MapsPMTilesDataSource *self = MAPS_PMTILES_DATA_SOURCE (source);
+  ShumateDataSourceRequest *req = shumate_data_source_request_new (x, y, zoom_level);
+  g_autoptr(GTask) task = NULL;
+
+  if (zoom_level < self->header.min_zoom || zoom_level > self->header.max_zoom)
+    {
+      if (self->next_source != NULL)
+        forward_request (self, req, cancellable);
+      else
+        shumate_data_source_request_complete (req);
+      return req;
+    }
+
+  /* Looking up the tile may mean decoding a leaf directory, and decompressing it may take a while, so it's done on a
+     thread */
+  task = g_task_new (self, cancellable, on_tile_read, NULL);
+  g_task_set_source_tag (task, maps_pmtiles_data_source_start_request);
+  g_task_set_task_data (task, g_object_ref (req), g_object_unref);
+  g_task_run_in_thread (task, read_tile_thread);
+
+  return req;
+}
+
+static void
+maps_pmtiles_data_source_finalize (GObject *object)
+{
+  MapsPMTilesDataSource *self = MAPS_PMTILES_DATA_SOURCE (object);
+
+  g_clear_pointer (&self->path, g_free);
+  g_clear_object (&self->next_source);
+  g_clear_object (&self->index);
+  g_clear_pointer (&self->bytes, g_bytes_unref);
+  g_clear_pointer (&self->file, g_mapped_file_unref);
+
+  G_OBJECT_CLASS (maps_pmtiles_data_source_parent_class)->finalize (object);
+}
+
+static void
+maps_pmtiles_data_source_class_init (MapsPMTilesDataSourceClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  ShumateDataSourceClass *data_source_class = SHUMATE_DATA_SOURCE_CLASS (klass);
+
+  object_class->finalize = maps_pmtiles_data_source_finalize;
+  data_source_class->start_request = maps_pmtiles_data_source_start_request;
+}
+
+static void
+maps_pmtiles_data_source_init (MapsPMTilesDataSource *self)
+{
+}
+
+static gboolean
+read_header (MapsPMTilesDataSource  *self,
+             GError                **error)
+{
+  gsize size;
+  const guint8 *data = g_bytes_get_data (self->bytes, &size);
+  Header *header = &self->header;
+
+  if (size < HEADER_LENGTH || memcmp (data, "PMTiles", 7) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Not a PMTiles file");
+      return FALSE;
+    }
+
+  if (data[7] != 3)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Unsupported PMTiles version %d", data[7]);
+      return FALSE;
+    }
+
+  header->root_dir_offset = read_u64 (data + 0x08);
+  header->root_dir_length = read_u64 (data + 0x10);
+  header->leaf_dirs_offset = read_u64 (data + 0x28);
+  header->leaf_dirs_length = read_u64 (data + 0x30);
+  header->tile_data_offset = read_u64 (data + 0x38);
+  header->tile_data_length = read_u64 (data + 0x40);
+  header->internal_compression = data[0x61];
+  header->tile_compression = data[0x62];
+  header->tile_type = data[0x63];
+  header->min_zoom = data[0x64];
+  header->max_zoom = data[0x65];
+
+  if (header->tile_type != TILE_TYPE_MVT)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "PMTiles file does not contain vector tiles");
+      return FALSE;
+    }
+
+  if (header->internal_compression != COMPRESSION_NONE && header->internal_compression != COMPRESSION_GZIP)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Unsupported internal compression %d", header->internal_compression);
+      return FALSE;
+    }
+
+  if (header->tile_compression != COMPRESSION_NONE && header->tile_compression != COMPRESSION_GZIP)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Unsupported tile compression %d", header->tile_compression);
+      return FALSE;
+    }
+
+  if (header->max_zoom > MAPS_TILE_ID_MAX_ZOOM || header->min_zoom > header->max_zoom)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Invalid zoom range");
+      return FALSE;
+    }
+
+  if (header->leaf_dirs_offset > size || header->leaf_dirs_length > size - header->leaf_dirs_offset)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Leaf directories are outside of the file");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * maps_pmtiles_data_source_new:
+ * @path: path to a PMTiles archive containing vector tiles
+ * @next_source: (nullable): data source for tiles that aren't in the archive
+ * @error: return location for a [class@GError]
+ *
+ * Creates a data source that serves tiles from a local PMTiles archive.
+ *
+ * Returns: (transfer full): a new [class@PMTilesDataSource], or %NULL if the
+ * archive could not be opened
+ */
+MapsPMTilesDataSource *
+maps_pmtiles_data_source_new (const char         *path,
+                              ShumateDataSource  *next_source,
+                              GError            **error)
+{
+  g_autoptr(MapsPMTilesDataSource) self = NULL;
+  g_autoptr(GBytes) compressed_root = NULL;
+  g_autoptr(GBytes) root_dir = NULL;
+
+  g_return_val_if_fail (path != NULL, NULL);
+  g_return_val_if_fail (next_source == NULL || SHUMATE_IS_DATA_SOURCE (next_source), NULL);
+
+  self = g_object_new (MAPS_TYPE_PMTILES_DATA_SOURCE, NULL);
+  self->path = g_strdup (path);
+
+  self->file = g_mapped_file_new (path, FALSE, error);
+  if (self->file == NULL)
+    return NULL;
+
+  self->bytes = g_mapped_file_get_bytes (self->file);
+
+  if (!read_header (self, error))
+    return NULL;
+
+  compressed_root = read_range (self, self->header.root_dir_offset, self->header.root_dir_length, error);
+  if (compressed_root == NULL)
+    return NULL;
+
+  root_dir = decompress (compressed_root, self->header.internal_compression, error);
+  if (root_dir == NULL)
+    return NULL;
+
+  self->index = maps_pmtiles_index_new (root_dir, error);
+  if (self->index == NULL)
+    return NULL;
+
+  if (next_source != NULL)
+    {
+      self->next_source = g_object_ref (next_source);
+      shumate_data_source_set_min_zoom_level (SHUMATE_DATA_SOURCE (self),
+                                              MIN (self->header.min_zoom, shumate_data_source_get_min_zoom_level (next_source)));
+      shumate_data_source_set_max_zoom_level (SHUMATE_DATA_SOURCE (self),
+                                              MAX (self->header.max_zoom, shumate_data_source_get_max_zoom_level (next_source)));
+    }
+  else
+    {
+      shumate_data_source_set_min_zoom_level (SHUMATE_DATA_SOURCE (self), self->header.min_zoom);
+      shumate_data_source_set_max_zoom_level (SHUMATE_DATA_SOURCE (self), self->header.max_zoom);
+    }
+
+  return g_steal_pointer (&self);
+}
+
+/**
+ * maps_pmtiles_data_source_get_path:
+ * @self: a [class@PMTilesDataSource]
+ *
+ * Gets the path of the archive.
+ *
+ * Returns: the path
+ */
+const char *
+maps_pmtiles_data_source_get_path (MapsPMTilesDataSource *self)
+{
+  g_return_val_if_fail (MAPS_IS_PMTILES_DATA_SOURCE (self), NULL);
+
+  return self->path;
+}
@@ -0,0 +1,31 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <shumate/shumate.h>
+
+G_BEGIN_DECLS
+
+#define MAPS_TYPE_PMTILES_DATA_SOURCE (maps_pmtiles_data_source_get_type())
+G_DECLARE_FINAL_TYPE (MapsPMTilesDataSource, maps_pmtiles_data_source, MAPS, PMTILES_DATA_SOURCE, ShumateDataSource)
+
+MapsPMTilesDataSource *maps_pmtiles_data_source_new (const char         *path,
+                                                     ShumateDataSource  *next_source,
+                                                     GError            **error);
+
+const char *maps_pmtiles_data_source_get_path (MapsPMTilesDataSource *self);
+
+G_END_DECLS
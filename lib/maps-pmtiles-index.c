@@ -0,0 +1,564 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "maps-lru-cache.h"
+#include "maps-pmtiles-index.h"
+
+/* Decodes PMTiles directories (https://github.com/protomaps/PMTiles/blob/main/spec/v3/spec.md#directories) into packed
+   arrays and looks tile IDs up in them. The index doesn't do any I/O: leaf directories are fetched by the caller,
+   which is told which ones are needed, so the same code works for local archives and for downloads. */
+
+/* The spec doesn't limit the depth, but real archives never have more than one level of leaves */
+#define MAX_DIRECTORY_DEPTH 4
+
+/* Memory for decoded leaf directories. A leaf has at most a few thousand entries, so this fits a few hundred of them.
+   A batch of lookups that needs more than that still gets resolved, but leaves are evicted and have to be added
+   again, which costs extra fetches. */
+#define LEAF_CACHE_SIZE (16 * 1024 * 1024)
+
+/* How often resolve checks whether it has been cancelled */
+#define CANCEL_CHECK_INTERVAL 4096
+
+typedef struct {
+  gsize n_entries;
+  guint64 *tile_ids;
+  guint64 *offsets;
+  guint32 *lengths;
+  guint32 *run_lengths;
+} Directory;
+
+struct _MapsPMTilesIndex {
+  GObject parent_instance;
+
+  Directory *root_dir;
+
+  GMutex mutex;
+  MapsLruCache *leaf_dirs;  /* guint64 * offset -> Directory * */
+};
+
+G_DEFINE_TYPE (MapsPMTilesIndex, maps_pmtiles_index, G_TYPE_OBJECT)
+
+static void
+directory_free (Directory *dir)
+{
+  g_free (dir->tile_ids);
+  g_free (dir->offsets);
+  g_free (dir->lengths);
+  g_free (dir->run_lengths);
+  g_free (dir);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (Directory, directory_free)
+
+static gsize
+directory_size (Directory *dir)
+{
+  return sizeof (Directory) + dir->n_entries * (2 * sizeof (guint64) + 2 * sizeof (guint32));
+}
+
+static gboolean
+read_varint (const guint8 **pos,
+             const guint8  *end,
+             guint64       *value)
+{
+  guint64 result = 0;
+
+  for (int shift = 0; shift < 64; shift += 7)
+    {
+      guint8 byte;
+
+      if (*pos >= end)
+        return FALSE;
+
+      byte = *(*pos)++;
+      result |= (guint64)(byte & 0x7f) << shift;
+
+      if ((byte & 0x80) == 0)
+        {
+          *value = result;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+static Directory *
+read_directory (GBytes  *bytes,
+                GError **error)
+{
+  g_autoptr(Directory) dir = NULL;
+  const guint8 *pos, *end;
+  gsize size;
+  guint64 n_entries, value, last = 0;
+
+  pos = g_bytes_get_data (bytes, &size);
+  end = pos + size;
+
+  /* Each entry takes at least 4 bytes, which bounds the allocation below */
+  if (!read_varint (&pos, end, &n_entries) || n_entries > size / 4)
+    goto invalid;
+
+  dir = g_new0 (Directory, 1);
+  dir->n_entries = n_entries;
+  dir->tile_ids = g_new (guint64, n_entries);
+  dir->offsets = g_new (guint64, n_entries);
+  dir->lengths = g_new (guint32, n_entries);
+  dir->run_lengths = g_new (guint32, n_entries);
+
+  for (gsize i = 0; i < n_entries; i++)
+    {
+      if (!read_varint (&pos, end, &value))
+        goto invalid;
+      last += value;
+      dir->tile_ids[i] = last;
+    }
+
+  for (gsize i = 0; i < n_entries; i++)
+    {
+      if (!read_varint (&pos, end, &value) || value > G_MAXUINT32)
+        goto invalid;
+      dir->run_lengths[i] = value;
+    }
+
+  for (gsize i = 0; i < n_entries; i++)
+    {
+      if (!read_varint (&pos, end, &value) || value > G_MAXUINT32)
+        goto invalid;
+      dir->lengths[i] = value;
+    }
+
+  for (gsize i = 0; i < n_entries; i++)
+    {
+      if (!read_varint (&pos, end, &value))
+        goto invalid;
+
+      /* 0 means the data directly follows the previous entry's */
+      if (value == 0 && i > 0)
+        dir->offsets[i] = dir->offsets[i - 1] + dir->lengths[i - 1];
+      else if (value == 0)
+        goto invalid;
+      else
+        dir->offsets[i] = value - 1;
+    }
+
+  return g_steal_pointer (&dir);
+
+invalid:
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Invalid PMTiles directory");
+  return NULL;
+}
+
+/* Returns the index of the last entry whose tile ID is <= @tile_id, or -1 */
+static gssize
+search_directory (Directory *dir,
+                  guint64    tile_id)
+{
+  gsize low = 0, high = dir->n_entries;
+
+  while (low < high)
+    {
+      gsize mid = low + (high - low) / 2;
+
+      if (dir->tile_ids[mid] <= tile_id)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+  return (gssize)low - 1;
+}
+
+/* Must be called with the mutex held */
+static MapsPMTilesLookupResult
+lookup_locked (MapsPMTilesIndex  *self,
+               guint64            tile_id,
+               guint64           *offset,
+               guint64           *length,
+               GError           **error)
+{
+  Directory *dir = self->root_dir;
+
+  for (int depth = 0; depth < MAX_DIRECTORY_DEPTH; depth++)
+    {
+      gssize i = search_directory (dir, tile_id);
+
+      if (i < 0)
+        return MAPS_PMTILES_LOOKUP_NOT_FOUND;
+
+      if (dir->run_lengths[i] == 0)
+        {
+          /* The entry points to a leaf directory */
+          Directory *leaf = maps_lru_cache_lookup (self->leaf_dirs, &dir->offsets[i]);
+
+          if (leaf == NULL)
+            {
+              *offset = dir->offsets[i];
+              *length = dir->lengths[i];
+              return MAPS_PMTILES_LOOKUP_NEED_LEAF;
+            }
+
+          dir = leaf;
+          continue;
+        }
+
+      if (tile_id - dir->tile_ids[i] >= dir->run_lengths[i])
+        return MAPS_PMTILES_LOOKUP_NOT_FOUND;
+
+      *offset = dir->offsets[i];
+      *length = dir->lengths[i];
+      return MAPS_PMTILES_LOOKUP_FOUND;
+    }
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "PMTiles directories are nested too deeply");
+  return MAPS_PMTILES_LOOKUP_NOT_FOUND;
+}
+
+static void
+maps_pmtiles_index_finalize (GObject *object)
+{
+  MapsPMTilesIndex *self = MAPS_PMTILES_INDEX (object);
+
+  g_clear_pointer (&self->root_dir, directory_free);
+  g_clear_object (&self->leaf_dirs);
+  g_mutex_clear (&self->mutex);
+
+  G_OBJECT_CLASS (maps_pmtiles_index_parent_class)->finalize (object);
+}
+
+static void
+maps_pmtiles_index_class_init (MapsPMTilesIndexClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = maps_pmtiles_index_finalize;
+}
+
+static void
+maps_pmtiles_index_init (MapsPMTilesIndex *self)
+{
+  g_mutex_init (&self->mutex);
+  self->leaf_dirs = maps_lru_cache_new (g_int64_hash, g_int64_equal, g_free, (GDestroyNotify)directory_free, LEAF_CACHE_SIZE);
+}
+
+/**
+ * maps_pmtiles_index_new:
+ * @root_dir: the decompressed root directory
+ * @error: return location for a [class@GError]
+ *
+ * Creates an index for a PMTiles archive from its root directory.
+ *
+ * Returns: (transfer full): a new [class@PMTilesIndex], or %NULL if the
+ * directory is invalid
+ */
+MapsPMTilesIndex *
+maps_pmtiles_index_new (GBytes  *root_dir,
+                        GError **error)
+{
+  g_autoptr(MapsPMTilesIndex) self = NULL;
+
+  g_return_val_if_fail (root_dir != NULL, NULL);
+
+  self = g_object_new (MAPS_TYPE_PMTILES_INDEX, NULL);
+
+  self->root_dir = read_directory (root_dir, error);
+  if (self->root_dir == NULL)
+    return NULL;
+
+  return g_steal_pointer (&self);
+}
+
+/**
+ * maps_pmtiles_index_add_leaf:
+ * @self: a [class@PMTilesIndex]
+ * @offset: the offset of the leaf directory, relative to the start of the
+ *   archive's leaf directory section
+ * @data: the decompressed leaf directory
+ * @error: return location for a [class@GError]
+ *
+ * Adds a leaf directory that a lookup asked for. Leaf directories are kept
+ * in a least recently used cache, so one that hasn't been used in a while
+ * may have to be added again later.
+ *
+ * Returns: whether the directory was valid
+ */
+gboolean
+maps_pmtiles_index_add_leaf (MapsPMTilesIndex  *self,
+                             guint64            offset,
+                             GBytes            *data,
+                             GError           **error)
+{
+  Directory *dir;
+
+  g_return_val_if_fail (MAPS_IS_PMTILES_INDEX (self), FALSE);
+  g_return_val_if_fail (data != NULL, FALSE);
+
+  dir = read_directory (data, error);
+  if (dir == NULL)
+    return FALSE;
+
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  maps_lru_cache_insert (self->leaf_dirs, g_memdup2 (&offset, sizeof offset), dir, directory_size (dir));
+  return TRUE;
+}
+
+/**
+ * maps_pmtiles_index_has_leaf:
+ * @self: a [class@PMTilesIndex]
+ * @offset: the offset of the leaf directory
+ *
+ * Checks whether a leaf directory has been added.
+ *
+ * Returns: whether the leaf directory is in the index
+ */
+gboolean
+maps_pmtiles_index_has_leaf (MapsPMTilesIndex *self,
+                             guint64           offset)
+{
+  g_return_val_if_fail (MAPS_IS_PMTILES_INDEX (self), FALSE);
+
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  return maps_lru_cache_contains (self->leaf_dirs, &offset);
+}
+
+/**
+ * maps_pmtiles_index_lookup:
+ * @self: a [class@PMTilesIndex]
+ * @tile_id: the tile ID, see maps_tile_id_from_zxy()
+ * @offset: (out): the offset of the tile data, relative to the start of the
+ *   archive's tile data section, or of the leaf directory that is needed
+ * @length: (out): the length of the tile data or leaf directory
+ * @error: return location for a [class@GError]
+ *
+ * Looks up where a tile's data is in the archive. If the tile is in a leaf
+ * directory that hasn't been added yet, returns
+ * %MAPS_PMTILES_LOOKUP_NEED_LEAF and sets @offset and @length to the leaf
+ * directory's range within the leaf directory section.
+ *
+ * This function is thread safe.
+ *
+ * Returns: the result of the lookup. If @error is set, the result is
+ * %MAPS_PMTILES_LOOKUP_NOT_FOUND.
+ */
+MapsPMTilesLookupResult
+maps_pmtiles_index_lookup (MapsPMTilesIndex  *self,
+                           guint64            tile_id,
+                           guint64           *offset,
+                           guint64           *length,
+                           GError           **error)
+{
+  g_return_val_if_fail (MAPS_IS_PMTILES_INDEX (self), MAPS_PMTILES_LOOKUP_NOT_FOUND);
+  g_return_val_if_fail (offset != NULL, MAPS_PMTILES_LOOKUP_NOT_FOUND);
+  g_return_val_if_fail (length != NULL, MAPS_PMTILES_LOOKUP_NOT_FOUND);
+
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  return lookup_locked (self, tile_id, offset, length, error);
+}
+
+typedef struct {
+  guint64 *tile_ids;
+  gsize n_tile_ids;
+
+  guint64 *offsets;
+  guint64 *lengths;
+
+  GArray *leaf_offsets;
+  GArray *leaf_lengths;
+} ResolveData;
+
+static void
+resolve_data_free (ResolveData *data)
+{
+  g_free (data->tile_ids);
+  g_free (data->offsets);
+  g_free (data->lengths);
+  g_clear_pointer (&data->leaf_offsets, g_array_unref);
+  g_clear_pointer (&data->leaf_lengths, g_array_unref);
+  g_free (data);
+}
+
+static void
+do_resolve (GTask        *task,
+            gpointer      source_object,
+            gpointer      task_data,
+            GCancellable *cancellable)
+{
+  MapsPMTilesIndex *self = MAPS_PMTILES_INDEX (source_object);
+  ResolveData *data = task_data;
+  g_autoptr(GHashTable) needed_leaves = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+  GError *error = NULL;
+
+  data->offsets = g_new0 (guint64, data->n_tile_ids);
+  data->lengths = g_new0 (guint64, data->n_tile_ids);
+  data->leaf_offsets = g_array_new (FALSE, FALSE, sizeof (guint64));
+  data->leaf_lengths = g_array_new (FALSE, FALSE, sizeof (guint64));
+
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+
+  for (gsize i = 0; i < data->n_tile_ids; i++)
+    {
+      MapsPMTilesLookupResult result;
+      guint64 offset, length;
+
+      if (i % CANCEL_CHECK_INTERVAL == 0 && g_cancellable_set_error_if_cancelled (cancellable, &error))
+        {
+          g_task_return_error (task, error);
+          return;
+        }
+
+      result = lookup_locked (self, data->tile_ids[i], &offset, &length, &error);
+      if (error != NULL)
+        {
+          g_task_return_error (task, error);
+          return;
+        }
+
+      switch (result)
+        {
+        case MAPS_PMTILES_LOOKUP_FOUND:
+          data->offsets[i] = offset;
+          data->lengths[i] = length;
+          break;
+
+        case MAPS_PMTILES_LOOKUP_NEED_LEAF:
+          if (!g_hash_table_contains (needed_leaves, &offset))
+            {
+              g_hash_table_add (needed_leaves, g_memdup2 (&offset, sizeof offset));
+              g_array_append_val (data->leaf_offsets, offset);
+              g_array_append_val (data->leaf_lengths, length);
+            }
+          break;
+
+        case MAPS_PMTILES_LOOKUP_NOT_FOUND:
+          break;
+        }
+    }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * maps_pmtiles_index_resolve_async:
+ * @self: a [class@PMTilesIndex]
+ * @tile_ids: (array length=n_tile_ids): the tile IDs to look up
+ * @n_tile_ids: number of tile IDs
+ * @cancellable: (nullable): a [class@Gio.Cancellable]
+ * @callback: (scope async): callback to call when the lookup is done
+ * @user_data: user data for @callback
+ *
+ * Looks up a batch of tiles on a worker thread. See
+ * maps_pmtiles_index_resolve_finish() for the results.
+ */
+void
+maps_pmtiles_index_resolve_async (MapsPMTilesIndex    *self,
+                                  const guint64       *tile_ids,
+                                  gsize                n_tile_ids,
+                                  GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  ResolveData *data;
+
+  g_return_if_fail (MAPS_IS_PMTILES_INDEX (self));
+  g_return_if_fail (tile_ids != NULL || n_tile_ids == 0);
+
+  data = g_new0 (ResolveData, 1);
+  data->tile_ids = g_memdup2 (tile_ids, n_tile_ids * sizeof (guint64));
+  data->n_tile_ids = n_tile_ids;
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, maps_pmtiles_index_resolve_async);
+  g_task_set_task_data (task, data, (GDestroyNotify)resolve_data_free);
+  g_task_run_in_thread (task, do_resolve);
+}
+
+/**
+ * maps_pmtiles_index_resolve_finish:
+ * @self: a [class@PMTilesIndex]
+ * @result: a [iface@Gio.AsyncResult]
+ * @n_tiles: (out): the number of tiles, the same as was passed to
+ *   maps_pmtiles_index_resolve_async()
+ * @lengths: (out) (array length=n_tiles) (transfer full): the length of each
+ *   tile's data
+ * @leaf_offsets: (out) (array length=n_leaves) (transfer full): offsets of
+ *   the leaf directories that are needed
+ * @leaf_lengths: (out) (array length=n_leaves) (transfer full): lengths of
+ *   the leaf directories that are needed
+ * @n_leaves: (out): number of leaf directories that are needed
+ * @error: return location for a [class@GError]
+ *
+ * Finishes looking up a batch of tiles. Tiles that aren't in the archive,
+ * or that are in one of the listed leaf directories, have a length of 0.
+ * Once the leaf directories have been added with
+ * maps_pmtiles_index_add_leaf(), resolve again to get the rest of the
+ * tiles.
+ *
+ * Returns: (array length=n_tiles) (transfer full): the offset of each tile's
+ * data, relative to the start of the tile data section
+ */
+guint64 *
+maps_pmtiles_index_resolve_finish (MapsPMTilesIndex  *self,
+                                   GAsyncResult      *result,
+                                   gsize             *n_tiles,
+                                   guint64          **lengths,
+                                   guint64          **leaf_offsets,
+                                   guint64          **leaf_lengths,
+                                   gsize             *n_leaves,
+                                   GError           **error)
+{
+  ResolveData *data;
+
+  g_return_val_if_fail (MAPS_IS_PMTILES_INDEX (self), NULL);
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  if (!g_task_propagate_boolean (G_TASK (result), error))
+    return NULL;
+
+  data = g_task_get_task_data (G_TASK (result));
+
+  *n_tiles = data->n_tile_ids;
+  *lengths = g_steal_pointer (&data->lengths);
+  *n_leaves = data->leaf_offsets->len;
+  *leaf_offsets = (guint64 *)g_array_free (g_steal_pointer (&data->leaf_offsets), FALSE);
+  *leaf_lengths = (guint64 *)g_array_free (g_steal_pointer (&data->leaf_lengths), FALSE);
+
+  return g_steal_pointer (&data->offsets);
+}
+
+/**
+ * maps_pmtiles_index_get_leaf_cache_stats:
+ * @self: a [class@PMTilesIndex]
+ * @hits: (out) (optional): return location for the number of leaf directory
+ *   lookups that found the directory in the cache
+ * @misses: (out) (optional): return location for the number that didn't
+ * @evictions: (out) (optional): return location for the number of leaf
+ *   directories that were evicted from the cache
+ *
+ * Gets statistics about the cache of decoded leaf directories.
+ */
+void
+maps_pmtiles_index_get_leaf_cache_stats (MapsPMTilesIndex *self,
+                                         guint64          *hits,
+                                         guint64          *misses,
+                                         guint64          *evictions)
+{
+  g_return_if_fail (MAPS_IS_PMTILES_INDEX (self));
+
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+  maps_lru_cache_get_stats (self->leaf_dirs, hits, misses, evictions);
+}
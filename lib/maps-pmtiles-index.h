@@ -0,0 +1,77 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * MapsPMTilesLookupResult:
+ * @MAPS_PMTILES_LOOKUP_NOT_FOUND: the tile is not in the archive
+ * @MAPS_PMTILES_LOOKUP_FOUND: the tile's data range was found
+ * @MAPS_PMTILES_LOOKUP_NEED_LEAF: a leaf directory has to be added with
+ *   maps_pmtiles_index_add_leaf() before the tile can be looked up
+ *
+ * The result of maps_pmtiles_index_lookup().
+ */
+typedef enum {
+  MAPS_PMTILES_LOOKUP_NOT_FOUND,
+  MAPS_PMTILES_LOOKUP_FOUND,
+  MAPS_PMTILES_LOOKUP_NEED_LEAF,
+} MapsPMTilesLookupResult;
+
+#define MAPS_TYPE_PMTILES_INDEX (maps_pmtiles_index_get_type())
+G_DECLARE_FINAL_TYPE (MapsPMTilesIndex, maps_pmtiles_index, MAPS, PMTILES_INDEX, GObject)
+
+MapsPMTilesIndex *maps_pmtiles_index_new (GBytes  *root_dir,
+                                          GError **error);
+
+gboolean maps_pmtiles_index_add_leaf (MapsPMTilesIndex  *self,
+                                      guint64            offset,
+                                      GBytes            *data,
+                                      GError           **error);
+
+gboolean maps_pmtiles_index_has_leaf (MapsPMTilesIndex *self,
+                                      guint64           offset);
+
+MapsPMTilesLookupResult maps_pmtiles_index_lookup (MapsPMTilesIndex  *self,
+                                                   guint64            tile_id,
+                                                   guint64           *offset,
+                                                   guint64           *length,
+                                                   GError           **error);
+
+void maps_pmtiles_index_resolve_async (MapsPMTilesIndex    *self,
+                                       const guint64       *tile_ids,
+                                       gsize                n_tile_ids,
+                                       GCancellable        *cancellable,
+                                       GAsyncReadyCallback  callback,
+                                       gpointer             user_data);
+guint64 *maps_pmtiles_index_resolve_finish (MapsPMTilesIndex  *self,
+                                            GAsyncResult      *result,
+                                            gsize             *n_tiles,
+                                            guint64          **lengths,
+                                            guint64          **leaf_offsets,
+                                            guint64          **leaf_lengths,
+                                            gsize             *n_leaves,
+                                            GError           **error);
+
+void maps_pmtiles_index_get_leaf_cache_stats (MapsPMTilesIndex *self,
+                                              guint64          *hits,
+                                              guint64          *misses,
+                                              guint64          *evictions);
+
+G_END_DECLS
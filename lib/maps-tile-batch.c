@@ -0,0 +1,298 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "maps-tile-batch.h"
+
+/* A group of tiles to be written to the download store in one transaction, see
+   maps_download_store_insert_batch_async(). Writing tiles in batches lets the store use multi-row inserts and commit
+   once per batch, rather than once per tile. A batch can also mark ranges of the tileset's download plan as complete,
+   so that they are saved atomically with their tiles. */
+
+typedef struct {
+  guint64 *ids;
+  gsize n_ids;
+  GBytes *data;
+  gboolean precompressed;
+} Entry;
+
+struct _MapsTileBatch {
+  GObject parent_instance;
+
+  char *tileset;
+  guint64 mtime;
+  gboolean cache_only;
+
+  GArray *entries;          /* Entry */
+  GArray *completed_ranges; /* guint */
+  gsize n_tiles;
+  gsize size;
+};
+
+G_DEFINE_TYPE (MapsTileBatch, maps_tile_batch, G_TYPE_OBJECT)
+
+static void
+entry_clear (Entry *entry)
+{
+  g_clear_pointer (&entry->ids, g_free);
+  g_clear_pointer (&entry->data, g_bytes_unref);
+}
+
+static void
+maps_tile_batch_finalize (GObject *object)
+{
+  MapsTileBatch *self = MAPS_TILE_BATCH (object);
+
+  g_clear_pointer (&self->tileset, g_free);
+  g_clear_pointer (&self->entries, g_array_unref);
+  g_clear_pointer (&self->completed_ranges, g_array_unref);
+
+  G_OBJECT_CLASS (maps_tile_batch_parent_class)->finalize (object);
+}
+
+static void
+maps_tile_batch_class_init (MapsTileBatchClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = maps_tile_batch_finalize;
+}
+
+static void
+maps_tile_batch_init (MapsTileBatch *self)
+{
+  self->entries = g_array_new (FALSE, FALSE, sizeof (Entry));
+  g_array_set_clear_func (self->entries, (GDestroyNotify)entry_clear);
+  self->completed_ranges = g_array_new (FALSE, FALSE, sizeof (guint));
+}
+
+/**
+ * maps_tile_batch_new:
+ * @tileset: the tileset the tiles belong to
+ * @mtime: the modification time to store with the tiles
+ *
+ * Creates an empty batch.
+ *
+ * Returns: (transfer full): a new [class@TileBatch]
+ */
+MapsTileBatch *
+maps_tile_batch_new (const char *tileset,
+                     guint64     mtime)
+{
+  MapsTileBatch *self;
+
+  g_return_val_if_fail (tileset != NULL, NULL);
+
+  self = g_object_new (MAPS_TYPE_TILE_BATCH, NULL);
+  self->tileset = g_strdup (tileset);
+  self->mtime = mtime;
+
+  return self;
+}
+
+/**
+ * maps_tile_batch_add:
+ * @self: a [class@TileBatch]
+ * @ids: (array length=n_ids): IDs of the tiles that have this data
+ * @n_ids: the length of @ids
+ * @data: the tile data
+ * @precompressed: whether @data is gzip compressed
+ *
+ * Adds tile data to the batch.
+ */
+void
+maps_tile_batch_add (MapsTileBatch *self,
+                     const guint64 *ids,
+                     gsize          n_ids,
+                     GBytes        *data,
+                     gboolean       precompressed)
+{
+  Entry entry;
+
+  g_return_if_fail (MAPS_IS_TILE_BATCH (self));
+  g_return_if_fail (ids != NULL || n_ids == 0);
+  g_return_if_fail (data != NULL);
+
+  entry.ids = g_memdup2 (ids, n_ids * sizeof (guint64));
+  entry.n_ids = n_ids;
+  entry.data = g_bytes_ref (data);
+  entry.precompressed = precompressed;
+  g_array_append_val (self->entries, entry);
+
+  self->n_tiles += n_ids;
+  self->size += g_bytes_get_size (data);
+}
+
+/**
+ * maps_tile_batch_complete_plan_range:
+ * @self: a [class@TileBatch]
+ * @range: the index of the range in the tileset's download plan
+ *
+ * Marks a range of the tileset's download plan as complete when the batch is
+ * written. See maps_download_store_complete_plan_range_async().
+ */
+void
+maps_tile_batch_complete_plan_range (MapsTileBatch *self,
+                                     guint          range)
+{
+  g_return_if_fail (MAPS_IS_TILE_BATCH (self));
+
+  g_array_append_val (self->completed_ranges, range);
+}
+
+/**
+ * maps_tile_batch_get_tileset:
+ * @self: a [class@TileBatch]
+ *
+ * Returns: the tileset
+ */
+const char *
+maps_tile_batch_get_tileset (MapsTileBatch *self)
+{
+  g_return_val_if_fail (MAPS_IS_TILE_BATCH (self), NULL);
+  return self->tileset;
+}
+
+/**
+ * maps_tile_batch_get_mtime:
+ * @self: a [class@TileBatch]
+ *
+ * Returns: the modification time for the tiles
+ */
+guint64
+maps_tile_batch_get_mtime (MapsTileBatch *self)
+{
+  g_return_val_if_fail (MAPS_IS_TILE_BATCH (self), 0);
+  return self->mtime;
+}
+
+/**
+ * maps_tile_batch_set_cache_only:
+ * @self: a [class@TileBatch]
+ * @cache_only: whether the tiles are only a cache
+ *
+ * Marks the tiles as a cache rather than part of a download area. Cache-only
+ * tiles are evicted when the download store is over its quota, see
+ * maps_download_store_set_quota().
+ */
+void
+maps_tile_batch_set_cache_only (MapsTileBatch *self,
+                                gboolean       cache_only)
+{
+  g_return_if_fail (MAPS_IS_TILE_BATCH (self));
+  self->cache_only = !!cache_only;
+}
+
+/**
+ * maps_tile_batch_get_cache_only:
+ * @self: a [class@TileBatch]
+ *
+ * Returns: whether the tiles are only a cache
+ */
+gboolean
+maps_tile_batch_get_cache_only (MapsTileBatch *self)
+{
+  g_return_val_if_fail (MAPS_IS_TILE_BATCH (self), FALSE);
+  return self->cache_only;
+}
+
+/**
+ * maps_tile_batch_get_n_entries:
+ * @self: a [class@TileBatch]
+ *
+ * Returns: the number of times maps_tile_batch_add() was called
+ */
+guint
+maps_tile_batch_get_n_entries (MapsTileBatch *self)
+{
+  g_return_val_if_fail (MAPS_IS_TILE_BATCH (self), 0);
+  return self->entries->len;
+}
+
+/**
+ * maps_tile_batch_get_n_tiles:
+ * @self: a [class@TileBatch]
+ *
+ * Returns: the number of tiles in the batch
+ */
+gsize
+maps_tile_batch_get_n_tiles (MapsTileBatch *self)
+{
+  g_return_val_if_fail (MAPS_IS_TILE_BATCH (self), 0);
+  return self->n_tiles;
+}
+
+/**
+ * maps_tile_batch_get_size:
+ * @self: a [class@TileBatch]
+ *
+ * Returns: the total size of the tile data in the batch
+ */
+gsize
+maps_tile_batch_get_size (MapsTileBatch *self)
+{
+  g_return_val_if_fail (MAPS_IS_TILE_BATCH (self), 0);
+  return self->size;
+}
+
+/**
+ * maps_tile_batch_get_entry: (skip)
+ * @self: a [class@TileBatch]
+ * @index: the index of the entry
+ * @ids: (out): return location for the tile IDs
+ * @n_ids: (out): return location for the number of tile IDs
+ * @precompressed: (out): return location for whether the data is compressed
+ *
+ * Gets an entry that was added with maps_tile_batch_add().
+ *
+ * Returns: (transfer none): the tile data
+ */
+GBytes *
+maps_tile_batch_get_entry (MapsTileBatch  *self,
+                           guint           index,
+                           const guint64 **ids,
+                           gsize          *n_ids,
+                           gboolean       *precompressed)
+{
+  Entry *entry;
+
+  g_return_val_if_fail (MAPS_IS_TILE_BATCH (self), NULL);
+  g_return_val_if_fail (index < self->entries->len, NULL);
+
+  entry = &g_array_index (self->entries, Entry, index);
+  *ids = entry->ids;
+  *n_ids = entry->n_ids;
+  *precompressed = entry->precompressed;
+  return entry->data;
+}
+
+/**
+ * maps_tile_batch_get_completed_ranges: (skip)
+ * @self: a [class@TileBatch]
+ * @n_ranges: (out): return location for the number of ranges
+ *
+ * Gets the plan ranges that were passed to
+ * maps_tile_batch_complete_plan_range().
+ *
+ * Returns: (transfer none): the range indices
+ */
+const guint *
+maps_tile_batch_get_completed_ranges (MapsTileBatch *self,
+                                      gsize         *n_ranges)
+{
+  g_return_val_if_fail (MAPS_IS_TILE_BATCH (self), NULL);
+
+  *n_ranges = self->completed_ranges->len;
+  return (const guint *)self->completed_ranges->data;
+}
@@ -0,0 +1,55 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define MAPS_TYPE_TILE_BATCH (maps_tile_batch_get_type())
+G_DECLARE_FINAL_TYPE (MapsTileBatch, maps_tile_batch, MAPS, TILE_BATCH, GObject)
+
+MapsTileBatch *maps_tile_batch_new (const char *tileset,
+                                    guint64     mtime);
+
+void maps_tile_batch_add (MapsTileBatch *self,
+                          const guint64 *ids,
+                          gsize          n_ids,
+                          GBytes        *data,
+                          gboolean       precompressed);
+
+void maps_tile_batch_complete_plan_range (MapsTileBatch *self,
+                                          guint          range);
+
+const char *maps_tile_batch_get_tileset (MapsTileBatch *self);
+guint64 maps_tile_batch_get_mtime (MapsTileBatch *self);
+void maps_tile_batch_set_cache_only (MapsTileBatch *self,
+                                     gboolean       cache_only);
+gboolean maps_tile_batch_get_cache_only (MapsTileBatch *self);
+guint maps_tile_batch_get_n_entries (MapsTileBatch *self);
+gsize maps_tile_batch_get_n_tiles (MapsTileBatch *self);
+gsize maps_tile_batch_get_size (MapsTileBatch *self);
+
+GBytes *maps_tile_batch_get_entry (MapsTileBatch  *self,
+                                   guint           index,
+                                   const guint64 **ids,
+                                   gsize          *n_ids,
+                                   gboolean       *precompressed);
+
+const guint *maps_tile_batch_get_completed_ranges (MapsTileBatch *self,
+                                                   gsize         *n_ranges);
+
+G_END_DECLS
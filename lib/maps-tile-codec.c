@@ -0,0 +1,504 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <zstd.h>
+#include <zdict.h>
+
+#include "maps-tile-codec.h"
+
+/* Vector tiles from the same tileset share most of their layer names, keys and values, so zstd with a dictionary
+   trained on the tileset's own tiles compresses them much better than gzip, and decompresses a lot faster. Until
+   enough tiles have been seen to train a dictionary, tiles are stored as gzip. */
+
+/* The dictionary is trained once this many tiles, or this many bytes of tile data, have been collected */
+#define DICT_N_SAMPLES 2000
+#define DICT_SAMPLES_SIZE (16 * 1024 * 1024)
+
+#define DICT_CAPACITY (112 * 1024)
+#define ZSTD_LEVEL 12
+
+typedef struct {
+  GBytes *dictionary;
+  ZSTD_CDict *cdict;
+
+  /* Tiles collected for training the dictionary */
+  GByteArray *samples;
+  GArray *sample_sizes;
+  gboolean training;
+} TilesetCodec;
+
+struct _MapsTileCodec {
+  GObject parent_instance;
+
+  /* Protects the tables below. A tileset's dictionary never changes once it is set, and dictionaries are only freed
+     along with the codec, so they can still be used after the lock is released. */
+  GMutex mutex;
+
+  GHashTable *tilesets;  /* char * -> TilesetCodec * */
+  GHashTable *ddicts;    /* dictionary ID -> ZSTD_DDict * */
+};
+
+G_DEFINE_TYPE (MapsTileCodec, maps_tile_codec, G_TYPE_OBJECT)
+
+static void
+free_cctx (gpointer cctx)
+{
+  ZSTD_freeCCtx (cctx);
+}
+
+static void
+free_dctx (gpointer dctx)
+{
+  ZSTD_freeDCtx (dctx);
+}
+
+static void
+free_ddict (gpointer ddict)
+{
+  ZSTD_freeDDict (ddict);
+}
+
+/* zstd contexts can be reused, but not by more than one thread at a time, so each thread gets its own */
+static GPrivate cctx_key = G_PRIVATE_INIT (free_cctx);
+static GPrivate dctx_key = G_PRIVATE_INIT (free_dctx);
+
+static ZSTD_CCtx *
+get_cctx (void)
+{
+  ZSTD_CCtx *cctx = g_private_get (&cctx_key);
+
+  if (cctx == NULL)
+    {
+      cctx = ZSTD_createCCtx ();
+      g_private_set (&cctx_key, cctx);
+    }
+
+  return cctx;
+}
+
+static ZSTD_DCtx *
+get_dctx (void)
+{
+  ZSTD_DCtx *dctx = g_private_get (&dctx_key);
+
+  if (dctx == NULL)
+    {
+      dctx = ZSTD_createDCtx ();
+      g_private_set (&dctx_key, dctx);
+    }
+
+  return dctx;
+}
+
+static void
+tileset_codec_free (TilesetCodec *codec)
+{
+  g_clear_pointer (&codec->dictionary, g_bytes_unref);
+  g_clear_pointer (&codec->cdict, ZSTD_freeCDict);
+  g_clear_pointer (&codec->samples, g_byte_array_unref);
+  g_clear_pointer (&codec->sample_sizes, g_array_unref);
+  g_free (codec);
+}
+
+static void
+maps_tile_codec_finalize (GObject *object)
+{
+  MapsTileCodec *self = MAPS_TILE_CODEC (object);
+
+  g_clear_pointer (&self->tilesets, g_hash_table_unref);
+  g_clear_pointer (&self->ddicts, g_hash_table_unref);
+  g_mutex_clear (&self->mutex);
+
+  G_OBJECT_CLASS (maps_tile_codec_parent_class)->finalize (object);
+}
+
+static void
+maps_tile_codec_class_init (MapsTileCodecClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = maps_tile_codec_finalize;
+}
+
+static void
+maps_tile_codec_init (MapsTileCodec *self)
+{
+  g_mutex_init (&self->mutex);
+  self->tilesets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)tileset_codec_free);
+  self->ddicts = g_hash_table_new_full (NULL, NULL, NULL, free_ddict);
+}
+
+MapsTileCodec *
+maps_tile_codec_new (void)
+{
+  return g_object_new (MAPS_TYPE_TILE_CODEC, NULL);
+}
+
+/* Must be called with the mutex held */
+static TilesetCodec *
+get_tileset_codec (MapsTileCodec *self,
+                   const char    *tileset)
+{
+  TilesetCodec *codec = g_hash_table_lookup (self->tilesets, tileset);
+
+  if (codec == NULL)
+    {
+      codec = g_new0 (TilesetCodec, 1);
+      codec->samples = g_byte_array_new ();
+      codec->sample_sizes = g_array_new (FALSE, FALSE, sizeof (size_t));
+      g_hash_table_insert (self->tilesets, g_strdup (tileset), codec);
+    }
+
+  return codec;
+}
+
+/* Must be called with the mutex held */
+static void
+set_dictionary (MapsTileCodec *self,
+                TilesetCodec  *codec,
+                GBytes        *dictionary)
+{
+  gsize size;
+  const guint8 *data = g_bytes_get_data (dictionary, &size);
+  guint dict_id = ZDICT_getDictID (data, size);
+
+  if (codec->dictionary != NULL)
+    return;
+
+  if (dict_id == 0)
+    {
+      g_warning ("Ignoring invalid zstd dictionary");
+      return;
+    }
+
+  codec->dictionary = g_bytes_ref (dictionary);
+  codec->cdict = ZSTD_createCDict (data, size, ZSTD_LEVEL);
+
+  if (!g_hash_table_contains (self->ddicts, GUINT_TO_POINTER (dict_id)))
+    g_hash_table_insert (self->ddicts, GUINT_TO_POINTER (dict_id), ZSTD_createDDict (data, size));
+
+  /* Samples are no longer needed */
+  g_byte_array_set_size (codec->samples, 0);
+  g_array_set_size (codec->sample_sizes, 0);
+}
+
+/**
+ * maps_tile_codec_add_dictionary:
+ * @self: a [class@TileCodec]
+ * @tileset: the tileset the dictionary belongs to
+ * @dictionary: the zstd dictionary
+ *
+ * Sets a previously trained dictionary for @tileset, e.g. one that was saved
+ * in the database. Does nothing if the tileset already has a dictionary.
+ */
+void
+maps_tile_codec_add_dictionary (MapsTileCodec *self,
+                                const char    *tileset,
+                                GBytes        *dictionary)
+{
+  g_return_if_fail (MAPS_IS_TILE_CODEC (self));
+  g_return_if_fail (tileset != NULL);
+  g_return_if_fail (dictionary != NULL);
+
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+
+  set_dictionary (self, get_tileset_codec (self, tileset), dictionary);
+}
+
+/**
+ * maps_tile_codec_get_dictionary:
+ * @self: a [class@TileCodec]
+ * @tileset: a tileset
+ *
+ * Gets the dictionary for @tileset, so it can be saved.
+ *
+ * Returns: (transfer full) (nullable): the dictionary, or %NULL if none has
+ * been trained yet
+ */
+GBytes *
+maps_tile_codec_get_dictionary (MapsTileCodec *self,
+                                const char    *tileset)
+{
+  TilesetCodec *codec;
+
+  g_return_val_if_fail (MAPS_IS_TILE_CODEC (self), NULL);
+  g_return_val_if_fail (tileset != NULL, NULL);
+
+  G_MUTEX_AUTO_LOCK (&self->mutex, locker);
+
+  codec = g_hash_table_lookup (self->tilesets, tileset);
+  if (codec == NULL || codec->dictionary == NULL)
+    return NULL;
+
+  return g_bytes_ref (codec->dictionary);
+}
+
+static GBytes *
+gzip_compress (GBytes  *bytes,
+               GError **error)
+{
+  g_autoptr(GZlibCompressor) compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, 9);
+  g_autoptr(GInputStream) input = g_memory_input_stream_new_from_bytes (bytes);
+  g_autoptr(GInputStream) converter = g_converter_input_stream_new (input, G_CONVERTER (compressor));
+  g_autoptr(GOutputStream) output = g_memory_output_stream_new_resizable ();
+  gssize result;
+
+  result = g_output_stream_splice (output, converter, G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE | G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET, NULL, error);
+  if (result < 0)
+    return NULL;
+
+  return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (output));
+}
+
+static GBytes *
+gzip_decompress (GBytes  *bytes,
+                 GError **error)
+{
+  g_autoptr(GZlibDecompressor) compressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+  g_autoptr(GInputStream) input = g_memory_input_stream_new_from_bytes (bytes);
+  g_autoptr(GInputStream) converter = g_converter_input_stream_new (input, G_CONVERTER (compressor));
+  g_autoptr(GOutputStream) output = g_memory_output_stream_new_resizable ();
+  gssize result;
+
+  result = g_output_stream_splice (output, converter, G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE | G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET, NULL, error);
+  if (result < 0)
+    return NULL;
+
+  return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (output));
+}
+
+static GBytes *
+zstd_compress (GBytes            *bytes,
+               const ZSTD_CDict  *cdict,
+               GError           **error)
+{
+  gsize size;
+  const guint8 *data = g_bytes_get_data (bytes, &size);
+  gsize capacity = ZSTD_compressBound (size);
+  g_autofree guint8 *out = g_malloc (capacity);
+  size_t result;
+
+  result = ZSTD_compress_usingCDict (get_cctx (), out, capacity, data, size, cdict);
+  if (ZSTD_isError (result))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to compress tile: %s", ZSTD_getErrorName (result));
+      return NULL;
+    }
+
+  return g_bytes_new_take (g_realloc (g_steal_pointer (&out), result), result);
+}
+
+static GBytes *
+zstd_decompress (MapsTileCodec  *self,
+                 gconstpointer   data,
+                 gsize           size,
+                 GError        **error)
+{
+  guint dict_id = ZSTD_getDictID_fromFrame (data, size);
+  unsigned long long content_size = ZSTD_getFrameContentSize (data, size);
+  ZSTD_DDict *ddict;
+  g_autofree guint8 *out = NULL;
+  size_t result;
+
+  if (content_size == ZSTD_CONTENTSIZE_ERROR || content_size == ZSTD_CONTENTSIZE_UNKNOWN)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Invalid zstd frame");
+      return NULL;
+    }
+
+  g_mutex_lock (&self->mutex);
+  ddict = g_hash_table_lookup (self->ddicts, GUINT_TO_POINTER (dict_id));
+  g_mutex_unlock (&self->mutex);
+
+  if (ddict == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Missing zstd dictionary %u", dict_id);
+      return NULL;
+    }
+
+  out = g_malloc (content_size);
+  result = ZSTD_decompress_usingDDict (get_dctx (), out, content_size, data, size, ddict);
+  if (ZSTD_isError (result))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Failed to decompress tile: %s", ZSTD_getErrorName (result));
+      return NULL;
+    }
+
+  return g_bytes_new_take (g_steal_pointer (&out), result);
+}
+
+static GBytes *
+train_dictionary (GByteArray *samples,
+                  GArray     *sample_sizes)
+{
+  g_autofree guint8 *dictionary = g_malloc (DICT_CAPACITY);
+  size_t size;
+
+  size = ZDICT_trainFromBuffer (dictionary, DICT_CAPACITY,
+                                samples->data, (const size_t *)sample_sizes->data, sample_sizes->len);
+  if (ZDICT_isError (size))
+    {
+      g_debug ("Failed to train zstd dictionary: %s", ZDICT_getErrorName (size));
+      return NULL;
+    }
+
+  return g_bytes_new_take (g_realloc (g_steal_pointer (&dictionary), size), size);
+}
+
+static void
+add_sample (MapsTileCodec *self,
+            TilesetCodec  *codec,
+            GBytes        *raw)
+{
+  g_autoptr(GByteArray) samples = NULL;
+  g_autoptr(GArray) sample_sizes = NULL;
+  g_autoptr(GBytes) dictionary = NULL;
+  gsize size;
+  const guint8 *data = g_bytes_get_data (raw, &size);
+
+  if (size == 0)
+    return;
+
+  g_mutex_lock (&self->mutex);
+
+  if (codec->dictionary == NULL && !codec->training)
+    {
+      g_byte_array_append (codec->samples, data, size);
+      g_array_append_val (codec->sample_sizes, size);
+
+      if (codec->sample_sizes->len >= DICT_N_SAMPLES || codec->samples->len >= DICT_SAMPLES_SIZE)
+        {
+          samples = g_steal_pointer (&codec->samples);
+          sample_sizes = g_steal_pointer (&codec->sample_sizes);
+          codec->samples = g_byte_array_new ();
+          codec->sample_sizes = g_array_new (FALSE, FALSE, sizeof (size_t));
+          codec->training = TRUE;
+        }
+    }
+
+  g_mutex_unlock (&self->mutex);
+
+  if (samples == NULL)
+    return;
+
+  /* Training takes a while, so don't hold the lock. Other tiles are stored as gzip in the meantime. If training
+     fails, the samples have already been reset, so it will be tried again with the next batch. */
+  dictionary = train_dictionary (samples, sample_sizes);
+
+  g_mutex_lock (&self->mutex);
+  codec->training = FALSE;
+  if (dictionary != NULL)
+    set_dictionary (self, codec, dictionary);
+  g_mutex_unlock (&self->mutex);
+}
+
+/**
+ * maps_tile_codec_encode:
+ * @self: a [class@TileCodec]
+ * @tileset: the tileset the tile belongs to
+ * @data: the tile data
+ * @precompressed: whether @data is already gzip compressed
+ * @format: (out): return location for the format of the result
+ * @error: return location for a [class@GError]
+ *
+ * Compresses a tile for storage. This may be called from any thread.
+ *
+ * Returns: (transfer full): the compressed tile
+ */
+GBytes *
+maps_tile_codec_encode (MapsTileCodec        *self,
+                        const char           *tileset,
+                        GBytes               *data,
+                        gboolean              precompressed,
+                        MapsTileCodecFormat  *format,
+                        GError              **error)
+{
+  TilesetCodec *codec;
+  ZSTD_CDict *cdict;
+  gboolean sample;
+  g_autoptr(GBytes) raw = NULL;
+
+  g_return_val_if_fail (MAPS_IS_TILE_CODEC (self), NULL);
+  g_return_val_if_fail (tileset != NULL, NULL);
+  g_return_val_if_fail (data != NULL, NULL);
+  g_return_val_if_fail (format != NULL, NULL);
+
+  g_mutex_lock (&self->mutex);
+  codec = get_tileset_codec (self, tileset);
+  cdict = codec->cdict;
+  sample = cdict == NULL && !codec->training;
+  g_mutex_unlock (&self->mutex);
+
+  *format = MAPS_TILE_CODEC_FORMAT_GZIP;
+
+  if (cdict == NULL && !sample)
+    return precompressed ? g_bytes_ref (data) : gzip_compress (data, error);
+
+  if (precompressed)
+    {
+      raw = gzip_decompress (data, error);
+      if (raw == NULL)
+        return NULL;
+    }
+  else
+    raw = g_bytes_ref (data);
+
+  if (cdict == NULL)
+    {
+      add_sample (self, codec, raw);
+      return precompressed ? g_bytes_ref (data) : gzip_compress (raw, error);
+    }
+
+  *format = MAPS_TILE_CODEC_FORMAT_ZSTD;
+  return zstd_compress (raw, cdict, error);
+}
+
+/**
+ * maps_tile_codec_decode:
+ * @self: a [class@TileCodec]
+ * @data: (array length=size) (element-type guint8): the compressed tile
+ * @size: the length of @data
+ * @format: the format of @data
+ * @error: return location for a [class@GError]
+ *
+ * Decompresses a tile. This may be called from any thread.
+ *
+ * Returns: (transfer full): the tile data
+ */
+GBytes *
+maps_tile_codec_decode (MapsTileCodec        *self,
+                        gconstpointer         data,
+                        gsize                 size,
+                        MapsTileCodecFormat   format,
+                        GError              **error)
+{
+  g_return_val_if_fail (MAPS_IS_TILE_CODEC (self), NULL);
+
+  switch (format)
+    {
+    case MAPS_TILE_CODEC_FORMAT_GZIP:
+      {
+        g_autoptr(GBytes) bytes = g_bytes_new (data, size);
+        return gzip_decompress (bytes, error);
+      }
+
+    case MAPS_TILE_CODEC_FORMAT_ZSTD:
+      return zstd_decompress (self, data, size, error);
+
+    default:
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Unknown tile format %d", format);
+      return NULL;
+    }
+}
@@ -0,0 +1,60 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * MapsTileCodecFormat:
+ * @MAPS_TILE_CODEC_FORMAT_GZIP: gzip
+ * @MAPS_TILE_CODEC_FORMAT_ZSTD: zstd, using the tileset's dictionary
+ *
+ * How a tile is compressed in the download store. The value is stored in
+ * the database, so existing values must not change.
+ */
+typedef enum {
+  MAPS_TILE_CODEC_FORMAT_GZIP = 0,
+  MAPS_TILE_CODEC_FORMAT_ZSTD = 1,
+} MapsTileCodecFormat;
+
+#define MAPS_TYPE_TILE_CODEC (maps_tile_codec_get_type())
+G_DECLARE_FINAL_TYPE (MapsTileCodec, maps_tile_codec, MAPS, TILE_CODEC, GObject)
+
+MapsTileCodec *maps_tile_codec_new (void);
+
+void maps_tile_codec_add_dictionary (MapsTileCodec *self,
+                                     const char    *tileset,
+                                     GBytes        *dictionary);
+
+GBytes *maps_tile_codec_get_dictionary (MapsTileCodec *self,
+                                        const char    *tileset);
+
+GBytes *maps_tile_codec_encode (MapsTileCodec        *self,
+                                const char           *tileset,
+                                GBytes               *data,
+                                gboolean              precompressed,
+                                MapsTileCodecFormat  *format,
+                                GError              **error);
+
+GBytes *maps_tile_codec_decode (MapsTileCodec        *self,
+                                gconstpointer         data,
+                                gsize                 size,
+                                MapsTileCodecFormat   format,
+                                GError              **error);
+
+G_END_DECLS
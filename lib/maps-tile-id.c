@@ -0,0 +1,128 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "maps-tile-id.h"
+
+/* Tile IDs as defined by the PMTiles spec: tiles are numbered zoom level by zoom level, and within a zoom level
+   along a Hilbert curve, so tiles that are close together on the map mostly have IDs that are close together. */
+
+static void
+rotate (guint64  n,
+        guint64 *x,
+        guint64 *y,
+        guint64  rx,
+        guint64  ry)
+{
+  if (ry == 0)
+    {
+      guint64 t;
+
+      if (rx == 1)
+        {
+          *x = n - 1 - *x;
+          *y = n - 1 - *y;
+        }
+
+      t = *x;
+      *x = *y;
+      *y = t;
+    }
+}
+
+/* Number of tiles in all zoom levels below @z, i.e. the ID of the first tile at zoom level @z */
+static guint64
+first_tile_id (guint z)
+{
+  return (((guint64)1 << (2 * z)) - 1) / 3;
+}
+
+/**
+ * maps_tile_id_from_zxy:
+ * @z: the zoom level
+ * @x: the tile's X coordinate
+ * @y: the tile's Y coordinate
+ *
+ * Gets the PMTiles tile ID of a tile.
+ *
+ * Returns: the tile ID
+ */
+guint64
+maps_tile_id_from_zxy (guint z,
+                       guint x,
+                       guint y)
+{
+  guint64 tx = x, ty = y, d = 0;
+
+  g_return_val_if_fail (z <= MAPS_TILE_ID_MAX_ZOOM, 0);
+  g_return_val_if_fail (tx < ((guint64)1 << z) && ty < ((guint64)1 << z), 0);
+
+  for (guint64 s = ((guint64)1 << z) / 2; s > 0; s /= 2)
+    {
+      guint64 rx = (tx & s) ? 1 : 0;
+      guint64 ry = (ty & s) ? 1 : 0;
+
+      d += s * s * ((3 * rx) ^ ry);
+      rotate (s, &tx, &ty, rx, ry);
+    }
+
+  return first_tile_id (z) + d;
+}
+
+/**
+ * maps_tile_id_to_zxy:
+ * @tile_id: a tile ID
+ * @z: (out): return location for the zoom level
+ * @x: (out): return location for the tile's X coordinate
+ * @y: (out): return location for the tile's Y coordinate
+ *
+ * Gets the position of a tile from its PMTiles tile ID.
+ *
+ * Returns: %TRUE if @tile_id is valid, %FALSE otherwise
+ */
+gboolean
+maps_tile_id_to_zxy (guint64  tile_id,
+                     guint   *z,
+                     guint   *x,
+                     guint   *y)
+{
+  guint zoom;
+  guint64 t, tx = 0, ty = 0;
+
+  for (zoom = 0; zoom < MAPS_TILE_ID_MAX_ZOOM; zoom++)
+    {
+      if (tile_id < first_tile_id (zoom + 1))
+        break;
+    }
+
+  t = tile_id - first_tile_id (zoom);
+  if (t >= (guint64)1 << (2 * zoom))
+    return FALSE;
+
+  for (guint64 s = 1; s < ((guint64)1 << zoom); s *= 2)
+    {
+      guint64 rx = 1 & (t / 2);
+      guint64 ry = 1 & (t ^ rx);
+
+      rotate (s, &tx, &ty, rx, ry);
+      tx += s * rx;
+      ty += s * ry;
+      t /= 4;
+    }
+
+  *z = zoom;
+  *x = tx;
+  *y = ty;
+  return TRUE;
+}
@@ -0,0 +1,34 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Highest zoom level whose tile IDs fit in 64 bits */
+#define MAPS_TILE_ID_MAX_ZOOM 31
+
+guint64 maps_tile_id_from_zxy (guint z,
+                               guint x,
+                               guint y);
+
+gboolean maps_tile_id_to_zxy (guint64  tile_id,
+                              guint   *z,
+                              guint   *x,
+                              guint   *y);
+
+G_END_DECLS
@@ -0,0 +1,517 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+
+#include "maps-tile-id.h"
+#include "maps-tile-prefetcher.h"
+#include "maps-tile-range.h"
+
+/* Guesses which tiles the map is about to show, and prefetches them with maps_offline_data_source_prefetch(), so
+   that a fast pan doesn't show blank tiles first.
+
+   While the map moves, the viewport's velocity and zoom speed are sampled once per frame, and the tiles in the viewport a short
+   time ahead that aren't on the screen yet are prefetched. The tiles along the route on the map, if there is one,
+   are prefetched as well, closest first.
+
+   Positions are in "world" coordinates, where the whole Web Mercator map is the unit square. */
+
+/* How often to prefetch while the map is moving */
+#define PREFETCH_INTERVAL 100 /* milliseconds */
+/* How far ahead to predict the viewport */
+#define LOOKAHEAD 0.5 /* seconds */
+/* Samples further apart than this mean the map stopped in between */
+#define MAX_SAMPLE_GAP 0.25 /* seconds */
+/* Weight of the previous velocity when smoothing it */
+#define SMOOTHING 0.6
+/* Slower than this is not considered moving */
+#define MIN_SPEED 0.2 /* viewports per second */
+#define MIN_ZOOM_SPEED 0.25 /* zoom levels per second */
+/* Route tiles are prefetched up to this many viewport sizes from the center of the map */
+#define ROUTE_RADIUS 3
+/* Upper limit on the number of points sampled along the route */
+#define MAX_ROUTE_SAMPLES 10000
+
+struct _MapsTilePrefetcher {
+  GObject parent_instance;
+
+  ShumateMap *map;
+  MapsOfflineDataSource *data_source;
+
+  /* The last position of the viewport, and its velocity in world units and zoom levels per second */
+  gint64 time;
+  double x, y, zoom;
+  double vx, vy, vzoom;
+
+  /* The route as alternating world x and y coordinates */
+  GArray *route;
+  /* The tile zoom level the route was last prefetched at, or -1 if it needs to be prefetched again */
+  int route_zoom;
+
+  guint tick_id;
+  guint timeout_id;
+};
+
+G_DEFINE_TYPE (MapsTilePrefetcher, maps_tile_prefetcher, G_TYPE_OBJECT)
+
+static double
+x_for_lng (double lng)
+{
+  return (lng + 180) / 360;
+}
+
+static double
+y_for_lat (double lat)
+{
+  double sin_lat = sin (CLAMP (lat, -85.0511, 85.0511) * G_PI / 180);
+  return 0.5 - log ((1 + sin_lat) / (1 - sin_lat)) / (4 * G_PI);
+}
+
+typedef struct {
+  guint64 id;
+  double distance;
+} Candidate;
+
+static int
+compare_candidates (gconstpointer a,
+                    gconstpointer b)
+{
+  const Candidate *ca = a, *cb = b;
+  return (ca->distance > cb->distance) - (ca->distance < cb->distance);
+}
+
+typedef struct {
+  guint z;
+  int x_min, y_min, x_max, y_max;
+} TileRect;
+
+/* The tiles at @z covering a viewport centered on @x, @y that is @width by @height in world units */
+static TileRect
+tile_rect (guint  z,
+           double x,
+           double y,
+           double width,
+           double height)
+{
+  double n = 1u << z;
+  TileRect rect = {
+    z,
+    CLAMP (floor ((x - width / 2) * n), 0, n - 1),
+    CLAMP (floor ((y - height / 2) * n), 0, n - 1),
+    CLAMP (floor ((x + width / 2) * n), 0, n - 1),
+    CLAMP (floor ((y + height / 2) * n), 0, n - 1),
+  };
+
+  return rect;
+}
+
+static gboolean
+tile_rect_contains (const TileRect *rect,
+                    guint           z,
+                    int             x,
+                    int             y)
+{
+  return z == rect->z && x >= rect->x_min && x <= rect->x_max && y >= rect->y_min && y <= rect->y_max;
+}
+
+/* Adds a tile unless it's on the screen already or was added before */
+static void
+add_candidate (GArray         *candidates,
+               GHashTable     *seen,
+               const TileRect *visible,
+               guint           z,
+               int             x,
+               int             y,
+               double          center_x,
+               double          center_y)
+{
+  double n = 1u << z;
+  Candidate candidate;
+
+  if (tile_rect_contains (visible, z, x, y))
+    return;
+
+  candidate.id = maps_tile_id_from_zxy (z, x, y);
+  if (!g_hash_table_add (seen, g_memdup2 (&candidate.id, sizeof candidate.id)))
+    return;
+
+  candidate.distance = hypot ((x + 0.5) / n - center_x, (y + 0.5) / n - center_y);
+  g_array_append_val (candidates, candidate);
+}
+
+/**
+ * maps_tile_prefetcher_predict_tiles: (skip)
+ * @motion: the viewport and how it is moving
+ * @min_tile_zoom: the lowest zoom level the data source has
+ * @max_tile_zoom: the highest zoom level the data source has
+ * @x: (out) (optional): the predicted center of the viewport
+ * @y: (out) (optional): the predicted center of the viewport
+ *
+ * Predicts where the viewport will be a short time from now, assuming it
+ * keeps moving as it does.
+ *
+ * Returns: (transfer full) (nullable): the tiles covering the predicted
+ *   viewport, or %NULL if it's too slow to be worth predicting
+ */
+MapsTileRange *
+maps_tile_prefetcher_predict_tiles (const MapsViewportMotion *motion,
+                                    guint                     min_tile_zoom,
+                                    guint                     max_tile_zoom,
+                                    double                   *x,
+                                    double                   *y)
+{
+  MapsTileRange *tiles;
+  double speed = hypot (motion->vx / motion->width, motion->vy / motion->height);
+  double zoom, factor, next_x, next_y;
+  guint next_z;
+  TileRect next;
+
+  if (speed < MIN_SPEED && fabs (motion->vzoom) < MIN_ZOOM_SPEED)
+    return NULL;
+
+  zoom = CLAMP (motion->zoom + motion->vzoom * LOOKAHEAD, motion->min_zoom, motion->max_zoom);
+  factor = exp2 (motion->zoom - zoom);
+  next_x = motion->x + motion->vx * LOOKAHEAD;
+  next_y = CLAMP (motion->y + motion->vy * LOOKAHEAD, 0, 1);
+  next_z = CLAMP (floor (zoom), min_tile_zoom, max_tile_zoom);
+  next = tile_rect (next_z, next_x, next_y, motion->width * factor, motion->height * factor);
+
+  tiles = maps_tile_range_new ();
+  maps_tile_range_add_rect (tiles, next.z, next.x_min, next.y_min, next.x_max, next.y_max);
+
+  if (x != NULL)
+    *x = next_x;
+  if (y != NULL)
+    *y = next_y;
+
+  return tiles;
+}
+
+static void
+add_route_candidates (MapsTilePrefetcher *self,
+                      GArray             *candidates,
+                      GHashTable         *seen,
+                      const TileRect     *visible,
+                      guint               z,
+                      double              radius)
+{
+  const double *points = (const double *)self->route->data;
+  guint n_points = self->route->len / 2;
+  double n = 1u << z;
+  guint n_samples = 0;
+
+  for (guint i = 0; i + 1 < n_points && n_samples < MAX_ROUTE_SAMPLES; i++)
+    {
+      double x0 = points[2 * i], y0 = points[2 * i + 1];
+      double x1 = points[2 * i + 2], y1 = points[2 * i + 3];
+      guint steps;
+
+      /* Skip segments that are nowhere near the map */
+      if (MAX (x0, x1) < self->x - radius || MIN (x0, x1) > self->x + radius
+          || MAX (y0, y1) < self->y - radius || MIN (y0, y1) > self->y + radius)
+        continue;
+
+      /* Sample every half tile, so no tile the route crosses is missed */
+      steps = MAX (1, ceil (hypot (x1 - x0, y1 - y0) * n * 2));
+
+      for (guint j = 0; j <= steps && n_samples < MAX_ROUTE_SAMPLES; j++, n_samples++)
+        {
+          double x = x0 + (x1 - x0) * j / steps;
+          double y = y0 + (y1 - y0) * j / steps;
+
+          if (fabs (x - self->x) > radius || fabs (y - self->y) > radius)
+            continue;
+
+          add_candidate (candidates, seen, visible, z, CLAMP (floor (x * n), 0, n - 1), CLAMP (floor (y * n), 0, n - 1),
+                         self->x, self->y);
+        }
+    }
+}
+
+static void
+prefetch (MapsTilePrefetcher *self)
+{
+  ShumateViewport *viewport = shumate_map_get_viewport (self->map);
+  ShumateMapSource *map_source = shumate_viewport_get_reference_map_source (viewport);
+  ShumateDataSource *data_source = SHUMATE_DATA_SOURCE (self->data_source);
+  g_autoptr(GArray) candidates = g_array_new (FALSE, FALSE, sizeof (Candidate));
+  g_autoptr(GHashTable) seen = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+  g_autoptr(GArray) ids = NULL;
+  g_autoptr(MapsTileRange) ahead_tiles = NULL;
+  double width, height, scale, x, y;
+  guint min_zoom, max_zoom, z;
+  TileRect visible;
+
+  if (map_source == NULL || self->data_source == NULL || maps_offline_data_source_get_prefetch_budget (self->data_source) == 0)
+    return;
+
+  min_zoom = shumate_data_source_get_min_zoom_level (data_source);
+  max_zoom = MIN (shumate_data_source_get_max_zoom_level (data_source), MAPS_TILE_ID_MAX_ZOOM);
+
+  /* The size of the viewport in world units. When the map is rotated, a square around it is used. */
+  scale = shumate_map_source_get_tile_size (map_source) * exp2 (self->zoom);
+  width = gtk_widget_get_width (GTK_WIDGET (self->map)) / scale;
+  height = gtk_widget_get_height (GTK_WIDGET (self->map)) / scale;
+  if (shumate_viewport_get_rotation (viewport) != 0)
+    width = height = hypot (width, height);
+
+  if (width == 0 || height == 0)
+    return;
+
+  z = CLAMP (floor (self->zoom), min_zoom, max_zoom);
+  visible = tile_rect (z, self->x, self->y, width, height);
+
+  {
+    MapsViewportMotion motion = {
+      .x = self->x, .y = self->y, .zoom = self->zoom,
+      .vx = self->vx, .vy = self->vy, .vzoom = self->vzoom,
+      .width = width, .height = height,
+      .min_zoom = shumate_viewport_get_min_zoom_level (viewport),
+      .max_zoom = shumate_viewport_get_max_zoom_level (viewport),
+    };
+
+    ahead_tiles = maps_tile_prefetcher_predict_tiles (&motion, min_zoom, max_zoom, &x, &y);
+  }
+
+  if (ahead_tiles != NULL)
+    {
+      g_autoptr(GArray) ahead = g_array_new (FALSE, FALSE, sizeof (Candidate));
+      guint next_z, x_min, y_min, x_max, y_max;
+
+      maps_tile_range_get_rect (ahead_tiles, 0, &next_z, &x_min, &y_min, &x_max, &y_max);
+      for (guint ty = y_min; ty <= y_max; ty++)
+        for (guint tx = x_min; tx <= x_max; tx++)
+          add_candidate (ahead, seen, &visible, next_z, tx, ty, x, y);
+
+      /* The tiles the map is heading towards come first */
+      g_array_sort (ahead, compare_candidates);
+      g_array_append_vals (candidates, ahead->data, ahead->len);
+
+      /* The route needs to be checked again once the map has moved */
+      self->route_zoom = -1;
+    }
+
+  if (self->route->len > 0 && self->route_zoom != (int)z)
+    {
+      g_autoptr(GArray) route = g_array_new (FALSE, FALSE, sizeof (Candidate));
+
+      add_route_candidates (self, route, seen, &visible, z, ROUTE_RADIUS * MAX (width, height));
+      g_array_sort (route, compare_candidates);
+      g_array_append_vals (candidates, route->data, route->len);
+
+      self->route_zoom = z;
+    }
+
+  if (candidates->len == 0)
+    return;
+
+  ids = g_array_sized_new (FALSE, FALSE, sizeof (guint64), candidates->len);
+  for (guint i = 0; i < candidates->len; i++)
+    g_array_append_val (ids, g_array_index (candidates, Candidate, i).id);
+
+  maps_offline_data_source_prefetch (self->data_source, (guint64 *)ids->data, ids->len);
+}
+
+static gboolean
+on_timeout (gpointer user_data)
+{
+  MapsTilePrefetcher *self = MAPS_TILE_PREFETCHER (user_data);
+
+  self->timeout_id = 0;
+  prefetch (self);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+schedule_prefetch (MapsTilePrefetcher *self)
+{
+  if (self->timeout_id != 0)
+    return;
+
+  self->timeout_id = g_timeout_add_full (G_PRIORITY_LOW, PREFETCH_INTERVAL, on_timeout, self, NULL);
+  g_source_set_name_by_id (self->timeout_id, "[gnome-maps] prefetch");
+}
+
+/* Records the viewport's position at @time, in microseconds */
+static void
+sample_viewport (MapsTilePrefetcher *self,
+                 gint64              time)
+{
+  ShumateViewport *viewport = shumate_map_get_viewport (self->map);
+  double x = x_for_lng (shumate_location_get_longitude (SHUMATE_LOCATION (viewport)));
+  double y = y_for_lat (shumate_location_get_latitude (SHUMATE_LOCATION (viewport)));
+  double zoom = shumate_viewport_get_zoom_level (viewport);
+  double dt = (time - self->time) / (double)G_USEC_PER_SEC;
+  double dx = x - self->x;
+
+  /* Take the short way around the antimeridian */
+  if (dx > 0.5)
+    dx -= 1;
+  else if (dx < -0.5)
+    dx += 1;
+
+  if (dt > MAX_SAMPLE_GAP)
+    {
+      self->vx = self->vy = self->vzoom = 0;
+    }
+  else if (dt > 0)
+    {
+      self->vx = SMOOTHING * self->vx + (1 - SMOOTHING) * dx / dt;
+      self->vy = SMOOTHING * self->vy + (1 - SMOOTHING) * (y - self->y) / dt;
+      self->vzoom = SMOOTHING * self->vzoom + (1 - SMOOTHING) * (zoom - self->zoom) / dt;
+    }
+
+  self->time = time;
+  self->x = x;
+  self->y = y;
+  self->zoom = zoom;
+}
+
+static gboolean
+on_tick (GtkWidget     *widget,
+         GdkFrameClock *frame_clock,
+         gpointer       user_data)
+{
+  MapsTilePrefetcher *self = MAPS_TILE_PREFETCHER (user_data);
+
+  self->tick_id = 0;
+  sample_viewport (self, gdk_frame_clock_get_frame_time (frame_clock));
+  schedule_prefetch (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+on_viewport_changed (ShumateViewport    *viewport,
+                     GParamSpec         *pspec,
+                     MapsTilePrefetcher *self)
+{
+  /* A single move notifies the longitude, latitude and zoom level separately, so they are sampled together in
+     the next frame rather than each being taken as a step of its own */
+  if (self->tick_id == 0)
+    self->tick_id = gtk_widget_add_tick_callback (GTK_WIDGET (self->map), on_tick, self, NULL);
+}
+
+static void
+maps_tile_prefetcher_finalize (GObject *object)
+{
+  MapsTilePrefetcher *self = MAPS_TILE_PREFETCHER (object);
+
+  if (self->tick_id != 0)
+    gtk_widget_remove_tick_callback (GTK_WIDGET (self->map), self->tick_id);
+  g_clear_handle_id (&self->timeout_id, g_source_remove);
+  g_clear_object (&self->map);
+  g_clear_object (&self->data_source);
+  g_clear_pointer (&self->route, g_array_unref);
+
+  G_OBJECT_CLASS (maps_tile_prefetcher_parent_class)->finalize (object);
+}
+
+static void
+maps_tile_prefetcher_class_init (MapsTilePrefetcherClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = maps_tile_prefetcher_finalize;
+}
+
+static void
+maps_tile_prefetcher_init (MapsTilePrefetcher *self)
+{
+  self->route = g_array_new (FALSE, FALSE, sizeof (double));
+  self->route_zoom = -1;
+}
+
+/**
+ * maps_tile_prefetcher_new:
+ * @map: the map to prefetch tiles for
+ *
+ * Creates a prefetcher that follows @map's viewport. It does nothing until
+ * it's given a data source with maps_tile_prefetcher_set_data_source().
+ *
+ * Returns: (transfer full): a new [class@TilePrefetcher]
+ */
+MapsTilePrefetcher *
+maps_tile_prefetcher_new (ShumateMap *map)
+{
+  MapsTilePrefetcher *self;
+  ShumateViewport *viewport;
+
+  g_return_val_if_fail (SHUMATE_IS_MAP (map), NULL);
+
+  self = g_object_new (MAPS_TYPE_TILE_PREFETCHER, NULL);
+  self->map = g_object_ref (map);
+
+  viewport = shumate_map_get_viewport (map);
+  g_signal_connect_object (viewport, "notify::longitude", G_CALLBACK (on_viewport_changed), self, 0);
+  g_signal_connect_object (viewport, "notify::latitude", G_CALLBACK (on_viewport_changed), self, 0);
+  g_signal_connect_object (viewport, "notify::zoom-level", G_CALLBACK (on_viewport_changed), self, 0);
+  sample_viewport (self, g_get_monotonic_time ());
+
+  return self;
+}
+
+/**
+ * maps_tile_prefetcher_set_data_source:
+ * @self: a [class@TilePrefetcher]
+ * @data_source: (nullable): the data source to prefetch tiles from
+ *
+ * Sets the data source of the map's vector tiles, which the tiles are
+ * prefetched from. Its [property@OfflineDataSource:prefetch-budget] limits
+ * how many tiles are prefetched.
+ */
+void
+maps_tile_prefetcher_set_data_source (MapsTilePrefetcher    *self,
+                                      MapsOfflineDataSource *data_source)
+{
+  g_return_if_fail (MAPS_IS_TILE_PREFETCHER (self));
+  g_return_if_fail (data_source == NULL || MAPS_IS_OFFLINE_DATA_SOURCE (data_source));
+
+  g_set_object (&self->data_source, data_source);
+  self->route_zoom = -1;
+}
+
+/**
+ * maps_tile_prefetcher_set_route:
+ * @self: a [class@TilePrefetcher]
+ * @path: (nullable) (element-type Shumate.Location): the points of the
+ *   route, or %NULL if there is no route
+ *
+ * Sets the route shown on the map. Tiles along it near the viewport are
+ * prefetched.
+ */
+void
+maps_tile_prefetcher_set_route (MapsTilePrefetcher *self,
+                                GList              *path)
+{
+  g_return_if_fail (MAPS_IS_TILE_PREFETCHER (self));
+
+  g_array_set_size (self->route, 0);
+
+  for (GList *l = path; l != NULL; l = l->next)
+    {
+      ShumateLocation *location = SHUMATE_LOCATION (l->data);
+      double point[2] = {
+        x_for_lng (shumate_location_get_longitude (location)),
+        y_for_lat (shumate_location_get_latitude (location)),
+      };
+
+      g_array_append_vals (self->route, point, 2);
+    }
+
+  self->route_zoom = -1;
+  if (self->route->len > 0)
+    schedule_prefetch (self);
+}
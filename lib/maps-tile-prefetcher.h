@@ -0,0 +1,50 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <shumate/shumate.h>
+
+#include "maps-offline-data-source.h"
+#include "maps-tile-range.h"
+
+G_BEGIN_DECLS
+
+/* A viewport and its velocity. Positions and sizes are in world units, where the whole map is the unit square. */
+typedef struct {
+  double x, y, zoom;
+  double vx, vy, vzoom;      /* per second */
+  double width, height;
+  double min_zoom, max_zoom; /* the viewport's zoom limits */
+} MapsViewportMotion;
+
+#define MAPS_TYPE_TILE_PREFETCHER (maps_tile_prefetcher_get_type())
+G_DECLARE_FINAL_TYPE (MapsTilePrefetcher, maps_tile_prefetcher, MAPS, TILE_PREFETCHER, GObject)
+
+MapsTilePrefetcher *maps_tile_prefetcher_new (ShumateMap *map);
+
+void maps_tile_prefetcher_set_data_source (MapsTilePrefetcher    *self,
+                                           MapsOfflineDataSource *data_source);
+
+void maps_tile_prefetcher_set_route (MapsTilePrefetcher *self,
+                                     GList              *path);
+
+MapsTileRange *maps_tile_prefetcher_predict_tiles (const MapsViewportMotion *motion,
+                                                   guint                     min_tile_zoom,
+                                                   guint                     max_tile_zoom,
+                                                   double                   *x,
+                                                   double                   *y);
+
+G_END_DECLS
@@ -0,0 +1,533 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+
+#include "maps-tile-id.h"
+#include "maps-tile-range.h"
+
+/* A set of tiles, stored as rectangles of tiles at each zoom level. An area on the map covers a few rectangles
+   rather than hundreds of thousands of individual tiles, so areas can be combined and compared cheaply, and only
+   expanded to tile IDs when they are needed for I/O.
+
+   The rectangles never overlap, which keeps counting and expanding them simple. */
+
+typedef struct {
+  guint z;
+  /* Inclusive */
+  guint x_min, y_min, x_max, y_max;
+} Rect;
+
+struct _MapsTileRange {
+  GObject parent_instance;
+
+  GArray *rects; /* Rect */
+};
+
+G_DEFINE_TYPE (MapsTileRange, maps_tile_range, G_TYPE_OBJECT)
+
+static void
+maps_tile_range_finalize (GObject *object)
+{
+  MapsTileRange *self = MAPS_TILE_RANGE (object);
+
+  g_clear_pointer (&self->rects, g_array_unref);
+
+  G_OBJECT_CLASS (maps_tile_range_parent_class)->finalize (object);
+}
+
+static void
+maps_tile_range_class_init (MapsTileRangeClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = maps_tile_range_finalize;
+}
+
+static void
+maps_tile_range_init (MapsTileRange *self)
+{
+  self->rects = g_array_new (FALSE, FALSE, sizeof (Rect));
+}
+
+static gboolean
+rects_intersect (const Rect *a,
+                 const Rect *b)
+{
+  return a->z == b->z
+    && a->x_min <= b->x_max && b->x_min <= a->x_max
+    && a->y_min <= b->y_max && b->y_min <= a->y_max;
+}
+
+/* Appends the parts of @a that are not in @b to @out, as at most four rectangles */
+static void
+rect_subtract (const Rect *a,
+               const Rect *b,
+               GArray     *out)
+{
+  Rect middle = *a;
+
+  if (!rects_intersect (a, b))
+    {
+      g_array_append_val (out, *a);
+      return;
+    }
+
+  /* Full-width bands above and below @b */
+  if (a->y_min < b->y_min)
+    {
+      Rect top = *a;
+      top.y_max = b->y_min - 1;
+      g_array_append_val (out, top);
+      middle.y_min = b->y_min;
+    }
+  if (a->y_max > b->y_max)
+    {
+      Rect bottom = *a;
+      bottom.y_min = b->y_max + 1;
+      g_array_append_val (out, bottom);
+      middle.y_max = b->y_max;
+    }
+
+  /* The parts to the left and right of @b, between the bands */
+  if (a->x_min < b->x_min)
+    {
+      Rect left = middle;
+      left.x_max = b->x_min - 1;
+      g_array_append_val (out, left);
+    }
+  if (a->x_max > b->x_max)
+    {
+      Rect right = middle;
+      right.x_min = b->x_max + 1;
+      g_array_append_val (out, right);
+    }
+}
+
+static void
+add_rect (MapsTileRange *self,
+          const Rect    *rect)
+{
+  g_autoptr(GArray) pieces = g_array_new (FALSE, FALSE, sizeof (Rect));
+  g_autoptr(GArray) remaining = g_array_new (FALSE, FALSE, sizeof (Rect));
+
+  /* Only add the parts of the rectangle that aren't in the range yet, so the rectangles stay disjoint */
+  g_array_append_val (pieces, *rect);
+
+  for (guint i = 0; i < self->rects->len && pieces->len > 0; i++)
+    {
+      const Rect *existing = &g_array_index (self->rects, Rect, i);
+      GArray *tmp;
+
+      g_array_set_size (remaining, 0);
+      for (guint j = 0; j < pieces->len; j++)
+        rect_subtract (&g_array_index (pieces, Rect, j), existing, remaining);
+
+      tmp = pieces;
+      pieces = remaining;
+      remaining = tmp;
+    }
+
+  g_array_append_vals (self->rects, pieces->data, pieces->len);
+}
+
+static void
+subtract_rect (MapsTileRange *self,
+               const Rect    *rect)
+{
+  g_autoptr(GArray) result = g_array_sized_new (FALSE, FALSE, sizeof (Rect), self->rects->len);
+
+  for (guint i = 0; i < self->rects->len; i++)
+    rect_subtract (&g_array_index (self->rects, Rect, i), rect, result);
+
+  g_array_unref (self->rects);
+  self->rects = g_steal_pointer (&result);
+}
+
+/**
+ * maps_tile_range_new:
+ *
+ * Creates an empty tile range.
+ *
+ * Returns: (transfer full): a new [class@TileRange]
+ */
+MapsTileRange *
+maps_tile_range_new (void)
+{
+  return g_object_new (MAPS_TYPE_TILE_RANGE, NULL);
+}
+
+/**
+ * maps_tile_range_copy:
+ * @self: a [class@TileRange]
+ *
+ * Returns: (transfer full): a new [class@TileRange] with the same tiles
+ */
+MapsTileRange *
+maps_tile_range_copy (MapsTileRange *self)
+{
+  MapsTileRange *copy;
+
+  g_return_val_if_fail (MAPS_IS_TILE_RANGE (self), NULL);
+
+  copy = maps_tile_range_new ();
+  g_array_append_vals (copy->rects, self->rects->data, self->rects->len);
+  return copy;
+}
+
+/**
+ * maps_tile_range_add_rect:
+ * @self: a [class@TileRange]
+ * @z: the zoom level
+ * @x_min: the first column
+ * @y_min: the first row
+ * @x_max: the last column, inclusive
+ * @y_max: the last row, inclusive
+ *
+ * Adds a rectangle of tiles to the range.
+ */
+void
+maps_tile_range_add_rect (MapsTileRange *self,
+                          guint          z,
+                          guint          x_min,
+                          guint          y_min,
+                          guint          x_max,
+                          guint          y_max)
+{
+  Rect rect = { z, x_min, y_min, x_max, y_max };
+
+  g_return_if_fail (MAPS_IS_TILE_RANGE (self));
+  g_return_if_fail (z <= MAPS_TILE_ID_MAX_ZOOM);
+  g_return_if_fail (x_min <= x_max && y_min <= y_max);
+  g_return_if_fail (x_max < (1u << z) && y_max < (1u << z));
+
+  add_rect (self, &rect);
+}
+
+static double
+x_for_lng (double lng,
+           guint  z)
+{
+  return (lng + 180) / 360 * (1u << z);
+}
+
+static double
+y_for_lat (double lat,
+           guint  z)
+{
+  double sin_lat = sin (lat * G_PI / 180);
+  return (0.5 - log ((1 + sin_lat) / (1 - sin_lat)) / (4 * G_PI)) * (1u << z);
+}
+
+/**
+ * maps_tile_range_add_bounds:
+ * @self: a [class@TileRange]
+ * @top: the northern edge, in degrees
+ * @left: the western edge, in degrees
+ * @bottom: the southern edge, in degrees
+ * @right: the eastern edge, in degrees
+ * @min_zoom: the lowest zoom level
+ * @max_zoom: the highest zoom level
+ *
+ * Adds the tiles that cover a bounding box at each zoom level from @min_zoom
+ * to @max_zoom.
+ */
+void
+maps_tile_range_add_bounds (MapsTileRange *self,
+                            double         top,
+                            double         left,
+                            double         bottom,
+                            double         right,
+                            guint          min_zoom,
+                            guint          max_zoom)
+{
+  g_return_if_fail (MAPS_IS_TILE_RANGE (self));
+  g_return_if_fail (max_zoom <= MAPS_TILE_ID_MAX_ZOOM);
+
+  for (guint z = min_zoom; z <= max_zoom; z++)
+    {
+      double max = (1u << z) - 1;
+      double x_min = CLAMP (floor (x_for_lng (left, z)), 0, max);
+      double x_max = CLAMP (ceil (x_for_lng (right, z)) - 1, 0, max);
+      double y_min = CLAMP (floor (y_for_lat (top, z)), 0, max);
+      double y_max = CLAMP (ceil (y_for_lat (bottom, z)) - 1, 0, max);
+      Rect rect = { z, x_min, y_min, x_max, y_max };
+
+      if (x_min > x_max || y_min > y_max)
+        continue;
+
+      add_rect (self, &rect);
+    }
+}
+
+/**
+ * maps_tile_range_union:
+ * @self: a [class@TileRange]
+ * @other: another [class@TileRange]
+ *
+ * Adds the tiles in @other to @self.
+ */
+void
+maps_tile_range_union (MapsTileRange *self,
+                       MapsTileRange *other)
+{
+  g_return_if_fail (MAPS_IS_TILE_RANGE (self));
+  g_return_if_fail (MAPS_IS_TILE_RANGE (other));
+
+  if (self == other)
+    return;
+
+  for (guint i = 0; i < other->rects->len; i++)
+    add_rect (self, &g_array_index (other->rects, Rect, i));
+}
+
+/**
+ * maps_tile_range_subtract:
+ * @self: a [class@TileRange]
+ * @other: another [class@TileRange]
+ *
+ * Removes the tiles in @other from @self.
+ */
+void
+maps_tile_range_subtract (MapsTileRange *self,
+                          MapsTileRange *other)
+{
+  g_return_if_fail (MAPS_IS_TILE_RANGE (self));
+  g_return_if_fail (MAPS_IS_TILE_RANGE (other));
+
+  if (self == other)
+    {
+      g_array_set_size (self->rects, 0);
+      return;
+    }
+
+  for (guint i = 0; i < other->rects->len && self->rects->len > 0; i++)
+    subtract_rect (self, &g_array_index (other->rects, Rect, i));
+}
+
+/**
+ * maps_tile_range_is_empty:
+ * @self: a [class@TileRange]
+ *
+ * Returns: whether the range contains no tiles
+ */
+gboolean
+maps_tile_range_is_empty (MapsTileRange *self)
+{
+  g_return_val_if_fail (MAPS_IS_TILE_RANGE (self), TRUE);
+  return self->rects->len == 0;
+}
+
+/**
+ * maps_tile_range_get_n_tiles:
+ * @self: a [class@TileRange]
+ *
+ * Returns: the number of tiles in the range
+ */
+guint64
+maps_tile_range_get_n_tiles (MapsTileRange *self)
+{
+  guint64 n_tiles = 0;
+
+  g_return_val_if_fail (MAPS_IS_TILE_RANGE (self), 0);
+
+  for (guint i = 0; i < self->rects->len; i++)
+    {
+      const Rect *rect = &g_array_index (self->rects, Rect, i);
+      n_tiles += (guint64)(rect->x_max - rect->x_min + 1) * (rect->y_max - rect->y_min + 1);
+    }
+
+  return n_tiles;
+}
+
+/**
+ * maps_tile_range_contains:
+ * @self: a [class@TileRange]
+ * @z: the zoom level
+ * @x: the column
+ * @y: the row
+ *
+ * Returns: whether the tile is in the range
+ */
+gboolean
+maps_tile_range_contains (MapsTileRange *self,
+                          guint          z,
+                          guint          x,
+                          guint          y)
+{
+  Rect tile = { z, x, y, x, y };
+
+  g_return_val_if_fail (MAPS_IS_TILE_RANGE (self), FALSE);
+
+  for (guint i = 0; i < self->rects->len; i++)
+    {
+      if (rects_intersect (&g_array_index (self->rects, Rect, i), &tile))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * maps_tile_range_contains_id:
+ * @self: a [class@TileRange]
+ * @id: a tile ID, see maps_tile_id_from_zxy()
+ *
+ * Returns: whether the tile is in the range
+ */
+gboolean
+maps_tile_range_contains_id (MapsTileRange *self,
+                             guint64        id)
+{
+  guint z, x, y;
+
+  g_return_val_if_fail (MAPS_IS_TILE_RANGE (self), FALSE);
+
+  if (!maps_tile_id_to_zxy (id, &z, &x, &y))
+    return FALSE;
+
+  return maps_tile_range_contains (self, z, x, y);
+}
+
+/**
+ * maps_tile_range_get_n_rects:
+ * @self: a [class@TileRange]
+ *
+ * Returns: the number of rectangles the range is made of
+ */
+guint
+maps_tile_range_get_n_rects (MapsTileRange *self)
+{
+  g_return_val_if_fail (MAPS_IS_TILE_RANGE (self), 0);
+  return self->rects->len;
+}
+
+/**
+ * maps_tile_range_get_rect:
+ * @self: a [class@TileRange]
+ * @index: the index of the rectangle
+ * @z: (out): return location for the zoom level
+ * @x_min: (out): return location for the first column
+ * @y_min: (out): return location for the first row
+ * @x_max: (out): return location for the last column, inclusive
+ * @y_max: (out): return location for the last row, inclusive
+ *
+ * Gets one of the rectangles the range is made of. They don't overlap, and
+ * are in no particular order.
+ */
+void
+maps_tile_range_get_rect (MapsTileRange *self,
+                          guint          index,
+                          guint         *z,
+                          guint         *x_min,
+                          guint         *y_min,
+                          guint         *x_max,
+                          guint         *y_max)
+{
+  const Rect *rect;
+
+  g_return_if_fail (MAPS_IS_TILE_RANGE (self));
+  g_return_if_fail (index < self->rects->len);
+
+  rect = &g_array_index (self->rects, Rect, index);
+  *z = rect->z;
+  *x_min = rect->x_min;
+  *y_min = rect->y_min;
+  *x_max = rect->x_max;
+  *y_max = rect->y_max;
+}
+
+static int
+compare_ids (gconstpointer a,
+             gconstpointer b)
+{
+  guint64 id_a = *(const guint64 *)a;
+  guint64 id_b = *(const guint64 *)b;
+
+  return (id_a > id_b) - (id_a < id_b);
+}
+
+/**
+ * maps_tile_range_get_ids:
+ * @self: a [class@TileRange]
+ * @n_ids: (out): return location for the number of tiles
+ *
+ * Expands the range into the IDs of its tiles, in ascending order, which is
+ * the order they are stored in PMTiles archives.
+ *
+ * Returns: (transfer full) (array length=n_ids): the tile IDs
+ */
+guint64 *
+maps_tile_range_get_ids (MapsTileRange *self,
+                         gsize         *n_ids)
+{
+  g_autoptr(GArray) ids = NULL;
+
+  g_return_val_if_fail (MAPS_IS_TILE_RANGE (self), NULL);
+  g_return_val_if_fail (n_ids != NULL, NULL);
+
+  ids = g_array_sized_new (FALSE, FALSE, sizeof (guint64), maps_tile_range_get_n_tiles (self));
+
+  for (guint i = 0; i < self->rects->len; i++)
+    {
+      const Rect *rect = &g_array_index (self->rects, Rect, i);
+
+      for (guint x = rect->x_min; x <= rect->x_max; x++)
+        for (guint y = rect->y_min; y <= rect->y_max; y++)
+          {
+            guint64 id = maps_tile_id_from_zxy (rect->z, x, y);
+            g_array_append_val (ids, id);
+          }
+    }
+
+  g_array_sort (ids, compare_ids);
+  return g_array_steal (ids, n_ids);
+}
+
+/**
+ * maps_tile_range_filter_ids:
+ * @self: a [class@TileRange]
+ * @ids: (array length=n_ids): tile IDs
+ * @n_ids: the length of @ids
+ * @inside: whether to keep the tiles that are in the range, or the ones
+ *   that aren't
+ * @n_filtered: (out): return location for the number of tiles returned
+ *
+ * Filters a list of tiles by whether they are in the range.
+ *
+ * Returns: (transfer full) (array length=n_filtered): the tile IDs, in the
+ *   same order as @ids
+ */
+guint64 *
+maps_tile_range_filter_ids (MapsTileRange *self,
+                            const guint64 *ids,
+                            gsize          n_ids,
+                            gboolean       inside,
+                            gsize         *n_filtered)
+{
+  g_autoptr(GArray) filtered = g_array_new (FALSE, FALSE, sizeof (guint64));
+
+  g_return_val_if_fail (MAPS_IS_TILE_RANGE (self), NULL);
+  g_return_val_if_fail (ids != NULL || n_ids == 0, NULL);
+  g_return_val_if_fail (n_filtered != NULL, NULL);
+
+  for (gsize i = 0; i < n_ids; i++)
+    {
+      if (!maps_tile_range_contains_id (self, ids[i]) == !inside)
+        g_array_append_val (filtered, ids[i]);
+    }
+
+  return g_array_steal (filtered, n_filtered);
+}
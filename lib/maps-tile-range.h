@@ -0,0 +1,76 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define MAPS_TYPE_TILE_RANGE (maps_tile_range_get_type())
+G_DECLARE_FINAL_TYPE (MapsTileRange, maps_tile_range, MAPS, TILE_RANGE, GObject)
+
+MapsTileRange *maps_tile_range_new (void);
+MapsTileRange *maps_tile_range_copy (MapsTileRange *self);
+
+void maps_tile_range_add_rect (MapsTileRange *self,
+                               guint          z,
+                               guint          x_min,
+                               guint          y_min,
+                               guint          x_max,
+                               guint          y_max);
+
+void maps_tile_range_add_bounds (MapsTileRange *self,
+                                 double         top,
+                                 double         left,
+                                 double         bottom,
+                                 double         right,
+                                 guint          min_zoom,
+                                 guint          max_zoom);
+
+void maps_tile_range_union (MapsTileRange *self,
+                            MapsTileRange *other);
+void maps_tile_range_subtract (MapsTileRange *self,
+                               MapsTileRange *other);
+
+gboolean maps_tile_range_is_empty (MapsTileRange *self);
+guint64 maps_tile_range_get_n_tiles (MapsTileRange *self);
+
+gboolean maps_tile_range_contains (MapsTileRange *self,
+                                   guint          z,
+                                   guint          x,
+                                   guint          y);
+gboolean maps_tile_range_contains_id (MapsTileRange *self,
+                                      guint64        id);
+
+guint maps_tile_range_get_n_rects (MapsTileRange *self);
+void maps_tile_range_get_rect (MapsTileRange *self,
+                               guint          index,
+                               guint         *z,
+                               guint         *x_min,
+                               guint         *y_min,
+                               guint         *x_max,
+                               guint         *y_max);
+
+guint64 *maps_tile_range_get_ids (MapsTileRange *self,
+                                  gsize         *n_ids);
+
+guint64 *maps_tile_range_filter_ids (MapsTileRange *self,
+                                     const guint64 *ids,
+                                     gsize          n_ids,
+                                     gboolean       inside,
+                                     gsize         *n_filtered);
+
+G_END_DECLS
@@ -164,7 +164,10 @@ export class Application extends Adw.Application {
         Application.routingDelegator = new RoutingDelegator({ query: Application.routeQuery });
         Application.geoclue = new Geoclue();
         Application.osmEdit = new OSMEdit();
-        Application.downloads = new DownloadManager();
+        Application.downloads = new DownloadManager({
+            cacheSize: Application.settings.get('tile-cache-size') * 1024 * 1024,
+            prefetchBudget: Application.settings.get('tile-prefetch-budget'),
+        });
         Application.downloads.load();
     }
 
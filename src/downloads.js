@@ -22,6 +22,7 @@ import GObject from "gi://GObject";
 
 import { BoundingBox } from "./boundingBox.js";
 import { JsonStorage } from "./jsonStorage.js";
+import { Pipeline } from "./pipeline.js";
 import { PMTilesDownload } from "./pmtiles.js";
 import * as Utils from "./utils.js";
 
@@ -30,9 +31,18 @@ const INDEX_FILE = "downloads.json";
 const STORAGE_FILE = "downloads.db";
 
 const CACHE_AGE = 7 * 24 * 60 * 60 * 1000; // 1 week
+/* Size of the download store's in-memory cache of decompressed tiles, so panning around the same area doesn't
+   read and decompress the same tiles over and over */
+const HOT_CACHE_SIZE = 32 * 1024 * 1024;
 /* The maximum size of a download area in number of tiles. This is fairly arbitrary and is mostly in place to prevent
    massive downloads that could fill the user's hard drive or waste bandwidth. */
 const MAX_SIZE_TILES = 100_000;
+/* Areas are downloaded from zoom level 0 up to this one */
+const MAX_ZOOM = 14;
+/* Free pages are given back to the filesystem this many at a time, with a
+   pause in between, so other writes aren't held up for long */
+const RECLAIM_PAGES = 256;
+const RECLAIM_INTERVAL = 100; // milliseconds
 
 const DOWNLOAD_URL = "https://mapdownloads.gnome.org/streets.pmtiles";
 
@@ -41,11 +51,25 @@ const DOWNLOAD_URL = "https://mapdownloads.gnome.org/streets.pmtiles";
  */
 export class DownloadManager extends GObject.Object {
     /**
-     * @param {{ storage?: JsonStorage }} props
+     * @param {{ storage?: JsonStorage, cacheSize?: number, prefetchBudget?: number }} props
+     *
+     * `cacheSize` is the size in bytes of the cache of tiles viewed online,
+     * which is kept in the download store alongside the downloaded areas.
+     * 0 disables the cache.
+     *
+     * `prefetchBudget` is the largest number of tiles that are prefetched
+     * before they come into view. 0 disables prefetching.
      */
-    constructor({ storage } = {}) {
+    constructor({ storage, cacheSize = 0, prefetchBudget = 0 } = {}) {
         super();
 
+        /** @private */
+        this._cacheSize = cacheSize;
+        /** @private */
+        this._prefetchBudget = prefetchBudget;
+        /** @private @type {Map<string, GnomeMaps.OfflineDataSource>} */
+        this._dataSources = new Map();
+
         /** @private @type {JsonStorage} */
         this._storage =
             storage ??
@@ -73,7 +97,10 @@ export class DownloadManager extends GObject.Object {
         /** @private */
         this._cancelQueue = null;
         /** @private */
-        this._shouldVacuum = false;
+        this._reclaimTimeout = null;
+        /** @private @type {Map<string, string>} Area ID -> the area's bounds
+            and tilesets when they were last recorded in the download store */
+        this._syncedAreas = new Map();
 
         /** @private @type {DownloadProgress?} */
         this._progress = null;
@@ -102,14 +129,43 @@ export class DownloadManager extends GObject.Object {
     }
 
     /**
-     * Gets a file from the download store.
+     * Creates a data source that serves tiles from the download store, and
+     * gets the rest from `nextSource`. Tiles from `nextSource` are added to
+     * the tile cache, unless it is disabled.
      *
      * @param {string} tileset
-     * @param {string} id
-     * @returns {Promise<GLib.Bytes | null>} The file data, or null if it doesn't exist.
+     * @param {Shumate.DataSource} nextSource
+     * @returns {GnomeMaps.OfflineDataSource}
      */
-    async getFile(tileset, id) {
-        return await this.downloadStore.get_async(tileset, id);
+    createDataSource(tileset, nextSource) {
+        const dataSource = GnomeMaps.OfflineDataSource.new(
+            this.downloadStore,
+            tileset,
+            nextSource
+        );
+        dataSource.cache_tiles = this._cacheSize > 0;
+        dataSource.prefetch_budget = this._prefetchBudget;
+        dataSource.connect("cache-written", () => {
+            if (this.downloadStore.is_over_quota()) this.scheduleReclaim();
+        });
+
+        /* Only the newest source for a tileset is in use, but the old one
+           may still have tiles waiting to be cached */
+        this._dataSources.get(tileset)?.flush_cache();
+        this._dataSources.set(tileset, dataSource);
+
+        return dataSource;
+    }
+
+    /**
+     * The data source that was last created for a tileset with
+     * createDataSource().
+     *
+     * @param {string} tileset
+     * @returns {GnomeMaps.OfflineDataSource?}
+     */
+    getDataSource(tileset) {
+        return this._dataSources.get(tileset) ?? null;
     }
 
     /**
@@ -205,6 +261,9 @@ export class DownloadManager extends GObject.Object {
                     STORAGE_FILE,
                 ])
             );
+            this._downloadStore.set_cache_size(HOT_CACHE_SIZE);
+            this._downloadStore.set_quota(this._cacheSize);
+            this._downloadStore.set_cache_max_age(CACHE_AGE);
         }
         return this._downloadStore;
     }
@@ -270,12 +329,51 @@ export class DownloadManager extends GObject.Object {
         );
     }
 
+    /**
+     * @private
+     * Starts evicting cached tiles if the download store is over its quota
+     * and giving free space back to the filesystem, in small steps in the
+     * background, instead of a VACUUM that rewrites the whole database at
+     * once.
+     */
+    scheduleReclaim() {
+        if (this._reclaimTimeout !== null) return;
+
+        this._reclaimTimeout = GLib.timeout_add(
+            GLib.PRIORITY_LOW,
+            RECLAIM_INTERVAL,
+            () => {
+                this._reclaimTimeout = null;
+                this.reclaimSlice().catch(logError);
+                return GLib.SOURCE_REMOVE;
+            }
+        );
+    }
+
+    /** @private */
+    async reclaimSlice() {
+        let evicted = 0;
+        if (this.downloadStore.is_over_quota()) {
+            evicted = await this.downloadStore.enforce_quota_async();
+            if (evicted > 0) Utils.debug(`Evicted ${evicted} cached tiles`);
+        }
+
+        /* Eviction is capped per call, so a large excess takes a few
+           slices */
+        const remaining = await this.downloadStore.reclaim_async(RECLAIM_PAGES);
+        if (remaining > 0 || (evicted > 0 && this.downloadStore.is_over_quota()))
+            this.scheduleReclaim();
+    }
+
     /** If there is a save scheduled, save it now. */
     saveOnQuit() {
         if (this._saveTimeout !== null) {
             GLib.source_remove(this._saveTimeout);
             this.save();
         }
+
+        for (const dataSource of this._dataSources.values())
+            dataSource.flush_cache();
     }
 
     /**
@@ -333,8 +431,8 @@ export class DownloadManager extends GObject.Object {
      */
     isTooBig(bounds) {
         const nTiles = Math.abs(
-            (getXForLng(bounds.right, 14) - getXForLng(bounds.left, 14)) *
-                (getYForLat(bounds.bottom, 14) - getYForLat(bounds.top, 14))
+            (getXForLng(bounds.right, MAX_ZOOM) - getXForLng(bounds.left, MAX_ZOOM)) *
+                (getYForLat(bounds.bottom, MAX_ZOOM) - getYForLat(bounds.top, MAX_ZOOM))
         );
         return nTiles > MAX_SIZE_TILES;
     }
@@ -395,7 +493,10 @@ export class DownloadManager extends GObject.Object {
 
         this._downloadQueue = this._downloadQueue.filter((a) => a !== area);
 
-        /* Restart the download queue without the removed area. This also deletes any files associated with the area. */
+        /* Restart the download queue without the removed area. The restart
+           waits for the cancelled download to write what it already
+           fetched, and only then deletes the tiles only this area needed,
+           so none of them are left behind. */
         this.processQueue();
     }
 
@@ -447,20 +548,13 @@ export class DownloadManager extends GObject.Object {
             while (true) {
                 this._restartQueue = false;
 
-                /* Delete unused files */
-                const unneeded = await this.getUnneededFiles();
-                if (Object.keys(unneeded).length > 0) {
-                    this.setProgress("deleting", Object.keys(unneeded).length);
-
-                    await this.transaction(async () => {
-                        for (const tileset in unneeded) {
-                            await this.downloadStore.remove_async(
-                                tileset,
-                                unneeded[tileset]
-                            );
-                            this.advanceProgress(1);
-                        }
-                    });
+                /* Delete files that no area needs anymore */
+                this.setProgress("deleting", 1);
+                const deleted = await this.syncAreas();
+                this.advanceProgress(1);
+                if (deleted > 0) {
+                    Utils.debug(`Deleted ${deleted} unneeded tiles`);
+                    this.scheduleReclaim();
                 }
 
                 if (this.paused) {
@@ -475,13 +569,6 @@ export class DownloadManager extends GObject.Object {
                     await this.doDownload(this.areas, false);
                 }
 
-                this.setProgress("finishing", 0);
-
-                if (this._shouldVacuum) {
-                    await this.downloadStore.exec_async("VACUUM");
-                    this._shouldVacuum = false;
-                }
-
                 if (!this._restartQueue) {
                     /* If we get here, we're done */
                     break;
@@ -496,157 +583,257 @@ export class DownloadManager extends GObject.Object {
 
     /**
      * @private
-     * Gets the list of files that are no longer needed and can be deleted.
-     * @returns {{ [tileset: string]: string[] }}
+     * Records the tiles each area needs in the download store, and forgets
+     * areas that were removed. The store deletes the tiles that are no
+     * longer needed as it goes. Only areas that changed since they were last
+     * recorded are recorded again.
+     *
+     * @returns {Promise<number>} The number of tiles that were deleted
      */
-    async getUnneededFiles() {
-        const needed = {};
+    async syncAreas() {
+        let deleted = 0;
+        const ids = new Set();
         for (const area of this._areas) {
-            const tiles = area.getTiles();
-            for (const tileset in tiles) {
-                needed[tileset] ??= new Set();
-                for (const tile of tiles[tileset]) {
-                    needed[tileset].add(tile);
-                }
-            }
-        }
+            ids.add(area.id);
 
-        const unneeded = {};
-        for (const tileset of await this.downloadStore.list_tilesets_async()) {
-            unneeded[tileset] = [];
-            for (const id of await this.downloadStore.list_tiles_async(tileset)) {
-                if (!needed[tileset]?.has(id)) {
-                    unneeded[tileset].push(id);
-                }
+            const state = JSON.stringify([area.bounds.toJSON(), area.tilesets]);
+            if (this._syncedAreas.get(area.id) === state) continue;
+
+            for (const tileset of area.tilesets) {
+                deleted += await this.downloadStore.set_area_async(
+                    area.id,
+                    tileset,
+                    this.getTilesetHandler(tileset).getTilesForBounds(area.bounds)
+                );
             }
+            this._syncedAreas.set(area.id, state);
         }
 
-        return unneeded;
-    }
-
-    /**
-     * @private
-     */
-    async transaction(task) {
-        await this.downloadStore.exec_async("BEGIN");
-        try {
-            await task();
-        } catch (e) {
-            /* Cancellation means some state changed and we should stop downloading, but we should still
-                save what's been downloaded so far. */
-            if (!isCancellationError(e)) {
-                await this.downloadStore.exec_async("ROLLBACK");
-                throw e;
-            }
+        for (const id of await this.downloadStore.list_areas_async()) {
+            if (!ids.has(id))
+                deleted += await this.downloadStore.remove_area_async(id);
+        }
+        for (const id of this._syncedAreas.keys()) {
+            if (!ids.has(id)) this._syncedAreas.delete(id);
         }
 
-        await this.downloadStore.exec_async("COMMIT");
-        this.scheduleSave();
-        this._shouldVacuum = true;
+        return deleted;
     }
 
     /**
      * @private
      * Downloads the given areas.
      *
-     * @param {DownloadArea[]} areas The areas to download
+     * @param {Iterable<DownloadArea>} areas The areas to download
      * @param {boolean} missingOnly If true, only download missing files and don't
      * update outdated ones.
      */
     async doDownload(areas, missingOnly) {
+        /* The areas are either the queue or the areas list model */
+        areas = Array.from(areas);
+
         this._cancelQueue = Gio.Cancellable.new();
 
         this.setProgress("estimating", 0);
 
         let totalSize = 0;
-        /** @type {{ [tileset: string]: Set<string> }} */
-        const files = {};
+        /** @type {{ [tileset: string]: DownloadJob }} */
+        const jobs = {};
 
-        /* Compute the list of files to download */
-        for (const area of areas) {
-            for (const tileset of area.tilesets) {
-                const tiles = await this.getDownloadList(area, tileset, missingOnly);
-                if (tiles.length === 0) continue;
+        /* Resume the saved plan for each tileset if it is still valid,
+           otherwise compute the list of files to download and plan it */
+        const tilesets = new Set(areas.flatMap((area) => area.tilesets));
+        try {
+            for (const tileset of tilesets) {
+                const job = await this.getDownloadJob(areas, tileset, missingOnly);
+                if (job === null) continue;
 
-                files[tileset] ??= new Set();
-                for (const tile of tiles) {
-                    files[tileset].add(tile);
-                }
+                jobs[tileset] = job;
+                totalSize += job.remainingSize;
             }
+        } catch (e) {
+            if (isCancellationError(e)) return;
+            throw e;
         }
 
         /* Quit if there's nothing to do */
-        if (Object.keys(files).length === 0) return;
-
-        /* Compute the total download size for the progress bar */
-        for (const tileset in files) {
-            const handler = this.getTilesetHandler(tileset);
-            totalSize += await handler.getSizeEstimate(
-                Array.from(files[tileset]),
-                this._cancelQueue
-            );
-        }
+        if (Object.keys(jobs).length === 0) return;
 
         this.setProgress(missingOnly ? "downloading" : "updating", totalSize);
 
         /* Download the files */
-        for (const tileset in files) {
+        for (const tileset in jobs) {
             const handler = this.getTilesetHandler(tileset);
-            const tiles = Array.from(files[tileset]);
-
-            await this.transaction(async () => {
-                let i = 0;
-
-                await handler.download(
-                    tiles,
-                    this._cancelQueue,
-                    async (ids, data, precompressed) => {
-                        const size = data.get_size();
-
-                        await this.downloadStore.insert_async(
-                            tileset,
-                            ids,
-                            data,
-                            precompressed,
-                            Date.now(),
-                        );
-
-                        this.advanceProgress(size);
-
-                        if (++i % 1000 === 0) {
-                            await this.downloadStore.exec_async("COMMIT");
-                            await this.downloadStore.exec_async("BEGIN");
-                            this.scheduleSave();
-                        }
-                    }
-                );
+            const job = jobs[tileset];
+
+            /* Network reads, decoding and database writes each run in
+               their own stage, so they overlap. Each batch of tiles is
+               written in one transaction, along with the plan ranges it
+               completes, so a range is only marked complete if its tiles
+               were saved. */
+            const pipeline = new Pipeline({
+                fetch: (emit) =>
+                    handler.download(job.plan, this._cancelQueue, emit, {
+                        isComplete: (index) => isBitSet(job.completed, index),
+                    }),
+                decode: (item) => handler.decode(item),
+                write: (items) => this.writeBatch(tileset, items),
+                cost: (item) => item.data?.get_size() ?? 0,
             });
+            try {
+                await pipeline.run(`Download of ${tileset}`);
+            } catch (e) {
+                /* Cancellation means some state changed and we should stop
+                   downloading. What was downloaded so far has been saved,
+                   and the plan is kept so the download can be resumed. */
+                if (isCancellationError(e)) return;
+                throw e;
+            }
+
+            await this.downloadStore.delete_plan_async(tileset);
+        }
+    }
+
+    /**
+     * @private
+     * Writes a batch of downloaded tiles to the store.
+     *
+     * @param {string} tileset
+     * @param {DownloadedItem[]} items
+     */
+    async writeBatch(tileset, items) {
+        const batch = GnomeMaps.TileBatch.new(tileset, Date.now());
+        let size = 0;
+
+        for (const item of items) {
+            if (item.completedRange !== undefined) {
+                batch.complete_plan_range(item.completedRange);
+            } else {
+                batch.add(item.tiles, item.data, item.precompressed);
+                size += item.data.get_size();
+            }
+        }
+
+        /* Not cancellable: tiles that were already fetched when a download
+           is cancelled are still worth keeping */
+        await this.downloadStore.insert_batch_async(batch, null);
+
+        this.advanceProgress(size);
+        this.scheduleSave();
+        this.scheduleReclaim();
+    }
+
+    /**
+     * @private
+     * @typedef {Object} DownloadJob
+     * @property {Object} plan The tileset handler's download plan
+     * @property {Uint8Array?} completed Bitmap of the plan's completed ranges
+     * @property {number} remainingSize Bytes left to download
+     */
+
+    /**
+     * @private
+     * Gets the plan for downloading a tileset for the given areas. If an
+     * earlier download of the same areas was interrupted and the source
+     * hasn't changed since, its plan is resumed, which skips both listing
+     * the tiles and planning. Otherwise a new plan is made and saved.
+     *
+     * @param {DownloadArea[]} areas
+     * @param {string} tileset
+     * @param {boolean} missingOnly
+     * @returns {Promise<DownloadJob?>} The job, or null if there is nothing
+     * to download
+     */
+    async getDownloadJob(areas, tileset, missingOnly) {
+        const handler = this.getTilesetHandler(tileset);
+        const jobId = GLib.compute_checksum_for_string(
+            GLib.ChecksumType.SHA256,
+            JSON.stringify({
+                areas: areas
+                    .filter((area) => area.tilesets.includes(tileset))
+                    .map((area) => [area.id, area.bounds.toJSON()]),
+                missingOnly,
+            }),
+            -1
+        );
+
+        const [savedPlan, savedJobId, savedVersion, completed] =
+            await this.downloadStore.load_plan_async(tileset);
+
+        /* Checking the version may need the network, so it's only done
+           when there is something to resume. Without a version, there is
+           no way to tell whether the source changed, so such plans are
+           never resumed. */
+        if (savedPlan !== null && savedJobId === jobId && savedVersion !== null &&
+            savedVersion === await handler.getVersion()) {
+            const plan = JSON.parse(new TextDecoder().decode(savedPlan.toArray()));
+            const completedRanges = completed.toArray();
+            const remainingSize = plan.ranges.reduce(
+                (acc, range, i) =>
+                    isBitSet(completedRanges, i) ? acc : acc + range.range.length,
+                0
+            );
+
+            Utils.debug(`Resuming the download of ${tileset}`);
+            return { plan, completed: completedRanges, remainingSize };
+        }
+
+        const tiles = GnomeMaps.TileRange.new();
+        for (const area of areas) {
+            if (!area.tilesets.includes(tileset)) continue;
+            tiles.union(handler.getTilesForBounds(area.bounds));
         }
+
+        const missing = await this.getDownloadList(
+            tiles, tileset, missingOnly, this._cancelQueue);
+        if (missing.length === 0) {
+            if (savedPlan !== null)
+                await this.downloadStore.delete_plan_async(tileset);
+            return null;
+        }
+
+        const plan = await handler.plan(missing, this._cancelQueue);
+        const version = await handler.getVersion();
+        if (version !== null) {
+            await this.downloadStore.save_plan_async(
+                tileset,
+                jobId,
+                version,
+                new GLib.Bytes(new TextEncoder().encode(JSON.stringify(plan))),
+                plan.ranges.length
+            );
+        } else if (savedPlan !== null) {
+            await this.downloadStore.delete_plan_async(tileset);
+        }
+
+        return { plan, completed: null, remainingSize: plan.size };
     }
 
     /**
      * @private
-     * @param {DownloadArea} area The area to download
+     * @param {GnomeMaps.TileRange} tiles The tiles to download
      * @param {string} tileset The tileset to download
      * @param {boolean} missingOnly If true, only list missing files,
      * not outdated ones.
+     * @param {Gio.Cancellable?} cancellable
      *
-     * Gets the list of files that need updating in the given area.
+     * Gets the list of files that need updating in the given range, in
+     * ascending order.
      */
-    async getDownloadList(area, tileset, missingOnly = false) {
-        const handler = this.getTilesetHandler(tileset);
+    async getDownloadList(tiles, tileset, missingOnly = false, cancellable = null) {
         const now = Date.now();
 
-        const neededTiles = handler.getTilesForBounds(area.bounds);
+        const neededTiles = tiles.get_ids();
         const mtimeThreshold = missingOnly ? 0 : now - CACHE_AGE;
-        const foundTiles = new Set(await this.downloadStore.filter_by_mtime_async(tileset, neededTiles, mtimeThreshold));
+        const foundTiles = await this.downloadStore.filter_by_mtime_async(
+            tileset, neededTiles, mtimeThreshold, cancellable);
 
-        return Array.from(neededTiles).filter(tile => !foundTiles.has(tile));
+        return sortedDifference(neededTiles, foundTiles);
     }
 
     /**
      * @private
-     * @param {"estimating" | "downloading" | "updating" | "deleting" | "finishing"} job The current job
+     * @param {"estimating" | "downloading" | "updating" | "deleting"} job The current job
      * @param {number} remaining The amount of work left to do
      */
     setProgress(job, remaining) {
@@ -659,8 +846,6 @@ export class DownloadManager extends GObject.Object {
             updating: _("Updating"),
             /* Translators: Progress bar text for deleting offline areas */
             deleting: _("Deleting"),
-            /* Translators: Progress bar text for a cleanup step */
-            finishing: _("Finishing"),
         }[job];
 
         this._progress = {
@@ -754,33 +939,81 @@ GObject.registerClass(
 
 class TilesetHandler {
     /**
-     * Gets the names of the tiles that cover the given bounding box.
+     * Gets the IDs of the tiles that cover the given bounding box.
+     * @param {BoundingBox} bounds
+     * @returns {number[]}
+     */
+    /**
      * @param {BoundingBox} bounds
-     * @returns {string[]}
+     * @returns {GnomeMaps.TileRange}
      */
     getTilesForBounds(bounds) {
         throw new Error("Not implemented");
     }
 
-    /** @returns {Promise<number>} */
+    /**
+     * @param {GnomeMaps.TileRange} tiles
+     * @param {Gio.Cancellable} cancellable
+     * @returns {Promise<number>}
+     */
     async getSizeEstimate(tiles, cancellable) {
         throw new Error("Not implemented");
     }
 
     /**
-     * @callback DownloadCallback
-     * @param {string} name
-     * @param {GLib.Bytes} data
-     * @param {boolean} precompressed
-     * @returns {Promise<void>}
+     * Gets the version of the tileset's source. Saved download plans are
+     * only resumed if the version hasn't changed.
+     *
+     * @returns {Promise<string?>}
      */
+    async getVersion() {
+        throw new Error("Not implemented");
+    }
 
     /**
-     * @param {string[]} tiles
+     * Plans the download of the given tiles. The plan must be serializable
+     * as JSON, and have `size` (the number of bytes to download) and
+     * `ranges` (an array with one entry per unit of work) properties.
+     *
+     * @param {number[]} tiles
      * @param {Gio.Cancellable} cancellable
-     * @param {DownloadCallback} callback
      */
-    async download(tiles, cancellable, callback) {
+    async plan(tiles, cancellable) {
+        throw new Error("Not implemented");
+    }
+
+    /**
+     * @typedef {Object} DownloadedItem
+     * @property {number[]} [tiles]
+     * @property {GLib.Bytes} [data]
+     * @property {boolean} [precompressed]
+     * @property {number} [completedRange] Set instead of the other
+     *   properties when all the tiles of a range of the plan have been
+     *   emitted
+     */
+
+    /**
+     * Fetches the tiles in a plan. This is the network stage of the
+     * download pipeline, so it should do as little else as possible.
+     *
+     * @param {Object} plan A plan returned by plan()
+     * @param {Gio.Cancellable} cancellable
+     * @param {(item: Object) => Promise<void>} emit Called with each item
+     *   that was fetched, which is then passed to decode()
+     * @param {Object} options
+     * @param {(index: number) => boolean} options.isComplete
+     */
+    async download(plan, cancellable, emit, options) {
+        throw new Error("Not implemented");
+    }
+
+    /**
+     * Turns an item emitted by download() into tile data.
+     *
+     * @param {Object} item
+     * @returns {DownloadedItem}
+     */
+    decode(item) {
         throw new Error("Not implemented");
     }
 
@@ -801,35 +1034,49 @@ class VectorTilesetHandler extends TilesetHandler {
     }
 
     getTilesForBounds(bounds) {
-        return tilesForBounds(bounds).map(
-            (tile) => `${tile[0]}/${tile[1]}/${tile[2]}`
+        const range = GnomeMaps.TileRange.new();
+        range.add_bounds(
+            bounds.top,
+            bounds.left,
+            bounds.bottom,
+            bounds.right,
+            0,
+            MAX_ZOOM
         );
+        return range;
     }
 
     async getSizeEstimate(tiles, cancellable) {
         return await this.getPMTilesDownloader().getDownloadSize(
-            this.convertTileNamesToPositions(tiles),
+            tiles.get_ids(),
             cancellable
         );
     }
 
-    async download(tiles, cancellable, callback) {
-        const download = this.getPMTilesDownloader();
-        const tilePositions = this.convertTileNamesToPositions(tiles);
+    async getVersion() {
+        return await this.getPMTilesDownloader().getVersion();
+    }
+
+    async plan(tiles, cancellable) {
+        return await this.getPMTilesDownloader().planDownload(
+            tiles,
+            cancellable
+        );
+    }
 
-        await download.downloadTiles(
-            tilePositions,
+    async download(plan, cancellable, emit, options) {
+        await this.getPMTilesDownloader().downloadPlan(
+            plan,
             cancellable,
-            async (tilePositions, data, precompressed) => {
-                await callback(
-                    tilePositions.map((pos) => `${pos[0]}/${pos[1]}/${pos[2]}`),
-                    data,
-                    precompressed
-                );
-            }
+            emit,
+            options
         );
     }
 
+    decode(item) {
+        return this.getPMTilesDownloader().decodeTile(item);
+    }
+
     /** @private */
     getPMTilesDownloader() {
         if (this._pmTilesDownload === null) {
@@ -837,15 +1084,33 @@ class VectorTilesetHandler extends TilesetHandler {
         }
         return this._pmTilesDownload;
     }
+}
 
-    /** @private */
-    convertTileNamesToPositions(tiles) {
-        return tiles.map((tile) => {
-            const p = tile.split("/");
-            return [parseInt(p[0]), parseInt(p[1]), parseInt(p[2])];
-        });
+/**
+ * Returns the items of `a` that are not in `b`. Both must be sorted in
+ * ascending order.
+ *
+ * @param {number[]} a
+ * @param {number[]} b
+ * @returns {number[]}
+ */
+const sortedDifference = (a, b) => {
+    const result = [];
+    let j = 0;
+    for (const item of a) {
+        while (j < b.length && b[j] < item) j++;
+        if (j >= b.length || b[j] !== item) result.push(item);
     }
-}
+    return result;
+};
+
+/**
+ * @param {Uint8Array?} bitmap
+ * @param {number} index
+ */
+const isBitSet = (bitmap, index) => {
+    return !!bitmap && !!(bitmap[index >> 3] & (1 << (index & 7)));
+};
 
 const getXForLng = (lng, zoom) => ((lng + 180) / 360) * (1 << zoom);
 const getYForLat = (lat, zoom) => {
@@ -856,24 +1121,6 @@ const getYForLat = (lat, zoom) => {
     );
 };
 
-const tilesForBounds = (bounds) => {
-    const tiles = [];
-
-    for (let z = 0; z <= 14; z++) {
-        const left = Math.floor(getXForLng(bounds.left, z));
-        const right = Math.ceil(getXForLng(bounds.right, z));
-        const top = Math.floor(getYForLat(bounds.top, z));
-        const bottom = Math.ceil(getYForLat(bounds.bottom, z));
-        for (let x = left; x < right; x++) {
-            for (let y = top; y < bottom; y++) {
-                tiles.push([z, x, y]);
-            }
-        }
-    }
-
-    return tiles;
-};
-
 export class DownloadArea extends GObject.Object {
     constructor({ manager, ...params }) {
         super(params);
@@ -944,7 +1191,8 @@ export class DownloadArea extends GObject.Object {
                 for (const tileset in tiles) {
                     sum += await this.manager.downloadStore.compute_size_async(
                         tileset,
-                        tiles[tileset]
+                        tiles[tileset].get_ids(),
+                        null
                     );
                 }
 
@@ -961,7 +1209,7 @@ export class DownloadArea extends GObject.Object {
         return this._manager;
     }
 
-    /** @returns {{ [tileset: string]: string[] }} */
+    /** @returns {{ [tileset: string]: GnomeMaps.TileRange }} */
     getTiles() {
         const result = {};
         for (const tileset of this.tilesets) {
@@ -49,16 +49,28 @@ Gio.Resource.load(GLib.build_filenamev([pkg.pkgdatadir, `${pkg.name}.shields.gre
 Gio._promisify(Adw.AlertDialog.prototype, 'choose', 'choose_finish');
 
 Gio._promisify(Gio.InputStream.prototype, 'read_bytes_async', 'read_bytes_finish');
+Gio._promisify(Gio.InputStream.prototype, 'skip_async', 'skip_finish');
 Gio._promisify(Gio.OutputStream.prototype, 'splice_async', 'splice_finish');
 
 Gio._promisify(GnomeMaps.DownloadStore.prototype, 'insert_async', 'insert_finish');
+Gio._promisify(GnomeMaps.DownloadStore.prototype, 'insert_batch_async', 'insert_batch_finish');
 Gio._promisify(GnomeMaps.DownloadStore.prototype, 'remove_async', 'remove_finish');
-Gio._promisify(GnomeMaps.DownloadStore.prototype, 'get_async', 'get_finish');
 Gio._promisify(GnomeMaps.DownloadStore.prototype, 'exec_async', 'exec_finish');
 Gio._promisify(GnomeMaps.DownloadStore.prototype, 'list_tilesets_async', 'list_tilesets_finish');
 Gio._promisify(GnomeMaps.DownloadStore.prototype, 'list_tiles_async', 'list_tiles_finish');
+Gio._promisify(GnomeMaps.DownloadStore.prototype, 'set_area_async', 'set_area_finish');
+Gio._promisify(GnomeMaps.DownloadStore.prototype, 'remove_area_async', 'remove_area_finish');
+Gio._promisify(GnomeMaps.DownloadStore.prototype, 'list_areas_async', 'list_areas_finish');
+Gio._promisify(GnomeMaps.DownloadStore.prototype, 'enforce_quota_async', 'enforce_quota_finish');
+Gio._promisify(GnomeMaps.DownloadStore.prototype, 'reclaim_async', 'reclaim_finish');
 Gio._promisify(GnomeMaps.DownloadStore.prototype, 'compute_size_async', 'compute_size_finish');
 Gio._promisify(GnomeMaps.DownloadStore.prototype, 'filter_by_mtime_async', 'filter_by_mtime_finish');
+Gio._promisify(GnomeMaps.DownloadStore.prototype, 'save_plan_async', 'save_plan_finish');
+Gio._promisify(GnomeMaps.DownloadStore.prototype, 'load_plan_async', 'load_plan_finish');
+Gio._promisify(GnomeMaps.DownloadStore.prototype, 'complete_plan_range_async', 'complete_plan_range_finish');
+Gio._promisify(GnomeMaps.DownloadStore.prototype, 'delete_plan_async', 'delete_plan_finish');
+
+Gio._promisify(GnomeMaps.PMTilesIndex.prototype, 'resolve_async', 'resolve_finish');
 
 Gio._promisify(Soup.Session.prototype, 'send_async', 'send_finish');
 Gio._promisify(Soup.Session.prototype, 'send_and_read_async', 'send_and_read_finish');
@@ -26,7 +26,6 @@ import GnomeMaps from 'gi://GnomeMaps';
 import {Application} from './application.js';
 import * as Utils from './utils.js';
 import { DEFAULT_TILE_URL_PATTERN, generateMapStyle } from './mapStyle/mapStyle.js';
-import { OfflineDataSource } from "./offlineDataSource.js";
 
 let lightStyle = null;
 let darkStyle = null;
@@ -62,10 +61,16 @@ export function createVectorSource() {
     const source = Shumate.VectorRenderer.new("vector-tiles", style);
     const tileDownloader = Shumate.TileDownloader.new(styleParams.tileUrlPattern);
     tileDownloader.max_zoom_level = 14;
-    source.set_data_source(
-        "vector-tiles",
-        new OfflineDataSource(Application.downloads, tileDownloader)
-    );
+
+    let dataSource = Application.downloads.createDataSource("vector", tileDownloader);
+    for (const path of Application.settings.get('offline-pmtiles-files').reverse()) {
+        try {
+            dataSource = GnomeMaps.PMTilesDataSource.new(path, dataSource);
+        } catch (e) {
+            logError(e, `Could not open ${path}`);
+        }
+    }
+    source.set_data_source("vector-tiles", dataSource);
     source.set_license("© OpenMapTiles © OpenStreetMap contributors");
     source.set_license_uri("https://www.openstreetmap.org/copyright");
 
@@ -23,6 +23,7 @@ import Adw from 'gi://Adw';
 import GObject from 'gi://GObject';
 import Gdk from 'gi://Gdk';
 import GeocodeGlib from 'gi://GeocodeGlib';
+import GnomeMaps from 'gi://GnomeMaps';
 import Gio from 'gi://Gio';
 import GLib from 'gi://GLib';
 import Gtk from 'gi://Gtk';
@@ -140,6 +141,7 @@ export class MapView extends Gtk.Overlay {
         this._storeId = 0;
         this._storeRotationId = 0;
         this.map = this._initMap();
+        this._tilePrefetcher = GnomeMaps.TilePrefetcher.new(this.map);
 
         this.child = this.map;
 
@@ -338,6 +340,7 @@ export class MapView extends Gtk.Overlay {
         });
 
         this._routeLayers = [];
+        this._tilePrefetcher.set_route(null);
     }
 
     _initLayers() {
@@ -491,6 +494,7 @@ export class MapView extends Gtk.Overlay {
         mapLayer.connect("map-loaded", this._onMapLoaded.bind(this));
 
         this.map.viewport.set_reference_map_source(mapSource);
+        this._tilePrefetcher.set_data_source(Application.downloads.getDataSource("vector"));
 
         this._mapSource = mapSource;
 
@@ -1056,6 +1060,7 @@ export class MapView extends Gtk.Overlay {
                                             TURN_BY_TURN_ROUTE_OUTLINE_COLOR,
                                             ROUTE_LINE_WIDTH + 4, 2);
         route.path.forEach((polyline) => routeLayer.add_node(polyline));
+        this._tilePrefetcher.set_route(route.path);
         this.routingOpen = true;
 
         this._showDestinationTurnpoints();
@@ -0,0 +1,361 @@
+/* -*- Mode: JS2; indent-tabs-mode: nil; js2-basic-offset: 4 -*- */
+/* vim: set et ts=4 sw=4: */
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+import GLib from "gi://GLib";
+
+import * as Utils from "./utils.js";
+
+/* Number of items that can wait between two stages before the earlier stage
+   has to wait for the later one */
+const DEFAULT_QUEUE_LENGTH = 256;
+/* Limits on the size of a batch passed to the write stage */
+const DEFAULT_BATCH_SIZE = 1000;
+const DEFAULT_BATCH_COST = 4 * 1024 * 1024;
+/* A batch is written once its first item has waited this long, even if it
+   isn't full, so that a slow download still makes progress */
+const MAX_BATCH_DELAY = 1_000_000; // 1 second, in microseconds
+
+/**
+ * A FIFO queue with a maximum length. put() waits while the queue is full
+ * and take() waits while it is empty, so a producer can't get further ahead
+ * of its consumer than the length of the queue.
+ *
+ * @template T
+ */
+export class BoundedQueue {
+    /**
+     * @param {number} capacity
+     */
+    constructor(capacity) {
+        this._capacity = capacity;
+        /** @type {T[]} */
+        this._items = [];
+        this._closed = false;
+        this._error = null;
+        /** @type {(() => void)[]} */
+        this._waiting = [];
+    }
+
+    get length() {
+        return this._items.length;
+    }
+
+    /**
+     * Adds an item, waiting until there is room for it.
+     *
+     * @param {T} item
+     * @returns {Promise<void>}
+     */
+    async put(item) {
+        while (this._items.length >= this._capacity && !this._closed)
+            await this._wait();
+
+        if (this._error)
+            throw this._error;
+        if (this._closed)
+            throw new Error("Queue is closed");
+
+        this._items.push(item);
+        this._wake();
+    }
+
+    /**
+     * Removes the oldest item, waiting until there is one.
+     *
+     * @returns {Promise<T?>} The item, or null if the queue is closed and
+     * there are no items left
+     */
+    async take() {
+        while (this._items.length === 0 && !this._closed)
+            await this._wait();
+
+        if (this._error)
+            throw this._error;
+
+        const item = this._items.shift() ?? null;
+        this._wake();
+        return item;
+    }
+
+    /**
+     * Waits until an item can be taken without waiting, or until `timeout`
+     * has passed.
+     *
+     * @param {number} timeout In microseconds
+     * @returns {Promise<boolean>} Whether take() would return right away
+     */
+    async waitForItem(timeout) {
+        let timeoutId = 0;
+        if (timeout > 0) {
+            timeoutId = GLib.timeout_add(GLib.PRIORITY_DEFAULT, Math.ceil(timeout / 1000), () => {
+                timeoutId = 0;
+                this._wake();
+                return GLib.SOURCE_REMOVE;
+            });
+        }
+
+        try {
+            while (this._items.length === 0 && !this._closed && timeoutId !== 0)
+                await this._wait();
+        } finally {
+            if (timeoutId !== 0)
+                GLib.source_remove(timeoutId);
+        }
+
+        return this._items.length > 0 || this._closed;
+    }
+
+    /**
+     * Marks the end of the items. Items already in the queue can still be
+     * taken.
+     */
+    close() {
+        this._closed = true;
+        this._wake();
+    }
+
+    /**
+     * Stops the queue. Pending and future calls to put() and take() throw
+     * the error.
+     *
+     * @param {Error} error
+     */
+    abort(error) {
+        this._error ??= error;
+        this._items = [];
+        this.close();
+    }
+
+    /** @private */
+    _wait() {
+        return new Promise((resolve) => this._waiting.push(resolve));
+    }
+
+    /** @private */
+    _wake() {
+        const waiting = this._waiting;
+        this._waiting = [];
+        for (const resolve of waiting)
+            resolve();
+    }
+}
+
+/**
+ * Runs a download as three stages connected by bounded queues: fetching
+ * (network reads), decoding (CPU) and writing (disk), so that each one
+ * works while the others wait on I/O, and a slow stage holds the earlier
+ * ones back instead of letting memory fill up.
+ *
+ * The write stage gets items in batches, so it can write many of them in
+ * one transaction.
+ *
+ * When it is finished, the time each stage spent working and waiting is
+ * logged, which shows which one is the bottleneck.
+ *
+ * @template Raw, Decoded
+ */
+export class Pipeline {
+    /**
+     * @param {Object} params
+     * @param {(emit: (item: Raw) => Promise<void>) => Promise<void>} params.fetch
+     *   Produces the items, calling `emit` for each one
+     * @param {(item: Raw) => Decoded} params.decode
+     * @param {(items: Decoded[]) => Promise<void>} params.write
+     * @param {(item: Decoded) => number} [params.cost] The cost of an item
+     *   towards the size of a batch, such as its size in bytes
+     * @param {number} [params.queueLength]
+     * @param {number} [params.batchSize] Maximum number of items in a batch
+     * @param {number} [params.batchCost] Maximum total cost of a batch
+     */
+    constructor({
+        fetch,
+        decode,
+        write,
+        cost = () => 0,
+        queueLength = DEFAULT_QUEUE_LENGTH,
+        batchSize = DEFAULT_BATCH_SIZE,
+        batchCost = DEFAULT_BATCH_COST,
+    }) {
+        this._fetch = fetch;
+        this._decode = decode;
+        this._write = write;
+        this._cost = cost;
+        this._batchSize = batchSize;
+        this._batchCost = batchCost;
+
+        /** @type {BoundedQueue<Raw>} */
+        this._fetched = new BoundedQueue(queueLength);
+        /** @type {BoundedQueue<Decoded>} */
+        this._decoded = new BoundedQueue(queueLength);
+
+        /* All times are in microseconds */
+        this._stats = {
+            elapsed: 0,
+            /* Time the fetch stage spent waiting for room in the queue */
+            fetchBlocked: 0,
+            decode: 0,
+            decodeIdle: 0,
+            decodeBlocked: 0,
+            write: 0,
+            writeIdle: 0,
+            items: 0,
+            batches: 0,
+        };
+    }
+
+    /**
+     * Time spent in each stage, in microseconds. Idle means waiting for
+     * the previous stage, and blocked means waiting for the next one.
+     */
+    get stats() {
+        return this._stats;
+    }
+
+    /**
+     * Runs the pipeline until all items are fetched and written.
+     *
+     * If fetching fails (for example because it was cancelled), the items
+     * that were already fetched are still written before the error is
+     * thrown. If decoding or writing fails, everything stops.
+     *
+     * @param {string} name Name of the pipeline for the log
+     * @returns {Promise<void>}
+     */
+    async run(name) {
+        const started = GLib.get_monotonic_time();
+        let error = null;
+
+        const fail = (e) => {
+            error ??= e;
+            this._fetched.abort(e);
+            this._decoded.abort(e);
+        };
+
+        await Promise.all([
+            this._runFetch().catch((e) => {
+                /* Let the other stages finish what they have */
+                error ??= e;
+            }),
+            this._runDecode().catch(fail),
+            this._runWrite().catch(fail),
+        ]);
+
+        this._stats.elapsed = GLib.get_monotonic_time() - started;
+        this._logStats(name);
+
+        if (error)
+            throw error;
+    }
+
+    /** @private */
+    async _runFetch() {
+        try {
+            await this._fetch(async (item) => {
+                const waitStarted = GLib.get_monotonic_time();
+                await this._fetched.put(item);
+                this._stats.fetchBlocked += GLib.get_monotonic_time() - waitStarted;
+            });
+        } finally {
+            this._fetched.close();
+        }
+    }
+
+    /** @private */
+    async _runDecode() {
+        try {
+            for (;;) {
+                let time = GLib.get_monotonic_time();
+                const item = await this._fetched.take();
+                this._stats.decodeIdle += GLib.get_monotonic_time() - time;
+                if (item === null)
+                    break;
+
+                time = GLib.get_monotonic_time();
+                const decoded = this._decode(item);
+                this._stats.decode += GLib.get_monotonic_time() - time;
+
+                time = GLib.get_monotonic_time();
+                await this._decoded.put(decoded);
+                this._stats.decodeBlocked += GLib.get_monotonic_time() - time;
+            }
+        } finally {
+            this._decoded.close();
+        }
+    }
+
+    /** @private */
+    async _runWrite() {
+        let batch = [];
+        let batchCost = 0;
+        let batchStarted = 0;
+
+        const flush = async () => {
+            const time = GLib.get_monotonic_time();
+            await this._write(batch);
+            this._stats.write += GLib.get_monotonic_time() - time;
+            this._stats.items += batch.length;
+            this._stats.batches++;
+
+            batch = [];
+            batchCost = 0;
+        };
+
+        for (;;) {
+            const time = GLib.get_monotonic_time();
+
+            /* Write a partial batch once it has waited long enough, even if
+               no more items come in */
+            if (batch.length > 0 &&
+                !await this._decoded.waitForItem(batchStarted + MAX_BATCH_DELAY - time)) {
+                this._stats.writeIdle += GLib.get_monotonic_time() - time;
+                await flush();
+                continue;
+            }
+
+            const item = await this._decoded.take();
+            this._stats.writeIdle += GLib.get_monotonic_time() - time;
+            if (item === null)
+                break;
+
+            if (batch.length === 0)
+                batchStarted = GLib.get_monotonic_time();
+            batch.push(item);
+            batchCost += this._cost(item);
+
+            if (batch.length >= this._batchSize ||
+                batchCost >= this._batchCost ||
+                GLib.get_monotonic_time() - batchStarted >= MAX_BATCH_DELAY)
+                await flush();
+        }
+
+        if (batch.length > 0)
+            await flush();
+    }
+
+    /** @private */
+    _logStats(name) {
+        const ms = (us) => (us / 1000).toFixed(0);
+        const stats = this._stats;
+
+        Utils.debug(
+            `${name}: ${stats.items} items in ${stats.batches} batches, ${ms(stats.elapsed)} ms; ` +
+            `fetch blocked ${ms(stats.fetchBlocked)} ms; ` +
+            `decode ${ms(stats.decode)} ms (idle ${ms(stats.decodeIdle)} ms, blocked ${ms(stats.decodeBlocked)} ms); ` +
+            `write ${ms(stats.write)} ms (idle ${ms(stats.writeIdle)} ms)`
+        );
+    }
+}
@@ -18,6 +18,8 @@
 import GLib from "gi://GLib";
 import Gio from "gi://Gio";
 import Soup from "gi://Soup";
+import GnomeMaps from "gi://GnomeMaps";
+import { Pipeline } from "./pipeline.js";
 import * as Utils from "./utils.js";
 import System from "system";
 
@@ -31,19 +33,38 @@ const Compression = {
 
 /** Maximum amount of data to fetch in a single tile request (16MB) */
 const MAX_RANGE_LENGTH = 1 << 24;
-/** Number of parallel requests to make when downloading tiles. Tiles are generally downloaded in lots of small ranges,
- * so having multiple requests in flight at once can significantly improve performance. */
+/** Bounds for the gap between two ranges that is downloaded and thrown away
+ * rather than starting a new request, see PMTilesDownload.gapThreshold */
+const MIN_GAP_THRESHOLD = 4 * 1024;
+const MAX_GAP_THRESHOLD = 1 << 20;
+/** Gap threshold to use until requests have been measured */
+const DEFAULT_GAP_THRESHOLD = 32 * 1024;
+/** Responses smaller than this are dominated by latency, so they don't say
+ * much about bandwidth */
+const MIN_BANDWIDTH_SAMPLE = 16 * 1024;
+/** Weight of a new sample in the latency and bandwidth averages */
+const SAMPLE_WEIGHT = 0.25;
+/** Number of parallel requests to make when fetching leaf directories */
 const PARALLEL_DOWNLOADS = 4;
+/** Bounds for the number of tile requests in flight at once, see ConcurrencyController. Tiles are generally downloaded
+ * in lots of small ranges, so having multiple requests in flight at once can significantly improve performance. */
+const MIN_CONCURRENT_DOWNLOADS = 1;
+const INITIAL_CONCURRENT_DOWNLOADS = 2;
+const MAX_CONCURRENT_DOWNLOADS = 32;
+/** How much throughput has to improve for a higher concurrency to count as better */
+const THROUGHPUT_MARGIN = 0.1;
+/** Round trip times this many times the minimum mean requests are queueing up somewhere */
+const RTT_TOLERANCE = 2;
 
 /** @typedef {{offset: number, length: number}} Range */
 /** @typedef {[number, number, number]} TilePos */
+/** @typedef {number} TileID A tile ID as defined by the PMTiles spec, see getTileID() */
 
-const createCaches = (header, rootDir) => {
+const createCaches = (header, index) => {
     return {
         header,
-        rootDir,
-        leafDirs: new LRUCache(100),
-        tileRanges: new LRUCache(1000),
+        /** @type {GnomeMaps.PMTilesIndex} */
+        index,
     };
 }
 
@@ -59,17 +80,63 @@ export class PMTilesDownload {
 
         /** @private */
         this._session = null;
+
+        /** @private @type {number?} Average time to response headers, in seconds */
+        this._latency = null;
+        /** @private @type {number?} Average transfer rate, in bytes per second */
+        this._bandwidth = null;
+        /** @private @type {number?} */
+        this._gapThreshold = null;
+        /** @private */
+        this._concurrency = new ConcurrencyController();
     }
 
     get url() {
         return this._url;
     }
 
+    /**
+     * Controls how many tile requests are in flight at once. It keeps what it
+     * has learned about the server between downloads.
+     *
+     * @type {ConcurrencyController}
+     */
+    get concurrency() {
+        return this._concurrency;
+    }
+
+    /**
+     * The largest gap between two tile ranges that is downloaded and thrown
+     * away in order to fetch both ranges in one request. Unless it is set
+     * explicitly, this is the amount of data that could be transferred in the
+     * time it takes to make another request, based on the requests made so
+     * far.
+     *
+     * @type {number}
+     */
+    get gapThreshold() {
+        if (this._gapThreshold !== null)
+            return this._gapThreshold;
+
+        if (this._latency === null || this._bandwidth === null)
+            return DEFAULT_GAP_THRESHOLD;
+
+        return Math.min(
+            MAX_GAP_THRESHOLD,
+            Math.max(MIN_GAP_THRESHOLD, Math.round(this._latency * this._bandwidth))
+        );
+    }
+
+    /** @param {number?} threshold The threshold in bytes, or null to measure it */
+    set gapThreshold(threshold) {
+        this._gapThreshold = threshold;
+    }
+
     /**
      * Estimates the amount of tile data to be downloaded. This calculation
      * requires downloading index information from the PMTiles file.
      *
-     * @param {TilePos[]} tiles
+     * @param {TileID[]} tiles
      * @param {Gio.Cancellable} cancellable
      * @returns {Promise<number>}
      */
@@ -90,65 +157,180 @@ export class PMTilesDownload {
             return this._caches;
         }
 
-        const [header, rootDir] = await this.fetchHeaderAndRootDir();
-        this._caches = createCaches(header, rootDir);
+        const [header, index] = await this.fetchHeaderAndRootDir();
+        this._caches = createCaches(header, index);
         return this._caches;
     }
 
     /**
      * @callback TileCallback
-     * @param {TilePos[]} tilePositions
+     * @param {TileID[]} tileIds
      * @param {GLib.Bytes} data
      * @param {boolean} precompressed
      * @returns {Promise<void>}
      *
      * Note: Because PMTiles deduplicates tile data, the same data may be
-     * returned for multiple tile positions. This is why @tilePositions is an
-     * array.
+     * returned for multiple tiles. This is why @tileIds is an array.
+     */
+
+    /**
+     * @typedef {Object} PlannedRange
+     * @property {Range} range The byte range to request
+     * @property {{skip?: number, length: number, tiles: TileID[]}[]} tiles
+     *   The tiles in the range, in order. `skip` is the number of bytes
+     *   before the tile that aren't needed.
+     */
+
+    /**
+     * @typedef {Object} DownloadPlan
+     * @property {string?} version The ETag of the PMTiles file the plan is for
+     * @property {PlannedRange[]} ranges
+     * @property {number} size Total number of bytes to download
      */
 
+    /**
+     * Gets the version of the PMTiles file, which is its ETag. Plans made for
+     * one version can't be used with another.
+     *
+     * @returns {Promise<string?>}
+     */
+    async getVersion() {
+        const caches = await this.getCaches();
+        return caches.header.etag ?? null;
+    }
+
+    /**
+     * Works out which ranges of the PMTiles file to download to get the
+     * given tiles. The plan is plain data, so it can be saved and resumed
+     * later with downloadPlan().
+     *
+     * @param {TileID[]} tiles
+     * @param {Gio.Cancellable} cancellable
+     * @returns {Promise<DownloadPlan>}
+     */
+    async planDownload(tiles, cancellable) {
+        const caches = await this.getCaches();
+        const ranges = await this.getDownloadPlan(tiles, cancellable, caches);
+
+        /* Start the largest ranges first, so that a big range started near
+           the end doesn't keep the download going on its own */
+        ranges.sort((a, b) => b.range.length - a.range.length);
+
+        return {
+            version: caches.header.etag ?? null,
+            ranges,
+            size: ranges.reduce((acc, range) => acc + range.range.length, 0),
+        };
+    }
+
     /**
      * Downloads the tiles from the PMTiles file and calls the callback
      * for each one.
      *
+     * @param {TileID[]} tiles
      * @param {Gio.Cancellable} cancellable
      * @param {TileCallback} callback
      * @returns {Promise<void>}
      */
     async downloadTiles(tiles, cancellable, callback) {
+        const plan = await this.planDownload(tiles, cancellable);
+        const pipeline = new Pipeline({
+            fetch: (emit) => this.downloadPlan(plan, cancellable, emit),
+            decode: (item) => this.decodeTile(item),
+            write: async (items) => {
+                for (const item of items) {
+                    if (item.data)
+                        await callback(item.tiles, item.data, item.precompressed);
+                }
+            },
+        });
+        await pipeline.run("PMTiles download");
+    }
+
+    /**
+     * @typedef {Object} FetchedTile
+     * @property {TileID[]} tiles
+     * @property {GLib.Bytes[]} chunks The tile data as it was read from
+     *   the network, still compressed
+     * @property {number} compression The compression of the data
+     */
+
+    /**
+     * @typedef {Object} RangeCompleted
+     * @property {number} completedRange The index of a range in the plan
+     *   whose tiles have all been emitted
+     */
+
+    /**
+     * Downloads the ranges of a plan. This is the network stage of a
+     * download Pipeline: it emits each tile's raw data, which is
+     * then passed through decodeTile(). After all the tiles of a range,
+     * it emits a marker with the range's index.
+     *
+     * @param {DownloadPlan} plan
+     * @param {Gio.Cancellable} cancellable
+     * @param {(item: FetchedTile|RangeCompleted) => Promise<void>} emit
+     * @param {Object} [options]
+     * @param {(index: number) => boolean} [options.isComplete] Whether a
+     *   range was already downloaded, in which case it is skipped
+     * @returns {Promise<void>}
+     */
+    async downloadPlan(plan, cancellable, emit, { isComplete } = {}) {
         const caches = await this.getCaches();
-        const plan = await this.getDownloadPlan(tiles, cancellable, caches);
+        if (plan.version !== (caches.header.etag ?? null)) {
+            throw new Error("PMTiles file has changed since the download was planned");
+        }
+
+        const indices = plan.ranges
+            .map((_range, i) => i)
+            .filter((i) => !isComplete?.(i));
 
-        const totalSize = plan.reduce((acc, range) => {
-            return acc + range.range.length;
-        }, 0);
         Utils.debug(
-            `Downloading ${tiles.length} tiles, ${totalSize} bytes in ${plan.length} ranges`
+            `Downloading ${plan.size} bytes in ${indices.length} of ${plan.ranges.length} ranges`
         );
 
-        /* Sort ranges by size to improve parallelism */
-        plan.sort((a, b) => a.range.length - b.range.length);
+        this._concurrency.downloadStarted();
 
-        await parallelLoop(plan, async (range) => {
+        await adaptiveLoop(indices, async (index) => {
+            const range = plan.ranges[index];
             cancellable?.set_error_if_cancelled();
 
             if (range.range.length === 0) {
-                const empty = new GLib.Bytes([]);
                 for (const tile of range.tiles) {
-                    await callback(tile.tiles, empty, false);
+                    await emit({ tiles: tile.tiles, chunks: [], compression: Compression.NONE });
                 }
-                return;
+                await emit({ completedRange: index });
+                return null;
             }
 
-            const [stream, _etag] = await this.fetch(
+            const sent = GLib.get_monotonic_time();
+            const [stream, _etag, started] = await this.fetch(
                 range.range.offset,
                 range.range.offset + range.range.length - 1,
                 cancellable,
                 caches.header.etag,
             );
 
+            /* Time spent waiting for the next pipeline stage, which
+               doesn't count towards the bandwidth */
+            let blocked = 0;
+
             try {
                 for (const tile of range.tiles) {
+                    /* skip the gap between this tile and the previous one */
+                    let skip = tile.skip ?? 0;
+                    while (skip > 0) {
+                        const skipped = await stream.skip_async(
+                            skip,
+                            Gio.PRIORITY_DEFAULT,
+                            cancellable
+                        );
+                        if (skipped === 0) {
+                            throw new Error("Unexpected end of stream");
+                        }
+                        skip -= skipped;
+                    }
+
                     let remaining = tile.length;
                     let chunks = [];
                     while (remaining > 0) {
@@ -164,65 +346,127 @@ export class PMTilesDownload {
                         remaining -= bytes.get_size();
                     }
 
-                    let tileData, precompressed;
-                    if (caches.header.tileCompression === Compression.GZIP) {
-                        tileData = decompress(chunks, Compression.NONE);
-                        precompressed = true;
-                    } else {
-                        tileData = decompress(chunks, caches.header.tileCompression);
-                        precompressed = false;
-                    }
-
-                    await callback(tile.tiles, tileData, precompressed);
+                    const emitted = GLib.get_monotonic_time();
+                    await emit({
+                        tiles: tile.tiles,
+                        chunks,
+                        compression: caches.header.tileCompression,
+                    });
+                    blocked += GLib.get_monotonic_time() - emitted;
                 }
+
+                this.recordTransfer(range.range.length, started + blocked);
             } finally {
                 stream.close(null);
             }
-        }, PARALLEL_DOWNLOADS);
+
+            await emit({ completedRange: index });
+            return { length: range.range.length, rtt: (started - sent) / 1_000_000 };
+        }, this._concurrency);
+
+        Utils.debug(`Finished download with up to ${this._concurrency.peak} requests in flight`);
+    }
+
+    /**
+     * Decodes a tile emitted by downloadPlan(). This is the decode stage of
+     * a download pipeline. Range markers are passed through unchanged.
+     *
+     * Gzip compressed tiles are left compressed, since the download store
+     * can take them that way.
+     *
+     * @param {FetchedTile|RangeCompleted} item
+     * @returns {{tiles: TileID[], data: GLib.Bytes, precompressed: boolean}|RangeCompleted}
+     */
+    decodeTile(item) {
+        if (!item.chunks)
+            return item;
+
+        if (item.chunks.length === 0)
+            return { tiles: item.tiles, data: new GLib.Bytes([]), precompressed: false };
+
+        if (item.compression === Compression.GZIP) {
+            return {
+                tiles: item.tiles,
+                data: decompress(item.chunks, Compression.NONE),
+                precompressed: true,
+            };
+        } else {
+            return {
+                tiles: item.tiles,
+                data: decompress(item.chunks, item.compression),
+                precompressed: false,
+            };
+        }
     }
 
     /**
      * @private
-     * @param {TilePos[]} tiles
+     * @param {TileID[]} tiles
      */
     async getDownloadPlan(tiles, cancellable, caches) {
-        const ranges = [];
-        let i = 0;
-        for (const tile of tiles) {
-            cancellable?.set_error_if_cancelled();
+        /* The index resolves the whole batch on a worker thread. Tiles in
+           leaf directories that haven't been fetched yet come back empty,
+           along with the list of leaves they need, so fetch those and
+           resolve the rest again. Only unresolved tiles are retried, so
+           leaves that get evicted from the index's cache in the meantime
+           don't matter for the tiles that already have their ranges.
+
+           A round needs more leaves either because they are nested deeper,
+           which the index limits, or because the ones it needs were
+           evicted to make room for others. Either way, each round fetches
+           a leaf for the first time or resolves more tiles, so the loop
+           ends. */
+        const offsets = new Array(tiles.length).fill(0);
+        const lengths = new Array(tiles.length).fill(0);
+        const fetchedLeaves = new Set();
+        let pending = tiles.map((_tile, i) => i);
+
+        for (;;) {
+            const [batchOffsets, batchLengths, leafOffsets, leafLengths] =
+                await caches.index.resolve_async(pending.map((i) => tiles[i]),
+                                                 cancellable ?? null);
+
+            pending.forEach((tileIndex, i) => {
+                offsets[tileIndex] = batchOffsets[i];
+                lengths[tileIndex] = batchLengths[i];
+            });
+
+            if (leafOffsets.length === 0)
+                break;
+
+            const unresolved = pending.filter((_tileIndex, i) => batchLengths[i] === 0);
+            const newLeaves = leafOffsets.filter((offset) => !fetchedLeaves.has(offset));
+            if (newLeaves.length === 0 && unresolved.length === pending.length)
+                throw new Error("PMTiles leaf directories don't fit in the index's cache");
+            pending = unresolved;
+            for (const offset of leafOffsets)
+                fetchedLeaves.add(offset);
+
+            await parallelLoop(
+                leafOffsets.map((offset, i) => [offset, leafLengths[i]]),
+                ([offset, length]) => this.fetchLeafDir(offset, length, caches, cancellable),
+                PARALLEL_DOWNLOADS
+            );
+        }
 
-            i++;
-            if (i % 1000 === 0) {
-                /* yield to the main loop so the UI doesn't stutter */
-                await new Promise((resolve) => {
-                    GLib.idle_add(GLib.PRIORITY_DEFAULT_IDLE, () => {
-                        resolve();
-                        return GLib.SOURCE_REMOVE;
-                    });
-                });
-            }
+        const [_hits, misses, evictions] = caches.index.get_leaf_cache_stats();
+        Utils.debug(`Resolved ${tiles.length} tiles, ${misses} leaf directory misses, ${evictions} evictions`);
 
-            const range = await this.getTileRange(getTileID(tile), caches);
-            if (range === null) {
-                ranges.push({
-                    range: {
-                        offset: 0,
-                        length: 0,
-                    },
-                    tile,
-                });
-            } else {
-                ranges.push({
-                    range,
-                    tile,
-                });
-            }
-        }
+        const ranges = tiles.map((tile, i) => ({
+            range: {
+                offset: lengths[i] === 0 ? 0 : caches.header.tileData.offset + offsets[i],
+                length: lengths[i],
+            },
+            tile,
+        }));
 
         /* sort by offset */
         ranges.sort((a, b) => a.range.offset - b.range.offset);
 
-        /* merge adjacent ranges */
+        /* Merge adjacent ranges. Ranges with a small gap between them are
+           merged too, since downloading the gap is quicker than making
+           another request. The gap is skipped when reading the response. */
+        const gapThreshold = this.gapThreshold;
         const mergedRanges = [];
         let currentRange = null;
 
@@ -236,13 +480,23 @@ export class PMTilesDownload {
                         currentRange.tiles.length - 1
                     ].tiles.push(nextRange.tile);
                     continue;
-                } else if (
-                    currentRange.range.offset + currentRange.range.length ===
-                        nextRange.range.offset &&
-                    currentRange.range.length < MAX_RANGE_LENGTH
+                }
+
+                const gap = nextRange.range.offset -
+                    (currentRange.range.offset + currentRange.range.length);
+                /* missing tiles have empty ranges at offset 0, which must
+                   not be merged with actual data */
+                const canSkipGap = gap <= gapThreshold &&
+                    currentRange.range.length > 0 &&
+                    nextRange.range.length > 0;
+
+                if (
+                    (gap === 0 || (gap > 0 && canSkipGap)) &&
+                    currentRange.range.length + gap < MAX_RANGE_LENGTH
                 ) {
-                    currentRange.range.length += nextRange.range.length;
+                    currentRange.range.length += gap + nextRange.range.length;
                     currentRange.tiles.push({
+                        skip: gap,
                         length: nextRange.range.length,
                         tiles: [nextRange.tile],
                     });
@@ -267,6 +521,10 @@ export class PMTilesDownload {
             mergedRanges.push(currentRange);
         }
 
+        Utils.debug(
+            `Planned ${mergedRanges.length} requests for ${ranges.length} tiles with a gap threshold of ${gapThreshold} bytes`
+        );
+
         /* Download planning creates a lot of temporary objects, so it's a good time to run GC. */
         System.gc();
 
@@ -355,35 +613,33 @@ export class PMTilesDownload {
             header.etag,
         );
 
-        return [header, readDirectory(rootDirData.toArray())];
+        return [header, GnomeMaps.PMTilesIndex.new(rootDirData)];
     }
 
     /** @private */
-    async fetchLeafDir(offset, length, caches) {
-        const existing = caches.leafDirs.get(offset);
-        if (existing) {
-            return existing;
+    async fetchLeafDir(offset, length, caches, cancellable) {
+        if (caches.index.has_leaf(offset)) {
+            return;
         }
 
         const [data, _etag] = await this.fetchAll(
             caches.header.leafDirs.offset + offset,
             caches.header.leafDirs.offset + offset + length - 1,
             caches.header.internalCompression,
-            null,
+            cancellable,
             caches.header.etag,
         );
 
-        const leafDir = readDirectory(data.toArray());
-        caches.leafDirs.set(offset, leafDir);
-
-        return leafDir;
+        caches.index.add_leaf(offset, data);
     }
 
     /**
      * @private
-     * @returns {Promise<[Gio.InputStream, string]>}
+     * @returns {Promise<[Gio.InputStream, string, number]>} the response
+     *   body, its ETag, and the monotonic time when the response started
      */
     async fetch(start, end, cancellable, etag) {
+        const sent = GLib.get_monotonic_time();
         const msg = Soup.Message.new("GET", this.url);
         msg.request_headers.set_range(start, end);
         if (etag) {
@@ -410,21 +666,39 @@ export class PMTilesDownload {
             }
         }
 
-        return [stream, msg.response_headers.get_one("ETag")];
+        const started = GLib.get_monotonic_time();
+        this._latency = average(this._latency, (started - sent) / 1_000_000);
+
+        return [stream, msg.response_headers.get_one("ETag"), started];
+    }
+
+    /**
+     * @private
+     * Updates the bandwidth estimate after reading a response.
+     *
+     * @param {number} length Number of bytes read
+     * @param {number} started Monotonic time when the response started
+     */
+    recordTransfer(length, started) {
+        const elapsed = (GLib.get_monotonic_time() - started) / 1_000_000;
+        if (length >= MIN_BANDWIDTH_SAMPLE && elapsed > 0) {
+            this._bandwidth = average(this._bandwidth, length / elapsed);
+        }
     }
 
     /** @private */
     async fetchAll(start, end, compression, cancellable, etag) {
-        const [stream, receivedEtag] = await this.fetch(start, end, cancellable, etag);
+        const [stream, receivedEtag, started] = await this.fetch(start, end, cancellable, etag);
 
         const memStream = Gio.MemoryOutputStream.new_resizable();
-        await memStream.splice_async(
+        const length = await memStream.splice_async(
             stream,
             Gio.OutputStreamSpliceFlags.CLOSE_SOURCE |
                 Gio.OutputStreamSpliceFlags.CLOSE_TARGET,
             GLib.PRIORITY_DEFAULT,
             cancellable ?? null
         );
+        this.recordTransfer(length, started);
 
         return [decompress([memStream.steal_as_bytes()], compression), receivedEtag];
     }
@@ -432,76 +706,27 @@ export class PMTilesDownload {
     /** @private */
     get soupSession() {
         if (this._session === null) {
-            this._session = new Soup.Session({ user_agent : 'gnome-maps/' + pkg.version });
+            /* libsoup allows only a few connections per host by default,
+               which would queue up the requests the concurrency controller
+               lets through */
+            this._session = new Soup.Session({
+                user_agent: 'gnome-maps/' + pkg.version,
+                max_conns: MAX_CONCURRENT_DOWNLOADS,
+                max_conns_per_host: MAX_CONCURRENT_DOWNLOADS,
+            });
         }
         return this._session;
     }
-
-    /**
-     * @private
-     * @returns {Promise<Range | null>}
-     */
-    async getTileRange(tileId, caches) {
-        const cached = caches.tileRanges.get(tileId);
-        if (cached) {
-            return await cached;
-        }
-
-        const recursiveSearch = async (dir) => {
-            if (dir.tileIDs.length === 0) {
-                return null;
-            }
-
-            const idx = searchDirectory(dir, tileId);
-            if (dir.runLengths[idx] === 0) {
-                const childDir = await this.fetchLeafDir(
-                    dir.offsets[idx],
-                    dir.lengths[idx],
-                    caches
-                );
-                return recursiveSearch(childDir, tileId);
-            } else {
-                if (tileId >= dir.tileIDs[idx] && tileId < dir.tileIDs[idx] + dir.runLengths[idx]) {
-                    return {
-                        offset: caches.header.tileData.offset + dir.offsets[idx],
-                        length: dir.lengths[idx],
-                    };
-                } else {
-                    return null;
-                }
-            }
-        };
-
-        const result = recursiveSearch(caches.rootDir);
-        caches.tileRanges.set(tileId, result);
-
-        return result;
-    }
 }
 
-const readVarint = (buf, offset) => {
-    let result = 0n;
-    let shift = 0n;
-    let byte;
-    do {
-        byte = buf[offset];
-        /* bigint is required because shifting is limited to 32 bits in JS */
-        result |= BigInt(byte & 0x7f) << shift;
-        shift += 7n;
-        offset++;
-    } while (byte & 0x80);
-    return [Number(result), offset];
-};
-
-const readVarints = (buf, offset, count) => {
-    const result = [];
-    for (let i = 0; i < count; i++) {
-        [result[i], offset] = readVarint(buf, offset);
-    }
-    return [result, offset];
-};
-
-const getTileID = ([zoom, x, y]) => {
+/**
+ * Gets the PMTiles tile ID of a tile. Tiles are numbered zoom level by zoom
+ * level, and along a Hilbert curve within each zoom level.
+ *
+ * @param {TilePos} tile
+ * @returns {TileID}
+ */
+export const getTileID = ([zoom, x, y]) => {
     /* Hilbert curve */
 
     if (zoom < 0 || isNaN(zoom)) {
@@ -533,52 +758,9 @@ const getTileID = ([zoom, x, y]) => {
     }
 };
 
-const readDirectory = (buf) => {
-    let offset, length, tileIDs, runLengths, lengths, offsets;
-    [length, offset] = readVarint(buf, 0);
-
-    [tileIDs, offset] = readVarints(buf, offset, length);
-    let lastId = 0;
-    for (let i = 0; i < length; i++) {
-        tileIDs[i] += lastId;
-        lastId = tileIDs[i];
-    }
-
-    [runLengths, offset] = readVarints(buf, offset, length);
-    [lengths, offset] = readVarints(buf, offset, length);
-
-    [offsets, offset] = readVarints(buf, offset, length);
-    let lastOffset = 0;
-    for (let i = 0; i < length; i++) {
-        const o = offsets[i];
-        if (o === 0) {
-            lastOffset += lengths[i - 1];
-        } else {
-            lastOffset = o - 1;
-        }
-        offsets[i] = lastOffset;
-    }
-
-    return {
-        tileIDs,
-        runLengths,
-        lengths,
-        offsets,
-    };
-};
-
-const searchDirectory = (dir, tileID) => {
-    let low = 0;
-    let high = dir.tileIDs.length;
-    while (low < high) {
-        const mid = low + Math.floor((high - low) / 2);
-        if (dir.tileIDs[mid] <= tileID) {
-            low = mid + 1;
-        } else {
-            high = mid;
-        }
-    }
-    return low - 1;
+/** Exponential moving average, starting with the first sample */
+const average = (current, sample) => {
+    return current === null ? sample : current + (sample - current) * SAMPLE_WEIGHT;
 };
 
 /** @returns {GLib.Bytes} */
@@ -631,42 +813,6 @@ const compressionSupported = (compression) => {
     return compression === Compression.NONE || compression === Compression.GZIP;
 };
 
-class LRUCache {
-    constructor(limit) {
-        this._limit = limit;
-        this._map = new Map();
-        this._recentKeys = [];
-    }
-
-    bump(key) {
-        this._recentKeys = this._recentKeys.filter((k) => k !== key);
-        this._recentKeys.push(key);
-    }
-
-    get(key) {
-        const value = this._map.get(key);
-        if (typeof value === "undefined") {
-            return undefined;
-        }
-        this.bump(key);
-        return value;
-    }
-
-    set(key, value) {
-        this._map.set(key, value);
-        this.bump(key);
-        if (this._recentKeys.length > this._limit) {
-            const oldestKey = this._recentKeys.shift();
-            this._map.delete(oldestKey);
-        }
-    }
-
-    clear() {
-        this._map.clear();
-        this._recentKeys = [];
-    }
-}
-
 const parallelLoop = async (items, fn, workers = 2) => {
     const queue = items.slice();
     const promises = [];
@@ -682,3 +828,177 @@ const parallelLoop = async (items, fn, workers = 2) => {
     }
     await Promise.all(promises);
 };
+
+/**
+ * Decides how many requests to have in flight at once, in the style of TCP
+ * congestion control. Completed requests are grouped into rounds of `limit`
+ * requests, and the total throughput of each round is compared with the
+ * previous one.
+ *
+ * It starts with slow start, doubling the limit every round for as long as
+ * that improves throughput. After that, it adds one request per round while
+ * throughput doesn't drop and round trip times stay close to the lowest seen,
+ * and backs off when either gets worse, since that means requests are just
+ * waiting for each other.
+ */
+export class ConcurrencyController {
+    constructor({
+        initial = INITIAL_CONCURRENT_DOWNLOADS,
+        min = MIN_CONCURRENT_DOWNLOADS,
+        max = MAX_CONCURRENT_DOWNLOADS,
+    } = {}) {
+        /** @private */
+        this._min = min;
+        /** @private */
+        this._max = max;
+        /** @private */
+        this._limit = initial;
+        /** @private */
+        this._peak = initial;
+        /** @private */
+        this._slowStart = true;
+
+        /** @private */
+        this._minRtt = Infinity;
+        /** @private @type {{limit: number, throughput: number}?} */
+        this._lastRound = null;
+
+        /** @private */
+        this._roundStart = null;
+        /** @private */
+        this._roundBytes = 0;
+        /** @private */
+        this._roundRtt = 0;
+        /** @private */
+        this._roundRequests = 0;
+    }
+
+    /** The number of requests that may be in flight */
+    get limit() {
+        return this._limit;
+    }
+
+    /** The highest limit so far */
+    get peak() {
+        return this._peak;
+    }
+
+    /**
+     * Called when a download starts. The limit learned so far is kept, but
+     * a round left unfinished by the previous download is dropped, since
+     * its clock has been running in between.
+     */
+    downloadStarted() {
+        this.resetRound();
+    }
+
+    /** Called when a request starts */
+    requestStarted() {
+        if (this._roundStart === null)
+            this._roundStart = GLib.get_monotonic_time();
+    }
+
+    /**
+     * Called when a request has been read completely.
+     *
+     * @param {number} length The number of bytes downloaded
+     * @param {number} rtt Time until the response started, in seconds
+     */
+    requestFinished(length, rtt) {
+        this._roundBytes += length;
+        this._roundRtt += rtt;
+        this._roundRequests++;
+        this._minRtt = Math.min(this._minRtt, rtt);
+
+        if (this._roundRequests < this._limit)
+            return;
+
+        const elapsed = (GLib.get_monotonic_time() - this._roundStart) / 1_000_000;
+        const throughput = this._roundBytes / Math.max(elapsed, 1e-6);
+        const meanRtt = this._roundRtt / this._roundRequests;
+        const last = this._lastRound;
+        const roundLimit = this._limit;
+        const improved = last === null ||
+            throughput > last.throughput * (1 + THROUGHPUT_MARGIN);
+
+        if (this._slowStart) {
+            if (improved) {
+                this.setLimit(this._limit * 2);
+            } else {
+                /* the previous limit did just as well with fewer requests */
+                this._slowStart = false;
+                this.setLimit(last.limit);
+            }
+        } else if (meanRtt > this._minRtt * RTT_TOLERANCE ||
+                   (last !== null && throughput < last.throughput * (1 - THROUGHPUT_MARGIN))) {
+            this.setLimit(Math.floor(this._limit * 0.75));
+        } else {
+            this.setLimit(this._limit + 1);
+        }
+
+        this._lastRound = { limit: roundLimit, throughput };
+        this.resetRound();
+    }
+
+    /** @private */
+    resetRound() {
+        /* the next request to start starts the clock */
+        this._roundStart = null;
+        this._roundBytes = 0;
+        this._roundRtt = 0;
+        this._roundRequests = 0;
+    }
+
+    /** @private */
+    setLimit(limit) {
+        this._limit = Math.min(this._max, Math.max(this._min, limit));
+        this._peak = Math.max(this._peak, this._limit);
+    }
+}
+
+/**
+ * Calls `fn` on each item, with as many calls in flight at once as the
+ * controller allows. `fn` returns the number of bytes it downloaded and the
+ * round trip time, or null if it didn't make a request.
+ *
+ * @template T
+ * @param {T[]} items
+ * @param {(item: T) => Promise<{length: number, rtt: number}?>} fn
+ * @param {ConcurrencyController} controller
+ * @returns {Promise<void>}
+ */
+const adaptiveLoop = (items, fn, controller) => {
+    return new Promise((resolve, reject) => {
+        let next = 0;
+        let running = 0;
+        let failed = false;
+
+        const startMore = () => {
+            if (failed)
+                return;
+
+            if (next >= items.length && running === 0) {
+                resolve();
+                return;
+            }
+
+            while (running < controller.limit && next < items.length) {
+                const item = items[next++];
+                running++;
+                controller.requestStarted();
+
+                fn(item).then((result) => {
+                    running--;
+                    if (result)
+                        controller.requestFinished(result.length, result.rtt);
+                    startMore();
+                }, (e) => {
+                    failed = true;
+                    reject(e);
+                });
+            }
+        };
+
+        startMore();
+    });
+};
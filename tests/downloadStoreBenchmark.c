@@ -0,0 +1,230 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Compares answering compute_size and filter_by_mtime with one query per tile, as the download store used to, to
+   the set-based queries it uses now, on an area with as many tiles as a download can have. */
+
+#include <string.h>
+#include <sqlite3.h>
+#include <glib/gstdio.h>
+
+#include "maps-download-store.h"
+#include "maps-tile-id.h"
+
+#define N_TILES 100000
+#define TILESET "vector"
+#define N_INSERTS 10000
+#define BATCH_SIZE 1000
+
+static void
+store_result_cb (GObject      *object,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  GAsyncResult **out = user_data;
+  *out = g_object_ref (result);
+}
+
+static guint64 *
+make_tile_ids (void)
+{
+  guint64 *ids = g_new (guint64, N_TILES);
+
+  for (int i = 0; i < N_TILES; i++)
+    ids[i] = maps_tile_id_from_zxy (14, 4000 + i % 316, 7000 + i / 316);
+
+  return ids;
+}
+
+static void
+benchmark_per_tile (const char    *path,
+                    const guint64 *ids)
+{
+  sqlite3 *db;
+  sqlite3_stmt *size_stmt, *mtime_stmt;
+  gint64 total_size = 0;
+  guint n_found = 0;
+  gint64 start;
+
+  g_assert_cmpint (sqlite3_open_v2 (path, &db, SQLITE_OPEN_READONLY, NULL), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_prepare_v2 (db, "SELECT length(blobs.bytes) FROM tiles JOIN blobs ON blobs.hash = tiles.hash WHERE tileset = ? and id = ?", -1, &size_stmt, NULL), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_prepare_v2 (db, "SELECT id FROM tiles WHERE tileset = ? AND id = ? AND mtime > ?", -1, &mtime_stmt, NULL), ==, SQLITE_OK);
+
+  start = g_get_monotonic_time ();
+  sqlite3_bind_text (size_stmt, 1, TILESET, -1, SQLITE_STATIC);
+  for (int i = 0; i < N_TILES; i++)
+    {
+      sqlite3_bind_int64 (size_stmt, 2, ids[i]);
+      if (sqlite3_step (size_stmt) == SQLITE_ROW)
+        total_size += sqlite3_column_int64 (size_stmt, 0);
+      sqlite3_reset (size_stmt);
+    }
+  g_print ("compute_size, per tile:    %6.1f ms (%" G_GINT64_FORMAT " bytes)\n",
+           (g_get_monotonic_time () - start) / 1000.0, total_size);
+
+  start = g_get_monotonic_time ();
+  sqlite3_bind_text (mtime_stmt, 1, TILESET, -1, SQLITE_STATIC);
+  sqlite3_bind_int64 (mtime_stmt, 3, 0);
+  for (int i = 0; i < N_TILES; i++)
+    {
+      sqlite3_bind_int64 (mtime_stmt, 2, ids[i]);
+      if (sqlite3_step (mtime_stmt) == SQLITE_ROW)
+        n_found++;
+      sqlite3_reset (mtime_stmt);
+    }
+  g_print ("filter_by_mtime, per tile: %6.1f ms (%u tiles)\n",
+           (g_get_monotonic_time () - start) / 1000.0, n_found);
+
+  sqlite3_finalize (size_stmt);
+  sqlite3_finalize (mtime_stmt);
+  sqlite3_close (db);
+}
+
+static void
+benchmark_set_based (MapsDownloadStore *store,
+                     const guint64     *ids)
+{
+  GAsyncResult *result = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree guint64 *found = NULL;
+  gsize n_found;
+  gsize total_size;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  maps_download_store_compute_size_async (store, TILESET, ids, N_TILES, NULL, store_result_cb, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  total_size = maps_download_store_compute_size_finish (store, result, &error);
+  g_assert_no_error (error);
+  g_clear_object (&result);
+  g_print ("compute_size, set based:    %6.1f ms (%" G_GSIZE_FORMAT " bytes)\n",
+           (g_get_monotonic_time () - start) / 1000.0, total_size);
+
+  start = g_get_monotonic_time ();
+  maps_download_store_filter_by_mtime_async (store, TILESET, ids, N_TILES, 0, NULL, store_result_cb, &result);
+  while (result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  found = maps_download_store_filter_by_mtime_finish (store, result, &n_found, &error);
+  g_assert_no_error (error);
+  g_clear_object (&result);
+  g_print ("filter_by_mtime, set based: %6.1f ms (%" G_GSIZE_FORMAT " tiles)\n",
+           (g_get_monotonic_time () - start) / 1000.0, n_found);
+}
+
+static GBytes *
+make_tile (int i)
+{
+  /* Distinct data for each tile, so every insert writes a new blob */
+  char *data = g_strdup_printf ("tile %d", i);
+  return g_bytes_new_take (data, strlen (data));
+}
+
+static void
+benchmark_inserts (MapsDownloadStore *store,
+                   const guint64     *ids)
+{
+  GAsyncResult *result = NULL;
+  g_autoptr(GError) error = NULL;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  for (int i = 0; i < N_INSERTS; i++)
+    {
+      g_autoptr(GBytes) tile = make_tile (i);
+
+      maps_download_store_insert_async (store, "per-tile", &ids[i], 1, tile, FALSE, 1, NULL, store_result_cb, &result);
+      while (result == NULL)
+        g_main_context_iteration (NULL, TRUE);
+      maps_download_store_insert_finish (store, result, &error);
+      g_assert_no_error (error);
+      g_clear_object (&result);
+    }
+  g_print ("insert, per tile:           %6.1f ms (%d tiles)\n",
+           (g_get_monotonic_time () - start) / 1000.0, N_INSERTS);
+
+  start = g_get_monotonic_time ();
+  for (int i = 0; i < N_INSERTS; i += BATCH_SIZE)
+    {
+      g_autoptr(MapsTileBatch) batch = maps_tile_batch_new ("batched", 1);
+
+      for (int j = i; j < MIN (i + BATCH_SIZE, N_INSERTS); j++)
+        {
+          g_autoptr(GBytes) tile = make_tile (j);
+          maps_tile_batch_add (batch, &ids[j], 1, tile, FALSE);
+        }
+
+      maps_download_store_insert_batch_async (store, batch, NULL, store_result_cb, &result);
+      while (result == NULL)
+        g_main_context_iteration (NULL, TRUE);
+      maps_download_store_insert_batch_finish (store, result, &error);
+      g_assert_no_error (error);
+      g_clear_object (&result);
+    }
+  g_print ("insert, batched:            %6.1f ms (%d tiles)\n",
+           (g_get_monotonic_time () - start) / 1000.0, N_INSERTS);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *dir = g_dir_make_tmp ("maps-download-store-XXXXXX", &error);
+  g_autofree char *path = NULL;
+  g_autoptr(MapsDownloadStore) store = NULL;
+  g_autoptr(GBytes) tile = NULL;
+  g_autofree guint64 *ids = NULL;
+  GAsyncResult *result = NULL;
+  const char *suffixes[] = { "", "-wal", "-shm" };
+
+  g_assert_no_error (error);
+  path = g_build_filename (dir, "downloads.sqlite", NULL);
+
+  store = maps_download_store_new ();
+  maps_download_store_open (store, path, &error);
+  g_assert_no_error (error);
+
+  /* Every other tile is in the store */
+  ids = make_tile_ids ();
+  {
+    g_autofree guint64 *stored = g_new (guint64, N_TILES / 2);
+
+    for (int i = 0; i < N_TILES / 2; i++)
+      stored[i] = ids[2 * i];
+
+    tile = g_bytes_new_static ("tile", 4);
+    maps_download_store_insert_async (store, TILESET, stored, N_TILES / 2, tile, FALSE, 1, NULL, store_result_cb, &result);
+    while (result == NULL)
+      g_main_context_iteration (NULL, TRUE);
+    maps_download_store_insert_finish (store, result, &error);
+    g_assert_no_error (error);
+    g_clear_object (&result);
+  }
+
+  benchmark_per_tile (path, ids);
+  benchmark_set_based (store, ids);
+  benchmark_inserts (store, ids);
+
+  g_clear_object (&store);
+  for (guint i = 0; i < G_N_ELEMENTS (suffixes); i++)
+    {
+      g_autofree char *file = g_strconcat (path, suffixes[i], NULL);
+      g_remove (file);
+    }
+  g_remove (dir);
+
+  return 0;
+}
@@ -0,0 +1,280 @@
+/* -*- Mode: JS2; indent-tabs-mode: nil; js2-basic-offset: 4 -*- */
+/* vim: set et ts=4 sw=4: */
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+import Gio from "gi://Gio";
+import GLib from "gi://GLib";
+import GnomeMaps from "gi://GnomeMaps";
+
+import { runAsync, withDownloadStore } from "./testUtils.js";
+
+const JsUnit = imports.jsUnit;
+
+for (const method of ['insert_batch_async', 'get_async', 'get_many_async',
+                      'remove_async', 'set_area_async', 'remove_area_async',
+                      'enforce_quota_async', 'reclaim_async', 'exec_async']) {
+    Gio._promisify(GnomeMaps.DownloadStore.prototype, method,
+                   method.replace(/_async$/, '_finish'));
+}
+
+const TILESET = "test";
+const id = (z, x, y) => GnomeMaps.tile_id_from_zxy(z, x, y);
+
+/* Two tiles in area "a", and one in area "b" in another part of the map */
+const a1 = id(3, 1, 1);
+const a2 = id(10, 100, 100);
+const b1 = id(10, 900, 900);
+/* Not stored, but in the same zoom level 8 square as a2, so it shares its
+   presence bit */
+const a2Neighbor = id(10, 101, 100);
+/* Not stored, and nothing near it is */
+const absent = [id(3, 2, 2), id(10, 500, 500), id(14, 0, 0)];
+
+const getMany = async (store, ids) => {
+    const result = new Map();
+    await store.get_many_async(TILESET, ids, (tileId, data) => {
+        result.set(tileId, data);
+    }, null);
+    JsUnit.assertEquals(ids.length, result.size);
+    return result;
+};
+
+const testPresence = async (store, path) => {
+    const areaA = GnomeMaps.TileRange.new();
+    areaA.add_rect(3, 1, 1, 1, 1);
+    areaA.add_rect(10, 100, 100, 100, 100);
+    const areaB = GnomeMaps.TileRange.new();
+    areaB.add_rect(10, 900, 900, 900, 900);
+    await store.set_area_async("a", TILESET, areaA);
+    await store.set_area_async("b", TILESET, areaB);
+
+    const batch = GnomeMaps.TileBatch.new(TILESET, Date.now());
+    for (const tile of [a1, a2, b1])
+        batch.add([tile], new GLib.Bytes([tile % 256]), false);
+    await store.insert_batch_async(batch, null);
+
+    for (const tile of [a1, a2, b1, a2Neighbor])
+        JsUnit.assertTrue(store.might_contain(TILESET, tile));
+    for (const tile of absent)
+        JsUnit.assertFalse(store.might_contain(TILESET, tile));
+    JsUnit.assertFalse(store.might_contain("other", a1));
+
+    /* Absent tiles are reported as missing along with the stored ones */
+    let tiles = await getMany(store, [a2, ...absent, b1]);
+    JsUnit.assertNotNull(tiles.get(a2));
+    JsUnit.assertNotNull(tiles.get(b1));
+    for (const tile of absent)
+        JsUnit.assertNull(tiles.get(tile));
+
+    /* Removing an area deletes its tiles and clears their bits, but not
+       the bits of the other area's tiles */
+    JsUnit.assertEquals(2, await store.remove_area_async("a"));
+    JsUnit.assertFalse(store.might_contain(TILESET, a1));
+    JsUnit.assertFalse(store.might_contain(TILESET, a2));
+    JsUnit.assertFalse(store.might_contain(TILESET, a2Neighbor));
+    JsUnit.assertTrue(store.might_contain(TILESET, b1));
+
+    tiles = await getMany(store, [a1, a2, b1]);
+    JsUnit.assertNull(tiles.get(a1));
+    JsUnit.assertNull(tiles.get(a2));
+    JsUnit.assertNotNull(tiles.get(b1));
+
+    /* The bitmaps are saved, so they are the same when the database is
+       opened again */
+    const reopened = GnomeMaps.DownloadStore.new();
+    reopened.open(path);
+    JsUnit.assertFalse(reopened.might_contain(TILESET, a2));
+    JsUnit.assertTrue(reopened.might_contain(TILESET, b1));
+
+    /* Removing single tiles clears their bits too */
+    await store.remove_async(TILESET, [b1], null);
+    JsUnit.assertFalse(store.might_contain(TILESET, b1));
+};
+
+/* A stale tile is still read, but it's kept out of the memory cache, so a
+   later read doesn't take it for a fresh one */
+const testStaleness = async (store) => {
+    const tile = id(5, 1, 1);
+    store.set_cache_size(1024 * 1024);
+    store.set_cache_max_age(1000);
+
+    const batch = GnomeMaps.TileBatch.new(TILESET, Date.now() - 2000);
+    batch.set_cache_only(true);
+    batch.add([tile], new GLib.Bytes([1]), false);
+    await store.insert_batch_async(batch, null);
+
+    JsUnit.assertNotNull(await store.get_async(TILESET, 5, 1, 1, null));
+
+    let stale = null;
+    await store.get_many_async(TILESET, [tile], (tileId, data, isStale) => {
+        JsUnit.assertNotNull(data);
+        stale = isStale;
+    }, null);
+    JsUnit.assertTrue(stale);
+};
+
+/* Shrinking an area deletes the tiles it no longer covers, except those
+   another area needs. Cached tiles next to the area are left to the
+   quota. */
+const testShrinkArea = async (store) => {
+    const area = GnomeMaps.TileRange.new();
+    area.add_rect(10, 100, 100, 103, 103);
+    area.add_rect(4, 1, 1, 1, 1);
+    await store.set_area_async("a", TILESET, area);
+    const other = GnomeMaps.TileRange.new();
+    other.add_rect(10, 103, 103, 103, 103);
+    await store.set_area_async("b", TILESET, other);
+
+    const grid = [];
+    for (let x = 100; x <= 103; x++) {
+        for (let y = 100; y <= 103; y++)
+            grid.push(id(10, x, y));
+    }
+    const low = id(4, 1, 1);
+    const cached = id(10, 104, 100);
+
+    const batch = GnomeMaps.TileBatch.new(TILESET, Date.now());
+    for (const tile of [...grid, low])
+        batch.add([tile], new GLib.Bytes([tile % 256]), false);
+    await store.insert_batch_async(batch, null);
+    const cacheBatch = GnomeMaps.TileBatch.new(TILESET, Date.now());
+    cacheBatch.set_cache_only(true);
+    cacheBatch.add([cached], new GLib.Bytes([1]), false);
+    await store.insert_batch_async(cacheBatch, null);
+
+    const shrunk = GnomeMaps.TileRange.new();
+    shrunk.add_rect(10, 100, 100, 101, 101);
+    shrunk.add_rect(4, 1, 1, 1, 1);
+    JsUnit.assertEquals(16 - 4 - 1, await store.set_area_async("a", TILESET, shrunk));
+
+    const kept = new Set([id(10, 100, 100), id(10, 100, 101), id(10, 101, 100),
+                          id(10, 101, 101), id(10, 103, 103), low, cached]);
+    const tiles = await getMany(store, [...grid, low, cached]);
+    for (const [tile, data] of tiles) {
+        if (kept.has(tile))
+            JsUnit.assertNotNull(data);
+        else
+            JsUnit.assertNull(data);
+    }
+
+    /* Setting the same area again finds nothing more to delete */
+    JsUnit.assertEquals(0, await store.set_area_async("a", TILESET, shrunk));
+};
+
+/* Random, so the codec can't shrink it, and large enough to take up more
+   than one page */
+const randomBytes = (length) =>
+    new GLib.Bytes(Uint8Array.from({ length }, () => Math.random() * 256));
+
+/* Inserts a tile and returns how much the size of the cache grew */
+const insertTile = async (store, tile, mtime, cacheOnly = true) => {
+    const before = store.get_cache_used();
+    const batch = GnomeMaps.TileBatch.new(TILESET, mtime);
+    batch.set_cache_only(cacheOnly);
+    batch.add([tile], randomBytes(8192), false);
+    await store.insert_batch_async(batch, null);
+    return store.get_cache_used() - before;
+};
+
+/* Frees one page at a time, and checks that each call frees one */
+const reclaimAll = async (store) => {
+    let remaining = await store.reclaim_async(1);
+    JsUnit.assertTrue(remaining > 0);
+    while (remaining > 0) {
+        const next = await store.reclaim_async(1);
+        JsUnit.assertTrue(next < remaining);
+        remaining = next;
+    }
+};
+
+const testQuota = async (store) => {
+    const now = Date.now();
+    const cached = [0, 1, 2, 3].map((x) => id(12, x, 0));
+    const inArea = id(12, 100, 0);
+    const claimed = id(12, 200, 0);
+    const downloaded = id(12, 300, 0);
+
+    const area = GnomeMaps.TileRange.new();
+    area.add_rect(12, 100, 0, 100, 0);
+    await store.set_area_async("a", TILESET, area);
+
+    /* The first tile is the oldest */
+    const sizes = [];
+    for (const [i, tile] of cached.entries())
+        sizes.push(await insertTile(store, tile, now - (10 - i) * 1000));
+    for (const size of sizes)
+        JsUnit.assertTrue(size > 0);
+    const total = sizes.reduce((a, b) => a + b);
+    JsUnit.assertEquals(total, store.get_cache_used());
+
+    /* Neither a cache-only tile an area needs nor a downloaded one counts */
+    JsUnit.assertEquals(0, await insertTile(store, inArea, now));
+    JsUnit.assertEquals(0, await insertTile(store, downloaded, now, false));
+
+    /* A tile that an area comes to need stops counting, too */
+    const claimedSize = await insertTile(store, claimed, now);
+    JsUnit.assertTrue(claimedSize > 0);
+    const areaB = GnomeMaps.TileRange.new();
+    areaB.add_rect(12, 200, 0, 200, 0);
+    await store.set_area_async("b", TILESET, areaB);
+    JsUnit.assertEquals(total, store.get_cache_used());
+
+    JsUnit.assertFalse(store.is_over_quota());
+    JsUnit.assertEquals(0, await store.enforce_quota_async());
+
+    /* Reading the oldest tile makes it the most recently used, so the next
+       two go first */
+    store.set_quota(sizes[0] + sizes[3]);
+    JsUnit.assertTrue(store.is_over_quota());
+    JsUnit.assertNotNull(await store.get_async(TILESET, 12, 0, 0, null));
+
+    JsUnit.assertEquals(2, await store.enforce_quota_async());
+    JsUnit.assertFalse(store.is_over_quota());
+    JsUnit.assertEquals(sizes[0] + sizes[3], store.get_cache_used());
+    JsUnit.assertEquals(0, await store.enforce_quota_async());
+
+    const tiles = await getMany(store, [...cached, inArea, claimed, downloaded]);
+    JsUnit.assertNull(tiles.get(cached[1]));
+    JsUnit.assertNull(tiles.get(cached[2]));
+    for (const tile of [cached[0], cached[3], inArea, claimed, downloaded])
+        JsUnit.assertNotNull(tiles.get(tile));
+
+    /* The evicted tiles' pages are given back one at a time */
+    await reclaimAll(store);
+};
+
+/* A database that was created without incremental vacuuming is converted
+   with a full VACUUM, after which pages are given back incrementally */
+const testVacuumConversion = async (store, path) => {
+    await store.exec_async("PRAGMA auto_vacuum = NONE; VACUUM");
+
+    const converted = GnomeMaps.DownloadStore.new();
+    converted.open(path);
+    JsUnit.assertEquals(0, await converted.reclaim_async(1));
+
+    const tile = id(12, 0, 0);
+    await insertTile(converted, tile, Date.now());
+    await converted.remove_async(TILESET, [tile], null);
+    await reclaimAll(converted);
+};
+
+runAsync(async () => {
+    await withDownloadStore(testPresence);
+    await withDownloadStore(testStaleness);
+    await withDownloadStore(testShrinkArea);
+    await withDownloadStore(testQuota);
+    await withDownloadStore(testVacuumConversion);
+});
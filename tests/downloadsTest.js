@@ -15,13 +15,26 @@
  * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
  */
 
+import Gio from "gi://Gio";
+import GLib from "gi://GLib";
+import GnomeMaps from "gi://GnomeMaps";
+
 const JsUnit = imports.jsUnit;
 
 import { BoundingBox } from "../src/boundingBox.js";
-import { DownloadManager } from "../src/downloads.js";
+import { DownloadArea, DownloadManager } from "../src/downloads.js";
+import { getTileID } from "../src/pmtiles.js";
+import { runAsync, withDownloadStore } from "./testUtils.js";
 
 pkg.initGettext();
 
+for (const method of ['insert_batch_async', 'compute_size_async',
+                      'filter_by_mtime_async', 'save_plan_async',
+                      'load_plan_async', 'delete_plan_async']) {
+    Gio._promisify(GnomeMaps.DownloadStore.prototype, method,
+                   method.replace(/_async$/, '_finish'));
+}
+
 const storage = {
     _json: null,
     load() {
@@ -51,27 +64,183 @@ JsUnit.assertEquals("1", area.id);
 JsUnit.assertEquals("Test area", area.name);
 _assertArrayEquals(
     [
-        "0/0/0",
-        "1/0/0",
-        "2/1/1",
-        "3/2/3",
-        "4/4/6",
-        "5/8/13",
-        "6/16/27",
-        "7/32/54",
-        "8/64/109",
-        "9/128/218",
-        "10/256/437",
-        "11/513/875",
-        "12/1026/1750",
-        "13/2053/3501",
-        "14/4106/7002",
-        "14/4106/7003",
-        "14/4107/7002",
-        "14/4107/7003",
+        0, // 0/0/0
+        1, // 1/0/0
+        7, // 2/1/1
+        32, // 3/2/3
+        131, // 4/4/6
+        528, // 5/8/13
+        2116, // 6/16/27
+        8467, // 7/32/54
+        33872, // 8/64/109
+        135489, // 9/128/218
+        541958, // 10/256/437
+        2167835, // 11/513/875
+        8671341, // 12/1026/1750
+        34685367, // 13/2053/3501
+        138741469, // 14/4106/7002
+        138741470, // 14/4107/7002
+        138741471, // 14/4107/7003
+        138741472, // 14/4106/7003
     ],
-    area.getTiles()["vector"]
+    area.getTiles()["vector"].get_ids()
+);
+
+/* The download store computes tile IDs itself, so they must match */
+JsUnit.assertEquals(19078479, GnomeMaps.tile_id_from_zxy(12, 3423, 1763));
+for (const id of area.getTiles()["vector"].get_ids()) {
+    const [valid, z, x, y] = GnomeMaps.tile_id_to_zxy(id);
+    JsUnit.assertTrue(valid);
+    JsUnit.assertEquals(id, getTileID([z, x, y]));
+}
+
+/* Tile ranges */
+const range = GnomeMaps.TileRange.new();
+range.add_rect(2, 0, 0, 2, 2);
+range.add_rect(2, 1, 1, 3, 3);
+JsUnit.assertEquals(14, range.get_n_tiles());
+JsUnit.assertTrue(range.contains(2, 3, 3));
+JsUnit.assertFalse(range.contains(2, 3, 0));
+const hole = GnomeMaps.TileRange.new();
+hole.add_rect(2, 1, 1, 1, 1);
+range.subtract(hole);
+JsUnit.assertEquals(13, range.get_n_tiles());
+JsUnit.assertFalse(range.contains_id(GnomeMaps.tile_id_from_zxy(2, 1, 1)));
+_assertArrayEquals([GnomeMaps.tile_id_from_zxy(2, 1, 1)],
+    range.filter_ids([GnomeMaps.tile_id_from_zxy(2, 1, 1), GnomeMaps.tile_id_from_zxy(2, 0, 0)], false));
+range.union(hole);
+JsUnit.assertEquals(14, range.get_ids().length);
+
+/* PMTiles directory lookup. The root directory has tiles 0 and 5-7, and a
+   leaf directory starting at tile 100. */
+const index = GnomeMaps.PMTilesIndex.new(
+    new GLib.Bytes([3, 0, 5, 95, 1, 3, 0, 10, 20, 30, 1, 0, 1])
 );
+_assertArrayEquals([GnomeMaps.PMTilesLookupResult.FOUND, 10, 20], index.lookup(6));
+JsUnit.assertEquals(GnomeMaps.PMTilesLookupResult.NOT_FOUND, index.lookup(8)[0]);
+_assertArrayEquals([GnomeMaps.PMTilesLookupResult.NEED_LEAF, 0, 30], index.lookup(200));
+index.add_leaf(0, new GLib.Bytes([1, 200, 1, 4, 1]));
+_assertArrayEquals([GnomeMaps.PMTilesLookupResult.FOUND, 0, 4], index.lookup(200));
+
+/* Downloading, with a fake tileset handler instead of the network. Its
+   tiles are the 16 tiles at zoom level 2, planned as 4 ranges of 4 tiles. */
+class FakeTilesetHandler {
+    constructor() {
+        this.version = "1";
+        /* Number of ranges to fetch before failing as if cancelled */
+        this.interruptAfter = null;
+        this.planned = 0;
+        this.fetched = [];
+    }
+
+    getTilesForBounds(bounds) {
+        const range = GnomeMaps.TileRange.new();
+        range.add_rect(2, 0, 0, 3, 3);
+        return range;
+    }
+
+    async getVersion() {
+        return this.version;
+    }
+
+    async plan(tiles, cancellable) {
+        this.planned++;
+        const ranges = [];
+        for (let i = 0; i < tiles.length; i += 4)
+            ranges.push({ tiles: tiles.slice(i, i + 4), range: { length: 4 } });
+        return { size: tiles.length, ranges };
+    }
+
+    async download(plan, cancellable, emit, { isComplete }) {
+        let fetched = 0;
+        for (const [index, range] of plan.ranges.entries()) {
+            if (isComplete(index))
+                continue;
+            if (fetched++ === this.interruptAfter) {
+                throw new GLib.Error(Gio.IOErrorEnum, Gio.IOErrorEnum.CANCELLED,
+                                     "Interrupted");
+            }
+
+            for (const id of range.tiles) {
+                this.fetched.push(id);
+                await emit({ tiles: [id], data: new GLib.Bytes([id % 256]),
+                             precompressed: false });
+            }
+            await emit({ completedRange: index });
+        }
+    }
+
+    decode(item) {
+        return item;
+    }
+}
+
+const testDownloads = async (store) => {
+    const manager = new DownloadManager({ storage: { load: () => null, save() {} } });
+    const handler = new FakeTilesetHandler();
+    manager._downloadStore = store;
+    manager.getTilesetHandler = () => handler;
+
+    const bounds = new BoundingBox({ left: -10, top: 10, right: 10, bottom: -10 });
+    const makeArea = (id, tileset) =>
+        new DownloadArea({ manager, id, name: id, bounds, tilesets: [tileset] });
+    const allTiles = handler.getTilesForBounds(bounds).get_ids();
+    const loadPlan = async (tileset) => await store.load_plan_async(tileset);
+
+    /* The areas list model can be downloaded directly */
+    manager.areas.append(makeArea("1", "model"));
+    await manager.doDownload(manager.areas, false);
+    _assertArrayEquals(allTiles, handler.fetched);
+    _assertArrayEquals(allTiles,
+        await store.filter_by_mtime_async("model", allTiles, 0, null));
+    JsUnit.assertEquals(null, (await loadPlan("model"))[0]);
+
+    /* An interrupted download keeps its plan and completed ranges, and is
+       resumed without planning again */
+    handler.fetched = [];
+    handler.interruptAfter = 2;
+    await manager.doDownload([makeArea("2", "resume")], false);
+    JsUnit.assertEquals(2, handler.planned);
+    let [plan, , version, completed] = await loadPlan("resume");
+    JsUnit.assertTrue(plan !== null);
+    JsUnit.assertEquals("1", version);
+    JsUnit.assertEquals(0b0011, completed.toArray()[0]);
+
+    handler.fetched = [];
+    handler.interruptAfter = null;
+    await manager.doDownload([makeArea("2", "resume")], false);
+    JsUnit.assertEquals(2, handler.planned);
+    _assertArrayEquals(allTiles.slice(8), handler.fetched);
+    JsUnit.assertEquals(null, (await loadPlan("resume"))[0]);
+
+    /* A plan for other areas is not resumed */
+    handler.interruptAfter = 1;
+    await manager.doDownload([makeArea("3", "job")], false);
+    JsUnit.assertEquals(3, handler.planned);
+    handler.fetched = [];
+    handler.interruptAfter = null;
+    await manager.doDownload([makeArea("4", "job")], false);
+    JsUnit.assertEquals(4, handler.planned);
+    _assertArrayEquals(allTiles.slice(4), handler.fetched);
+
+    /* Neither is a plan for another version of the source */
+    handler.interruptAfter = 1;
+    await manager.doDownload([makeArea("5", "version")], false);
+    JsUnit.assertEquals(5, handler.planned);
+    handler.version = "2";
+    handler.interruptAfter = null;
+    await manager.doDownload([makeArea("5", "version")], false);
+    JsUnit.assertEquals(6, handler.planned);
+
+    /* Without a version, plans are not saved */
+    handler.version = null;
+    handler.interruptAfter = 1;
+    await manager.doDownload([makeArea("6", "unversioned")], false);
+    JsUnit.assertEquals(7, handler.planned);
+    JsUnit.assertEquals(null, (await loadPlan("unversioned"))[0]);
+};
+
+runAsync(() => withDownloadStore(testDownloads));
 
 function _assertArrayEquals(arr1, arr2) {
     JsUnit.assertEquals(arr1.length, arr2.length);
@@ -0,0 +1,172 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "maps-lru-cache.h"
+
+/* The values are strings, and freeing one records it, so the tests can check which entries were evicted and in
+   what order. */
+static GString *freed;
+
+static void
+value_free (gpointer value)
+{
+  g_string_append_printf (freed, "%s ", (char *) value);
+  g_free (value);
+}
+
+static MapsLruCache *
+cache_new (gsize max_cost)
+{
+  g_string_truncate (freed, 0);
+  return maps_lru_cache_new (g_str_hash, g_str_equal, g_free, value_free, max_cost);
+}
+
+static gboolean
+insert (MapsLruCache *cache,
+        const char   *key,
+        gsize         cost)
+{
+  return maps_lru_cache_insert (cache, g_strdup (key), g_strdup (key), cost);
+}
+
+static void
+test_eviction_order (void)
+{
+  g_autoptr(MapsLruCache) cache = cache_new (10);
+  guint64 hits, misses, evictions;
+
+  g_assert_true (insert (cache, "a", 3));
+  g_assert_true (insert (cache, "b", 3));
+  g_assert_true (insert (cache, "c", 3));
+  g_assert_cmpuint (maps_lru_cache_get_cost (cache), ==, 9);
+  g_assert_cmpstr (freed->str, ==, "");
+
+  /* Looking up "a" makes "b" the least recently used entry, and it takes
+     "c" as well to make room for an entry that costs 4 */
+  g_assert_cmpstr (maps_lru_cache_lookup (cache, "a"), ==, "a");
+  g_assert_true (insert (cache, "d", 4));
+  g_assert_cmpstr (freed->str, ==, "b ");
+  g_assert_true (insert (cache, "e", 3));
+  g_assert_cmpstr (freed->str, ==, "b c ");
+
+  g_assert_true (maps_lru_cache_contains (cache, "a"));
+  g_assert_false (maps_lru_cache_contains (cache, "b"));
+  g_assert_false (maps_lru_cache_contains (cache, "c"));
+  g_assert_cmpuint (maps_lru_cache_get_n_items (cache), ==, 3);
+  g_assert_cmpuint (maps_lru_cache_get_cost (cache), ==, 10);
+
+  /* contains() doesn't mark entries as used, so "a" is the next to go */
+  g_assert_true (insert (cache, "f", 1));
+  g_assert_cmpstr (freed->str, ==, "b c a ");
+
+  /* An entry that costs more than the maximum isn't added at all */
+  g_assert_false (insert (cache, "g", 11));
+  g_assert_cmpstr (freed->str, ==, "b c a g ");
+  g_assert_null (maps_lru_cache_lookup (cache, "g"));
+  g_assert_cmpuint (maps_lru_cache_get_cost (cache), ==, 8);
+
+  maps_lru_cache_get_stats (cache, &hits, &misses, &evictions);
+  g_assert_cmpuint (hits, ==, 1);
+  g_assert_cmpuint (misses, ==, 1);
+  g_assert_cmpuint (evictions, ==, 3);
+}
+
+static void
+test_reinsert (void)
+{
+  g_autoptr(MapsLruCache) cache = cache_new (10);
+  guint64 evictions;
+
+  g_assert_true (insert (cache, "a", 4));
+  g_assert_true (insert (cache, "b", 4));
+
+  /* Inserting "a" again replaces the old value, updates the cost and makes
+     it the most recently used entry, without counting as an eviction */
+  g_assert_true (insert (cache, "a", 2));
+  g_assert_cmpstr (freed->str, ==, "a ");
+  g_assert_cmpuint (maps_lru_cache_get_n_items (cache), ==, 2);
+  g_assert_cmpuint (maps_lru_cache_get_cost (cache), ==, 6);
+
+  g_assert_true (insert (cache, "c", 5));
+  g_assert_cmpstr (freed->str, ==, "a b ");
+  g_assert_true (maps_lru_cache_contains (cache, "a"));
+
+  /* A larger cost can push out other entries */
+  g_assert_true (insert (cache, "a", 7));
+  g_assert_cmpstr (freed->str, ==, "a b a c ");
+  g_assert_cmpuint (maps_lru_cache_get_n_items (cache), ==, 1);
+  g_assert_cmpuint (maps_lru_cache_get_cost (cache), ==, 7);
+
+  maps_lru_cache_get_stats (cache, NULL, NULL, &evictions);
+  g_assert_cmpuint (evictions, ==, 2);
+
+  /* Removing isn't an eviction either */
+  g_assert_true (maps_lru_cache_remove (cache, "a"));
+  g_assert_false (maps_lru_cache_remove (cache, "a"));
+  g_assert_cmpuint (maps_lru_cache_get_cost (cache), ==, 0);
+  maps_lru_cache_get_stats (cache, NULL, NULL, &evictions);
+  g_assert_cmpuint (evictions, ==, 2);
+}
+
+static void
+test_shrink (void)
+{
+  g_autoptr(MapsLruCache) cache = cache_new (100);
+
+  for (int i = 0; i < 10; i++)
+    {
+      g_autofree char *key = g_strdup_printf ("%d", i);
+      g_assert_true (insert (cache, key, 10));
+    }
+  g_assert_cmpstr (maps_lru_cache_lookup (cache, "0"), ==, "0");
+
+  /* Shrinking evicts the least recently used entries until the rest fit */
+  maps_lru_cache_set_max_cost (cache, 35);
+  g_assert_cmpuint (maps_lru_cache_get_max_cost (cache), ==, 35);
+  g_assert_cmpstr (freed->str, ==, "1 2 3 4 5 6 7 ");
+  g_assert_cmpuint (maps_lru_cache_get_n_items (cache), ==, 3);
+  g_assert_cmpuint (maps_lru_cache_get_cost (cache), ==, 30);
+
+  /* Growing it again doesn't bring anything back, and the new maximum holds
+     for later inserts */
+  maps_lru_cache_set_max_cost (cache, 40);
+  g_assert_cmpstr (freed->str, ==, "1 2 3 4 5 6 7 ");
+  g_assert_true (insert (cache, "a", 10));
+  g_assert_true (insert (cache, "b", 10));
+  g_assert_cmpstr (freed->str, ==, "1 2 3 4 5 6 7 8 ");
+
+  maps_lru_cache_set_max_cost (cache, 0);
+  g_assert_cmpuint (maps_lru_cache_get_n_items (cache), ==, 0);
+  g_assert_cmpuint (maps_lru_cache_get_cost (cache), ==, 0);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  int ret;
+
+  g_test_init (&argc, &argv, NULL);
+  freed = g_string_new (NULL);
+
+  g_test_add_func ("/lru-cache/eviction-order", test_eviction_order);
+  g_test_add_func ("/lru-cache/reinsert", test_reinsert);
+  g_test_add_func ("/lru-cache/shrink", test_shrink);
+
+  ret = g_test_run ();
+  g_string_free (freed, TRUE);
+
+  return ret;
+}
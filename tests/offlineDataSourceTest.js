@@ -0,0 +1,222 @@
+/* -*- Mode: JS2; indent-tabs-mode: nil; js2-basic-offset: 4 -*- */
+/* vim: set et ts=4 sw=4: */
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+import Gio from "gi://Gio";
+import GLib from "gi://GLib";
+import GnomeMaps from "gi://GnomeMaps";
+import GObject from "gi://GObject";
+import Shumate from "gi://Shumate";
+
+import { runAsync, withDownloadStore } from "./testUtils.js";
+
+const JsUnit = imports.jsUnit;
+
+for (const method of ['insert_batch_async', 'get_many_async']) {
+    Gio._promisify(GnomeMaps.DownloadStore.prototype, method,
+                   method.replace(/_async$/, '_finish'));
+}
+
+/* A next source that only records the requests it gets. The test emits
+   data and completes them by hand. */
+class FakeSource extends Shumate.DataSource {
+    constructor() {
+        super({ min_zoom_level: 0, max_zoom_level: 14 });
+        this.requests = [];
+    }
+
+    vfunc_start_request(x, y, zoomLevel, cancellable) {
+        const req = Shumate.DataSourceRequest.new(x, y, zoomLevel);
+        this.requests.push({ req, cancellable });
+        return req;
+    }
+}
+
+GObject.registerClass(FakeSource);
+
+/* Runs the main loop until the condition holds. The store reads tiles on
+   its own threads, so there may be nothing to dispatch for a while. */
+const waitFor = (condition) => {
+    const context = GLib.MainContext.default();
+    const deadline = GLib.get_monotonic_time() + 5 * GLib.USEC_PER_SEC;
+    while (!condition()) {
+        JsUnit.assertTrue(GLib.get_monotonic_time() < deadline);
+        context.iteration(false);
+    }
+};
+
+const drain = () => {
+    const context = GLib.MainContext.default();
+    while (context.pending())
+        context.iteration(false);
+};
+
+const assertBytes = (expected, actual) => {
+    JsUnit.assertNotNull(actual);
+    _assertArrayEquals(expected.toArray(), actual.toArray());
+};
+
+const assertData = (expected, req) => assertBytes(expected, req.get_data());
+
+const tile = new GLib.Bytes([1, 2, 3]);
+
+/* Reads a tile straight from the store, and whether it's stale */
+const getStored = async (store, z, x, y) => {
+    let result = null;
+    await store.get_many_async("test", [GnomeMaps.tile_id_from_zxy(z, x, y)],
+                               (id, data, stale) => { result = { data, stale }; },
+                               null);
+    return result;
+};
+
+/* Counts the cache-written signals, and flushes the tile cache */
+const watchCache = (source) => {
+    const watch = { written: 0 };
+    source.connect("cache-written", () => watch.written++);
+    watch.flush = () => {
+        const written = watch.written;
+        source.flush_cache();
+        waitFor(() => watch.written > written);
+    };
+    return watch;
+};
+
+const testCoalescing = async (store) => {
+    const next = new FakeSource();
+    const source = GnomeMaps.OfflineDataSource.new(store, "test", next);
+
+    /* The tile isn't stored, so the first request goes to the next source, and
+       a second request before any data joins it */
+    const req1 = source.start_request(0, 0, 1, new Gio.Cancellable());
+    waitFor(() => next.requests.length === 1);
+    const req2 = source.start_request(0, 0, 1, new Gio.Cancellable());
+    drain();
+    JsUnit.assertEquals(1, next.requests.length);
+
+    next.requests[0].req.emit_data(tile, false);
+    assertData(tile, req1);
+    assertData(tile, req2);
+
+    /* A request after the first data joins as well, and gets that data even if
+       the tile is completed before the catch-up could run */
+    const req3 = source.start_request(0, 0, 1, new Gio.Cancellable());
+    next.requests[0].req.complete();
+    JsUnit.assertEquals(1, next.requests.length);
+    for (const req of [req1, req2, req3]) {
+        JsUnit.assertTrue(req.is_completed());
+        assertData(tile, req);
+    }
+    drain();
+};
+
+const testCancellation = async (store) => {
+    const next = new FakeSource();
+    const source = GnomeMaps.OfflineDataSource.new(store, "test", next);
+
+    /* The fetch goes on while anyone still wants the tile, and is cancelled
+       once nobody does */
+    const cancellable1 = new Gio.Cancellable();
+    const cancellable2 = new Gio.Cancellable();
+    source.start_request(1, 0, 1, cancellable1);
+    source.start_request(1, 0, 1, cancellable2);
+    waitFor(() => next.requests.length === 1);
+    const fetch = next.requests[0];
+
+    cancellable1.cancel();
+    drain();
+    JsUnit.assertFalse(fetch.cancellable.is_cancelled());
+
+    cancellable2.cancel();
+    drain();
+    JsUnit.assertTrue(fetch.cancellable.is_cancelled());
+    JsUnit.assertEquals(1, next.requests.length);
+};
+
+/* A tile from the next source is written to the store as a cache-only tile,
+   and later requests are served from there */
+const testWriteThrough = async (store) => {
+    const next = new FakeSource();
+    const source = GnomeMaps.OfflineDataSource.new(store, "test", next);
+    source.cache_tiles = true;
+    const cache = watchCache(source);
+
+    const req1 = source.start_request(2, 1, 3, new Gio.Cancellable());
+    waitFor(() => next.requests.length === 1);
+    next.requests[0].req.emit_data(tile, false);
+    next.requests[0].req.complete();
+    JsUnit.assertTrue(req1.is_completed());
+    assertData(tile, req1);
+
+    JsUnit.assertEquals(0, cache.written);
+    cache.flush();
+    JsUnit.assertEquals(1, cache.written);
+
+    const stored = await getStored(store, 3, 2, 1);
+    assertBytes(tile, stored.data);
+    JsUnit.assertFalse(stored.stale);
+    /* Only cache-only tiles count towards the quota */
+    JsUnit.assertTrue(store.get_cache_used() > 0);
+
+    const req2 = source.start_request(2, 1, 3, new Gio.Cancellable());
+    waitFor(() => req2.is_completed());
+    assertData(tile, req2);
+    JsUnit.assertEquals(1, next.requests.length);
+};
+
+/* A stale tile is shown right away, then replaced by a fresh one from the
+   next source, which is written back to the store */
+const testStaleRefetch = async (store) => {
+    const stale = new GLib.Bytes([9, 9]);
+    store.set_cache_max_age(1000);
+    const batch = GnomeMaps.TileBatch.new("test", Date.now() - 2000);
+    batch.set_cache_only(true);
+    batch.add([GnomeMaps.tile_id_from_zxy(3, 2, 1)], stale, false);
+    await store.insert_batch_async(batch, null);
+
+    const next = new FakeSource();
+    const source = GnomeMaps.OfflineDataSource.new(store, "test", next);
+    source.cache_tiles = true;
+    const cache = watchCache(source);
+
+    const req = source.start_request(2, 1, 3, new Gio.Cancellable());
+    waitFor(() => next.requests.length === 1);
+    assertData(stale, req);
+    JsUnit.assertFalse(req.is_completed());
+
+    next.requests[0].req.emit_data(tile, false);
+    assertData(tile, req);
+    next.requests[0].req.complete();
+    JsUnit.assertTrue(req.is_completed());
+
+    cache.flush();
+    const stored = await getStored(store, 3, 2, 1);
+    assertBytes(tile, stored.data);
+    JsUnit.assertFalse(stored.stale);
+};
+
+runAsync(async () => {
+    await withDownloadStore(testCoalescing);
+    await withDownloadStore(testCancellation);
+    await withDownloadStore(testWriteThrough);
+    await withDownloadStore(testStaleRefetch);
+});
+
+function _assertArrayEquals(arr1, arr2) {
+    JsUnit.assertEquals(arr1.length, arr2.length);
+    for (let i = 0; i < arr1.length; i++) {
+        JsUnit.assertEquals(arr1[i], arr2[i]);
+    }
+}
@@ -0,0 +1,177 @@
+/* -*- Mode: JS2; indent-tabs-mode: nil; js2-basic-offset: 4 -*- */
+/* vim: set et ts=4 sw=4: */
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+import GLib from "gi://GLib";
+
+import { BoundedQueue, Pipeline } from "../src/pipeline.js";
+import { runAsync } from "./testUtils.js";
+
+const JsUnit = imports.jsUnit;
+
+/* Lets pending promise callbacks run */
+const settle = () => new Promise((resolve) => {
+    GLib.idle_add(GLib.PRIORITY_DEFAULT_IDLE, () => {
+        resolve();
+        return GLib.SOURCE_REMOVE;
+    });
+});
+
+const assertRejects = async (promise, message) => {
+    let error = null;
+    try {
+        await promise;
+    } catch (e) {
+        error = e;
+    }
+    JsUnit.assertNotNull(error);
+    JsUnit.assertEquals(message, error.message);
+};
+
+/* put() waits while the queue is full, until an item is taken */
+const testBackpressure = async () => {
+    const queue = new BoundedQueue(2);
+    await queue.put(1);
+    await queue.put(2);
+
+    let added = false;
+    const put = queue.put(3).then(() => { added = true; });
+    await settle();
+    JsUnit.assertFalse(added);
+    JsUnit.assertEquals(2, queue.length);
+
+    JsUnit.assertEquals(1, await queue.take());
+    await put;
+    JsUnit.assertTrue(added);
+    JsUnit.assertEquals(2, await queue.take());
+    JsUnit.assertEquals(3, await queue.take());
+};
+
+/* Closing lets the items that are left be taken, aborting drops them */
+const testCloseAndAbort = async () => {
+    const closed = new BoundedQueue(4);
+    await closed.put(1);
+    await closed.put(2);
+    closed.close();
+    await assertRejects(closed.put(3), "Queue is closed");
+    JsUnit.assertEquals(1, await closed.take());
+    JsUnit.assertEquals(2, await closed.take());
+    JsUnit.assertNull(await closed.take());
+
+    /* A take() that is already waiting gets null too */
+    const empty = new BoundedQueue(4);
+    const waiting = empty.take();
+    empty.close();
+    JsUnit.assertNull(await waiting);
+
+    const aborted = new BoundedQueue(1);
+    await aborted.put(1);
+    const blocked = aborted.put(2);
+    aborted.abort(new Error("stop"));
+    await assertRejects(blocked, "stop");
+    await assertRejects(aborted.take(), "stop");
+    await assertRejects(aborted.put(3), "stop");
+    JsUnit.assertEquals(0, aborted.length);
+};
+
+/* A batch that isn't full is written once its first item has waited long
+   enough, even though fetching isn't done */
+const testPartialBatch = async () => {
+    const batches = [];
+    let firstWritten;
+    const written = new Promise((resolve) => { firstWritten = resolve; });
+
+    const pipeline = new Pipeline({
+        fetch: async (emit) => {
+            await emit(1);
+            await emit(2);
+            await written;
+            await emit(3);
+        },
+        decode: (item) => item * 10,
+        write: async (items) => {
+            batches.push(items);
+            firstWritten();
+        },
+    });
+
+    const started = GLib.get_monotonic_time();
+    await pipeline.run("test");
+
+    JsUnit.assertEquals(2, batches.length);
+    _assertArrayEquals([10, 20], batches[0]);
+    _assertArrayEquals([30], batches[1]);
+    /* The first batch waited for the delay, since fetching was stuck */
+    JsUnit.assertTrue(GLib.get_monotonic_time() - started >= GLib.USEC_PER_SEC);
+    JsUnit.assertEquals(3, pipeline.stats.items);
+    JsUnit.assertEquals(2, pipeline.stats.batches);
+};
+
+/* Items that were fetched before fetching failed are still written, and the
+   error is thrown afterwards */
+const testFetchFailure = async () => {
+    const written = [];
+
+    const pipeline = new Pipeline({
+        fetch: async (emit) => {
+            await emit(1);
+            await emit(2);
+            await emit(3);
+            throw new Error("network");
+        },
+        decode: (item) => item,
+        write: async (items) => { written.push(...items); },
+    });
+
+    await assertRejects(pipeline.run("test"), "network");
+    _assertArrayEquals([1, 2, 3], written);
+};
+
+/* A failing write stops everything, including the fetch stage */
+const testWriteFailure = async () => {
+    let emitted = 0;
+
+    const pipeline = new Pipeline({
+        fetch: async (emit) => {
+            for (let i = 0; i < 100; i++) {
+                await emit(i);
+                emitted++;
+            }
+        },
+        decode: (item) => item,
+        write: async () => { throw new Error("disk"); },
+        queueLength: 1,
+        batchSize: 1,
+    });
+
+    await assertRejects(pipeline.run("test"), "disk");
+    JsUnit.assertTrue(emitted < 100);
+};
+
+runAsync(async () => {
+    await testBackpressure();
+    await testCloseAndAbort();
+    await testPartialBatch();
+    await testFetchFailure();
+    await testWriteFailure();
+});
+
+function _assertArrayEquals(arr1, arr2) {
+    JsUnit.assertEquals(arr1.length, arr2.length);
+    for (let i = 0; i < arr1.length; i++) {
+        JsUnit.assertEquals(arr1[i], arr2[i]);
+    }
+}
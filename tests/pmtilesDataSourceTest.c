@@ -0,0 +1,371 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib/gstdio.h>
+
+#include "maps-pmtiles-data-source.h"
+#include "maps-tile-id.h"
+
+/* The tests build a small archive for zoom levels 0 to 2, with gzip compressed directories and tiles. The root
+   directory holds the zoom level 0 tile itself, and points to a leaf directory for everything after it, which holds
+   two more tiles. */
+#define MAX_ZOOM 2
+
+typedef struct {
+  guint z, x, y;
+  const char *data;
+} TestTile;
+
+static const TestTile root_tile = { 0, 0, 0, "zero" };
+static const TestTile leaf_tiles[] = {
+  { 1, 1, 0, "one" },
+  { 2, 3, 3, "two" },
+};
+/* In the leaf directory's range, but not in it */
+static const TestTile missing_tile = { 1, 0, 0, NULL };
+
+typedef struct {
+  guint64 tile_id;
+  guint64 offset;
+  guint64 length;
+  guint64 run_length;
+} Entry;
+
+static char *archive_path;
+
+/* A next data source that only records the requests it gets. The tests emit data and complete them by hand. */
+#define TEST_TYPE_NEXT_SOURCE (test_next_source_get_type ())
+G_DECLARE_FINAL_TYPE (TestNextSource, test_next_source, TEST, NEXT_SOURCE, ShumateDataSource)
+
+struct _TestNextSource {
+  ShumateDataSource parent_instance;
+  GPtrArray *requests;
+};
+
+G_DEFINE_FINAL_TYPE (TestNextSource, test_next_source, SHUMATE_TYPE_DATA_SOURCE)
+
+static ShumateDataSourceRequest *
+test_next_source_start_request (ShumateDataSource *source,
+                                int                x,
+                                int                y,
+                                int                zoom_level,
+                                GCancellable      *cancellable)
+{
+  TestNextSource *self = TEST_NEXT_SOURCE (source);
+  ShumateDataSourceRequest *req = shumate_data_source_request_new (x, y, zoom_level);
+
+  g_ptr_array_add (self->requests, g_object_ref (req));
+  return req;
+}
+
+static void
+test_next_source_finalize (GObject *object)
+{
+  TestNextSource *self = TEST_NEXT_SOURCE (object);
+
+  g_clear_pointer (&self->requests, g_ptr_array_unref);
+
+  G_OBJECT_CLASS (test_next_source_parent_class)->finalize (object);
+}
+
+static void
+test_next_source_class_init (TestNextSourceClass *klass)
+{
+  G_OBJECT_CLASS (klass)->finalize = test_next_source_finalize;
+  SHUMATE_DATA_SOURCE_CLASS (klass)->start_request = test_next_source_start_request;
+}
+
+static void
+test_next_source_init (TestNextSource *self)
+{
+  self->requests = g_ptr_array_new_with_free_func (g_object_unref);
+  shumate_data_source_set_min_zoom_level (SHUMATE_DATA_SOURCE (self), 0);
+  shumate_data_source_set_max_zoom_level (SHUMATE_DATA_SOURCE (self), 14);
+}
+
+static GBytes *
+gzip (const void *data,
+      gsize       size)
+{
+  g_autoptr(GZlibCompressor) compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+  g_autoptr(GOutputStream) output = g_memory_output_stream_new_resizable ();
+  g_autoptr(GOutputStream) converter = g_converter_output_stream_new (output, G_CONVERTER (compressor));
+
+  g_assert_true (g_output_stream_write_all (converter, data, size, NULL, NULL, NULL));
+  g_assert_true (g_output_stream_close (converter, NULL, NULL));
+
+  return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (output));
+}
+
+static void
+append_varint (GByteArray *out,
+               guint64     value)
+{
+  guint8 byte;
+
+  while (value >= 0x80)
+    {
+      byte = (value & 0x7f) | 0x80;
+      g_byte_array_append (out, &byte, 1);
+      value >>= 7;
+    }
+
+  byte = value;
+  g_byte_array_append (out, &byte, 1);
+}
+
+/* Encodes a directory as the spec describes it, and compresses it */
+static GBytes *
+encode_directory (const Entry *entries,
+                  guint        n_entries)
+{
+  g_autoptr(GByteArray) dir = g_byte_array_new ();
+
+  append_varint (dir, n_entries);
+  for (guint i = 0; i < n_entries; i++)
+    append_varint (dir, entries[i].tile_id - (i == 0 ? 0 : entries[i - 1].tile_id));
+  for (guint i = 0; i < n_entries; i++)
+    append_varint (dir, entries[i].run_length);
+  for (guint i = 0; i < n_entries; i++)
+    append_varint (dir, entries[i].length);
+  /* Offsets are stored plus one, since 0 means right after the previous entry */
+  for (guint i = 0; i < n_entries; i++)
+    append_varint (dir, entries[i].offset + 1);
+
+  return gzip (dir->data, dir->len);
+}
+
+/* Adds a tile's compressed data to the tile data section, and returns its directory entry */
+static Entry
+add_tile (GByteArray     *tile_data,
+          const TestTile *tile)
+{
+  g_autoptr(GBytes) data = gzip (tile->data, strlen (tile->data));
+  Entry entry = {
+    .tile_id = maps_tile_id_from_zxy (tile->z, tile->x, tile->y),
+    .offset = tile_data->len,
+    .length = g_bytes_get_size (data),
+    .run_length = 1,
+  };
+
+  g_byte_array_append (tile_data, g_bytes_get_data (data, NULL), g_bytes_get_size (data));
+  return entry;
+}
+
+static int
+compare_entries (gconstpointer a,
+                 gconstpointer b)
+{
+  guint64 ia = ((const Entry *)a)->tile_id, ib = ((const Entry *)b)->tile_id;
+  return (ia > ib) - (ia < ib);
+}
+
+static void
+write_u64 (guint8  *data,
+           guint64  value)
+{
+  value = GUINT64_TO_LE (value);
+  memcpy (data, &value, sizeof value);
+}
+
+static char *
+write_archive (void)
+{
+  g_autoptr(GByteArray) tile_data = g_byte_array_new ();
+  g_autoptr(GByteArray) archive = g_byte_array_new ();
+  g_autoptr(GBytes) root_dir = NULL;
+  g_autoptr(GBytes) leaf_dir = NULL;
+  g_autoptr(GError) error = NULL;
+  Entry leaf_entries[G_N_ELEMENTS (leaf_tiles)];
+  Entry root_entries[2];
+  guint8 header[127] = { 0 };
+  char *path;
+  int fd;
+
+  root_entries[0] = add_tile (tile_data, &root_tile);
+  for (guint i = 0; i < G_N_ELEMENTS (leaf_tiles); i++)
+    leaf_entries[i] = add_tile (tile_data, &leaf_tiles[i]);
+  qsort (leaf_entries, G_N_ELEMENTS (leaf_entries), sizeof (Entry), compare_entries);
+  leaf_dir = encode_directory (leaf_entries, G_N_ELEMENTS (leaf_entries));
+
+  /* A run length of 0 points to a leaf directory, which covers everything after the zoom level 0 tile */
+  root_entries[1] = (Entry) {
+    .tile_id = maps_tile_id_from_zxy (0, 0, 0) + 1,
+    .offset = 0,
+    .length = g_bytes_get_size (leaf_dir),
+    .run_length = 0,
+  };
+  root_dir = encode_directory (root_entries, G_N_ELEMENTS (root_entries));
+
+  memcpy (header, "PMTiles", 7);
+  header[7] = 3;
+  write_u64 (header + 0x08, sizeof header);
+  write_u64 (header + 0x10, g_bytes_get_size (root_dir));
+  write_u64 (header + 0x28, sizeof header + g_bytes_get_size (root_dir));
+  write_u64 (header + 0x30, g_bytes_get_size (leaf_dir));
+  write_u64 (header + 0x38, sizeof header + g_bytes_get_size (root_dir) + g_bytes_get_size (leaf_dir));
+  write_u64 (header + 0x40, tile_data->len);
+  header[0x61] = 2; /* gzip */
+  header[0x62] = 2; /* gzip */
+  header[0x63] = 1; /* vector tiles */
+  header[0x64] = 0;
+  header[0x65] = MAX_ZOOM;
+
+  g_byte_array_append (archive, header, sizeof header);
+  g_byte_array_append (archive, g_bytes_get_data (root_dir, NULL), g_bytes_get_size (root_dir));
+  g_byte_array_append (archive, g_bytes_get_data (leaf_dir, NULL), g_bytes_get_size (leaf_dir));
+  g_byte_array_append (archive, tile_data->data, tile_data->len);
+
+  fd = g_file_open_tmp ("maps-test-XXXXXX.pmtiles", &path, &error);
+  g_assert_no_error (error);
+  g_close (fd, NULL);
+  g_file_set_contents (path, (const char *)archive->data, archive->len, &error);
+  g_assert_no_error (error);
+
+  return path;
+}
+
+static ShumateDataSourceRequest *
+request_tile (MapsPMTilesDataSource *source,
+              const TestTile        *tile)
+{
+  ShumateDataSourceRequest *req;
+
+  req = shumate_data_source_start_request (SHUMATE_DATA_SOURCE (source), tile->x, tile->y, tile->z, NULL);
+  while (!shumate_data_source_request_is_completed (req))
+    g_main_context_iteration (NULL, TRUE);
+
+  return req;
+}
+
+static void
+assert_data (ShumateDataSourceRequest *req,
+             const char               *expected)
+{
+  GBytes *data = shumate_data_source_request_get_data (req);
+  gsize size;
+  const char *bytes;
+
+  g_assert_no_error (shumate_data_source_request_get_error (req));
+  g_assert_nonnull (data);
+  bytes = g_bytes_get_data (data, &size);
+  g_assert_cmpuint (size, ==, strlen (expected));
+  if (size > 0)
+    g_assert_cmpmem (bytes, size, expected, strlen (expected));
+}
+
+static void
+test_tiles (void)
+{
+  g_autoptr(MapsPMTilesDataSource) source = NULL;
+  g_autoptr(GError) error = NULL;
+
+  source = maps_pmtiles_data_source_new (archive_path, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (shumate_data_source_get_max_zoom_level (SHUMATE_DATA_SOURCE (source)), ==, MAX_ZOOM);
+
+  /* In the root directory */
+  {
+    g_autoptr(ShumateDataSourceRequest) req = request_tile (source, &root_tile);
+    assert_data (req, root_tile.data);
+  }
+
+  /* In the leaf directory, which is decoded for the first tile and reused for the second */
+  for (guint i = 0; i < G_N_ELEMENTS (leaf_tiles); i++)
+    {
+      g_autoptr(ShumateDataSourceRequest) req = request_tile (source, &leaf_tiles[i]);
+      assert_data (req, leaf_tiles[i].data);
+    }
+
+  /* Without a next source, a tile that isn't in the archive is empty */
+  {
+    g_autoptr(ShumateDataSourceRequest) req = request_tile (source, &missing_tile);
+    assert_data (req, "");
+  }
+}
+
+static void
+test_next_source (void)
+{
+  g_autoptr(TestNextSource) next = g_object_new (TEST_TYPE_NEXT_SOURCE, NULL);
+  g_autoptr(MapsPMTilesDataSource) source = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GBytes) fetched = g_bytes_new_static ("fetched", 7);
+  const TestTile out_of_range = { MAX_ZOOM + 3, 5, 5, NULL };
+
+  source = maps_pmtiles_data_source_new (archive_path, SHUMATE_DATA_SOURCE (next), &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (shumate_data_source_get_max_zoom_level (SHUMATE_DATA_SOURCE (source)), ==, 14);
+
+  /* Zoom levels the archive doesn't have go to the next source without looking at the archive */
+  {
+    g_autoptr(ShumateDataSourceRequest) req = NULL;
+    ShumateDataSourceRequest *next_req;
+
+    req = shumate_data_source_start_request (SHUMATE_DATA_SOURCE (source), out_of_range.x, out_of_range.y, out_of_range.z, NULL);
+    g_assert_cmpuint (next->requests->len, ==, 1);
+    next_req = g_ptr_array_index (next->requests, 0);
+    g_assert_cmpint (shumate_data_source_request_get_zoom_level (next_req), ==, out_of_range.z);
+    g_assert_cmpint (shumate_data_source_request_get_x (next_req), ==, out_of_range.x);
+
+    shumate_data_source_request_emit_data (next_req, fetched, FALSE);
+    shumate_data_source_request_complete (next_req);
+    g_assert_true (shumate_data_source_request_is_completed (req));
+    assert_data (req, "fetched");
+  }
+
+  /* So do tiles in its zoom range that it doesn't have, once the lookup is done */
+  {
+    g_autoptr(ShumateDataSourceRequest) req = NULL;
+
+    req = shumate_data_source_start_request (SHUMATE_DATA_SOURCE (source), missing_tile.x, missing_tile.y, missing_tile.z, NULL);
+    while (next->requests->len < 2)
+      g_main_context_iteration (NULL, TRUE);
+
+    shumate_data_source_request_emit_data (g_ptr_array_index (next->requests, 1), fetched, FALSE);
+    shumate_data_source_request_complete (g_ptr_array_index (next->requests, 1));
+    g_assert_true (shumate_data_source_request_is_completed (req));
+    assert_data (req, "fetched");
+  }
+
+  /* Tiles that are in the archive don't */
+  {
+    g_autoptr(ShumateDataSourceRequest) req = request_tile (source, &leaf_tiles[0]);
+    assert_data (req, leaf_tiles[0].data);
+    g_assert_cmpuint (next->requests->len, ==, 2);
+  }
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  int ret;
+
+  g_test_init (&argc, &argv, NULL);
+  archive_path = write_archive ();
+
+  g_test_add_func ("/pmtiles-data-source/tiles", test_tiles);
+  g_test_add_func ("/pmtiles-data-source/next-source", test_next_source);
+
+  ret = g_test_run ();
+  g_unlink (archive_path);
+  g_free (archive_path);
+
+  return ret;
+}
@@ -0,0 +1,224 @@
+/* -*- Mode: JS2; indent-tabs-mode: nil; js2-basic-offset: 4 -*- */
+/* vim: set et ts=4 sw=4: */
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+import GLib from "gi://GLib";
+import Gio from "gi://Gio";
+import GnomeMaps from "gi://GnomeMaps";
+import Soup from "gi://Soup?version=3.0";
+
+import { PMTilesDownload } from "../src/pmtiles.js";
+
+const JsUnit = imports.jsUnit;
+
+Gio._promisify(Gio.InputStream.prototype, 'read_bytes_async', 'read_bytes_finish');
+Gio._promisify(Gio.InputStream.prototype, 'skip_async', 'skip_finish');
+Gio._promisify(Gio.OutputStream.prototype, 'splice_async', 'splice_finish');
+Gio._promisify(Soup.Session.prototype, 'send_async', 'send_finish');
+Gio._promisify(GnomeMaps.PMTilesIndex.prototype, 'resolve_async', 'resolve_finish');
+
+const N_TILES = 400;
+const TILE_SIZE = 4096;
+
+const encodeVarint = (value, out) => {
+    while (value >= 0x80) {
+        out.push((value & 0x7f) | 0x80);
+        value = Math.floor(value / 128);
+    }
+    out.push(value);
+};
+
+/* Builds an uncompressed PMTiles archive with tiles 0 to N_TILES - 1. Each
+   tile is filled with its ID, modulo 256. */
+const buildArchive = () => {
+    const dir = [];
+    encodeVarint(N_TILES, dir);
+    for (let i = 0; i < N_TILES; i++)
+        encodeVarint(i === 0 ? 0 : 1, dir);
+    for (let i = 0; i < N_TILES; i++)
+        encodeVarint(1, dir);
+    for (let i = 0; i < N_TILES; i++)
+        encodeVarint(TILE_SIZE, dir);
+    for (let i = 0; i < N_TILES; i++)
+        encodeVarint(i === 0 ? 1 : 0, dir);
+
+    const tileDataOffset = 127 + dir.length;
+    const archive = new Uint8Array(tileDataOffset + N_TILES * TILE_SIZE);
+    const view = new DataView(archive.buffer);
+
+    archive.set(new TextEncoder().encode("PMTiles"), 0);
+    view.setUint8(7, 3);
+    view.setBigUint64(0x08, 127n, true);
+    view.setBigUint64(0x10, BigInt(dir.length), true);
+    view.setBigUint64(0x28, BigInt(tileDataOffset), true);
+    view.setBigUint64(0x30, 0n, true);
+    view.setBigUint64(0x38, BigInt(tileDataOffset), true);
+    view.setBigUint64(0x40, BigInt(N_TILES * TILE_SIZE), true);
+    view.setUint8(0x61, 1); // no internal compression
+    view.setUint8(0x62, 1); // no tile compression
+    view.setUint8(0x63, 1); // vector tiles
+    view.setUint8(0x65, 14);
+
+    archive.set(dir, 127);
+    for (let i = 0; i < N_TILES; i++)
+        archive.fill(i % 256, tileDataOffset + i * TILE_SIZE, tileDataOffset + (i + 1) * TILE_SIZE);
+
+    return archive;
+};
+
+/* A local stand-in for the download server. Every response is delayed by
+   `latency`, and all responses share one link of `bandwidth` bytes per
+   second, so they have to wait for each other's data to go through. */
+class ThrottlingServer {
+    constructor(archive, { latency, bandwidth }) {
+        this.archive = archive;
+        this.latency = latency;
+        this.bandwidth = bandwidth;
+        this.requests = 0;
+        /** @type {[number, number][]} The first and last byte of each request */
+        this.ranges = [];
+        this._linkFreeAt = 0;
+
+        this.server = new Soup.Server();
+        this.server.add_handler("/test.pmtiles", (server, msg) => this._handle(msg));
+        this.server.listen_local(0, Soup.ServerListenOptions.IPV4_ONLY);
+        this.url = `http://127.0.0.1:${this.server.get_uris()[0].get_port()}/test.pmtiles`;
+    }
+
+    _handle(msg) {
+        const match = /^bytes=(\d+)-(\d+)$/.exec(
+            msg.get_request_headers().get_one("Range") ?? ""
+        );
+        if (!match) {
+            msg.set_status(400, null);
+            return;
+        }
+
+        const start = Number(match[1]);
+        const end = Math.min(Number(match[2]), this.archive.length - 1);
+        const length = end - start + 1;
+        this.requests++;
+        this.ranges.push([start, end]);
+
+        const now = GLib.get_monotonic_time() / 1000;
+        const sendAt = Math.max(now + this.latency * 1000, this._linkFreeAt);
+        this._linkFreeAt = sendAt + (length / this.bandwidth) * 1000;
+
+        msg.pause();
+        GLib.timeout_add(GLib.PRIORITY_DEFAULT, Math.max(0, this._linkFreeAt - now), () => {
+            msg.set_status(206, null);
+            msg.get_response_headers().set_content_range(start, end, this.archive.length);
+            msg.get_response_headers().replace("ETag", '"test"');
+            msg.set_response(
+                "application/octet-stream",
+                Soup.MemoryUse.COPY,
+                this.archive.subarray(start, end + 1)
+            );
+            msg.unpause();
+            return GLib.SOURCE_REMOVE;
+        });
+    }
+}
+
+const downloadAll = async (server) => {
+    const download = new PMTilesDownload(server.url);
+    /* every other tile, so each one is a separate request */
+    download.gapThreshold = 0;
+    const tiles = [];
+    for (let i = 0; i < N_TILES; i += 2)
+        tiles.push(i);
+
+    const received = new Set();
+    await download.downloadTiles(tiles, null, async (tileIds, data, precompressed) => {
+        JsUnit.assertFalse(precompressed);
+        JsUnit.assertEquals(1, tileIds.length);
+        const bytes = data.toArray();
+        JsUnit.assertEquals(TILE_SIZE, bytes.length);
+        JsUnit.assertEquals(tileIds[0] % 256, bytes[0]);
+        JsUnit.assertEquals(tileIds[0] % 256, bytes[TILE_SIZE - 1]);
+        received.add(tileIds[0]);
+    });
+
+    JsUnit.assertEquals(tiles.length, received.size);
+    return download;
+};
+
+const archive = buildArchive();
+const tileOffset = (tileId) =>
+    Number(new DataView(archive.buffer).getBigUint64(0x38, true)) + tileId * TILE_SIZE;
+
+/* With lots of latency and plenty of bandwidth, more requests in flight
+   means more throughput, so slow start should keep doubling the limit
+   well past its initial value. */
+const latencyBound = async () => {
+    const server = new ThrottlingServer(archive, { latency: 0.05, bandwidth: 1e9 });
+    const download = await downloadAll(server);
+    JsUnit.assertTrue(download.concurrency.peak >= 8);
+    server.server.disconnect();
+};
+
+/* With a slow shared link, more requests only make each other wait, so
+   the download has to complete without the controller running away. */
+const bandwidthBound = async () => {
+    const server = new ThrottlingServer(archive, { latency: 0.001, bandwidth: 2e6 });
+    const download = await downloadAll(server);
+    JsUnit.assertTrue(download.concurrency.limit < 32);
+    server.server.disconnect();
+};
+
+/* Tiles that are close enough together are fetched in one request, and
+   the bytes between them are read but not passed on */
+const gapMerging = async () => {
+    const server = new ThrottlingServer(archive, { latency: 0.001, bandwidth: 1e9 });
+    const download = new PMTilesDownload(server.url);
+    download.gapThreshold = TILE_SIZE;
+    const tiles = [0, 2, 4, 6, 8, 100];
+
+    const received = new Map();
+    await download.downloadTiles(tiles, null, async (tileIds, data) => {
+        JsUnit.assertEquals(1, tileIds.length);
+        received.set(tileIds[0], data.toArray());
+    });
+
+    JsUnit.assertEquals(tiles.length, received.size);
+    for (const [tileId, bytes] of received) {
+        JsUnit.assertEquals(TILE_SIZE, bytes.length);
+        JsUnit.assertTrue(bytes.every((b) => b === tileId % 256));
+    }
+
+    /* The directories come before the tile data, so any other requests
+       are for them */
+    const tileRequests = server.ranges.filter(([start]) => start >= tileOffset(0));
+    JsUnit.assertEquals(2, tileRequests.length);
+    tileRequests.sort((a, b) => a[0] - b[0]);
+    JsUnit.assertEquals(tileOffset(0), tileRequests[0][0]);
+    JsUnit.assertEquals(tileOffset(9) - 1, tileRequests[0][1]);
+    JsUnit.assertEquals(tileOffset(100), tileRequests[1][0]);
+    JsUnit.assertEquals(tileOffset(101) - 1, tileRequests[1][1]);
+    server.server.disconnect();
+};
+
+const loop = new GLib.MainLoop(null, false);
+let error = null;
+latencyBound()
+    .then(bandwidthBound)
+    .then(gapMerging)
+    .catch((e) => { error = e; })
+    .finally(() => loop.quit());
+loop.run();
+
+if (error)
+    throw error;
@@ -0,0 +1,69 @@
+/* -*- Mode: JS2; indent-tabs-mode: nil; js2-basic-offset: 4 -*- */
+/* vim: set et ts=4 sw=4: */
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Helpers shared by the tests. This is not a test itself. */
+
+import Gio from "gi://Gio";
+import GLib from "gi://GLib";
+import GnomeMaps from "gi://GnomeMaps";
+
+/**
+ * Runs an async test in a main loop, and throws its error, if any, once it
+ * is done.
+ *
+ * @param {() => Promise<void>} test
+ */
+export function runAsync(test) {
+    const loop = new GLib.MainLoop(null, false);
+    let error = null;
+    test()
+        .catch((e) => { error = e; })
+        .finally(() => loop.quit());
+    loop.run();
+
+    if (error)
+        throw error;
+}
+
+/**
+ * Calls `callback` with a download store in a new temporary directory. The
+ * directory is deleted afterwards, along with the database and its WAL
+ * files, whether the callback succeeds or not.
+ *
+ * @template T
+ * @param {(store: GnomeMaps.DownloadStore, path: string) => Promise<T>} callback
+ * @returns {Promise<T>}
+ */
+export async function withDownloadStore(callback) {
+    const dir = Gio.File.new_for_path(GLib.dir_make_tmp("maps-test-XXXXXX"));
+    const path = dir.get_child("tiles.sqlite").get_path();
+
+    try {
+        const store = GnomeMaps.DownloadStore.new();
+        store.open(path);
+        return await callback(store, path);
+    } finally {
+        const children = dir.enumerate_children("standard::name",
+                                                Gio.FileQueryInfoFlags.NONE,
+                                                null);
+        let info;
+        while ((info = children.next_file(null)) !== null)
+            dir.get_child(info.get_name()).delete(null);
+        children.close(null);
+        dir.delete(null);
+    }
+}
@@ -0,0 +1,134 @@
+/*
+ * GNOME Maps is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * GNOME Maps is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with GNOME Maps; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "maps-tile-prefetcher.h"
+
+/* Sizes are in world units, so at zoom 10 one tile is 1/1024 wide */
+#define TILE (1.0 / 1024)
+
+/* A viewport four tiles square, in the middle of the map at zoom 10 */
+static MapsViewportMotion
+viewport (void)
+{
+  MapsViewportMotion motion = {
+    .x = 0.5, .y = 0.5, .zoom = 10,
+    .width = 4 * TILE, .height = 4 * TILE,
+    .min_zoom = 0, .max_zoom = 20,
+  };
+
+  return motion;
+}
+
+static void
+assert_rect (MapsTileRange *range,
+             guint          z,
+             guint          x_min,
+             guint          y_min,
+             guint          x_max,
+             guint          y_max)
+{
+  guint rz, rx_min, ry_min, rx_max, ry_max;
+
+  g_assert_nonnull (range);
+  g_assert_cmpuint (maps_tile_range_get_n_rects (range), ==, 1);
+  maps_tile_range_get_rect (range, 0, &rz, &rx_min, &ry_min, &rx_max, &ry_max);
+  g_assert_cmpuint (rz, ==, z);
+  g_assert_cmpuint (rx_min, ==, x_min);
+  g_assert_cmpuint (ry_min, ==, y_min);
+  g_assert_cmpuint (rx_max, ==, x_max);
+  g_assert_cmpuint (ry_max, ==, y_max);
+}
+
+static void
+test_pan (void)
+{
+  MapsViewportMotion motion = viewport ();
+  g_autoptr(MapsTileRange) range = NULL;
+  double x, y;
+
+  /* Two viewports per second to the east puts the viewport four tiles over half a second from now */
+  motion.vx = 8 * TILE;
+  range = maps_tile_prefetcher_predict_tiles (&motion, 0, 14, &x, &y);
+  assert_rect (range, 10, 514, 510, 518, 514);
+  g_assert_cmpfloat (x, ==, 0.5 + 4 * TILE);
+  g_assert_cmpfloat (y, ==, 0.5);
+}
+
+static void
+test_slow (void)
+{
+  MapsViewportMotion motion = viewport ();
+
+  /* Nothing is predicted for a viewport that's barely moving */
+  motion.vx = 0.1 * TILE;
+  motion.vzoom = 0.1;
+  g_assert_null (maps_tile_prefetcher_predict_tiles (&motion, 0, 14, NULL, NULL));
+
+  motion.vx = 0;
+  motion.vzoom = 0;
+  g_assert_null (maps_tile_prefetcher_predict_tiles (&motion, 0, 14, NULL, NULL));
+}
+
+static void
+test_zoom (void)
+{
+  MapsViewportMotion motion = viewport ();
+  g_autoptr(MapsTileRange) out = NULL;
+  g_autoptr(MapsTileRange) clamped = NULL;
+
+  /* Zooming out two levels per second ends up one level out, where the viewport covers twice as much */
+  motion.vzoom = -2;
+  out = maps_tile_prefetcher_predict_tiles (&motion, 0, 14, NULL, NULL);
+  assert_rect (out, 9, 254, 254, 258, 258);
+
+  /* ...but not past the viewport's minimum zoom level */
+  motion.min_zoom = 9.5;
+  clamped = maps_tile_prefetcher_predict_tiles (&motion, 0, 14, NULL, NULL);
+  assert_rect (clamped, 9, 254, 254, 257, 257);
+}
+
+static void
+test_tile_zoom_limits (void)
+{
+  MapsViewportMotion motion = viewport ();
+  g_autoptr(MapsTileRange) above = NULL;
+  g_autoptr(MapsTileRange) below = NULL;
+
+  /* Past the data source's highest zoom level, its deepest tiles are used instead */
+  motion.vx = 8 * TILE;
+  above = maps_tile_prefetcher_predict_tiles (&motion, 0, 8, NULL, NULL);
+  assert_rect (above, 8, 128, 127, 129, 128);
+
+  /* Below its lowest zoom level, the tiles at that level cover the viewport */
+  motion.zoom = 2;
+  motion.width = motion.height = 0.25;
+  motion.vx = 0.5;
+  below = maps_tile_prefetcher_predict_tiles (&motion, 4, 14, NULL, NULL);
+  assert_rect (below, 4, 10, 6, 14, 10);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/tile-prefetcher/pan", test_pan);
+  g_test_add_func ("/tile-prefetcher/slow", test_slow);
+  g_test_add_func ("/tile-prefetcher/zoom", test_zoom);
+  g_test_add_func ("/tile-prefetcher/tile-zoom-limits", test_tile_zoom_limits);
+
+  return g_test_run ();
+}